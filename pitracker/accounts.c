@@ -39,7 +39,44 @@ static PACCOUNT_RECORD _account_get(const char* Login)
 }
 
 
-int account_add(const char* Login, const char* Password, int Admin)
+/* Position of the account among the "account" settings values */
+static int _account_value_index(const char* Login, size_t* Index)
+{
+	int ret = 0;
+	char** values = NULL;
+	size_t valueCount = 0;
+	size_t len = 0;
+	log_enter("Login=\"%s\"; Index=0x%p", Login, Index);
+
+	ret = settings_values_enum("account", &values, &valueCount);
+	if (ret == 0) {
+		ret = ENOENT;
+		len = strlen(Login);
+		for (size_t i = 0; i < valueCount; ++i) {
+			if (strncmp(values[i], Login, len) == 0 && (values[i][len] == ' ' || values[i][len] == '\0')) {
+				*Index = i;
+				ret = 0;
+				break;
+			}
+		}
+
+		settings_values_free(values, valueCount);
+	}
+
+	log_exit("%i, *Index=%zu", ret, *Index);
+	return ret;
+}
+
+
+static void _account_line(const ACCOUNT_RECORD* Account, char* Line, size_t Size)
+{
+	snprintf(Line, Size, "%s %s %i", Account->Login, Account->Password, Account->Admin);
+
+	return;
+}
+
+
+static int _account_add(const char* Login, const char* Password, int Admin, PACCOUNT_RECORD* Account)
 {
 	int ret = 0;
 	char* l = NULL;
@@ -69,6 +106,7 @@ int account_add(const char* Login, const char* Password, int Admin)
 				tmp->Authenticated = 0;
 				tmp->Admin = Admin;
 				++_accountCount;
+				*Account = tmp;
 			} else ret = ENOMEM;
 		}
 
@@ -83,16 +121,38 @@ int account_add(const char* Login, const char* Password, int Admin)
 }
 
 
+int account_add(const char* Login, const char* Password, int Admin)
+{
+	int ret = 0;
+	char line[256];
+	PACCOUNT_RECORD account = NULL;
+	log_enter("Login=\"%s\"; Password=\"%s\"; Admin=%u", Login, Password, Admin);
+
+	ret = _account_add(Login, Password, Admin, &account);
+	if (ret == 0) {
+		_account_line(account, line, sizeof(line) / sizeof(line[0]));
+		ret = settings_value_add("account", line);
+	}
+
+	log_exit("%i", ret);
+	return ret;
+}
+
+
 int account_delete(const char* Login, const char* Password)
 {
 	int ret = 0;
 	size_t index = 0;
+	size_t valueIndex = 0;
 	PACCOUNT_RECORD tmp = NULL;
 	log_enter("Login=\"%s\"; Password=\"%s\"", Login, Password);
 
 	tmp = _account_get(Login);
 	if (tmp != NULL) {
 		if (strcmp(tmp->Password, Password) == 0) {
+			if (_account_value_index(Login, &valueIndex) == 0)
+				ret = settings_value_delete("account", valueIndex);
+
 			index = (size_t)(tmp - _accounts);
 			free(tmp->Login);
 			free(tmp->Password);
@@ -106,55 +166,70 @@ int account_delete(const char* Login, const char* Password)
 }
 
 
-int account_login(const char* Login, const char* Password)
+int account_login(const char* Login, const char* Password, size_t Device)
 {
 	int ret = 0;
 	PACCOUNT_RECORD tmp = NULL;
-	log_enter("Login=\"%s\"; Password=\"%s\"", Login, Password);
+	log_enter("Login=\"%s\"; Password=\"%s\"; Device=%zu", Login, Password, Device);
 
-	tmp = _account_get(Login);
-	if (tmp != NULL) {
-		if (strcmp(tmp->Password, Password) == 0) {
-			if (tmp->Authenticated)
-				ret = EEXIST;
-			
-			tmp->Authenticated = 1;
-		} else ret = EACCES;
-	} else ret = ENOENT;
+	if (Device >= ACCOUNT_DEVICES_MAX)
+		ret = EINVAL;
+
+	if (ret == 0) {
+		tmp = _account_get(Login);
+		if (tmp != NULL) {
+			if (strcmp(tmp->Password, Password) == 0) {
+				if (tmp->Authenticated & (1u << Device))
+					ret = EEXIST;
+
+				tmp->Authenticated |= (1u << Device);
+			} else ret = EACCES;
+		} else ret = ENOENT;
+	}
 
 	log_exit("", ret);
 	return ret;
 }
 
-int account_logout(const char* Login)
+int account_logout(const char* Login, size_t Device)
 {
 	int ret = 0;
 	PACCOUNT_RECORD tmp = NULL;
-	log_enter("Login=\"%s\"", Login);
+	log_enter("Login=\"%s\"; Device=%zu", Login, Device);
 
-	tmp = _account_get(Login);
-	if (tmp != NULL) {
-		if (!tmp->Authenticated)
-			ret = EEXIST;
+	if (Device >= ACCOUNT_DEVICES_MAX)
+		ret = EINVAL;
 
-		tmp->Authenticated = 0;
-	} else ret = ENOENT;
+	if (ret == 0) {
+		tmp = _account_get(Login);
+		if (tmp != NULL) {
+			if ((tmp->Authenticated & (1u << Device)) == 0)
+				ret = EEXIST;
+
+			tmp->Authenticated &= ~(1u << Device);
+		} else ret = ENOENT;
+	}
 
 	log_exit("%i", ret);
 	return ret;
 }
 
 
-int account_logged_in(const char* Login, int* Result)
+int account_logged_in(const char* Login, size_t Device, int* Result)
 {
 	int ret = 0;
 	PACCOUNT_RECORD tmp = NULL;
-	log_enter("Login=\"%s\"; Result=0x%p", Login, Result);
+	log_enter("Login=\"%s\"; Device=%zu; Result=0x%p", Login, Device, Result);
 
-	tmp = _account_get(Login);
-	if (tmp != NULL)
-		*Result = tmp->Authenticated;
-	else ret = ENOENT;
+	if (Device >= ACCOUNT_DEVICES_MAX)
+		ret = EINVAL;
+
+	if (ret == 0) {
+		tmp = _account_get(Login);
+		if (tmp != NULL)
+			*Result = ((tmp->Authenticated & (1u << Device)) != 0);
+		else ret = ENOENT;
+	}
 
 	log_exit("%i, *Result=%i", ret, *Result);
 	return ret;
@@ -165,6 +240,8 @@ int account_set_password(const char* Login, const char* Old, const char* New)
 {
 	int ret = 0;
 	char* p = NULL;
+	size_t valueIndex = 0;
+	char line[256];
 	PACCOUNT_RECORD tmp = NULL;
 	log_enter("Login=\"%s\"; Old=\"%s\"; New=\"%s\"", Login, Old, New);
 
@@ -181,6 +258,12 @@ int account_set_password(const char* Login, const char* Old, const char* New)
 			if (ret == 0) {
 				free(tmp->Password);
 				tmp->Password = p;
+				_account_line(tmp, line, sizeof(line) / sizeof(line[0]));
+				if (_account_value_index(Login, &valueIndex) == 0)
+					ret = settings_value_set_string("account", valueIndex, line);
+				else ret = settings_value_add("account", line);
+
+				p = NULL;
 			}
 
 			if (ret != 0)
@@ -216,11 +299,12 @@ int accounts_init(void)
 			if (ret == 0) {
 				if (arrSize >= 2) {
 					int admin = 0;
+					PACCOUNT_RECORD account = NULL;
 
 					if (arrSize >= 3)
 						admin = atoi(arr[2]);
 
-					ret = account_add(arr[0], arr[1], admin);
+					ret = _account_add(arr[0], arr[1], admin, &account);
 					if (ret != 0)
 						log_error("Unable to add account %s:%s:%i: %i", arr[0], arr[1], admin, ret);
 				} else log_error("Invalid value: \"%s\"", lines[i]);
@@ -240,27 +324,48 @@ int accounts_init(void)
 }
 
 
-int accounts_save(void)
+/* Logged in users stay logged in unless their password changed */
+int accounts_reload(void)
 {
 	int ret = 0;
-	char line[256];
+	PACCOUNT_RECORD oldAccounts = NULL;
+	size_t oldCount = 0;
+	PACCOUNT_RECORD newAccounts = NULL;
+	size_t newCount = 0;
 	PACCOUNT_RECORD tmp = NULL;
 	log_enter("");
 
-	ret = settings_key_delete("account");
-	if (ret == ENOENT)
-		ret = 0;
+	oldAccounts = _accounts;
+	oldCount = _accountCount;
+	_accounts = NULL;
+	_accountCount = 0;
+	ret = accounts_init();
+	if (ret == 0) {
+		for (size_t i = 0; i < oldCount; ++i) {
+			if (oldAccounts[i].Authenticated) {
+				tmp = _account_get(oldAccounts[i].Login);
+				if (tmp != NULL && strcmp(tmp->Password, oldAccounts[i].Password) == 0)
+					tmp->Authenticated = oldAccounts[i].Authenticated;
+			}
+		}
+
+		newAccounts = _accounts;
+		newCount = _accountCount;
+	}
 
+	/* Releases the old accounts on success and the partially loaded ones on failure */
 	if (ret == 0) {
-		tmp = _accounts;
-		for (size_t i = 0; i < _accountCount; ++i) {
-			snprintf(line, sizeof(line) / sizeof(line[0]), "%s %s %i", tmp->Login, tmp->Password, tmp->Admin);
-			ret = settings_value_add("account", line);
-			if (ret != 0)
-				break;
+		_accounts = oldAccounts;
+		_accountCount = oldCount;
+	}
 
-			++tmp;
-		}
+	accounts_finit();
+	if (ret == 0) {
+		_accounts = newAccounts;
+		_accountCount = newCount;
+	} else {
+		_accounts = oldAccounts;
+		_accountCount = oldCount;
 	}
 
 	log_exit("%i", ret);
@@ -3,11 +3,14 @@
 
 
 
+#define ACCOUNT_DEVICES_MAX				(sizeof(unsigned int) * 8)
+
 
 typedef struct _ACCOUNT_RECORD {
 	char *Login;
 	char *Password;
-	int Authenticated;
+	/* A bit for every modem the phone logged in through, each SIM is a login of its own */
+	unsigned int Authenticated;
 	int Admin;
 } ACCOUNT_RECORD, *PACCOUNT_RECORD;
 
@@ -15,11 +18,11 @@ typedef struct _ACCOUNT_RECORD {
 
 int account_add(const char* Login, const char* Password, int Admin);
 int account_delete(const char* Login, const char* Password);
-int account_login(const char* Login, const char* Password);
-int account_logout(const char* Login);
-int account_logged_in(const char* Login, int* Result);
+int account_login(const char* Login, const char* Password, size_t Device);
+int account_logout(const char* Login, size_t Device);
+int account_logged_in(const char* Login, size_t Device, int* Result);
 int account_set_password(const char* Login, const char* Old, const char* New);
 
 int accounts_init(void);
+int accounts_reload(void);
 void accounts_finit(void);
-int accounts_save(void);
@@ -0,0 +1,282 @@
+
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include "logging.h"
+#include "metrics.h"
+#include "serial.h"
+#include "capture.h"
+#include "arena.h"
+#include "arbiter.h"
+
+
+
+typedef struct _ARBITER_QUEUE {
+	PARBITER_JOB Head;
+	PARBITER_JOB Tail;
+} ARBITER_QUEUE, *PARBITER_QUEUE;
+
+static ARBITER_QUEUE _queues[apMax];
+/* The job whose chunk runs now, it is in no queue meanwhile */
+static PARBITER_JOB _running = NULL;
+/* Jobs waiting for their WakeUp, in no particular order */
+static PARBITER_JOB _sleeping = NULL;
+/* Seconds the running job asked to sleep for, -1 for none */
+static int _sleep = -1;
+static volatile sig_atomic_t _stop = 0;
+static const char* _priorityNames[apMax] = {
+	"interactive",
+	"telemetry",
+	"bulk",
+};
+
+
+
+static void _arbiter_enqueue(PARBITER_JOB Job)
+{
+	PARBITER_QUEUE q = _queues + Job->Priority;
+
+	Job->Next = NULL;
+	if (q->Tail != NULL)
+		q->Tail->Next = Job;
+	else q->Head = Job;
+
+	q->Tail = Job;
+
+	return;
+}
+
+
+static PARBITER_JOB _arbiter_dequeue(void)
+{
+	PARBITER_JOB ret = NULL;
+	PARBITER_QUEUE q = NULL;
+
+	for (int i = 0; i < apMax; ++i) {
+		q = _queues + i;
+		if (q->Head != NULL) {
+			ret = q->Head;
+			q->Head = ret->Next;
+			if (q->Head == NULL)
+				q->Tail = NULL;
+
+			ret->Next = NULL;
+			break;
+		}
+	}
+
+	return ret;
+}
+
+
+/* Queues the sleeping jobs whose time has come */
+static void _arbiter_wake_up(void)
+{
+	struct timespec now;
+	PARBITER_JOB job = NULL;
+	PARBITER_JOB* prev = NULL;
+
+	if (_sleeping == NULL)
+		return;
+
+	capture_clock(&now);
+	prev = &_sleeping;
+	while (*prev != NULL) {
+		job = *prev;
+		if (job->WakeUp.tv_sec < now.tv_sec ||
+			(job->WakeUp.tv_sec == now.tv_sec && job->WakeUp.tv_nsec <= now.tv_nsec)) {
+			*prev = job->Next;
+			_arbiter_enqueue(job);
+		} else prev = &job->Next;
+	}
+
+	return;
+}
+
+
+static void _arbiter_job_free(PARBITER_JOB Job)
+{
+	if (Job->Free != NULL)
+		Job->Free(Job->Context);
+
+	free(Job);
+
+	return;
+}
+
+
+/* A periodic job still queued or running from its previous period is not queued twice */
+int arbiter_submit(EArbiterPriority Priority, const char* Name, ARBITER_JOB_CALLBACK* Callback, void* Context, ARBITER_FREE_CALLBACK* Free)
+{
+	int ret = 0;
+	PARBITER_JOB job = NULL;
+	log_enter("Priority=%u; Name=\"%s\"; Callback=0x%p; Context=0x%p; Free=0x%p", Priority, Name, Callback, Context, Free);
+
+	if (_running != NULL && _running->Callback == Callback && _running->Context == Context)
+		ret = EEXIST;
+
+	for (int i = 0; ret == 0 && i < apMax; ++i) {
+		for (job = _queues[i].Head; job != NULL; job = job->Next) {
+			if (job->Callback == Callback && job->Context == Context) {
+				ret = EEXIST;
+				break;
+			}
+		}
+	}
+
+	for (job = _sleeping; ret == 0 && job != NULL; job = job->Next) {
+		if (job->Callback == Callback && job->Context == Context)
+			ret = EEXIST;
+	}
+
+	if (ret == 0) {
+		job = calloc(1, sizeof(ARBITER_JOB));
+		if (job == NULL)
+			ret = ENOMEM;
+	}
+
+	if (ret == 0) {
+		job->Priority = Priority;
+		job->Name = Name;
+		job->Callback = Callback;
+		job->Free = Free;
+		job->Context = Context;
+		clock_gettime(CLOCK_MONOTONIC, &job->Submitted);
+		_arbiter_enqueue(job);
+		/* A URC queued the job while the main loop idles, let it run now */
+		serial_wait_break();
+	}
+
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+int arbiter_pending(void)
+{
+	for (int i = 0; i < apMax; ++i) {
+		if (_queues[i].Head != NULL)
+			return 1;
+	}
+
+	return 0;
+}
+
+
+/* Shortens the Timeout (in seconds) of the main loop wait to the first wake up */
+int arbiter_timeout(int Timeout)
+{
+	int ret = Timeout;
+	struct timespec now;
+
+	if (arbiter_pending())
+		return 0;
+
+	if (_sleeping != NULL) {
+		capture_clock(&now);
+		for (PARBITER_JOB job = _sleeping; job != NULL; job = job->Next) {
+			/* Whole seconds, rounded up so the job is due once the wait ends */
+			long long left = (long long)(job->WakeUp.tv_sec - now.tv_sec) + (job->WakeUp.tv_nsec > now.tv_nsec ? 1 : 0);
+
+			if (left < 0)
+				left = 0;
+
+			if (left < ret)
+				ret = (int)left;
+		}
+	}
+
+	return ret;
+}
+
+
+/* Called by a chunk that sets *More, the next chunk runs Seconds later at the earliest */
+void arbiter_sleep(int Seconds)
+{
+	_sleep = Seconds;
+
+	return;
+}
+
+
+/*
+ * Runs the queued jobs until none is left. Between two chunks the modems
+ * behind Handles are polled without waiting, so a command arriving on any
+ * of them is queued before the next chunk is picked.
+ */
+void arbiter_run(const int* Handles, size_t Count)
+{
+	int ret = 0;
+	int more = 0;
+	struct timespec now;
+	PARBITER_JOB job = NULL;
+	log_enter("Handles=0x%p; Count=%zu", Handles, Count);
+
+	_arbiter_wake_up();
+	while (!_stop) {
+		job = _arbiter_dequeue();
+		if (job == NULL)
+			break;
+
+		more = 0;
+		_sleep = -1;
+		_running = job;
+		/* Whatever the chunk parses is gone after it */
+		arena_enter();
+		ret = job->Callback(job->Context, &more);
+		arena_leave();
+		_running = NULL;
+		++job->Chunks;
+		/* The job has logged its failure, it is not run any further */
+		if (ret == 0 && more && _sleep >= 0) {
+			capture_clock(&job->WakeUp);
+			job->WakeUp.tv_sec += _sleep;
+			job->Next = _sleeping;
+			_sleeping = job;
+		} else if (ret == 0 && more)
+			_arbiter_enqueue(job);
+		else {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			metrics_job_end(_priorityNames[job->Priority], (unsigned long long)(now.tv_sec - job->Submitted.tv_sec) * 1000000ULL + (unsigned long long)((now.tv_nsec - job->Submitted.tv_nsec) / 1000));
+			log_info("Job %s (%s) done in %u chunks", job->Name, _priorityNames[job->Priority], job->Chunks);
+			_arbiter_job_free(job);
+		}
+
+		if (Count > 0)
+			serial_response_wait_any(Handles, Count, 0);
+	}
+
+	log_exit("void");
+	return;
+}
+
+
+/* Safe in a signal handler: the chunk being run finishes, no other one starts */
+void arbiter_stop(void)
+{
+	_stop = 1;
+
+	return;
+}
+
+
+/* Drops the jobs left in the queues and the sleeping ones */
+void arbiter_finit(void)
+{
+	PARBITER_JOB job = NULL;
+
+	while ((job = _arbiter_dequeue()) != NULL)
+		_arbiter_job_free(job);
+
+	while (_sleeping != NULL) {
+		job = _sleeping;
+		_sleeping = job->Next;
+		_arbiter_job_free(job);
+	}
+
+	return;
+}
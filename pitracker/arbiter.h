@@ -0,0 +1,54 @@
+
+#pragma once
+
+
+#include <stddef.h>
+#include <time.h>
+
+
+/*
+ * Orders the work sent to the modems. Jobs wait in one FIFO per priority
+ * and run a chunk at a time, the highest priority first; a job with more
+ * to do goes to the end of its queue again. A long job thus hands the
+ * modem to an operator command between its chunks instead of after its
+ * last one. URC callbacks only queue jobs, so no command is ever sent
+ * while another one waits for its answer. A job may sleep between two
+ * chunks, it is left out of the queues until its time comes.
+ */
+
+typedef enum _EArbiterPriority {
+	/* Operator SMS commands */
+	apInteractive,
+	/* GNSS reads */
+	apTelemetry,
+	/* Track uploads */
+	apBulk,
+	apMax,
+} EArbiterPriority, *PEArbiterPriority;
+
+/* Runs one chunk of the job, sets *More when there is another one; a failed job ends */
+typedef int (ARBITER_JOB_CALLBACK)(void* Context, int* More);
+typedef void (ARBITER_FREE_CALLBACK)(void* Context);
+
+typedef struct _ARBITER_JOB {
+	struct _ARBITER_JOB* Next;
+	EArbiterPriority Priority;
+	const char* Name;
+	ARBITER_JOB_CALLBACK* Callback;
+	/* Called for the Context once the job is done or dropped, may be NULL */
+	ARBITER_FREE_CALLBACK* Free;
+	void* Context;
+	struct timespec Submitted;
+	/* Capture clock time the sleeping job is queued again at */
+	struct timespec WakeUp;
+	unsigned int Chunks;
+} ARBITER_JOB, *PARBITER_JOB;
+
+
+int arbiter_submit(EArbiterPriority Priority, const char* Name, ARBITER_JOB_CALLBACK* Callback, void* Context, ARBITER_FREE_CALLBACK* Free);
+int arbiter_pending(void);
+int arbiter_timeout(int Timeout);
+void arbiter_sleep(int Seconds);
+void arbiter_run(const int* Handles, size_t Count);
+void arbiter_stop(void);
+void arbiter_finit(void);
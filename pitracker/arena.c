@@ -0,0 +1,243 @@
+
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include "logging.h"
+#include "metrics.h"
+#include "arena.h"
+
+
+
+typedef struct _ARENA_BLOCK {
+	struct _ARENA_BLOCK* Next;
+	size_t Used;
+	unsigned char Data[ARENA_BLOCK_SIZE];
+} ARENA_BLOCK, *PARENA_BLOCK;
+
+/* Precedes every allocation, arena_realloc() needs the size; the union keeps the data aligned */
+typedef union _ARENA_HEADER {
+	size_t Size;
+	long double AlignLongDouble;
+	long long AlignLongLong;
+	void* AlignPointer;
+} ARENA_HEADER, *PARENA_HEADER;
+
+static PARENA_BLOCK _blocks = NULL;
+/* The block allocations come from, the ones after it are free */
+static PARENA_BLOCK _current = NULL;
+/* The allocation at the end of _current, it may grow or go back in place */
+static void* _last = NULL;
+static int _depth = 0;
+static int _bypass = 0;
+static unsigned long _eventAllocations = 0;
+static size_t _eventBytes = 0;
+
+
+
+static int _arena_contains(const void* Block)
+{
+	const unsigned char* b = (const unsigned char*)Block;
+
+	for (PARENA_BLOCK a = _blocks; a != NULL; a = a->Next) {
+		if (b >= a->Data && b < a->Data + sizeof(a->Data))
+			return 1;
+	}
+
+	return 0;
+}
+
+
+static size_t _arena_size(size_t Size)
+{
+	return sizeof(ARENA_HEADER) + (Size + sizeof(ARENA_HEADER) - 1) / sizeof(ARENA_HEADER) * sizeof(ARENA_HEADER);
+}
+
+
+/* Moves to a block with Need bytes free, the first event gets the first one */
+static int _arena_reserve(size_t Need)
+{
+	PARENA_BLOCK b = NULL;
+
+	if (_current == NULL) {
+		_blocks = malloc(sizeof(ARENA_BLOCK));
+		if (_blocks == NULL)
+			return 0;
+
+		_blocks->Next = NULL;
+		_blocks->Used = 0;
+		_current = _blocks;
+	}
+
+	while (_current->Used + Need > sizeof(_current->Data)) {
+		if (_current->Next == NULL) {
+			b = malloc(sizeof(ARENA_BLOCK));
+			if (b == NULL)
+				return 0;
+
+			b->Next = NULL;
+			_current->Next = b;
+		}
+
+		_current = _current->Next;
+		_current->Used = 0;
+		_last = NULL;
+	}
+
+	return 1;
+}
+
+
+void arena_enter(void)
+{
+	++_depth;
+
+	return;
+}
+
+
+/* The outermost call ends the event, everything allocated in it is free after it */
+void arena_leave(void)
+{
+	--_depth;
+	if (_depth > 0)
+		return;
+
+#ifndef NDEBUG
+	/* Memory kept past the event is then easy to spot */
+	for (PARENA_BLOCK b = _blocks; b != NULL && b != _current->Next; b = b->Next)
+		memset(b->Data, 0xA5, b->Used);
+#endif
+
+	if (_blocks != NULL)
+		_blocks->Used = 0;
+
+	_current = _blocks;
+	_last = NULL;
+	if (_eventAllocations > 0) {
+		log_trace("Event served %lu allocations (%zu bytes) from the arena", _eventAllocations, _eventBytes);
+		metrics_arena_event(_eventAllocations, _eventBytes);
+	}
+
+	_eventAllocations = 0;
+	_eventBytes = 0;
+
+	return;
+}
+
+
+/* While set, the allocations come from malloc(); returns the previous state */
+int arena_bypass(int Bypass)
+{
+	int ret = _bypass;
+
+	_bypass = Bypass;
+
+	return ret;
+}
+
+
+void* arena_alloc(size_t Size)
+{
+	size_t need = 0;
+	PARENA_HEADER h = NULL;
+
+	if (_depth == 0 || _bypass || Size > ARENA_LARGE_SIZE)
+		return malloc(Size);
+
+	need = _arena_size(Size);
+	if (!_arena_reserve(need))
+		return malloc(Size);
+
+	h = (PARENA_HEADER)(_current->Data + _current->Used);
+	h->Size = Size;
+	_current->Used += need;
+	_last = h + 1;
+	++_eventAllocations;
+	_eventBytes += need;
+
+	return _last;
+}
+
+
+void* arena_realloc(void* Block, size_t Size)
+{
+	void* ret = NULL;
+	PARENA_HEADER h = NULL;
+	size_t start = 0;
+
+	if (Block == NULL)
+		return arena_alloc(Size);
+
+	if (!_arena_contains(Block))
+		return realloc(Block, Size);
+
+	h = (PARENA_HEADER)Block - 1;
+	/* The response buffer grows read by read, usually with nothing allocated after it */
+	if (Block == _last && !_bypass && Size <= ARENA_LARGE_SIZE) {
+		start = (size_t)((unsigned char*)h - _current->Data);
+		if (start + _arena_size(Size) <= sizeof(_current->Data)) {
+			_eventBytes += _arena_size(Size) - (_current->Used - start);
+			_current->Used = start + _arena_size(Size);
+			h->Size = Size;
+			return Block;
+		}
+	}
+
+	ret = arena_alloc(Size);
+	if (ret != NULL)
+		memcpy(ret, Block, (h->Size < Size) ? h->Size : Size);
+
+	return ret;
+}
+
+
+char* arena_strdup(const char* String)
+{
+	char* ret = NULL;
+	size_t len = 0;
+
+	len = strlen(String) + 1;
+	ret = arena_alloc(len);
+	if (ret != NULL)
+		memcpy(ret, String, len);
+
+	return ret;
+}
+
+
+void arena_free(void* Block)
+{
+	if (Block == NULL)
+		return;
+
+	if (!_arena_contains(Block)) {
+		free(Block);
+		return;
+	}
+
+	/* Only the last allocation can be given back before the event ends */
+	if (Block == _last) {
+		_current->Used = (size_t)((unsigned char*)((PARENA_HEADER)Block - 1) - _current->Data);
+		_last = NULL;
+	}
+
+	return;
+}
+
+
+void arena_finit(void)
+{
+	PARENA_BLOCK b = NULL;
+
+	while (_blocks != NULL) {
+		b = _blocks;
+		_blocks = b->Next;
+		free(b);
+	}
+
+	_current = NULL;
+	_last = NULL;
+
+	return;
+}
@@ -0,0 +1,34 @@
+
+#pragma once
+
+
+#include <stddef.h>
+
+
+/*
+ * Bump allocator for the memory of a single event: an arbiter chunk or the
+ * SMS drain of a modem. Between arena_enter() and the matching
+ * arena_leave() the responses, their lines, field arrays and SMS messages
+ * take their memory from a chain of blocks by moving a pointer, and the
+ * outermost arena_leave() makes all of it free again at once. The blocks
+ * are kept for the next event.
+ *
+ * arena_free() does nothing for arena memory and calls free() for any
+ * other, so the owners keep freeing what they got and the same code works
+ * outside of an event, where the allocations come from malloc(). Whatever
+ * lives longer than the event must be allocated under arena_bypass().
+ */
+
+/* Size of a block, a larger allocation gets malloc() */
+#define ARENA_BLOCK_SIZE				(16 * 1024)
+#define ARENA_LARGE_SIZE				(ARENA_BLOCK_SIZE / 4)
+
+
+void arena_enter(void);
+void arena_leave(void);
+int arena_bypass(int Bypass);
+void* arena_alloc(size_t Size);
+void* arena_realloc(void* Block, size_t Size);
+char* arena_strdup(const char* String);
+void arena_free(void* Block);
+void arena_finit(void);
@@ -0,0 +1,752 @@
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "logging.h"
+#include "binlog.h"
+
+
+/*
+ * Nothing here may log, the logger would end up calling itself.
+ *
+ * Producers reserve space by advancing Head with a compare-and-swap, fill
+ * the record and publish it by setting Ready. The writer thread consumes
+ * complete records from Tail, zeroes them and releases their space by
+ * advancing Tail, so the space a producer has reserved but not filled yet
+ * never looks ready.
+ * A record never wraps, the rest of the ring is skipped by a binlogPad
+ * record instead. When the ring is full the message is dropped and
+ * counted, the caller never waits for the SD card.
+ */
+
+
+typedef struct _BINLOG_SPEC {
+	const char* Start;
+	size_t Length;
+	char Modifier[3];
+	char Conversion;
+} BINLOG_SPEC, *PBINLOG_SPEC;
+
+typedef struct _BINLOG_RING {
+	uint64_t Head;
+	uint64_t Tail;
+	uint64_t Dropped;
+	unsigned char* Data;
+} BINLOG_RING, *PBINLOG_RING;
+
+typedef struct _BINLOG_WRITER {
+	pthread_t Thread;
+	int Running;
+	int FD;
+	char* FileName;
+	size_t MaxSize;
+	size_t MaxRecords;
+	size_t FileSize;
+	size_t FileRecords;
+	uint64_t DroppedReported;
+	/* Formats already defined in the current file */
+	uint64_t* Formats;
+	size_t FormatCount;
+	size_t FormatCapacity;
+	unsigned char* Buffer;
+	size_t BufferUsed;
+} BINLOG_WRITER, *PBINLOG_WRITER;
+
+
+#define BINLOG_BUFFER_SIZE				(64 * 1024)
+#define BINLOG_FORMATS_MIN				1024
+#define BINLOG_ALIGN(aSize)				(((aSize) + 7) & ~(size_t)7)
+
+static BINLOG_RING _ring;
+static BINLOG_WRITER _writer = {.FD = -1};
+static int _started = 0;
+static const char _droppedFormat[] = "[WARNING]: %lu log messages dropped, the log ring was full\n";
+
+
+
+/* Next conversion at or after Format, NULL when there is none */
+static const char* _binlog_spec_next(const char* Format, PBINLOG_SPEC Spec)
+{
+	const char* p = NULL;
+	size_t modLen = 0;
+
+	p = strchr(Format, '%');
+	if (p == NULL)
+		return NULL;
+
+	memset(Spec, 0, sizeof(BINLOG_SPEC));
+	Spec->Start = p;
+	++p;
+	if (*p != '%') {
+		p += strspn(p, "-+ #0");
+		p += strspn(p, "0123456789");
+		if (*p == '.') {
+			++p;
+			p += strspn(p, "0123456789");
+		}
+
+		modLen = strspn(p, "hlLqjzt");
+		memcpy(Spec->Modifier, p, (modLen < 2) ? modLen : 2);
+		p += modLen;
+	}
+
+	Spec->Conversion = *p;
+	if (*p != '\0')
+		++p;
+
+	Spec->Length = (size_t)(p - Spec->Start);
+
+	return p;
+}
+
+
+static char _binlog_spec_kind(const BINLOG_SPEC* Spec)
+{
+	char ret = 0;
+
+	switch (Spec->Conversion) {
+		case 'd':
+		case 'i':
+		case 'u':
+		case 'x':
+		case 'X':
+		case 'o':
+		case 'c':
+		case 'p':
+			ret = BINLOG_ARG_INT;
+			break;
+		case 'f':
+		case 'F':
+		case 'e':
+		case 'E':
+		case 'g':
+		case 'G':
+		case 'a':
+		case 'A':
+			ret = BINLOG_ARG_DOUBLE;
+			break;
+		case 's':
+			ret = BINLOG_ARG_STRING;
+			break;
+		default:
+			/* "%%", "%m" and unknown conversions take no argument */
+			break;
+	}
+
+	return ret;
+}
+
+
+static uint64_t _binlog_int_fetch(const BINLOG_SPEC* Spec, va_list* Args)
+{
+	uint64_t ret = 0;
+	int isUnsigned = 0;
+	const char* m = Spec->Modifier;
+
+	isUnsigned = (strchr("uxXo", Spec->Conversion) != NULL);
+	if (Spec->Conversion == 'p')
+		ret = (uint64_t)(uintptr_t)va_arg(*Args, void*);
+	else if (m[0] == 'l' && m[1] == 'l')
+		ret = isUnsigned ? (uint64_t)va_arg(*Args, unsigned long long) : (uint64_t)va_arg(*Args, long long);
+	else if (m[0] == 'q')
+		ret = isUnsigned ? (uint64_t)va_arg(*Args, unsigned long long) : (uint64_t)va_arg(*Args, long long);
+	else if (m[0] == 'l')
+		ret = isUnsigned ? (uint64_t)va_arg(*Args, unsigned long) : (uint64_t)va_arg(*Args, long);
+	else if (m[0] == 'z')
+		ret = isUnsigned ? (uint64_t)va_arg(*Args, size_t) : (uint64_t)va_arg(*Args, ssize_t);
+	else if (m[0] == 'j')
+		ret = isUnsigned ? (uint64_t)va_arg(*Args, uintmax_t) : (uint64_t)va_arg(*Args, intmax_t);
+	else if (m[0] == 't')
+		ret = (uint64_t)va_arg(*Args, ptrdiff_t);
+	else ret = isUnsigned ? (uint64_t)va_arg(*Args, unsigned int) : (uint64_t)va_arg(*Args, int);
+
+	return ret;
+}
+
+
+/* Builds a record in Buffer (BINLOG_RECORD_MAX bytes), strings that do not fit are cut */
+static size_t _binlog_encode(unsigned char* Buffer, int Type, const char* Format, va_list Args)
+{
+	BINLOG_SPEC spec;
+	const char* p = NULL;
+	const char* s = NULL;
+	size_t len = 0;
+	size_t used = sizeof(BINLOG_RECORD_HEADER);
+	uint64_t i = 0;
+	double d = 0;
+	char kind = 0;
+	struct timespec ts;
+	PBINLOG_RECORD_HEADER h = (PBINLOG_RECORD_HEADER)Buffer;
+	va_list vl;
+
+	va_copy(vl, Args);
+	p = Format;
+	while ((p = _binlog_spec_next(p, &spec)) != NULL) {
+		kind = _binlog_spec_kind(&spec);
+		switch (kind) {
+			case BINLOG_ARG_INT:
+				i = _binlog_int_fetch(&spec, &vl);
+				if (used + 1 + sizeof(i) <= BINLOG_RECORD_MAX) {
+					Buffer[used] = (unsigned char)kind;
+					memcpy(Buffer + used + 1, &i, sizeof(i));
+					used += 1 + sizeof(i);
+				}
+				break;
+			case BINLOG_ARG_DOUBLE:
+				if (spec.Modifier[0] == 'L')
+					d = (double)va_arg(vl, long double);
+				else d = va_arg(vl, double);
+
+				if (used + 1 + sizeof(d) <= BINLOG_RECORD_MAX) {
+					Buffer[used] = (unsigned char)kind;
+					memcpy(Buffer + used + 1, &d, sizeof(d));
+					used += 1 + sizeof(d);
+				}
+				break;
+			case BINLOG_ARG_STRING:
+				s = va_arg(vl, const char*);
+				if (s == NULL)
+					s = "(null)";
+
+				if (used + 2 <= BINLOG_RECORD_MAX) {
+					len = strnlen(s, BINLOG_RECORD_MAX - used - 2);
+					Buffer[used] = (unsigned char)kind;
+					memcpy(Buffer + used + 1, s, len);
+					Buffer[used + 1 + len] = '\0';
+					used += len + 2;
+				}
+				break;
+			default:
+				break;
+		}
+	}
+
+	va_end(vl);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	h->Size = (uint16_t)BINLOG_ALIGN(used);
+	h->Type = (uint8_t)Type;
+	h->Ready = 0;
+	h->Reserved = 0;
+	h->Format = (uint64_t)(uintptr_t)Format;
+	h->Timestamp = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+	memset(Buffer + used, 0, h->Size - used);
+
+	return h->Size;
+}
+
+
+void binlog_record(int Type, const char* Format, va_list Args)
+{
+	unsigned char buf[BINLOG_RECORD_MAX] __attribute__((aligned(8)));
+	PBINLOG_RECORD_HEADER h = NULL;
+	size_t size = 0;
+	size_t offset = 0;
+	size_t pad = 0;
+	uint64_t head = 0;
+	uint64_t tail = 0;
+
+	if (!__atomic_load_n(&_started, __ATOMIC_ACQUIRE))
+		return;
+
+	size = _binlog_encode(buf, Type, Format, Args);
+	head = __atomic_load_n(&_ring.Head, __ATOMIC_RELAXED);
+	do {
+		offset = (size_t)(head % BINLOG_RING_SIZE);
+		pad = (BINLOG_RING_SIZE - offset < size) ? BINLOG_RING_SIZE - offset : 0;
+		tail = __atomic_load_n(&_ring.Tail, __ATOMIC_ACQUIRE);
+		if (head + pad + size - tail > BINLOG_RING_SIZE) {
+			__atomic_add_fetch(&_ring.Dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+	} while (!__atomic_compare_exchange_n(&_ring.Head, &head, head + pad + size, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	if (pad > 0) {
+		h = (PBINLOG_RECORD_HEADER)(_ring.Data + offset);
+		h->Size = (uint16_t)pad;
+		h->Type = binlogPad;
+		__atomic_store_n(&h->Ready, 1, __ATOMIC_RELEASE);
+		offset = 0;
+	}
+
+	memcpy(_ring.Data + offset, buf, size);
+	h = (PBINLOG_RECORD_HEADER)(_ring.Data + offset);
+	__atomic_store_n(&h->Ready, 1, __ATOMIC_RELEASE);
+
+	return;
+}
+
+
+static int _binlog_write(int FD, const void* Data, size_t Length)
+{
+	int ret = 0;
+	ssize_t written = 0;
+	const unsigned char* d = (const unsigned char*)Data;
+
+	while (ret == 0 && Length > 0) {
+		written = write(FD, d, Length);
+		if (written == -1) {
+			if (errno != EINTR)
+				ret = errno;
+
+			continue;
+		}
+
+		d += written;
+		Length -= (size_t)written;
+	}
+
+	return ret;
+}
+
+
+static int _binlog_file_open(PBINLOG_WRITER Writer)
+{
+	int ret = 0;
+	struct stat st;
+	char magic[sizeof(BINLOG_MAGIC) - 1];
+
+	Writer->FD = open(Writer->FileName, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (Writer->FD == -1)
+		ret = errno;
+
+	if (ret == 0 && fstat(Writer->FD, &st) == -1)
+		ret = errno;
+
+	if (ret == 0) {
+		Writer->FileSize = (size_t)st.st_size;
+		Writer->FileRecords = 0;
+		Writer->FormatCount = 0;
+		memset(Writer->Formats, 0, Writer->FormatCapacity * sizeof(uint64_t));
+		if (Writer->FileSize == 0) {
+			ret = _binlog_write(Writer->FD, BINLOG_MAGIC, sizeof(magic));
+			if (ret == 0)
+				Writer->FileSize = sizeof(magic);
+		}
+	}
+
+	/* Appending to a text log of an older version would make both unreadable */
+	if (ret == 0 && Writer->FileSize > sizeof(magic)) {
+		int fd = open(Writer->FileName, O_RDONLY | O_CLOEXEC);
+
+		if (fd != -1) {
+			if (pread(fd, magic, sizeof(magic), 0) != (ssize_t)sizeof(magic) || memcmp(magic, BINLOG_MAGIC, sizeof(magic)) != 0)
+				Writer->FileSize = Writer->MaxSize + 1;
+
+			close(fd);
+		}
+	}
+
+	if (ret != 0 && Writer->FD != -1) {
+		close(Writer->FD);
+		Writer->FD = -1;
+	}
+
+	return ret;
+}
+
+
+static int _binlog_rotate(PBINLOG_WRITER Writer)
+{
+	int ret = 0;
+	size_t nameLen = 0;
+	char* from = NULL;
+	char* to = NULL;
+
+	close(Writer->FD);
+	Writer->FD = -1;
+	nameLen = strlen(Writer->FileName) + 16;
+	from = malloc(nameLen);
+	to = malloc(nameLen);
+	if (from == NULL || to == NULL)
+		ret = ENOMEM;
+
+	if (ret == 0) {
+		for (int i = BINLOG_ROTATE_FILES - 1; i > 0; --i) {
+			snprintf(from, nameLen, "%s.%i", Writer->FileName, i);
+			snprintf(to, nameLen, "%s.%i", Writer->FileName, i + 1);
+			rename(from, to);
+		}
+
+		snprintf(to, nameLen, "%s.1", Writer->FileName);
+		if (rename(Writer->FileName, to) == -1)
+			ret = errno;
+	}
+
+	free(to);
+	free(from);
+	if (_binlog_file_open(Writer) != 0)
+		ret = EIO;
+
+	return ret;
+}
+
+
+static int _binlog_flush(PBINLOG_WRITER Writer)
+{
+	int ret = 0;
+
+	if (Writer->BufferUsed > 0 && Writer->FD != -1) {
+		ret = _binlog_write(Writer->FD, Writer->Buffer, Writer->BufferUsed);
+		if (ret == 0)
+			Writer->FileSize += Writer->BufferUsed;
+	}
+
+	Writer->BufferUsed = 0;
+
+	return ret;
+}
+
+
+/* Nonzero if the format had not been defined in the current file yet */
+static int _binlog_format_add(PBINLOG_WRITER Writer, uint64_t Format)
+{
+	int ret = 0;
+	uint64_t* formats = NULL;
+	size_t capacity = 0;
+	size_t slot = 0;
+
+	if (Writer->FormatCount * 2 >= Writer->FormatCapacity) {
+		capacity = Writer->FormatCapacity * 2;
+		formats = calloc(capacity, sizeof(uint64_t));
+		if (formats == NULL)
+			return 1;
+
+		for (size_t i = 0; i < Writer->FormatCapacity; ++i) {
+			if (Writer->Formats[i] == 0)
+				continue;
+
+			slot = (size_t)((Writer->Formats[i] >> 3) % capacity);
+			while (formats[slot] != 0)
+				slot = (slot + 1) % capacity;
+
+			formats[slot] = Writer->Formats[i];
+		}
+
+		free(Writer->Formats);
+		Writer->Formats = formats;
+		Writer->FormatCapacity = capacity;
+	}
+
+	slot = (size_t)((Format >> 3) % Writer->FormatCapacity);
+	while (Writer->Formats[slot] != 0 && Writer->Formats[slot] != Format)
+		slot = (slot + 1) % Writer->FormatCapacity;
+
+	if (Writer->Formats[slot] == 0) {
+		Writer->Formats[slot] = Format;
+		++Writer->FormatCount;
+		ret = 1;
+	}
+
+	return ret;
+}
+
+
+static void _binlog_append(PBINLOG_WRITER Writer, const void* Data, size_t Length)
+{
+	if (Writer->BufferUsed + Length > BINLOG_BUFFER_SIZE)
+		_binlog_flush(Writer);
+
+	memcpy(Writer->Buffer + Writer->BufferUsed, Data, Length);
+	Writer->BufferUsed += Length;
+
+	return;
+}
+
+
+static void _binlog_message_append(PBINLOG_WRITER Writer, const BINLOG_RECORD_HEADER* Record)
+{
+	BINLOG_RECORD_HEADER h;
+	const char* format = NULL;
+	size_t len = 0;
+	size_t formatSize = 0;
+	static const unsigned char zeros[8];
+
+	format = (const char*)(uintptr_t)Record->Format;
+	len = strlen(format) + 1;
+	formatSize = BINLOG_ALIGN(sizeof(BINLOG_RECORD_HEADER) + len);
+	if (Writer->FileSize + Writer->BufferUsed > sizeof(BINLOG_MAGIC) - 1 &&
+		(Writer->FileSize + Writer->BufferUsed + Record->Size + formatSize > Writer->MaxSize ||
+		(Writer->MaxRecords > 0 && Writer->FileRecords >= Writer->MaxRecords))) {
+		_binlog_flush(Writer);
+		_binlog_rotate(Writer);
+	}
+
+	if (Writer->FD == -1)
+		return;
+
+	/* Each file defines the formats it uses, so a rotated file decodes on its own */
+	if (_binlog_format_add(Writer, Record->Format)) {
+		memset(&h, 0, sizeof(h));
+		h.Size = (uint16_t)formatSize;
+		h.Type = binlogFormat;
+		h.Format = Record->Format;
+		_binlog_append(Writer, &h, sizeof(h));
+		_binlog_append(Writer, format, len);
+		_binlog_append(Writer, zeros, formatSize - sizeof(h) - len);
+	}
+
+	_binlog_append(Writer, Record, Record->Size);
+	((PBINLOG_RECORD_HEADER)(Writer->Buffer + Writer->BufferUsed - Record->Size))->Ready = 0;
+	++Writer->FileRecords;
+
+	return;
+}
+
+
+static void _binlog_dropped_report(PBINLOG_WRITER Writer, ...)
+{
+	unsigned char buf[BINLOG_RECORD_MAX] __attribute__((aligned(8)));
+	va_list vl;
+
+	va_start(vl, Writer);
+	_binlog_encode(buf, ltWarning, _droppedFormat, vl);
+	va_end(vl);
+	_binlog_message_append(Writer, (PBINLOG_RECORD_HEADER)buf);
+
+	return;
+}
+
+
+static void _binlog_drain(PBINLOG_WRITER Writer)
+{
+	uint64_t tail = 0;
+	uint64_t head = 0;
+	uint64_t dropped = 0;
+	PBINLOG_RECORD_HEADER h = NULL;
+
+	/* The file could not be reopened after a rotation, try again */
+	if (Writer->FD == -1)
+		_binlog_file_open(Writer);
+
+	tail = __atomic_load_n(&_ring.Tail, __ATOMIC_RELAXED);
+	head = __atomic_load_n(&_ring.Head, __ATOMIC_ACQUIRE);
+	while (tail != head) {
+		h = (PBINLOG_RECORD_HEADER)(_ring.Data + tail % BINLOG_RING_SIZE);
+		/* Reserved, but the producer is still filling it */
+		if (!__atomic_load_n(&h->Ready, __ATOMIC_ACQUIRE))
+			break;
+
+		if (h->Type != binlogPad)
+			_binlog_message_append(Writer, h);
+
+		/* The next lap may put a header anywhere in the record, so all of it goes back to zero */
+		tail += h->Size;
+		memset(h, 0, h->Size);
+		__atomic_store_n(&_ring.Tail, tail, __ATOMIC_RELEASE);
+	}
+
+	dropped = __atomic_load_n(&_ring.Dropped, __ATOMIC_RELAXED);
+	if (dropped != Writer->DroppedReported) {
+		_binlog_dropped_report(Writer, (unsigned long)(dropped - Writer->DroppedReported));
+		Writer->DroppedReported = dropped;
+	}
+
+	_binlog_flush(Writer);
+
+	return;
+}
+
+
+static void* _binlog_thread(void* Context)
+{
+	PBINLOG_WRITER w = (PBINLOG_WRITER)Context;
+	struct timespec interval;
+
+	interval.tv_sec = BINLOG_FLUSH_INTERVAL_MS / 1000;
+	interval.tv_nsec = (BINLOG_FLUSH_INTERVAL_MS % 1000) * 1000000L;
+	/* One write per interval keeps the SD card from being hit by every message */
+	while (__atomic_load_n(&w->Running, __ATOMIC_ACQUIRE)) {
+		nanosleep(&interval, NULL);
+		_binlog_drain(w);
+	}
+
+	_binlog_drain(w);
+
+	return NULL;
+}
+
+
+int binlog_start(const char* FileName, size_t MaxSize, size_t MaxRecords)
+{
+	int ret = 0;
+	sigset_t all;
+	sigset_t old;
+
+	if (_started)
+		return EALREADY;
+
+	memset(&_ring, 0, sizeof(_ring));
+	/* A header the producers have reserved but not written yet must read as not ready */
+	_ring.Data = calloc(1, BINLOG_RING_SIZE);
+	_writer.Buffer = malloc(BINLOG_BUFFER_SIZE);
+	_writer.Formats = calloc(BINLOG_FORMATS_MIN, sizeof(uint64_t));
+	_writer.FormatCapacity = BINLOG_FORMATS_MIN;
+	_writer.FileName = strdup(FileName);
+	if (_ring.Data == NULL || _writer.Buffer == NULL || _writer.Formats == NULL || _writer.FileName == NULL)
+		ret = ENOMEM;
+
+	if (ret == 0) {
+		memset(_ring.Data, 0, BINLOG_RING_SIZE);
+		_writer.MaxSize = MaxSize;
+		_writer.MaxRecords = MaxRecords;
+		_writer.DroppedReported = 0;
+		_writer.BufferUsed = 0;
+		ret = _binlog_file_open(&_writer);
+	}
+
+	if (ret == 0) {
+		_writer.Running = 1;
+		/* Signals are for the main loop, not for the writer */
+		sigfillset(&all);
+		pthread_sigmask(SIG_SETMASK, &all, &old);
+		ret = pthread_create(&_writer.Thread, NULL, _binlog_thread, &_writer);
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+	}
+
+	if (ret == 0)
+		__atomic_store_n(&_started, 1, __ATOMIC_RELEASE);
+	else {
+		if (_writer.FD != -1)
+			close(_writer.FD);
+
+		_writer.FD = -1;
+		free(_writer.FileName);
+		free(_writer.Formats);
+		free(_writer.Buffer);
+		free(_ring.Data);
+		_writer.FileName = NULL;
+		_writer.Formats = NULL;
+		_writer.Buffer = NULL;
+		_ring.Data = NULL;
+	}
+
+	return ret;
+}
+
+
+void binlog_stop(void)
+{
+	if (!_started)
+		return;
+
+	/* Called once no other thread logs anymore, the final drain takes everything recorded so far */
+	__atomic_store_n(&_started, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&_writer.Running, 0, __ATOMIC_RELEASE);
+	pthread_join(_writer.Thread, NULL);
+	close(_writer.FD);
+	_writer.FD = -1;
+	free(_writer.FileName);
+	free(_writer.Formats);
+	free(_writer.Buffer);
+	free(_ring.Data);
+	_writer.FileName = NULL;
+	_writer.Formats = NULL;
+	_writer.Buffer = NULL;
+	_ring.Data = NULL;
+
+	return;
+}
+
+
+int binlog_record_print(FILE* Stream, const BINLOG_RECORD_HEADER* Record, const char* Format)
+{
+	int ret = 0;
+	BINLOG_SPEC spec;
+	char specString[32];
+	const char* p = NULL;
+	const char* next = NULL;
+	const unsigned char* arg = NULL;
+	const unsigned char* end = NULL;
+	const char* m = NULL;
+	char kind = 0;
+	uint64_t i = 0;
+	double d = 0;
+	int isUnsigned = 0;
+
+	arg = (const unsigned char*)(Record + 1);
+	end = (const unsigned char*)Record + Record->Size;
+	p = Format;
+	while (ret == 0 && (next = _binlog_spec_next(p, &spec)) != NULL) {
+		fwrite(p, 1, (size_t)(spec.Start - p), Stream);
+		p = next;
+		kind = _binlog_spec_kind(&spec);
+		if (kind == 0 || spec.Length >= sizeof(specString)) {
+			if (spec.Conversion == '%')
+				fputc('%', Stream);
+			else fwrite(spec.Start, 1, spec.Length, Stream);
+
+			continue;
+		}
+
+		if (arg >= end || *arg != (unsigned char)kind) {
+			ret = EINVAL;
+			continue;
+		}
+
+		++arg;
+		memcpy(specString, spec.Start, spec.Length);
+		specString[spec.Length] = '\0';
+		m = spec.Modifier;
+		switch (kind) {
+			case BINLOG_ARG_INT:
+				if (arg + sizeof(i) > end) {
+					ret = EINVAL;
+					continue;
+				}
+
+				memcpy(&i, arg, sizeof(i));
+				arg += sizeof(i);
+				isUnsigned = (strchr("uxXo", spec.Conversion) != NULL);
+				if (spec.Conversion == 'p')
+					fprintf(Stream, specString, (void*)(uintptr_t)i);
+				else if ((m[0] == 'l' && m[1] == 'l') || m[0] == 'q' || m[0] == 'j')
+					fprintf(Stream, specString, (long long)i);
+				else if (m[0] == 'l')
+					fprintf(Stream, specString, isUnsigned ? (unsigned long)i : (unsigned long)(long)i);
+				else if (m[0] == 'z')
+					fprintf(Stream, specString, (size_t)i);
+				else if (m[0] == 't')
+					fprintf(Stream, specString, (ptrdiff_t)i);
+				else fprintf(Stream, specString, isUnsigned ? (unsigned int)i : (unsigned int)(int)i);
+				break;
+			case BINLOG_ARG_DOUBLE:
+				if (arg + sizeof(d) > end) {
+					ret = EINVAL;
+					continue;
+				}
+
+				memcpy(&d, arg, sizeof(d));
+				arg += sizeof(d);
+				if (m[0] == 'L')
+					fprintf(Stream, specString, (long double)d);
+				else fprintf(Stream, specString, d);
+				break;
+			case BINLOG_ARG_STRING:
+				if (memchr(arg, '\0', (size_t)(end - arg)) == NULL) {
+					ret = EINVAL;
+					continue;
+				}
+
+				fprintf(Stream, specString, (const char*)arg);
+				arg += strlen((const char*)arg) + 1;
+				break;
+		}
+	}
+
+	if (ret == 0)
+		fputs(p, Stream);
+	else fputs("<corrupted arguments>\n", Stream);
+
+	return ret;
+}
@@ -0,0 +1,48 @@
+
+#pragma once
+
+
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+
+/*
+ * Binary log file: BINLOG_MAGIC followed by records. A format string is
+ * stored once per file in a binlogFormat record, the messages refer to it
+ * by the address the format had in the logging process and carry their
+ * arguments unformatted.
+ */
+
+#define BINLOG_MAGIC					"PTBLOG1\n"
+#define BINLOG_RECORD_MAX				512
+#define BINLOG_RING_SIZE				(256 * 1024)
+#define BINLOG_ROTATE_FILES				3
+#define BINLOG_FLUSH_INTERVAL_MS		500
+
+/* Record types above the ELogType values */
+#define binlogFormat					0xfe
+#define binlogPad						0xff
+
+/* Argument tags */
+#define BINLOG_ARG_INT					'i'
+#define BINLOG_ARG_DOUBLE				'd'
+#define BINLOG_ARG_STRING				's'
+
+typedef struct _BINLOG_RECORD_HEADER {
+	/* Whole record, a multiple of 8 bytes */
+	uint16_t Size;
+	uint8_t Type;
+	/* Set by the producer once the record is complete, always zero in the file */
+	uint8_t Ready;
+	uint32_t Reserved;
+	uint64_t Format;
+	/* CLOCK_REALTIME in nanoseconds */
+	uint64_t Timestamp;
+} BINLOG_RECORD_HEADER, *PBINLOG_RECORD_HEADER;
+
+
+int binlog_start(const char* FileName, size_t MaxSize, size_t MaxRecords);
+void binlog_stop(void);
+void binlog_record(int Type, const char* Format, va_list Args);
+int binlog_record_print(FILE* Stream, const BINLOG_RECORD_HEADER* Record, const char* Format);
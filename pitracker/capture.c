@@ -0,0 +1,340 @@
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "logging.h"
+#include "capture.h"
+
+
+
+#define CAPTURE_ALIGN(aSize)			(((aSize) + 7) & ~(size_t)7)
+#define CAPTURE_BUFFER_SIZE				(64 * 1024)
+
+typedef struct _CAPTURE_REPLAY {
+	unsigned char* Data;
+	size_t Size;
+	size_t Offset;
+	/* Bytes of the current frtTx record already written by the application */
+	size_t TxOffset;
+	int RealTime;
+	uint64_t FirstTimestamp;
+	struct timespec Start;
+	size_t Records;
+	size_t Bytes;
+	size_t Mismatches;
+	/* Timestamp of the record served last */
+	uint64_t Clock;
+} CAPTURE_REPLAY, *PCAPTURE_REPLAY;
+
+
+static FILE* _recordFile = NULL;
+static char* _recordBuffer = NULL;
+static CAPTURE_REPLAY _replay;
+static int _replaying = 0;
+
+
+
+static uint64_t _capture_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+
+static const FLIGHT_RECORD* _capture_replay_current(void)
+{
+	const FLIGHT_RECORD* ret = NULL;
+
+	if (_replay.Offset + sizeof(FLIGHT_RECORD) <= _replay.Size) {
+		ret = (const FLIGHT_RECORD*)(_replay.Data + _replay.Offset);
+		if (ret->Size < sizeof(FLIGHT_RECORD) + ret->Length || ret->Size > _replay.Size - _replay.Offset)
+			ret = NULL;
+	}
+
+	return ret;
+}
+
+
+static void _capture_replay_next(void)
+{
+	_replay.Clock = _capture_replay_current()->Timestamp;
+	_replay.Offset += _capture_replay_current()->Size;
+	_replay.TxOffset = 0;
+	++_replay.Records;
+
+	return;
+}
+
+
+/* In real time the record is not served before its offset from the first one has passed */
+static void _capture_replay_pace(const FLIGHT_RECORD* Record)
+{
+	uint64_t due = 0;
+	uint64_t elapsed = 0;
+	struct timespec now;
+	struct timespec delay;
+
+	if (!_replay.RealTime)
+		return;
+
+	due = Record->Timestamp - _replay.FirstTimestamp;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (uint64_t)(now.tv_sec - _replay.Start.tv_sec) * 1000000000ULL + (uint64_t)now.tv_nsec - (uint64_t)_replay.Start.tv_nsec;
+	if (due > elapsed) {
+		delay.tv_sec = (time_t)((due - elapsed) / 1000000000ULL);
+		delay.tv_nsec = (long)((due - elapsed) % 1000000000ULL);
+		while (nanosleep(&delay, &delay) == -1 && errno == EINTR)
+			;
+	}
+
+	return;
+}
+
+
+int capture_record_open(const char* FileName)
+{
+	int ret = 0;
+	log_enter("FileName=\"%s\"", FileName);
+
+	_recordFile = fopen(FileName, "wb");
+	if (_recordFile == NULL)
+		ret = errno;
+
+	if (ret == 0) {
+		_recordBuffer = malloc(CAPTURE_BUFFER_SIZE);
+		if (_recordBuffer != NULL)
+			setvbuf(_recordFile, _recordBuffer, _IOFBF, CAPTURE_BUFFER_SIZE);
+
+		if (fwrite(CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC) - 1, 1, _recordFile) != 1)
+			ret = EIO;
+	}
+
+	if (ret != 0 && _recordFile != NULL) {
+		fclose(_recordFile);
+		_recordFile = NULL;
+		free(_recordBuffer);
+		_recordBuffer = NULL;
+	}
+
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+int capture_replay_open(const char* FileName, int RealTime)
+{
+	int ret = 0;
+	FILE* f = NULL;
+	struct stat st;
+	char magic[sizeof(CAPTURE_MAGIC) - 1];
+	log_enter("FileName=\"%s\"; RealTime=%i", FileName, RealTime);
+
+	memset(&_replay, 0, sizeof(_replay));
+	f = fopen(FileName, "rb");
+	if (f == NULL)
+		ret = errno;
+
+	if (ret == 0 && fstat(fileno(f), &st) == -1)
+		ret = errno;
+
+	if (ret == 0 && (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0))
+		ret = EINVAL;
+
+	if (ret == 0) {
+		_replay.Size = (size_t)st.st_size - sizeof(magic);
+		_replay.Data = malloc(_replay.Size + 1);
+		if (_replay.Data == NULL)
+			ret = ENOMEM;
+	}
+
+	if (ret == 0 && _replay.Size > 0 && fread(_replay.Data, _replay.Size, 1, f) != 1)
+		ret = EIO;
+
+	if (ret == 0) {
+		_replay.RealTime = RealTime;
+		if (_capture_replay_current() != NULL)
+			_replay.FirstTimestamp = _capture_replay_current()->Timestamp;
+
+		_replay.Clock = _replay.FirstTimestamp;
+
+		clock_gettime(CLOCK_MONOTONIC, &_replay.Start);
+		_replaying = 1;
+	}
+
+	if (ret != 0) {
+		free(_replay.Data);
+		_replay.Data = NULL;
+	}
+
+	if (f != NULL)
+		fclose(f);
+
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+void capture_close(void)
+{
+	struct timespec now;
+	log_enter("");
+
+	if (_recordFile != NULL) {
+		fclose(_recordFile);
+		_recordFile = NULL;
+		free(_recordBuffer);
+		_recordBuffer = NULL;
+	}
+
+	if (_replaying) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		/* The benchmark result, printed whatever the verbosity */
+		fprintf(stderr, "Replayed %zu records, %zu bytes received in %li ms, %zu mismatches\n", _replay.Records, _replay.Bytes,
+			(long)((now.tv_sec - _replay.Start.tv_sec) * 1000 + (now.tv_nsec - _replay.Start.tv_nsec) / 1000000), _replay.Mismatches);
+		_replaying = 0;
+		free(_replay.Data);
+		memset(&_replay, 0, sizeof(_replay));
+	}
+
+	log_exit("void");
+	return;
+}
+
+
+int capture_replaying(void)
+{
+	return _replaying;
+}
+
+
+int capture_replay_done(void)
+{
+	return (_replaying && _capture_replay_current() == NULL);
+}
+
+
+void capture_record(EFlightRecordType Type, const void* Data, size_t Length)
+{
+	FLIGHT_RECORD r;
+	static const unsigned char zeros[8];
+
+	if (_recordFile == NULL)
+		return;
+
+	if (Length > UINT16_MAX)
+		Length = UINT16_MAX;
+
+	memset(&r, 0, sizeof(r));
+	r.Size = (uint32_t)CAPTURE_ALIGN(sizeof(r) + Length);
+	r.Type = (uint16_t)Type;
+	r.Length = (uint16_t)Length;
+	r.Timestamp = _capture_now();
+	fwrite(&r, sizeof(r), 1, _recordFile);
+	if (Length > 0)
+		fwrite(Data, Length, 1, _recordFile);
+
+	fwrite(zeros, r.Size - sizeof(r) - Length, 1, _recordFile);
+
+	return;
+}
+
+
+/* *Read is zero when the recorded wait timed out, ENODATA marks the end of the capture */
+int capture_replay_read(void* Buffer, size_t Size, ssize_t* Read)
+{
+	int ret = 0;
+	const FLIGHT_RECORD* r = NULL;
+
+	*Read = 0;
+	r = _capture_replay_current();
+	/* The application sent less than recorded, its requests are skipped */
+	while (r != NULL && r->Type == frtTx) {
+		++_replay.Mismatches;
+		_capture_replay_next();
+		r = _capture_replay_current();
+	}
+
+	if (r != NULL) {
+		_capture_replay_pace(r);
+		if (r->Type == frtRx) {
+			*Read = (r->Length < Size) ? r->Length : (ssize_t)Size;
+			memcpy(Buffer, r + 1, (size_t)*Read);
+			_replay.Bytes += (size_t)*Read;
+		}
+
+		_capture_replay_next();
+	} else ret = ENODATA;
+
+	return ret;
+}
+
+
+/*
+ * The clock of the main loop. A replay returns the recorded reading, or
+ * the time of the record served last for a capture made without them, so
+ * the periodic work comes at the same point of the session.
+ */
+void capture_clock(struct timespec* Now)
+{
+	uint64_t ns = 0;
+	const FLIGHT_RECORD* r = NULL;
+
+	if (_replaying) {
+		r = _capture_replay_current();
+		if (r != NULL && r->Type == frtClock)
+			_capture_replay_next();
+
+		ns = _replay.Clock;
+	} else {
+		ns = _capture_now();
+		if (_recordFile != NULL)
+			capture_record(frtClock, NULL, 0);
+	}
+
+	Now->tv_sec = (time_t)(ns / 1000000000ULL);
+	Now->tv_nsec = (long)(ns % 1000000000ULL);
+
+	return;
+}
+
+
+void capture_replay_write(const void* Data, size_t Length)
+{
+	const FLIGHT_RECORD* r = NULL;
+	const unsigned char* d = NULL;
+	size_t len = 0;
+
+	d = (const unsigned char*)Data;
+	while (Length > 0) {
+		r = _capture_replay_current();
+		if (r == NULL || r->Type != frtTx) {
+			++_replay.Mismatches;
+			break;
+		}
+
+		len = r->Length - _replay.TxOffset;
+		if (len > Length)
+			len = Length;
+
+		if (memcmp((const unsigned char*)(r + 1) + _replay.TxOffset, d, len) != 0)
+			++_replay.Mismatches;
+
+		_replay.TxOffset += len;
+		d += len;
+		Length -= len;
+		if (_replay.TxOffset == r->Length)
+			_capture_replay_next();
+	}
+
+	return;
+}
@@ -0,0 +1,30 @@
+
+#pragma once
+
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+#include "flight-recorder.h"
+
+
+/*
+ * Session capture: CAPTURE_MAGIC followed by FLIGHT_RECORDs (frtTx, frtRx,
+ * frtTimeout and frtClock) in the order seen on the serial port. A replay
+ * serves the frtRx chunks to serial_response_wait() instead of the modem,
+ * the frtClock times to capture_clock() and checks what the application
+ * writes against the frtTx records.
+ */
+
+#define CAPTURE_MAGIC					"PTCAPT1\n"
+
+
+int capture_record_open(const char* FileName);
+int capture_replay_open(const char* FileName, int RealTime);
+void capture_close(void);
+int capture_replaying(void);
+int capture_replay_done(void);
+void capture_record(EFlightRecordType Type, const void* Data, size_t Length);
+int capture_replay_read(void* Buffer, size_t Size, ssize_t* Read);
+void capture_replay_write(const void* Data, size_t Length);
+void capture_clock(struct timespec* Now);
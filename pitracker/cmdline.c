@@ -26,6 +26,9 @@ typedef enum _EOptionType {
 	otPIN,
 	otConfigFile,
 	otGPSFile,
+	otRecord,
+	otReplay,
+	otRealTime,
 	otMax,
 } EOptionType, * PEOptionType;
 
@@ -49,12 +52,18 @@ static OPTION_RECORD _options[] = {
 	{otPIN, 0, "p", "pin", 1},
 	{otConfigFile, 0, "c", "config-file", 1},
 	{otGPSFile, 0, "g", "gps-file", 1},
+	{otRecord, 0, "r", "record", 1},
+	{otReplay, 0, "R", "replay", 1},
+	{otRealTime, 0, "t", "real-time", 0},
 };
 
 
 int _help = 0;
 int _version = 0;
 char* _configFile = NULL;
+const char* _recordFile = NULL;
+const char* _replayFile = NULL;
+int _replayRealTime = 0;
 
 
 static int _on_cmd_option(EOptionType Type, const char** Arguments, int ArgumentCount)
@@ -71,12 +80,12 @@ static int _on_cmd_option(EOptionType Type, const char** Arguments, int Argument
 			_version = 1;
 			break;
 		case otDevice:
-			ret = settings_value_set_string("device", 0, Arguments[0]);
+			ret = settings_set_string(skDevice, Arguments[0]);
 			if (ret != 0)
 				log_error("Unable to add (device,%s): %i", Arguments[0], ret);
 			break;
 		case otLogFile:
-			ret = settings_value_set_string("logfile", 0, Arguments[0]);
+			ret = settings_set_string(skLogFile, Arguments[0]);
 			if (ret != 0)
 				log_error("Unable to add (logfile,%s): %i", Arguments[0], ret);
 			break;
@@ -94,7 +103,7 @@ static int _on_cmd_option(EOptionType Type, const char** Arguments, int Argument
 				goto Exit;
 			}
 
-			ret = settings_value_set_string("baudrate", 0, Arguments[0]);
+			ret = settings_set_string(skBaudRate, Arguments[0]);
 			if (ret != 0)
 				log_error("Unable to add (baudrate,%s): %i", Arguments[0], ret);
 			break;
@@ -107,9 +116,9 @@ static int _on_cmd_option(EOptionType Type, const char** Arguments, int Argument
 			}
 			break;
 		case otPIN:
-			ret = settings_value_set_string("pin", 0, Arguments[0]);
+			ret = settings_set_string(skPin, Arguments[0]);
 			if (ret != 0)
-				log_error("Unable to add (pin,%s): %i", Arguments[0], ret);
+				log_error("Unable to set the PIN: %i", ret);
 			break;
 		case otConfigFile:
 			_configFile = strdup(Arguments[0]);
@@ -128,10 +137,19 @@ static int _on_cmd_option(EOptionType Type, const char** Arguments, int Argument
 			}
 			break;
 		case otGPSFile:
-			ret = settings_value_set_string("gpsfile", 0, Arguments[0]);
+			ret = settings_set_string(skGpsFile, Arguments[0]);
 			if (ret != 0)
 				log_error("Unable to add (gpsfile,%s): %i", Arguments[0], ret);
 			break;
+		case otRecord:
+			_recordFile = Arguments[0];
+			break;
+		case otReplay:
+			_replayFile = Arguments[0];
+			break;
+		case otRealTime:
+			_replayRealTime = 1;
+			break;
 		default:
 			ret = -7;
 			goto Exit;
@@ -215,5 +233,10 @@ int process_command_line(int argc, char** argv)
 		++argvIt;
 	}
 
+	if (ret == 0 && _recordFile != NULL && _replayFile != NULL) {
+		ret = -8;
+		log_error("--record and --replay cannot be combined");
+	}
+
 	return ret;
 }
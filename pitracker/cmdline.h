@@ -5,6 +5,9 @@
 extern int _help;
 extern int _version;
 extern char* _configFile;
+extern const char* _recordFile;
+extern const char* _replayFile;
+extern int _replayRealTime;
 
 
 int process_command_line(int argc, char** argv);
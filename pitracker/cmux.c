@@ -0,0 +1,136 @@
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include "cmux.h"
+
+
+
+/* CRC-8 of 07.10 (x^8 + x^2 + x + 1, reflected), start with 0xFF; the frame carries its complement */
+static unsigned char _cmux_crc(unsigned char Crc, const unsigned char* Data, size_t Length)
+{
+	unsigned char ret = Crc;
+
+	while (Length > 0) {
+		ret ^= *Data;
+		for (int i = 0; i < 8; ++i)
+			ret = (ret & 1) ? (unsigned char)((ret >> 1) ^ 0xE0) : (unsigned char)(ret >> 1);
+
+		++Data;
+		--Length;
+	}
+
+	return ret;
+}
+
+
+/* UIH frames protect the header only, the other types their data too */
+static unsigned char _cmux_fcs(ECmuxFrameType Type, const unsigned char* Header, size_t HeaderLength, const unsigned char* Data, size_t Length)
+{
+	unsigned char ret = 0;
+
+	ret = _cmux_crc(0xFF, Header, HeaderLength);
+	if (Type != cftUIH)
+		ret = _cmux_crc(ret, Data, Length);
+
+	return (unsigned char)(0xFF - ret);
+}
+
+
+/* Frame must hold CMUX_FRAME_MAX bytes; we are the initiator, so our commands carry C/R */
+size_t cmux_frame_encode(int Dlci, ECmuxFrameType Type, const void* Data, size_t Length, unsigned char* Frame)
+{
+	size_t ret = 0;
+
+	if (Length > CMUX_N1)
+		Length = CMUX_N1;
+
+	Frame[ret++] = CMUX_FLAG;
+	Frame[ret++] = (unsigned char)((Dlci << 2) | CMUX_CR | CMUX_EA);
+	Frame[ret++] = (unsigned char)((Type == cftUIH || Type == cftUI) ? Type : (Type | CMUX_PF));
+	Frame[ret++] = (unsigned char)((Length << 1) | CMUX_EA);
+	if (Length > 0)
+		memcpy(Frame + ret, Data, Length);
+
+	Frame[ret + Length] = _cmux_fcs(Type, Frame + 1, ret - 1, Frame + ret, Length);
+	ret += Length + 1;
+	Frame[ret++] = CMUX_FLAG;
+
+	return ret;
+}
+
+
+void cmux_decoder_init(PCMUX_DECODER Decoder)
+{
+	memset(Decoder, 0, sizeof(CMUX_DECODER));
+	Decoder->State = cdsFlag;
+
+	return;
+}
+
+
+/* Complete frames with a valid FCS go to the callback, anything else is counted and skipped up to the next flag */
+void cmux_decode(PCMUX_DECODER Decoder, const unsigned char* Data, size_t Length, CMUX_FRAME_CALLBACK* Callback, void* Context)
+{
+	unsigned char b = 0;
+	PCMUX_DECODER d = Decoder;
+
+	for (size_t i = 0; i < Length; ++i) {
+		b = Data[i];
+		switch (d->State) {
+			case cdsFlag:
+				if (b == CMUX_FLAG)
+					d->State = cdsAddress;
+				break;
+			case cdsAddress:
+				/* Frames may share or repeat flags */
+				if (b != CMUX_FLAG) {
+					d->Header[0] = b;
+					d->HeaderLength = 1;
+					d->State = cdsControl;
+				}
+				break;
+			case cdsControl:
+				d->Header[d->HeaderLength++] = b;
+				d->State = cdsLength;
+				break;
+			case cdsLength:
+			case cdsLength2:
+				d->Header[d->HeaderLength++] = b;
+				if (d->State == cdsLength)
+					d->Length = b >> 1;
+				else d->Length |= (size_t)b << 7;
+
+				if (d->State == cdsLength && !(b & CMUX_EA)) {
+					d->State = cdsLength2;
+					break;
+				}
+
+				d->Index = 0;
+				if (d->Length > sizeof(d->Data)) {
+					++d->Errors;
+					d->State = cdsFlag;
+				} else d->State = (d->Length > 0) ? cdsData : cdsFCS;
+				break;
+			case cdsData:
+				d->Data[d->Index++] = b;
+				if (d->Index == d->Length)
+					d->State = cdsFCS;
+				break;
+			case cdsFCS:
+				d->FCSValid = (_cmux_fcs((ECmuxFrameType)(d->Header[1] & ~CMUX_PF), d->Header, d->HeaderLength, d->Data, d->Length) == b);
+				d->State = cdsEnd;
+				break;
+			case cdsEnd:
+				if (b == CMUX_FLAG && d->FCSValid)
+					Callback(d->Header[0] >> 2, (ECmuxFrameType)(d->Header[1] & ~CMUX_PF), d->Data, d->Length, Context);
+				else ++d->Errors;
+
+				d->State = (b == CMUX_FLAG) ? cdsAddress : cdsFlag;
+				break;
+		}
+	}
+
+	return;
+}
@@ -0,0 +1,62 @@
+
+#pragma once
+
+
+#include <stddef.h>
+
+
+/*
+ * GSM 07.10 basic option framing as used by AT+CMUX=0: F9 address control
+ * length [data] FCS F9. DLCI 0 carries the multiplexer control messages,
+ * the others the virtual channels. Only the frame types needed to open,
+ * use and close the channels are produced.
+ */
+
+#define CMUX_FLAG						0xF9
+#define CMUX_EA							0x01
+#define CMUX_CR							0x02
+#define CMUX_PF							0x10
+/* Maximum information field, negotiated by AT+CMUX */
+#define CMUX_N1							127
+#define CMUX_FRAME_MAX					(CMUX_N1 + 7)
+/* Multiplexer close down on DLCI 0, command and response */
+#define CMUX_CLD_COMMAND				0xC3
+#define CMUX_CLD_RESPONSE				0xC1
+
+typedef enum _ECmuxFrameType {
+	cftSABM = 0x2F,
+	cftUA = 0x63,
+	cftDM = 0x0F,
+	cftDISC = 0x43,
+	cftUIH = 0xEF,
+	cftUI = 0x03,
+} ECmuxFrameType, *PECmuxFrameType;
+
+typedef enum _ECmuxDecoderState {
+	cdsFlag,
+	cdsAddress,
+	cdsControl,
+	cdsLength,
+	cdsLength2,
+	cdsData,
+	cdsFCS,
+	cdsEnd,
+} ECmuxDecoderState, *PECmuxDecoderState;
+
+typedef struct _CMUX_DECODER {
+	ECmuxDecoderState State;
+	unsigned char Header[4];
+	size_t HeaderLength;
+	size_t Length;
+	size_t Index;
+	int FCSValid;
+	unsigned long Errors;
+	unsigned char Data[CMUX_N1];
+} CMUX_DECODER, *PCMUX_DECODER;
+
+typedef void (CMUX_FRAME_CALLBACK)(int Dlci, ECmuxFrameType Type, const unsigned char* Data, size_t Length, void* Context);
+
+
+size_t cmux_frame_encode(int Dlci, ECmuxFrameType Type, const void* Data, size_t Length, unsigned char* Frame);
+void cmux_decoder_init(PCMUX_DECODER Decoder);
+void cmux_decode(PCMUX_DECODER Decoder, const unsigned char* Data, size_t Length, CMUX_FRAME_CALLBACK* Callback, void* Context);
@@ -0,0 +1,304 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "logging.h"
+#include "cmux.h"
+#include "serial-io.h"
+
+
+/*
+ * Checks the CMUX framing and the channels of the serial thread without a
+ * modem. The first part round-trips frames through cmux_frame_encode()
+ * and cmux_decode(): known FCS values, frames sharing their flags, bytes
+ * fed one by one and a broken FCS. The second part runs serial_io_start()
+ * on one end of a socket pair while a thread on the other end plays the
+ * modem: it answers SABM and DISC with UA (DM for CMUXTEST_REFUSED_DLCI),
+ * echoes channel data back as two frames sharing a flag and goes silent
+ * after the close down. Exits with the number of failed checks.
+ */
+
+
+#define CMUXTEST_TIMEOUT_MS					1000
+#define CMUXTEST_REFUSED_DLCI				3
+#define CMUXTEST_FRAMES_MAX					16
+
+typedef struct _CMUXTEST_FRAME {
+	int Dlci;
+	ECmuxFrameType Type;
+	size_t Length;
+	unsigned char Data[CMUX_N1];
+} CMUXTEST_FRAME, *PCMUXTEST_FRAME;
+
+typedef struct _CMUXTEST_FRAMES {
+	size_t Count;
+	CMUXTEST_FRAME Frames[CMUXTEST_FRAMES_MAX];
+} CMUXTEST_FRAMES, *PCMUXTEST_FRAMES;
+
+typedef struct _CMUXTEST_MODEM {
+	int FD;
+	int Closed;
+	CMUX_DECODER Decoder;
+} CMUXTEST_MODEM, *PCMUXTEST_MODEM;
+
+static int _failures = 0;
+
+
+static void _cmuxtest_check(int Condition, const char* Name)
+{
+	printf("%s: %s\n", Condition ? "PASS" : "FAIL", Name);
+	if (!Condition)
+		++_failures;
+
+	return;
+}
+
+
+static void _cmuxtest_collect(int Dlci, ECmuxFrameType Type, const unsigned char* Data, size_t Length, void* Context)
+{
+	PCMUXTEST_FRAMES f = (PCMUXTEST_FRAMES)Context;
+
+	if (f->Count < CMUXTEST_FRAMES_MAX) {
+		f->Frames[f->Count].Dlci = Dlci;
+		f->Frames[f->Count].Type = Type;
+		f->Frames[f->Count].Length = Length;
+		memcpy(f->Frames[f->Count].Data, Data, Length);
+	}
+
+	++f->Count;
+
+	return;
+}
+
+
+static int _cmuxtest_frame_equal(const CMUXTEST_FRAME* Frame, int Dlci, ECmuxFrameType Type, const void* Data, size_t Length)
+{
+	return (Frame->Dlci == Dlci && Frame->Type == Type && Frame->Length == Length &&
+		(Length == 0 || memcmp(Frame->Data, Data, Length) == 0));
+}
+
+
+static void _cmuxtest_codec(void)
+{
+	unsigned char frame[CMUX_FRAME_MAX];
+	unsigned char stream[4 * CMUX_FRAME_MAX];
+	unsigned char payload[CMUX_N1];
+	size_t len = 0;
+	size_t streamLength = 0;
+	CMUX_DECODER d;
+	CMUXTEST_FRAMES f;
+	/* SABM and DISC of DLCI 0 as the 07.10 examples give them */
+	static const unsigned char sabm0[] = {0xF9, 0x03, 0x3F, 0x01, 0x1C, 0xF9};
+	static const unsigned char disc0[] = {0xF9, 0x03, 0x53, 0x01, 0xFD, 0xF9};
+
+	len = cmux_frame_encode(0, cftSABM, NULL, 0, frame);
+	_cmuxtest_check(len == sizeof(sabm0) && memcmp(frame, sabm0, len) == 0, "SABM of DLCI 0");
+	len = cmux_frame_encode(0, cftDISC, NULL, 0, frame);
+	_cmuxtest_check(len == sizeof(disc0) && memcmp(frame, disc0, len) == 0, "DISC of DLCI 0");
+
+	/* Flags in the data are fine, the length field delimits it */
+	for (size_t i = 0; i < sizeof(payload); ++i)
+		payload[i] = (i % 3 == 0) ? CMUX_FLAG : (unsigned char)i;
+
+	/* Three frames, each one opened by the closing flag of the one before */
+	streamLength = cmux_frame_encode(1, cftUIH, "AT\r", 3, stream);
+	len = cmux_frame_encode(2, cftUIH, payload, sizeof(payload), frame);
+	memcpy(stream + streamLength, frame + 1, len - 1);
+	streamLength += len - 1;
+	len = cmux_frame_encode(3, cftUA, NULL, 0, frame);
+	memcpy(stream + streamLength, frame + 1, len - 1);
+	streamLength += len - 1;
+
+	memset(&f, 0, sizeof(f));
+	cmux_decoder_init(&d);
+	cmux_decode(&d, stream, streamLength, _cmuxtest_collect, &f);
+	_cmuxtest_check(f.Count == 3 && d.Errors == 0 &&
+		_cmuxtest_frame_equal(f.Frames + 0, 1, cftUIH, "AT\r", 3) &&
+		_cmuxtest_frame_equal(f.Frames + 1, 2, cftUIH, payload, sizeof(payload)) &&
+		_cmuxtest_frame_equal(f.Frames + 2, 3, cftUA, NULL, 0), "Frames sharing flags");
+
+	memset(&f, 0, sizeof(f));
+	cmux_decoder_init(&d);
+	for (size_t i = 0; i < streamLength; ++i)
+		cmux_decode(&d, stream + i, 1, _cmuxtest_collect, &f);
+
+	_cmuxtest_check(f.Count == 3 && d.Errors == 0 &&
+		_cmuxtest_frame_equal(f.Frames + 1, 2, cftUIH, payload, sizeof(payload)), "Frames fed byte by byte");
+
+	/* The FCS of UIH covers the header only, break the one of the first frame */
+	stream[1 + 3 + 3] ^= 0x01;
+	memset(&f, 0, sizeof(f));
+	cmux_decoder_init(&d);
+	cmux_decode(&d, stream, streamLength, _cmuxtest_collect, &f);
+	_cmuxtest_check(f.Count == 2 && d.Errors == 1 &&
+		_cmuxtest_frame_equal(f.Frames + 0, 2, cftUIH, payload, sizeof(payload)), "Broken FCS skipped");
+
+	return;
+}
+
+
+static void _cmuxtest_modem_frame(int Dlci, ECmuxFrameType Type, const unsigned char* Data, size_t Length, void* Context)
+{
+	PCMUXTEST_MODEM m = (PCMUXTEST_MODEM)Context;
+	unsigned char frame[CMUX_FRAME_MAX];
+	unsigned char wire[2 * CMUX_FRAME_MAX];
+	static const unsigned char closeDown[] = {CMUX_CLD_RESPONSE, CMUX_EA};
+	size_t len = 0;
+	size_t half = 0;
+
+	if (m->Closed)
+		return;
+
+	switch (Type) {
+		case cftSABM:
+			len = cmux_frame_encode(Dlci, (Dlci == CMUXTEST_REFUSED_DLCI) ? cftDM : cftUA, NULL, 0, wire);
+			break;
+		case cftDISC:
+			len = cmux_frame_encode(Dlci, cftUA, NULL, 0, wire);
+			break;
+		case cftUIH:
+			if (Dlci == 0) {
+				if (Length > 0 && Data[0] == CMUX_CLD_COMMAND) {
+					len = cmux_frame_encode(0, cftUIH, closeDown, sizeof(closeDown), wire);
+					m->Closed = 1;
+				}
+			} else {
+				/* The echo comes back in two frames sharing a flag */
+				half = Length / 2;
+				len = cmux_frame_encode(Dlci, cftUIH, Data, half, wire);
+				half = cmux_frame_encode(Dlci, cftUIH, Data + half, Length - half, frame);
+				memcpy(wire + len, frame + 1, half - 1);
+				len += half - 1;
+			}
+			break;
+		default:
+			break;
+	}
+
+	if (len > 0 && write(m->FD, wire, len) != (ssize_t)len)
+		m->Closed = 1;
+
+	return;
+}
+
+
+static void* _cmuxtest_modem(void* Context)
+{
+	PCMUXTEST_MODEM m = (PCMUXTEST_MODEM)Context;
+	unsigned char buf[256];
+	ssize_t len = 0;
+
+	cmux_decoder_init(&m->Decoder);
+	while ((len = read(m->FD, buf, sizeof(buf))) > 0)
+		cmux_decode(&m->Decoder, buf, (size_t)len, _cmuxtest_modem_frame, m);
+
+	return NULL;
+}
+
+
+/* Reads Length bytes of the channel, waiting for its event */
+static int _cmuxtest_read(PSERIAL_IO Io, int Channel, unsigned char* Buffer, size_t Length)
+{
+	int ret = 0;
+	size_t done = 0;
+	ssize_t len = 0;
+	struct pollfd fds;
+
+	memset(&fds, 0, sizeof(fds));
+	fds.fd = serial_io_event(Io, Channel);
+	fds.events = POLLIN;
+	while (ret == 0 && done < Length) {
+		ret = serial_io_read(Io, Channel, Buffer + done, Length - done, &len);
+		if (ret == 0 && len == 0 && poll(&fds, 1, CMUXTEST_TIMEOUT_MS) == 0)
+			ret = ETIMEDOUT;
+
+		done += (size_t)len;
+	}
+
+	return ret;
+}
+
+
+static void _cmuxtest_channels(void)
+{
+	int ret = 0;
+	int sv[2];
+	PSERIAL_IO io = NULL;
+	pthread_t modem;
+	CMUXTEST_MODEM m;
+	unsigned char data[300];
+	unsigned char buf[sizeof(data)];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+		_cmuxtest_check(0, "socketpair");
+		return;
+	}
+
+	memset(&m, 0, sizeof(m));
+	m.FD = sv[1];
+	ret = serial_io_start(sv[0], &io);
+	_cmuxtest_check(ret == 0, "serial_io_start");
+	if (ret != 0)
+		goto Exit;
+
+	ret = pthread_create(&modem, NULL, _cmuxtest_modem, &m);
+	if (ret != 0) {
+		_cmuxtest_check(0, "pthread_create");
+		serial_io_stop(io);
+		goto Exit;
+	}
+
+	_cmuxtest_check(serial_io_mux(io, 1) == 0, "CMUX on");
+	_cmuxtest_check(serial_io_control(io, 0, cftSABM, CMUXTEST_TIMEOUT_MS) == 0, "DLCI 0 opened");
+	_cmuxtest_check(serial_io_control(io, 1, cftSABM, CMUXTEST_TIMEOUT_MS) == 0, "DLCI 1 opened");
+	_cmuxtest_check(serial_io_control(io, 2, cftSABM, CMUXTEST_TIMEOUT_MS) == 0, "DLCI 2 opened");
+	_cmuxtest_check(serial_io_control(io, CMUXTEST_REFUSED_DLCI, cftSABM, CMUXTEST_TIMEOUT_MS) == ECONNREFUSED, "DM refuses a DLCI");
+
+	/* More than CMUX_N1 bytes go out in several frames */
+	for (size_t i = 0; i < sizeof(data); ++i)
+		data[i] = (unsigned char)(i * 7);
+
+	ret = serial_io_write(io, 1, "AT\r", 3);
+	if (ret == 0)
+		ret = serial_io_write(io, 2, data, sizeof(data));
+
+	_cmuxtest_check(ret == 0, "Channel writes");
+	memset(buf, 0, sizeof(buf));
+	ret = _cmuxtest_read(io, 1, buf, 3);
+	_cmuxtest_check(ret == 0 && memcmp(buf, "AT\r", 3) == 0, "Echo on DLCI 1");
+	memset(buf, 0, sizeof(buf));
+	ret = _cmuxtest_read(io, 2, buf, sizeof(data));
+	_cmuxtest_check(ret == 0 && memcmp(buf, data, sizeof(data)) == 0, "Echo on DLCI 2 split into frames");
+
+	_cmuxtest_check(serial_io_control(io, 1, cftDISC, CMUXTEST_TIMEOUT_MS) == 0, "DLCI 1 closed");
+	_cmuxtest_check(serial_io_control(io, 2, cftDISC, CMUXTEST_TIMEOUT_MS) == 0, "DLCI 2 closed");
+	_cmuxtest_check(serial_io_control(io, 0, cftUIH, CMUXTEST_TIMEOUT_MS) == 0, "Multiplexer closed down");
+	_cmuxtest_check(serial_io_control(io, 1, cftSABM, CMUXTEST_TIMEOUT_MS / 10) == ETIMEDOUT, "No answer after the close down");
+	_cmuxtest_check(serial_io_mux(io, 0) == 0, "CMUX off");
+
+	serial_io_stop(io);
+	/* The modem thread ends with the connection */
+	shutdown(sv[0], SHUT_RDWR);
+	pthread_join(modem, NULL);
+Exit:
+	close(sv[0]);
+	close(sv[1]);
+
+	return;
+}
+
+
+int main(int argc, char** argv)
+{
+	_cmuxtest_codec();
+	_cmuxtest_channels();
+	printf("%i checks failed\n", _failures);
+
+	return _failures;
+}
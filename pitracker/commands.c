@@ -6,120 +6,198 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <assert.h>
+#include <time.h>
 #include "logging.h"
 #include "serial.h"
+#include "line-buffer.h"
 #include "field-array.h"
+#include "pdu.h"
+#include "arena.h"
 #include "commands.h"
 
 
+/* Characters of a single SMS in text mode, the modem rejects longer ones */
+#define SMS_TEXT_MAX					160
 
-static int _is_hex_string(const char *Str)
+
+static int _smsPDUMode = 0;
+static const char* _smsStatNames[] = {
+	"REC UNREAD",
+	"REC READ",
+	"STO UNSENT",
+	"STO SENT",
+	"ALL",
+};
+
+
+
+typedef enum _ESMSCommandType {
+	sctList,
+	sctOne,
+} ESMSCommandType, *PESMSCommandType;
+
+static int _process_sms_pdu(ESMSCommandType Type, const char* Header, const char* Hex, PSMS_MESSAGE Message)
 {
-	int ret = 1;
-	size_t len = 0;
-	log_enter("Str=\"%s\"", Str);
-
-	while (*Str != '\0') {
-		ret = (
-			(*Str >= '0' && *Str <= '9') ||
-			(*Str >= 'a' && *Str <= 'f') ||
-			(*Str >= 'A' && *Str <= 'F'));
-		if (!ret)
-			break;
+	int ret = 0;
+	int stat = 0;
+	char** arr = NULL;
+	size_t arrSize = 0;
+	PDU_MESSAGE pdu;
+	log_enter("Type=%u; Header=\"%s\"; Hex=\"%s\"; Message=0x%p", Type, Header, Hex, Message);
 
-		++Str;
-		++len;
+	ret = field_array_get(Header, ',', &arr, &arrSize);
+	if (ret == 0) {
+		STRING_FIELD_FORMAT fields[] = {
+			{sftInt, {&Message->Index}},
+			{sftInt, {&stat}},
+		};
+		size_t bias = 0;
+
+		if (Type == sctOne)
+			bias = 1;
+
+		ret = field_array_extract(arr, arrSize, fields + bias, sizeof(fields) / sizeof(fields[0]) - bias);
+		field_array_free(arr, arrSize);
 	}
 
-	if (ret)
-		ret = ((len % 2) == 0);
+	if (ret == 0)
+		ret = pdu_deliver_decode(Hex, &pdu);
+
+	if (ret == 0) {
+		if (stat < 0 || stat >= (int)(sizeof(_smsStatNames) / sizeof(_smsStatNames[0])))
+			stat = 0;
+
+		Message->Storage = arena_strdup(_smsStatNames[stat]);
+		Message->PhoneNumber = arena_strdup(pdu.Address);
+		Message->Name = arena_strdup("");
+		Message->Timestamp = arena_strdup(pdu.Timestamp);
+		if (Message->Storage == NULL || Message->PhoneNumber == NULL ||
+			Message->Name == NULL || Message->Timestamp == NULL)
+			ret = ENOMEM;
+	}
+
+	if (ret == 0) {
+		Message->Binary = (pdu.DataCoding == pdc8Bit);
+		if (pdu.PartCount > 1) {
+			ret = pdu_concat_add(&pdu, Message->Index, (unsigned char**)&Message->Text, &Message->TextLength, &Message->Indices, &Message->IndexCount);
+		} else {
+			Message->Text = arena_alloc(pdu.DataLength + 1);
+			if (Message->Text != NULL) {
+				memcpy(Message->Text, pdu.Data, pdu.DataLength + 1);
+				Message->TextLength = pdu.DataLength;
+			} else ret = ENOMEM;
+		}
+	}
 
 	log_exit("%i", ret);
 	return ret;
 }
 
-typedef enum _ESMSCommandType {
-	sctList,
-	sctOne,
-} ESMSCommandType, *PESMSCommandType;
 
-static int _process_sms(ESMSCommandType Type, const char *Command, char **Lines, size_t LineCount, SMS_MESSAGE **Messages, size_t *Count)
+static int _process_sms(ESMSCommandType Type, int Index, const char *Command, char **Lines, size_t LineCount, SMS_MESSAGE **Messages, size_t *Count, size_t *Pending, int **Skipped, size_t *SkippedCount)
 {
 	int ret = 0;
 	size_t len = 0;
 	size_t cmdLen = 0;
+	size_t pending = 0;
 	const char *line = NULL;
 	SMS_MESSAGE msg;
 	PSMS_MESSAGE tmpMessages = NULL;
 	PSMS_MESSAGE tmpMessages2 = NULL;
 	size_t tmpCount = 0;
-	log_enter("Type=%u; Command=\"%s\"; Lines=0x%p; LineCount=%zu; Messages=0x%p; Count=0x%p", Type, Command, Lines, LineCount, Messages, Count);
+	int* tmpSkipped = NULL;
+	int* tmpSkipped2 = NULL;
+	size_t tmpSkippedCount = 0;
+	log_enter("Type=%u; Index=%i; Command=\"%s\"; Lines=0x%p; LineCount=%zu; Messages=0x%p; Count=0x%p; Pending=0x%p; Skipped=0x%p; SkippedCount=0x%p", Type, Index, Command, Lines, LineCount, Messages, Count, Pending, Skipped, SkippedCount);
 
 	cmdLen = strlen(Command);
 	while (ret == 0 && LineCount > 0) {
 		line = *Lines;
 		len = strlen(line);
 		if (len > cmdLen && memcmp(line, Command, cmdLen * sizeof(char)) == 0) {
-			char** arr = NULL;
-			size_t arrSize = 0;
-			
+			const char* header = line + cmdLen;
+
 			memset(&msg, 0, sizeof(msg));
-			ret = field_array_get(line + cmdLen, ',', &arr, &arrSize);
-			if (ret == 0) {
-				STRING_FIELD_FORMAT fields[] = {
-					{sftInt, {&msg.Index}},
-					{sftString, {&msg.Storage}},
-					{sftString, {&msg.PhoneNumber}},
-					{sftString, {&msg.Name}},
-					{sftString, {&msg.Timestamp}},
-				};
-				size_t bias = 0;
+			/* +CMGR does not repeat the index */
+			msg.Index = Index;
+			++Lines;
+			--LineCount;
+			if (LineCount > 0 && _smsPDUMode) {
+				ret = _process_sms_pdu(Type, header, *Lines, &msg);
+				if (ret == EAGAIN || ret == EINVAL || ret == ENOTSUP || ret == E2BIG) {
+					if (ret == EAGAIN)
+						++pending;
+					else {
+						log_warning("Unable to decode PDU on index %i: %i", msg.Index, ret);
+						/* The slot can never be handled, the caller only deletes it */
+						if (msg.Index >= 0) {
+							tmpSkipped2 = arena_realloc(tmpSkipped, (tmpSkippedCount + 1)*sizeof(int));
+							if (tmpSkipped2 != NULL) {
+								tmpSkipped = tmpSkipped2;
+								tmpSkipped[tmpSkippedCount] = msg.Index;
+								++tmpSkippedCount;
+							}
+						}
+					}
 
-				if (Type == sctOne)
-					bias = 1;
+					sms_free(&msg);
+					ret = 0;
+					continue;
+				}
+			} else if (LineCount > 0) {
+				char** arr = NULL;
+				size_t arrSize = 0;
 
-				ret = field_array_extract(arr, arrSize, fields + bias, sizeof(fields) / sizeof(fields[0]) - bias);
-				field_array_free(arr, arrSize);
-			}
+				ret = field_array_get(header, ',', &arr, &arrSize);
+				if (ret == 0) {
+					STRING_FIELD_FORMAT fields[] = {
+						{sftInt, {&msg.Index}},
+						{sftString, {&msg.Storage}},
+						{sftString, {&msg.PhoneNumber}},
+						{sftString, {&msg.Name}},
+						{sftString, {&msg.Timestamp}},
+					};
+					size_t bias = 0;
+
+					if (Type == sctOne)
+						bias = 1;
+
+					ret = field_array_extract(arr, arrSize, fields + bias, sizeof(fields) / sizeof(fields[0]) - bias);
+					field_array_free(arr, arrSize);
+				}
 
-			++Lines;
-			--LineCount;
-			if (ret == 0 && LineCount > 0) {
-				line = *Lines;
-				msg.Text = strdup(line);
-				if (msg.Text == NULL)
-					ret = ENOMEM;
+				if (ret == 0) {
+					line = *Lines;
+					msg.Text = arena_strdup(line);
+					if (msg.Text == NULL)
+						ret = ENOMEM;
+				}
 
 				if (ret == 0) {
 					len = strlen(msg.Text);
-					if (_is_hex_string(msg.Text)) {
-						for (size_t i = 0; i < len / 2; ++i) {
-							char d1 = msg.Text[i * 2];
-							char d2 = msg.Text[i * 2 + 1];
-
-							d1 &= (char)~(0x60);
-							d1 = (d1 & 0x10) ? (d1 & 0xf) : (d1 + 9);
-							d2 &= (char)~(0x60);
-							d2 = (d2 & 0x10) ? (d2 & 0xf) : (d2 + 9);
-							msg.Text[i] = (char)((d1 << 4) + d2);
-						}
-
-						msg.Text[len / 2] = '\0';
+					if (pdu_is_hex(msg.Text, len)) {
+						len = pdu_hex_decode(msg.Text, len, (unsigned char*)msg.Text);
+						msg.Text[len] = '\0';
 					}
 
-					tmpMessages2 = realloc(tmpMessages, (tmpCount + 1)*sizeof(SMS_MESSAGE));
-					if (tmpMessages2 == NULL) {
-						sms_free(&msg);
-						ret = ENOMEM;
-					}
+					msg.TextLength = len;
+				}
+			} else continue;
 
-					if (ret == 0) {
-						tmpMessages = tmpMessages2;
-						tmpMessages[tmpCount] = msg;
-						++tmpCount;
-					}
+			if (ret == 0) {
+				tmpMessages2 = arena_realloc(tmpMessages, (tmpCount + 1)*sizeof(SMS_MESSAGE));
+				if (tmpMessages2 == NULL)
+					ret = ENOMEM;
+
+				if (ret == 0) {
+					tmpMessages = tmpMessages2;
+					tmpMessages[tmpCount] = msg;
+					++tmpCount;
 				}
 			}
+
+			if (ret != 0)
+				sms_free(&msg);
 		}
 
 		if (LineCount > 0) {
@@ -131,13 +209,19 @@ static int _process_sms(ESMSCommandType Type, const char *Command, char **Lines,
 	if (ret == 0) {
 		*Messages = tmpMessages;
 		*Count = tmpCount;
+		if (Pending != NULL)
+			*Pending = pending;
+
+		*Skipped = tmpSkipped;
+		*SkippedCount = tmpSkippedCount;
 	}
 
 	if (ret != 0) {
 		for (size_t i = 0; i < tmpCount; ++i)
 			sms_free(tmpMessages + i);
 
-		free(tmpMessages);
+		arena_free(tmpMessages);
+		arena_free(tmpSkipped);
 	}
 
 	log_exit("%i, *Messages=0x%p, *Count=%zu", ret, *Messages, *Count);
@@ -171,11 +255,11 @@ static int _standard_command_issue(int SerialFD, const char *Command, PCOMMAND_R
 			}
 
 			if (ret != 0)
-				free(ls);
+				arena_free(ls);
 		}
 
 		if (ret != 0)
-			free(r);
+			arena_free(r);
 	}
 
 	log_exit("%i", ret);
@@ -209,11 +293,11 @@ static int _standard_command_issue_ex(int SerialFD, const char *Command, int CR,
 			}
 
 			if (ret != 0)
-				free(ls);
+				arena_free(ls);
 		}
 
 		if (ret != 0)
-			free(r);
+			arena_free(r);
 	}
 
 	log_exit("%i", ret);
@@ -245,8 +329,8 @@ static void _standard_command_free(PCOMMAND_RESPONSE Response)
 {
 	log_enter("Response=0x%p", Response);
 
-	free(Response->Lines);
-	free(Response->Response);
+	arena_free(Response->Lines);
+	arena_free(Response->Response);
 
 	log_exit("void");
 	return;
@@ -275,7 +359,7 @@ int command_pin_enter(int SerialFD, const char* PIN)
 	int ret = 0;
 	char pinCommand[256];
 	COMMAND_RESPONSE r;
-	log_enter("SerialFD=%i; PIN=\"%s\"", SerialFD, PIN);
+	log_enter("SerialFD=%i; PIN=0x%p", SerialFD, PIN);
 
 	snprintf(pinCommand, sizeof(pinCommand) / sizeof(pinCommand[0]), "AT+CPIN=%s", PIN);
 	ret = _standard_command_issue(SerialFD, pinCommand, &r);
@@ -287,6 +371,92 @@ int command_pin_enter(int SerialFD, const char* PIN)
 }
 
 
+/* Readiness URCs; the query responses carry the same lines, so probing and waiting share the parser */
+static int _ready_line_callback(const char* Line, void* Context)
+{
+	int* ready = (int*)Context;
+	const char* stat = NULL;
+
+	if (strcmp(Line, "+CPIN: READY") == 0)
+		*ready |= MODEM_READY_SIM;
+	else if (strcmp(Line, "SMS Ready") == 0)
+		*ready |= MODEM_READY_SMS;
+	else if (strcmp(Line, "Call Ready") == 0 || strcmp(Line, "+CCALR: 1") == 0)
+		*ready |= MODEM_READY_CALL;
+	else if (strncmp(Line, "+CREG: ", 7) == 0) {
+		/* "+CREG: <stat>" as URC, "+CREG: <n>,<stat>" as query response */
+		stat = strchr(Line, ',');
+		stat = (stat != NULL) ? stat + 1 : Line + 7;
+		if (*stat == '1' || *stat == '5')
+			*ready |= MODEM_READY_NETWORK;
+	}
+
+	return 0;
+}
+
+
+static void _ready_probe(int SerialFD, int Missing, int* Ready)
+{
+	COMMAND_RESPONSE r;
+	log_enter("SerialFD=%i; Missing=0x%x; Ready=0x%p", SerialFD, Missing, Ready);
+
+	if ((Missing & MODEM_READY_SIM) && _standard_command_issue(SerialFD, "AT+CPIN?", &r) == 0)
+		_standard_command_free(&r);
+
+	/* The SMS storage answers only once the SMS subsystem is up */
+	if ((Missing & MODEM_READY_SMS) && (*Ready & MODEM_READY_SIM) && _standard_command_issue(SerialFD, "AT+CPMS?", &r) == 0) {
+		*Ready |= MODEM_READY_SMS;
+		_standard_command_free(&r);
+	}
+
+	if ((Missing & MODEM_READY_CALL) && _standard_command_issue(SerialFD, "AT+CCALR?", &r) == 0)
+		_standard_command_free(&r);
+
+	if ((Missing & MODEM_READY_NETWORK) && _standard_command_issue(SerialFD, "AT+CREG?", &r) == 0)
+		_standard_command_free(&r);
+
+	log_exit("void, *Ready=0x%x", *Ready);
+	return;
+}
+
+
+int command_ready_wait(int SerialFD, int Mask, int Timeout, int* Ready)
+{
+	int ret = 0;
+	int ready = 0;
+	void* handle = NULL;
+	struct timespec start;
+	struct timespec now;
+	log_enter("SerialFD=%i; Mask=0x%x; Timeout=%i; Ready=0x%p", SerialFD, Mask, Timeout, Ready);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = line_callback_register(_ready_line_callback, &ready, &handle);
+	while (ret == 0) {
+		/* A modem that is up already sent its URCs long ago, so ask first and wait only for what is missing */
+		_ready_probe(SerialFD, Mask & ~ready, &ready);
+		if ((ready & Mask) == Mask)
+			break;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec - start.tv_sec >= Timeout) {
+			ret = ETIMEDOUT;
+			break;
+		}
+
+		serial_response_wait(SerialFD, 1, 0, NULL, NULL);
+	}
+
+	if (handle != NULL)
+		line_callback_unregister(handle);
+
+	if (Ready != NULL)
+		*Ready = ready;
+
+	log_exit("%i, *Ready=0x%x", ret, ready);
+	return ret;
+}
+
+
 int command_set_text_mode(int SerialFD, int Mode)
 {
 	int ret = 0;
@@ -296,8 +466,10 @@ int command_set_text_mode(int SerialFD, int Mode)
 
 	snprintf(cmd, sizeof(cmd) / sizeof(cmd[0]), "AT+CMGF=%i", Mode);
 	ret = _standard_command_issue(SerialFD, cmd, &r);
-	if (ret == 0)
+	if (ret == 0) {
+		_smsPDUMode = !Mode;
 		_standard_command_free(&r);
+	}
 
 	log_exit("%i", ret);
 	return ret;
@@ -311,19 +483,27 @@ int command_sms_read(int SerialFD, int Index, PSMS_MESSAGE Message)
 	COMMAND_RESPONSE r;
 	PSMS_MESSAGE msgs;
 	size_t msgCount = 0;
+	size_t pending = 0;
+	int* skipped = NULL;
+	size_t skippedCount = 0;
 	log_enter("SerialFD=%u; Index=%i; Message=0x%p", SerialFD, Index, Message);
 
 	snprintf(cmd, sizeof(cmd) / sizeof(cmd[0]), "AT+CMGR=%i", Index);
 	ret = _standard_command_issue(SerialFD, cmd, &r);
 	if (ret == 0) {
-		ret = _process_sms(sctOne, "+CMGR: ", r.Lines, r.LineCount, &msgs, &msgCount);
+		ret = _process_sms(sctOne, Index, "+CMGR: ", r.Lines, r.LineCount, &msgs, &msgCount, &pending, &skipped, &skippedCount);
 		if (ret == 0) {
 			if (msgCount > 0) {
 				assert(msgCount == 1);
 				*Message = msgs[0];
-			} else ret = ENOENT;
-
-			free(msgs);
+			} else if (pending > 0)
+				ret = EAGAIN;
+			else if (skippedCount > 0)
+				ret = EBADMSG;
+			else ret = ENOENT;
+
+			arena_free(msgs);
+			arena_free(skipped);
 		}
 
 		_standard_command_free(&r);
@@ -334,17 +514,33 @@ int command_sms_read(int SerialFD, int Index, PSMS_MESSAGE Message)
 }
 
 
-int command_sms_list(int SerialFD, const char* Type, SMS_MESSAGE **Messages, size_t *Count)
+int command_sms_list(int SerialFD, const char* Type, SMS_MESSAGE **Messages, size_t *Count, size_t *Pending, int **Skipped, size_t *SkippedCount)
 {
 	int ret = 0;
+	int stat = -1;
 	char cmd[256];
 	COMMAND_RESPONSE r;
-	log_enter("SerialFD=%u; Type=\"%s\"; Messages=0x%p; Count=0x%p", SerialFD, Type, Messages, Count);
+	log_enter("SerialFD=%u; Type=\"%s\"; Messages=0x%p; Count=0x%p; Pending=0x%p; Skipped=0x%p; SkippedCount=0x%p", SerialFD, Type, Messages, Count, Pending, Skipped, SkippedCount);
+
+	if (_smsPDUMode) {
+		for (size_t i = 0; i < sizeof(_smsStatNames) / sizeof(_smsStatNames[0]); ++i) {
+			if (strcmp(_smsStatNames[i], Type) == 0) {
+				stat = (int)i;
+				break;
+			}
+		}
+
+		if (stat == -1)
+			ret = EINVAL;
+
+		snprintf(cmd, sizeof(cmd) / sizeof(cmd[0]), "AT+CMGL=%i", stat);
+	} else snprintf(cmd, sizeof(cmd) / sizeof(cmd[0]), "AT+CMGL=\"%s\"", Type);
+
+	if (ret == 0)
+		ret = _standard_command_issue(SerialFD, cmd, &r);
 
-	snprintf(cmd, sizeof(cmd) / sizeof(cmd[0]), "AT+CMGL=\"%s\"", Type);
-	ret = _standard_command_issue(SerialFD, cmd, &r);
 	if (ret == 0) {
-		ret = _process_sms(sctList, "+CMGL: ", r.Lines, r.LineCount, Messages, Count);
+		ret = _process_sms(sctList, -1, "+CMGL: ", r.Lines, r.LineCount, Messages, Count, Pending, Skipped, SkippedCount);
 		_standard_command_free(&r);
 	}
 
@@ -353,15 +549,40 @@ int command_sms_list(int SerialFD, const char* Type, SMS_MESSAGE **Messages, siz
 }
 
 
+int command_sms_storage_select(int SerialFD, const char* Storage, int* Used, int* Total)
+{
+	int ret = 0;
+	char cmd[256];
+	char* l = NULL;
+	COMMAND_RESPONSE r;
+	log_enter("SerialFD=%i; Storage=\"%s\"; Used=0x%p; Total=0x%p", SerialFD, Storage, Used, Total);
+
+	snprintf(cmd, sizeof(cmd) / sizeof(cmd[0]), "AT+CPMS=\"%s\"", Storage);
+	ret = _standard_command_issue(SerialFD, cmd, &r);
+	if (ret == 0) {
+		ret = ENOENT;
+		l = _standard_command_getline(&r, "+CPMS: ");
+		if (l != NULL && sscanf(l, "%i,%i", Used, Total) == 2)
+			ret = 0;
+
+		_standard_command_free(&r);
+	}
+
+	log_exit("%i, *Used=%i, *Total=%i", ret, *Used, *Total);
+	return ret;
+}
+
+
 void sms_free(PSMS_MESSAGE Message)
 {
 	log_enter("Message=0x%p", Message);
 
-	free(Message->PhoneNumber);
-	free(Message->Name);
-	free(Message->Storage);
-	free(Message->Text);
-	free(Message->Timestamp);
+	arena_free(Message->PhoneNumber);
+	arena_free(Message->Name);
+	arena_free(Message->Storage);
+	arena_free(Message->Text);
+	arena_free(Message->Timestamp);
+	arena_free(Message->Indices);
 
 	log_exit("void");
 	return;
@@ -373,7 +594,7 @@ void sms_array_free(PSMS_MESSAGE Messages, size_t Count)
 	for (size_t i = 0; i < Count; ++i)
 		sms_free(Messages + i);
 
-	free(Messages);
+	arena_free(Messages);
 
 	log_exit("void");
 	return;
@@ -397,12 +618,48 @@ int command_sms_delete(int SerialFD, int Index, ESMSDeleteType Type)
 }
 
 
-int command_sms_send(int SerialFD, const char *Phone, const char *Text)
+static int _sms_send_pdu(int SerialFD, const PDU_SUBMIT_PART* Parts, size_t Count)
 {
 	int ret = 0;
-	char cmd[1024];
+	char cmd[PDU_HEX_MAX + 2];
 	COMMAND_RESPONSE r;
-	log_enter("SerialFD=%i; Phone=\"%s\"; Text=\"%s\"", SerialFD, Phone, Text);
+	log_enter("SerialFD=%i; Parts=0x%p; Count=%zu", SerialFD, Parts, Count);
+
+	for (size_t i = 0; ret == 0 && i < Count; ++i) {
+		memset(&r, 0, sizeof(r));
+		snprintf(cmd, sizeof(cmd) / sizeof(cmd[0]), "AT+CMGS=%zu", Parts[i].TPDULength);
+		ret = serial_command_with_response(SerialFD, cmd, 1, 0, 0, &r.Response, &r.ResponseSize);
+		if (ret == 0) {
+			ret = serial_response_to_lines(r.Response, r.ResponseSize, &r.Lines, &r.LineCount);
+			if (ret == 0) {
+				if (!serial_command_contains(r.Lines, r.LineCount, "> "))
+					ret = -1;
+
+				arena_free(r.Lines);
+			}
+
+			arena_free(r.Response);
+		}
+
+		if (ret == 0) {
+			snprintf(cmd, sizeof(cmd) / sizeof(cmd[0]), "%s\x1a", Parts[i].Hex);
+			ret = _standard_command_issue_ex(SerialFD, cmd, 0, 0, 1, &r);
+			if (ret == 0)
+				_standard_command_free(&r);
+		}
+	}
+
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+static int _sms_send_text(int SerialFD, const char* Phone, const char* Text, size_t Length)
+{
+	int ret = 0;
+	char cmd[256];
+	COMMAND_RESPONSE r;
+	log_enter("SerialFD=%i; Phone=\"%s\"; Text=\"%.*s\"; Length=%zu", SerialFD, Phone, (int)Length, Text, Length);
 
 	memset(&r, 0, sizeof(r));
 	snprintf(cmd, sizeof(cmd) / sizeof(cmd[0]), "AT+CMGS=\"%s\"\n", Phone);
@@ -413,14 +670,14 @@ int command_sms_send(int SerialFD, const char *Phone, const char *Text)
 			if (!serial_command_contains(r.Lines, r.LineCount, "> "))
 				ret = -1;
 
-			free(r.Lines);
+			arena_free(r.Lines);
 		}
 
-		free(r.Response);
+		arena_free(r.Response);
 	}
 
 	if (ret == 0) {
-		snprintf(cmd, sizeof(cmd) / sizeof(cmd[0]), "%s\x1a", Text);
+		snprintf(cmd, sizeof(cmd) / sizeof(cmd[0]), "%.*s\x1a", (int)Length, Text);
 		ret = _standard_command_issue_ex(SerialFD, cmd, 0, 0, 1, &r);
 		if (ret == 0)
 			_standard_command_free(&r);
@@ -431,6 +688,84 @@ int command_sms_send(int SerialFD, const char *Phone, const char *Text)
 }
 
 
+int command_sms_send(int SerialFD, const char *Phone, const char *Text)
+{
+	int ret = 0;
+	size_t len = 0;
+	size_t sent = 0;
+	PPDU_SUBMIT_PART parts = NULL;
+	size_t partCount = 0;
+	log_enter("SerialFD=%i; Phone=\"%s\"; Text=\"%s\"", SerialFD, Phone, Text);
+
+	if (_smsPDUMode) {
+		ret = pdu_submit_encode_text(Phone, Text, &parts, &partCount);
+		if (ret == 0) {
+			ret = _sms_send_pdu(SerialFD, parts, partCount);
+			pdu_submit_free(parts, partCount);
+		}
+
+		goto Exit;
+	}
+
+	/* Text mode has no concatenation, a longer text goes out as several messages split after a line where possible */
+	while (ret == 0 && *Text != '\0') {
+		len = strlen(Text);
+		sent = len;
+		if (len > SMS_TEXT_MAX) {
+			len = SMS_TEXT_MAX;
+			sent = len;
+			for (size_t i = SMS_TEXT_MAX; i > SMS_TEXT_MAX / 2; --i) {
+				if (Text[i - 1] == '\n') {
+					len = i - 1;
+					sent = i;
+					break;
+				}
+			}
+		}
+
+		ret = _sms_send_text(SerialFD, Phone, Text, len);
+		Text += sent;
+	}
+
+Exit:
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+int command_sms_send_binary(int SerialFD, const char* Phone, const unsigned char* Data, size_t Length)
+{
+	int ret = 0;
+	int err = 0;
+	int textMode = 0;
+	PPDU_SUBMIT_PART parts = NULL;
+	size_t partCount = 0;
+	log_enter("SerialFD=%i; Phone=\"%s\"; Data=0x%p; Length=%zu", SerialFD, Phone, Data, Length);
+
+	ret = pdu_submit_encode(Phone, pdc8Bit, Data, Length, &parts, &partCount);
+	if (ret == 0) {
+		/* Binary data can be sent only in PDU mode */
+		textMode = !_smsPDUMode;
+		if (textMode)
+			ret = command_set_text_mode(SerialFD, 0);
+
+		if (ret == 0) {
+			ret = _sms_send_pdu(SerialFD, parts, partCount);
+			if (textMode) {
+				err = command_set_text_mode(SerialFD, 1);
+				if (err != 0)
+					log_error("Unable to restore SMS text mode: %i", err);
+			}
+		}
+
+		pdu_submit_free(parts, partCount);
+	}
+
+	log_exit("%i", ret);
+	return ret;
+}
+
+
 int command_gnss_enable(int SerialFD, int Enable)
 {
 	int ret = 0;
@@ -528,13 +863,80 @@ void command_gnss_info_free(PGPS_RECORD Record)
 {
 	log_enter("Record=0x%p", Record);
 
-	free(Record->Timestamp);
+	arena_free(Record->Timestamp);
 
 	log_exit("void");
 	return;
 }
 
 
+int command_ping(int SerialFD)
+{
+	int ret = 0;
+	COMMAND_RESPONSE r;
+	log_enter("SerialFD=%i", SerialFD);
+
+	ret = _standard_command_issue(SerialFD, "AT", &r);
+	if (ret == 0)
+		_standard_command_free(&r);
+
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+/* The modem answers at the old rate and switches right after */
+int command_baud_rate_set(int SerialFD, int Rate)
+{
+	int ret = 0;
+	COMMAND_RESPONSE r;
+	char cmd[64];
+	log_enter("SerialFD=%i; Rate=%i", SerialFD, Rate);
+
+	snprintf(cmd, sizeof(cmd) / sizeof(cmd[0]), "AT+IPR=%i", Rate);
+	ret = _standard_command_issue(SerialFD, cmd, &r);
+	if (ret == 0)
+		_standard_command_free(&r);
+
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+/* Basic option, UIH frames, N1 127; the port speed is coded as 1 (9600) to 7 (460800) */
+int command_mux_enable(int SerialFD, int Rate)
+{
+	int ret = 0;
+	int speed = 0;
+	COMMAND_RESPONSE r;
+	char cmd[64];
+	static const int rates[] = {9600, 19200, 38400, 57600, 115200, 230400, 460800};
+	log_enter("SerialFD=%i; Rate=%i", SerialFD, Rate);
+
+	for (size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); ++i) {
+		if (rates[i] == Rate) {
+			speed = (int)i + 1;
+			break;
+		}
+	}
+
+	if (speed == 0) {
+		ret = EINVAL;
+		log_error("CMUX does not support %i baud", Rate);
+		goto Exit;
+	}
+
+	snprintf(cmd, sizeof(cmd) / sizeof(cmd[0]), "AT+CMUX=0,0,%i,127", speed);
+	ret = _standard_command_issue(SerialFD, cmd, &r);
+	if (ret == 0)
+		_standard_command_free(&r);
+
+Exit:
+	log_exit("%i", ret);
+	return ret;
+}
+
+
 int command_signal_quality(int SerialFD, int *Percentage, int *Second)
 {
 	int ret = 0;
@@ -654,39 +1056,63 @@ int command_apn_set(int SerialFD, const char* Protocol, const char* URL, const c
 }
 
 
-int command_gprs_connect(int SerialFD, int Connect)
+/* An AT command per step, Co starts by CO_INIT; the attach steps of Connect run only after the first three succeed */
+int command_gprs_connect_step(PCOROUTINE Co, int SerialFD, int Connect)
 {
 	int ret = 0;
 	COMMAND_RESPONSE r;
 	char cmd[256];
-	log_enter("SerialFD=%i; Connect=%i", SerialFD, Connect);
+	log_enter("Co=0x%p; SerialFD=%i; Connect=%i", Co, SerialFD, Connect);
 
+	CO_BEGIN(Co);
 	snprintf(cmd, sizeof(cmd) / sizeof(cmd[0]), "AT+CREG=%i", Connect);
 	ret = _standard_command_issue(SerialFD, cmd, &r);
-	if (ret == 0) {
+	if (ret != 0)
+		CO_RETURN(Co);
+
+	_standard_command_free(&r);
+	CO_YIELD(Co);
+	snprintf(cmd, sizeof(cmd) / sizeof(cmd[0]), "AT+CGACT=%i,1", Connect);
+	ret = _standard_command_issue(SerialFD, cmd, &r);
+	if (ret != 0)
+		CO_RETURN(Co);
+
+	_standard_command_free(&r);
+	CO_YIELD(Co);
+	snprintf(cmd, sizeof(cmd) / sizeof(cmd[0]), "AT+CGATT=%i", Connect);
+	ret = _standard_command_issue(SerialFD, cmd, &r);
+	if (ret != 0)
+		CO_RETURN(Co);
+
+	_standard_command_free(&r);
+	if (!Connect)
+		CO_RETURN(Co);
+
+	CO_YIELD(Co);
+	/* The modem may have brought the connection up by itself */
+	if (_standard_command_issue(SerialFD, "AT+CIICR", &r) == 0)
 		_standard_command_free(&r);
-		snprintf(cmd, sizeof(cmd) / sizeof(cmd[0]), "AT+CGACT=%i,1", Connect);
-		ret = _standard_command_issue(SerialFD, cmd, &r);
-		if (ret == 0) {
-			_standard_command_free(&r);
-			snprintf(cmd, sizeof(cmd) / sizeof(cmd[0]), "AT+CGATT=%i", Connect);
-			ret = _standard_command_issue(SerialFD, cmd, &r);
-			if (ret == 0)
-				_standard_command_free(&r);
-		}
-	}
 
-	if (ret == 0 && Connect) {
-		ret = _standard_command_issue(SerialFD, "AT+CIICR", &r);
-		if (ret == 0)
-			_standard_command_free(&r);
+	CO_YIELD(Co);
+	if (_standard_command_issue(SerialFD, "AT+CIFSR", &r) == 0)
+		_standard_command_free(&r);
 
-		ret = _standard_command_issue(SerialFD, "AT+CIFSR", &r);
-		if (ret == 0)
-			_standard_command_free(&r);
+	CO_END(Co);
+	log_exit("%i, Co->Line=%i", ret, Co->Line);
+	return ret;
+}
 
-		ret = 0;
-	}
+
+int command_gprs_connect(int SerialFD, int Connect)
+{
+	int ret = 0;
+	COROUTINE co;
+	log_enter("SerialFD=%i; Connect=%i", SerialFD, Connect);
+
+	CO_INIT(&co);
+	do {
+		ret = command_gprs_connect_step(&co, SerialFD, Connect);
+	} while (CO_RUNNING(&co));
 
 	log_exit("%i", ret);
 	return ret;
@@ -744,10 +1170,10 @@ int command_tcp_send(int SerialFD, const char* IP, int Port, const char* Data)
 				if (!serial_command_contains(r.Lines, r.LineCount, "> "))
 					ret = -1;
 
-				free(r.Lines);
+				arena_free(r.Lines);
 			}
 
-			free(r.Response);
+			arena_free(r.Response);
 		}
 
 		if (ret == 0) {
@@ -2,6 +2,8 @@
 #pragma once
 
 
+#include "coroutine.h"
+
 
 typedef struct _SMS_MESSAGE {
 	int Index;
@@ -11,6 +13,10 @@ typedef struct _SMS_MESSAGE {
 	char *Timestamp;
 	char *Text;
 	int StorageNo;
+	size_t TextLength;
+	int Binary;
+	int* Indices;
+	size_t IndexCount;
 } SMS_MESSAGE, * PSMS_MESSAGE;
 
 typedef struct _COMMAND_RESPONSE {
@@ -52,16 +58,28 @@ typedef struct _GPS_RECORD {
 	int VPA;
 } GPS_RECORD, *PGPS_RECORD;
 
+#define MODEM_READY_SIM				0x1
+#define MODEM_READY_SMS				0x2
+#define MODEM_READY_CALL			0x4
+#define MODEM_READY_NETWORK			0x8
+
 
+int command_ping(int SerialFD);
+int command_baud_rate_set(int SerialFD, int Rate);
+int command_mux_enable(int SerialFD, int Rate);
 int command_pin_required(int SerialFD, int* Result);
 int command_pin_enter(int SerialFD, const char* PIN);
+int command_ready_wait(int SerialFD, int Mask, int Timeout, int* Ready);
 int command_set_text_mode(int SerialFD, int Mode);
 int command_sms_read(int SerialFD, int Index, PSMS_MESSAGE Message);
-int command_sms_list(int SerialFD, const char* Type, SMS_MESSAGE **Messages, size_t *Count);
+/* Skipped lists the slots whose PDU cannot be decoded, free it with arena_free() */
+int command_sms_list(int SerialFD, const char* Type, SMS_MESSAGE **Messages, size_t *Count, size_t *Pending, int **Skipped, size_t *SkippedCount);
+int command_sms_storage_select(int SerialFD, const char* Storage, int* Used, int* Total);
 void sms_free(PSMS_MESSAGE Message);
 void sms_array_free(PSMS_MESSAGE Messages, size_t Count);
 int command_sms_delete(int SerialFD, int Index, ESMSDeleteType Type);
 int command_sms_send(int SerialFD, const char *Phone, const char *Text);
+int command_sms_send_binary(int SerialFD, const char* Phone, const unsigned char* Data, size_t Length);
 int command_gnss_enable(int SerialFD, int Enable);
 int command_gnss_info(int SerialFD, PGPS_RECORD Record);
 void command_gnss_info_free(PGPS_RECORD Record);
@@ -69,6 +87,7 @@ int command_gnss_status(int SerialFD, int *Status);
 int command_signal_quality(int SerialFD, int* Percentage, int* Second);
 int command_battery(int SerialFD, int *Unknown, int *Percentage, int *Voltage);
 int command_apn_set(int SerialFD, const char* Protocol, const char* URL, const char* UserName, const char* Password);
+int command_gprs_connect_step(PCOROUTINE Co, int SerialFD, int Connect);
 int command_gprs_connect(int SerialFD, int Connect);
 int command_gprs_connected(int SerialFD, int* Connected);
 int command_tcp_send(int SerialFD, const char* IP, int Port, const char* Data);
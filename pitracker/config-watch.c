@@ -0,0 +1,112 @@
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/inotify.h>
+#include "logging.h"
+#include "config-watch.h"
+
+
+
+static int _watchFD = -1;
+static char* _baseName = NULL;
+
+
+
+int config_watch_init(const char* FileName)
+{
+	int ret = 0;
+	char* dirCopy = NULL;
+	char* baseCopy = NULL;
+	log_enter("FileName=\"%s\"", FileName);
+
+	dirCopy = strdup(FileName);
+	baseCopy = strdup(FileName);
+	if (dirCopy == NULL || baseCopy == NULL)
+		ret = ENOMEM;
+
+	if (ret == 0) {
+		_baseName = strdup(basename(baseCopy));
+		if (_baseName == NULL)
+			ret = ENOMEM;
+	}
+
+	if (ret == 0) {
+		_watchFD = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (_watchFD == -1)
+			ret = errno;
+	}
+
+	/* Editors and settings_save() replace the file by a rename, so the directory is watched rather than the inode */
+	if (ret == 0 && inotify_add_watch(_watchFD, dirname(dirCopy), IN_CLOSE_WRITE | IN_MOVED_TO) == -1)
+		ret = errno;
+
+	if (ret != 0)
+		config_watch_finit();
+
+	free(baseCopy);
+	free(dirCopy);
+
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+void config_watch_finit(void)
+{
+	log_enter("");
+
+	if (_watchFD != -1) {
+		close(_watchFD);
+		_watchFD = -1;
+	}
+
+	free(_baseName);
+	_baseName = NULL;
+
+	log_exit("void");
+	return;
+}
+
+
+/* Drains the pending events without blocking, several writes of one edit are reported once */
+int config_watch_check(int* Changed)
+{
+	int ret = 0;
+	ssize_t len = 0;
+	const struct inotify_event* e = NULL;
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	log_enter("Changed=0x%p", Changed);
+
+	*Changed = 0;
+	if (_watchFD == -1)
+		ret = EBADF;
+
+	while (ret == 0) {
+		len = read(_watchFD, buf, sizeof(buf));
+		if (len == -1) {
+			if (errno == EAGAIN)
+				break;
+
+			if (errno != EINTR)
+				ret = errno;
+
+			continue;
+		}
+
+		for (char* p = buf; p < buf + len; p += sizeof(struct inotify_event) + e->len) {
+			e = (const struct inotify_event*)p;
+			if ((e->mask & IN_Q_OVERFLOW) ||
+				(e->len > 0 && strcmp(e->name, _baseName) == 0))
+				*Changed = 1;
+		}
+	}
+
+	log_exit("%i, *Changed=%i", ret, *Changed);
+	return ret;
+}
@@ -0,0 +1,9 @@
+
+#pragma once
+
+
+
+
+int config_watch_init(const char* FileName);
+void config_watch_finit(void);
+int config_watch_check(int* Changed);
@@ -0,0 +1,720 @@
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "logging.h"
+#include "serial.h"
+#include "control.h"
+
+
+
+/* A request on its way to the main loop or a reply on its way back */
+typedef struct _CONTROL_MESSAGE {
+	struct _CONTROL_MESSAGE* Next;
+	CONTROL_REQUEST Request;
+	int Result;
+	char Reply[CONTROL_REPLY_MAX];
+} CONTROL_MESSAGE, *PCONTROL_MESSAGE;
+
+typedef struct _CONTROL_CLIENT {
+	int FD;
+	/* 0 for a free slot */
+	unsigned long Id;
+	unsigned long Sequence;
+} CONTROL_CLIENT, *PCONTROL_CLIENT;
+
+/* What the main loop learnt about a modem, -1 stands for a value it could not get */
+typedef struct _CONTROL_DEVICE {
+	int SerialFD;
+	int SignalQuality;
+	int Gprs;
+	int Battery;
+	int Gnss;
+	/* Monotonic seconds of the last #status, 0 before the first one */
+	time_t Updated;
+	double Latitude;
+	double Longitude;
+	char Time[32];
+	int SatellitesUsed;
+	int SatellitesInView;
+	/* Monotonic seconds of the last fix, 0 before the first one */
+	time_t FixUpdated;
+} CONTROL_DEVICE, *PCONTROL_DEVICE;
+
+/* The queues, the devices and _stopping are shared by the main loop and the server thread */
+static pthread_mutex_t _lock = PTHREAD_MUTEX_INITIALIZER;
+static PCONTROL_MESSAGE _requests = NULL;
+static PCONTROL_MESSAGE _replies = NULL;
+static CONTROL_DEVICE _devices[CONTROL_DEVICES_MAX];
+static size_t _deviceCount = 0;
+static int _stopping = 0;
+
+/* Used by the server thread only */
+static CONTROL_CLIENT _clients[CONTROL_CLIENTS_MAX];
+static unsigned long _lastClient = 0;
+
+static int _listenFD = -1;
+/* Wakes the server thread for the replies and the stop */
+static int _wakePipe[2] = { -1, -1 };
+/* Wakes the main loop for the requests */
+static int _requestPipe[2] = { -1, -1 };
+static int _watching = 0;
+static char* _socketPath = NULL;
+static pthread_t _serverThread;
+static int _serverRunning = 0;
+static int _maxAge = 0;
+static CONTROL_REQUEST_CALLBACK* _callback = NULL;
+static void* _callbackContext = NULL;
+
+
+
+static time_t _control_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec;
+}
+
+
+static void _control_queue(PCONTROL_MESSAGE* Queue, PCONTROL_MESSAGE Message)
+{
+	while (*Queue != NULL)
+		Queue = &(*Queue)->Next;
+
+	Message->Next = NULL;
+	*Queue = Message;
+
+	return;
+}
+
+
+static void _control_queue_free(PCONTROL_MESSAGE Queue)
+{
+	PCONTROL_MESSAGE m = NULL;
+
+	while (Queue != NULL) {
+		m = Queue;
+		Queue = m->Next;
+		free(m);
+	}
+
+	return;
+}
+
+
+static void _control_json_string(FILE* Stream, const char* Name, const char* Value)
+{
+	fprintf(Stream, "\"%s\":\"", Name);
+	for (const unsigned char* c = (const unsigned char*)Value; *c != '\0'; ++c) {
+		switch (*c) {
+			case '"':
+			case '\\':
+				fprintf(Stream, "\\%c", *c);
+				break;
+			case '\n':
+				fputs("\\n", Stream);
+				break;
+			case '\r':
+				fputs("\\r", Stream);
+				break;
+			case '\t':
+				fputs("\\t", Stream);
+				break;
+			default:
+				if (*c < 0x20)
+					fprintf(Stream, "\\u%04x", *c);
+				else fputc(*c, Stream);
+				break;
+		}
+	}
+
+	fputc('"', Stream);
+
+	return;
+}
+
+
+static void _control_json_status(FILE* Stream, const CONTROL_DEVICE* Device)
+{
+	time_t now = _control_now();
+
+	fprintf(Stream, ",\"status\":{\"signal\":%i,\"gprs\":%i,\"battery\":%i,\"gnss\":%i,\"age\":%li", Device->SignalQuality, Device->Gprs, Device->Battery, Device->Gnss, (long)(now - Device->Updated));
+	if (Device->FixUpdated != 0) {
+		fprintf(Stream, ",\"fix\":{\"latitude\":%lf,\"longitude\":%lf,", Device->Latitude, Device->Longitude);
+		_control_json_string(Stream, "time", Device->Time);
+		fprintf(Stream, ",\"used\":%i,\"view\":%i,\"age\":%li}", Device->SatellitesUsed, Device->SatellitesInView, (long)(now - Device->FixUpdated));
+	}
+
+	fputc('}', Stream);
+
+	return;
+}
+
+
+/* A status is sent with the cached values, whichever way its reply came */
+static void _control_send(const CONTROL_CLIENT* Client, const CONTROL_MESSAGE* Message, int Cached)
+{
+	FILE* stream = NULL;
+	char* json = NULL;
+	size_t jsonSize = 0;
+	CONTROL_DEVICE device;
+
+	stream = open_memstream(&json, &jsonSize);
+	if (stream == NULL)
+		return;
+
+	fprintf(stream, "{\"seq\":%lu,\"device\":%zu,", Message->Request.Sequence, Message->Request.Device);
+	_control_json_string(stream, "command", Message->Request.Command);
+	fprintf(stream, ",\"result\":%i,\"cached\":%s,", Message->Result, (Cached ? "true" : "false"));
+	_control_json_string(stream, "reply", Message->Reply);
+	memset(&device, 0, sizeof(device));
+	if (strcmp(Message->Request.Command, "#status") == 0) {
+		pthread_mutex_lock(&_lock);
+		if (Message->Request.Device < _deviceCount)
+			device = _devices[Message->Request.Device];
+
+		pthread_mutex_unlock(&_lock);
+	}
+
+	if (device.Updated != 0)
+		_control_json_status(stream, &device);
+
+	fputc('}', stream);
+	fclose(stream);
+	if (send(Client->FD, json, jsonSize, MSG_DONTWAIT | MSG_NOSIGNAL) == -1)
+		log_warning("Unable to answer control client %lu: %i", Client->Id, errno);
+
+	free(json);
+
+	return;
+}
+
+
+/* Puts '#' in front of the verb of each command of Text, the SMS commands have it */
+static int _control_command(char* Command, size_t Size, const char* Text)
+{
+	size_t len = 0;
+	size_t commandLength = 0;
+
+	Command[0] = '\0';
+	while (*Text != '\0') {
+		Text += strspn(Text, " \t");
+		commandLength = strcspn(Text, ";");
+		if (commandLength > 0) {
+			if (snprintf(Command + len, Size - len, "%s%s%.*s", (len > 0 ? ";" : ""), (*Text == '#' ? "" : "#"), (int)commandLength, Text) >= (int)(Size - len)) {
+				Command[0] = '\0';
+				return E2BIG;
+			}
+
+			len = strlen(Command);
+		}
+
+		Text += commandLength;
+		if (*Text == ';')
+			++Text;
+	}
+
+	return 0;
+}
+
+
+/* Answers what it can from the cache and the errors, passes the rest to the main loop */
+static void _control_request(PCONTROL_CLIENT Client, char* Text, size_t Length)
+{
+	int cached = 0;
+	char* command = NULL;
+	char* end = NULL;
+	const CONTROL_DEVICE* d = NULL;
+	PCONTROL_MESSAGE m = NULL;
+
+	m = calloc(1, sizeof(CONTROL_MESSAGE));
+	if (m == NULL)
+		return;
+
+	m->Request.Client = Client->Id;
+	m->Request.Sequence = ++Client->Sequence;
+	while (Length > 0 && (Text[Length - 1] == '\r' || Text[Length - 1] == '\n' || Text[Length - 1] == ' ' || Text[Length - 1] == '\t'))
+		--Length;
+
+	Text[Length] = '\0';
+	command = Text + strspn(Text, " \t");
+	if (*command == '@') {
+		m->Request.Device = (size_t)strtoul(command + 1, &end, 10);
+		if (end == command + 1)
+			m->Request.Device = CONTROL_DEVICES_MAX;
+
+		command = end + strspn(end, " \t");
+	}
+
+	m->Result = _control_command(m->Request.Command, sizeof(m->Request.Command), command);
+	pthread_mutex_lock(&_lock);
+	if (m->Request.Device < _deviceCount)
+		d = _devices + m->Request.Device;
+
+	if (m->Result != 0)
+		snprintf(m->Reply, sizeof(m->Reply), "COMMAND_TOO_LONG");
+	else if (strlen(m->Request.Command) <= 1) {
+		m->Result = EINVAL;
+		snprintf(m->Reply, sizeof(m->Reply), "NO_COMMAND");
+	} else if (d == NULL || d->SerialFD == -1) {
+		m->Result = ENODEV;
+		snprintf(m->Reply, sizeof(m->Reply), "UNKNOWN_DEVICE");
+	} else if (strcmp(m->Request.Command, "#status") == 0 && d->Updated != 0 && _control_now() - d->Updated <= _maxAge) {
+		cached = 1;
+		snprintf(m->Reply, sizeof(m->Reply), "GSM %i %%; GPRS %i; BATTERY: %i %%; GPS: %i", d->SignalQuality, d->Gprs, d->Battery, d->Gnss);
+	} else {
+		_control_queue(&_requests, m);
+		m = NULL;
+	}
+
+	pthread_mutex_unlock(&_lock);
+	if (m != NULL) {
+		_control_send(Client, m, cached);
+		free(m);
+	} else if (write(_requestPipe[1], "", 1) == -1 && errno != EAGAIN)
+		log_error("Unable to pass a control request on: %i", errno);
+
+	return;
+}
+
+
+static void _control_close(PCONTROL_CLIENT Client)
+{
+	close(Client->FD);
+	Client->FD = -1;
+	Client->Id = 0;
+
+	return;
+}
+
+
+static void _control_receive(PCONTROL_CLIENT Client)
+{
+	ssize_t len = 0;
+	char text[CONTROL_COMMAND_MAX];
+	CONTROL_MESSAGE m;
+
+	/* MSG_TRUNC gets the length of a command longer than the buffer */
+	len = recv(Client->FD, text, sizeof(text) - 1, MSG_TRUNC);
+	if (len == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+
+	if (len <= 0) {
+		_control_close(Client);
+		return;
+	}
+
+	if ((size_t)len > sizeof(text) - 1) {
+		memset(&m, 0, sizeof(m));
+		m.Request.Sequence = ++Client->Sequence;
+		m.Result = E2BIG;
+		snprintf(m.Reply, sizeof(m.Reply), "COMMAND_TOO_LONG");
+		_control_send(Client, &m, 0);
+		return;
+	}
+
+	_control_request(Client, text, (size_t)len);
+
+	return;
+}
+
+
+static void _control_accept(void)
+{
+	int fd = -1;
+	PCONTROL_CLIENT c = NULL;
+	CONTROL_MESSAGE m;
+	CONTROL_CLIENT busy;
+
+	fd = accept(_listenFD, NULL, NULL);
+	if (fd == -1)
+		return;
+
+	for (size_t i = 0; i < CONTROL_CLIENTS_MAX; ++i) {
+		if (_clients[i].Id == 0) {
+			c = _clients + i;
+			break;
+		}
+	}
+
+	if (c == NULL) {
+		memset(&m, 0, sizeof(m));
+		m.Result = EBUSY;
+		snprintf(m.Reply, sizeof(m.Reply), "TOO_MANY_CLIENTS");
+		busy.FD = fd;
+		busy.Id = 0;
+		_control_send(&busy, &m, 0);
+		close(fd);
+		return;
+	}
+
+	c->FD = fd;
+	c->Id = ++_lastClient;
+	c->Sequence = 0;
+
+	return;
+}
+
+
+/* The replies of a client gone meanwhile are dropped */
+static void _control_replies_send(void)
+{
+	PCONTROL_MESSAGE replies = NULL;
+	PCONTROL_MESSAGE m = NULL;
+
+	pthread_mutex_lock(&_lock);
+	replies = _replies;
+	_replies = NULL;
+	pthread_mutex_unlock(&_lock);
+	while (replies != NULL) {
+		m = replies;
+		replies = m->Next;
+		for (size_t i = 0; i < CONTROL_CLIENTS_MAX; ++i) {
+			if (_clients[i].Id == m->Request.Client) {
+				_control_send(_clients + i, m, 0);
+				break;
+			}
+		}
+
+		free(m);
+	}
+
+	return;
+}
+
+
+static void* _control_thread(void* Context)
+{
+	int stop = 0;
+	char buffer[64];
+	struct pollfd fds[2 + CONTROL_CLIENTS_MAX];
+
+	while (!stop) {
+		memset(fds, 0, sizeof(fds));
+		fds[0].fd = _wakePipe[0];
+		fds[0].events = POLLIN;
+		fds[1].fd = _listenFD;
+		fds[1].events = POLLIN;
+		for (size_t i = 0; i < CONTROL_CLIENTS_MAX; ++i) {
+			fds[2 + i].fd = (_clients[i].Id != 0) ? _clients[i].FD : -1;
+			fds[2 + i].events = POLLIN;
+		}
+
+		if (poll(fds, sizeof(fds) / sizeof(fds[0]), -1) == -1) {
+			if (errno == EINTR)
+				continue;
+
+			break;
+		}
+
+		if (fds[0].revents != 0) {
+			while (read(_wakePipe[0], buffer, sizeof(buffer)) > 0)
+				;
+
+			pthread_mutex_lock(&_lock);
+			stop = _stopping;
+			pthread_mutex_unlock(&_lock);
+			if (!stop)
+				_control_replies_send();
+		}
+
+		if (!stop && (fds[1].revents & POLLIN) != 0)
+			_control_accept();
+
+		for (size_t i = 0; !stop && i < CONTROL_CLIENTS_MAX; ++i) {
+			if (fds[2 + i].fd != -1 && fds[2 + i].revents != 0)
+				_control_receive(_clients + i);
+		}
+	}
+
+	for (size_t i = 0; i < CONTROL_CLIENTS_MAX; ++i) {
+		if (_clients[i].Id != 0)
+			_control_close(_clients + i);
+	}
+
+	return NULL;
+}
+
+
+/* Called by the idle waits of the main loop, the callback queues the jobs of the requests */
+static void _control_dispatch(int fd, void* Context)
+{
+	int ret = 0;
+	char buffer[64];
+	PCONTROL_MESSAGE requests = NULL;
+	PCONTROL_MESSAGE m = NULL;
+	char reply[32];
+	log_enter("fd=%i; Context=0x%p", fd, Context);
+
+	while (read(fd, buffer, sizeof(buffer)) > 0)
+		;
+
+	pthread_mutex_lock(&_lock);
+	requests = _requests;
+	_requests = NULL;
+	pthread_mutex_unlock(&_lock);
+	while (requests != NULL) {
+		m = requests;
+		requests = m->Next;
+		log_info("Control client %lu: %s", m->Request.Client, m->Request.Command);
+		ret = _callback(&m->Request, _callbackContext);
+		if (ret != 0) {
+			log_error("Unable to run control command \"%s\": %i", m->Request.Command, ret);
+			snprintf(reply, sizeof(reply), "ERROR: %i", ret);
+			control_reply(&m->Request, ret, reply);
+		}
+
+		free(m);
+	}
+
+	log_exit("void");
+	return;
+}
+
+
+int control_server_start(const char* Path, int MaxAge, CONTROL_REQUEST_CALLBACK* Callback, void* Context)
+{
+	int ret = 0;
+	struct sockaddr_un addr;
+	sigset_t all;
+	sigset_t old;
+	log_enter("Path=\"%s\"; MaxAge=%i; Callback=0x%p; Context=0x%p", Path, MaxAge, Callback, Context);
+
+	_maxAge = MaxAge;
+	_callback = Callback;
+	_callbackContext = Context;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(Path) >= sizeof(addr.sun_path))
+		ret = ENAMETOOLONG;
+
+	if (ret == 0) {
+		strcpy(addr.sun_path, Path);
+		_socketPath = strdup(Path);
+		if (_socketPath == NULL)
+			ret = ENOMEM;
+	}
+
+	if (ret == 0) {
+		_listenFD = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+		if (_listenFD == -1)
+			ret = errno;
+	}
+
+	/* A socket left behind by a crashed instance; nobody connects before listen(), so the mode is set in between */
+	if (ret == 0) {
+		unlink(Path);
+		if (bind(_listenFD, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+			chmod(Path, CONTROL_SOCKET_MODE) == -1 ||
+			listen(_listenFD, CONTROL_CLIENTS_MAX) == -1)
+			ret = errno;
+	}
+
+	if (ret == 0 && (pipe(_wakePipe) == -1 || pipe(_requestPipe) == -1))
+		ret = errno;
+
+	/* The pipes are drained until empty, a full one is awake already */
+	for (size_t i = 0; ret == 0 && i < 2; ++i) {
+		if (fcntl(_wakePipe[i], F_SETFL, O_NONBLOCK) == -1 || fcntl(_requestPipe[i], F_SETFL, O_NONBLOCK) == -1)
+			ret = errno;
+	}
+
+	if (ret == 0) {
+		ret = serial_watch(_requestPipe[0], _control_dispatch, NULL);
+		_watching = (ret == 0);
+	}
+
+	if (ret == 0) {
+		sigfillset(&all);
+		pthread_sigmask(SIG_SETMASK, &all, &old);
+		ret = pthread_create(&_serverThread, NULL, _control_thread, NULL);
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		if (ret == 0)
+			_serverRunning = 1;
+	}
+
+	if (ret != 0)
+		control_server_stop();
+
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+void control_server_stop(void)
+{
+	log_enter("");
+
+	if (_serverRunning) {
+		pthread_mutex_lock(&_lock);
+		_stopping = 1;
+		pthread_mutex_unlock(&_lock);
+		if (write(_wakePipe[1], "", 1) == -1)
+			log_warning("Unable to stop the control server: %i", errno);
+
+		pthread_join(_serverThread, NULL);
+		_serverRunning = 0;
+	}
+
+	if (_watching) {
+		serial_unwatch(_requestPipe[0]);
+		_watching = 0;
+	}
+
+	for (size_t i = 0; i < 2; ++i) {
+		if (_wakePipe[i] != -1) {
+			close(_wakePipe[i]);
+			_wakePipe[i] = -1;
+		}
+
+		if (_requestPipe[i] != -1) {
+			close(_requestPipe[i]);
+			_requestPipe[i] = -1;
+		}
+	}
+
+	if (_listenFD != -1) {
+		close(_listenFD);
+		_listenFD = -1;
+		unlink(_socketPath);
+	}
+
+	free(_socketPath);
+	_socketPath = NULL;
+	_control_queue_free(_requests);
+	_requests = NULL;
+	_control_queue_free(_replies);
+	_replies = NULL;
+	_stopping = 0;
+
+	log_exit("void");
+	return;
+}
+
+
+int control_reply(const CONTROL_REQUEST* Request, int Result, const char* Reply)
+{
+	int ret = 0;
+	PCONTROL_MESSAGE m = NULL;
+	log_enter("Request=0x%p; Result=%i; Reply=\"%s\"", Request, Result, Reply);
+
+	if (!_serverRunning)
+		goto Exit;
+
+	m = calloc(1, sizeof(CONTROL_MESSAGE));
+	if (m == NULL) {
+		ret = ENOMEM;
+		goto Exit;
+	}
+
+	m->Request = *Request;
+	m->Result = Result;
+	snprintf(m->Reply, sizeof(m->Reply), "%s", Reply);
+	pthread_mutex_lock(&_lock);
+	_control_queue(&_replies, m);
+	pthread_mutex_unlock(&_lock);
+	if (write(_wakePipe[1], "", 1) == -1 && errno != EAGAIN) {
+		ret = errno;
+		log_error("Unable to wake the control server: %i", ret);
+	}
+
+Exit:
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+/* The modem opened as Index is served through SerialFD, its cache starts empty */
+void control_device_set(size_t Index, int SerialFD)
+{
+	PCONTROL_DEVICE d = NULL;
+	log_enter("Index=%zu; SerialFD=%i", Index, SerialFD);
+
+	if (Index < CONTROL_DEVICES_MAX) {
+		pthread_mutex_lock(&_lock);
+		for (; _deviceCount <= Index; ++_deviceCount)
+			_devices[_deviceCount].SerialFD = -1;
+
+		d = _devices + Index;
+		memset(d, 0, sizeof(CONTROL_DEVICE));
+		d->SerialFD = SerialFD;
+		pthread_mutex_unlock(&_lock);
+	}
+
+	log_exit("void");
+	return;
+}
+
+
+static PCONTROL_DEVICE _control_device(int SerialFD)
+{
+	PCONTROL_DEVICE ret = NULL;
+
+	for (size_t i = 0; i < _deviceCount; ++i) {
+		if (_devices[i].SerialFD == SerialFD) {
+			ret = _devices + i;
+			break;
+		}
+	}
+
+	return ret;
+}
+
+
+void control_status_update(int SerialFD, int SignalQuality, int Gprs, int Battery, int Gnss)
+{
+	PCONTROL_DEVICE d = NULL;
+	log_enter("SerialFD=%i; SignalQuality=%i; Gprs=%i; Battery=%i; Gnss=%i", SerialFD, SignalQuality, Gprs, Battery, Gnss);
+
+	pthread_mutex_lock(&_lock);
+	d = _control_device(SerialFD);
+	if (d != NULL) {
+		d->SignalQuality = SignalQuality;
+		d->Gprs = Gprs;
+		d->Battery = Battery;
+		d->Gnss = Gnss;
+		d->Updated = _control_now();
+	}
+
+	pthread_mutex_unlock(&_lock);
+
+	log_exit("void");
+	return;
+}
+
+
+void control_fix_update(int SerialFD, const GPS_RECORD* Record)
+{
+	PCONTROL_DEVICE d = NULL;
+	log_enter("SerialFD=%i; Record=0x%p", SerialFD, Record);
+
+	pthread_mutex_lock(&_lock);
+	d = _control_device(SerialFD);
+	if (d != NULL) {
+		d->Latitude = Record->Lattitude;
+		d->Longitude = Record->Longitude;
+		snprintf(d->Time, sizeof(d->Time), "%s", (Record->Timestamp != NULL) ? Record->Timestamp : "");
+		d->SatellitesUsed = Record->GNSSSatelitesUsed;
+		d->SatellitesInView = Record->GNSSSatelitesInView;
+		d->FixUpdated = _control_now();
+	}
+
+	pthread_mutex_unlock(&_lock);
+
+	log_exit("void");
+	return;
+}
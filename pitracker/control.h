@@ -0,0 +1,50 @@
+
+#pragma once
+
+
+#include <stddef.h>
+#include "commands.h"
+
+
+/*
+ * Local control socket. A client connects to the SOCK_SEQPACKET Unix
+ * socket and sends one command per message, with the verbs and arguments
+ * of the SMS commands ("status", "#gpson", "getopt gpsperiod"); "@<n> "
+ * in front of the command addresses the n-th modem, the first one is
+ * the default. Every command gets a message with a JSON object back,
+ * "seq" counts the commands of the connection.
+ *
+ * A thread serves the clients. It answers a status from the values the
+ * main loop cached while they are younger than the maximum age, so the
+ * answer does not wait for the modem. The other commands are passed to
+ * the main loop, whose idle waits watch the request pipe; it runs them
+ * as arbiter jobs and hands their replies to control_reply(). Access is
+ * controlled by the permissions of the socket file, which is created for
+ * the owner and the group of the tracker only, whatever the umask is.
+ */
+
+#define CONTROL_CLIENTS_MAX				8
+#define CONTROL_DEVICES_MAX				8
+#define CONTROL_COMMAND_MAX				256
+#define CONTROL_REPLY_MAX				1024
+#define CONTROL_SOCKET_MODE				0660
+
+typedef struct _CONTROL_REQUEST {
+	/* The connection and its command the reply goes to */
+	unsigned long Client;
+	unsigned long Sequence;
+	size_t Device;
+	/* The commands, separated by ';' and with '#' in front of their verbs */
+	char Command[CONTROL_COMMAND_MAX];
+} CONTROL_REQUEST, *PCONTROL_REQUEST;
+
+/* Takes over the request in the main loop, control_reply() is called once it is done */
+typedef int (CONTROL_REQUEST_CALLBACK)(const CONTROL_REQUEST* Request, void* Context);
+
+
+int control_server_start(const char* Path, int MaxAge, CONTROL_REQUEST_CALLBACK* Callback, void* Context);
+void control_server_stop(void);
+int control_reply(const CONTROL_REQUEST* Request, int Result, const char* Reply);
+void control_device_set(size_t Index, int SerialFD);
+void control_status_update(int SerialFD, int SignalQuality, int Gprs, int Battery, int Gnss);
+void control_fix_update(int SerialFD, const GPS_RECORD* Record);
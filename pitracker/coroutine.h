@@ -0,0 +1,43 @@
+
+#pragma once
+
+
+/*
+ * Stackless coroutines for the modem flows of several steps. A flow is a
+ * function whose body sits between CO_BEGIN and CO_END; it returns at each
+ * CO_YIELD and the next call continues right after it. Locals do not live
+ * through a yield, whatever a flow needs later goes to its context next to
+ * the COROUTINE. The flows run as arbiter jobs, a step per chunk, so they
+ * never block the main loop and several of them interleave on one channel.
+ *
+ * The body ends at the CoYield label, so the statements following CO_END
+ * run after every step, the last one included:
+ *
+ *	CO_BEGIN(co);
+ *	ret = first_step();
+ *	if (ret != 0)
+ *		CO_RETURN(co);
+ *
+ *	CO_YIELD(co);
+ *	ret = second_step();
+ *	CO_END(co);
+ *	*More = CO_RUNNING(co);
+ */
+
+#define CO_FINISHED						(-1)
+
+typedef struct _COROUTINE {
+	/* Line of the last yield, 0 before the first step, CO_FINISHED after the last one */
+	int Line;
+} COROUTINE, *PCOROUTINE;
+
+
+#define CO_INIT(Co)						((Co)->Line = 0)
+#define CO_RUNNING(Co)					((Co)->Line != CO_FINISHED)
+#define CO_BEGIN(Co)					switch ((Co)->Line) { case 0:
+#define CO_YIELD(Co)					do { (Co)->Line = __LINE__; goto CoYield; case __LINE__:; } while (0)
+#define CO_RETURN(Co)					do { (Co)->Line = CO_FINISHED; goto CoYield; } while (0)
+#define CO_END(Co)						default: break; } (Co)->Line = CO_FINISHED; CoYield:
+
+/* Runs the coroutine Sub by Call, a step per resume, until it finishes */
+#define CO_AWAIT(Co, Sub, Call)			do { CO_INIT(Sub); (Co)->Line = __LINE__; case __LINE__: Call; if (CO_RUNNING(Sub)) goto CoYield; } while (0)
@@ -6,6 +6,7 @@
 #include <string.h>
 #include <errno.h>
 #include "logging.h"
+#include "arena.h"
 #include "field-array.h"
 
 
@@ -32,6 +33,11 @@ int field_array_get(const char* Line, char Delimiter, char*** Array, size_t* Cou
 		memset(buf, 0, sizeof(buf));
 		bufLen = 0;
 		while ((quotes || *tmp != Delimiter) && *tmp != '\0') {
+			if (bufLen == sizeof(buf) - 1) {
+				ret = E2BIG;
+				break;
+			}
+
 			if (*tmp == '"')
 				quotes = !quotes;
 
@@ -40,6 +46,9 @@ int field_array_get(const char* Line, char Delimiter, char*** Array, size_t* Cou
 			++tmp;
 		}
 
+		if (ret != 0)
+			continue;
+
 		if (*tmp != '\0')
 			++tmp;
 
@@ -49,14 +58,14 @@ int field_array_get(const char* Line, char Delimiter, char*** Array, size_t* Cou
 			buf[bufLen] = '\0';
 		}
 
-		tmpArray2 = realloc(tmpArray, (tmpCount + 1) * sizeof(char*));
+		tmpArray2 = arena_realloc(tmpArray, (tmpCount + 1) * sizeof(char*));
 		if (tmpArray2 == NULL) {
 			ret = ENOMEM;
 			continue;
 		}
 
 		tmpArray = tmpArray2;
-		tmpArray[tmpCount] = strdup(buf);
+		tmpArray[tmpCount] = arena_strdup(buf);
 		if (tmpArray[tmpCount] == NULL) {
 			ret = ENOMEM;
 			continue;
@@ -73,9 +82,9 @@ int field_array_get(const char* Line, char Delimiter, char*** Array, size_t* Cou
 
 	if (ret != 0) {
 		for (size_t i = 0; i < tmpCount; ++i)
-			free(tmpArray[i]);
+			arena_free(tmpArray[i]);
 
-		free(tmpArray);
+		arena_free(tmpArray);
 	}
 
 	log_exit("%i, *Array=0x%p, *Count=%zu", ret, *Array, *Count);
@@ -92,7 +101,7 @@ int field_array_extract(char** Array, const size_t Count, const STRING_FIELD_FOR
 		case sftNone:
 			break;
 		case sftString:
-			*Formats->Target.String = strdup(*Array);
+			*Formats->Target.String = arena_strdup(*Array);
 			if (*Formats->Target.String == NULL)
 				ret = ENOMEM;
 			break;
@@ -117,7 +126,7 @@ int field_array_extract(char** Array, const size_t Count, const STRING_FIELD_FOR
 			for (size_t j = 0; j < i; ++j) {
 				--Formats;
 				if (Formats->FieldType == sftString)
-					free(*Formats->Target.String);
+					arena_free(*Formats->Target.String);
 			}
 
 			break;
@@ -134,9 +143,9 @@ int field_array_extract(char** Array, const size_t Count, const STRING_FIELD_FOR
 void field_array_free(char** Array, size_t Count)
 {
 	for (size_t i = 0; i < Count; ++i)
-		free(Array[i]);
+		arena_free(Array[i]);
 
-	free(Array);
+	arena_free(Array);
 
 	return;
 }
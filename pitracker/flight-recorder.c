@@ -0,0 +1,306 @@
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "logging.h"
+#include "flight-recorder.h"
+
+
+
+#define FLIGHT_ALIGN(aSize)				(((aSize) + 7) & ~(size_t)7)
+#define FLIGHT_PIN_COMMAND				"AT+CPIN="
+
+static PFLIGHT_RECORDER_HEADER _ring = NULL;
+static unsigned char* _data = NULL;
+static size_t _size = 0;
+static char* _dumpFile = NULL;
+static void* _altStack = NULL;
+static const int _crashSignals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+
+
+
+/* Frees the oldest records until End fits; the Tail is published before they get overwritten */
+static void _flight_recorder_reserve(uint64_t End)
+{
+	uint64_t tail = 0;
+	uint32_t size = 0;
+
+	tail = _ring->Tail;
+	while (End - tail > _size) {
+		size = ((PFLIGHT_RECORD)(_data + tail % _size))->Size;
+		if (size == 0 || size > _size) {
+			tail = _ring->Head;
+			break;
+		}
+
+		tail += size;
+	}
+
+	__atomic_store_n(&_ring->Tail, tail, __ATOMIC_RELEASE);
+
+	return;
+}
+
+
+/* The PIN does not go to the ring, nor to the dumps made of it */
+static void _flight_recorder_mask(char* Data, size_t Length)
+{
+	size_t prefix = sizeof(FLIGHT_PIN_COMMAND) - 1;
+
+	if (Length > prefix && memcmp(Data, FLIGHT_PIN_COMMAND, prefix) == 0) {
+		for (size_t i = prefix; i < Length && Data[i] != '\r'; ++i) {
+			if (Data[i] != '"')
+				Data[i] = '*';
+		}
+	}
+
+	return;
+}
+
+
+/* Async-signal-safe */
+static int _flight_recorder_dump(const char* FileName)
+{
+	int ret = 0;
+	int fd = -1;
+	const unsigned char* d = NULL;
+	size_t remaining = 0;
+	ssize_t written = 0;
+
+	fd = open(FileName, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1)
+		ret = errno;
+
+	if (ret == 0) {
+		d = (const unsigned char*)_ring;
+		remaining = sizeof(FLIGHT_RECORDER_HEADER) + _size;
+		while (remaining > 0) {
+			written = write(fd, d, remaining);
+			if (written == -1) {
+				ret = errno;
+				if (ret == EINTR) {
+					ret = 0;
+					continue;
+				}
+
+				break;
+			}
+
+			d += written;
+			remaining -= (size_t)written;
+		}
+
+		close(fd);
+	}
+
+	return ret;
+}
+
+
+static void _on_crash(int Signal)
+{
+	flight_recorder_event("crash");
+	_flight_recorder_dump(_dumpFile);
+	/* SA_RESETHAND restored the default action */
+	raise(Signal);
+
+	return;
+}
+
+
+void flight_recorder_record(EFlightRecordType Type, const void* Data, size_t Length)
+{
+	uint64_t head = 0;
+	size_t pos = 0;
+	size_t size = 0;
+	size_t gap = 0;
+	PFLIGHT_RECORD r = NULL;
+	struct timespec ts;
+
+	if (_ring == NULL)
+		return;
+
+	if (Length > FLIGHT_RECORD_DATA_MAX)
+		Length = FLIGHT_RECORD_DATA_MAX;
+
+	size = FLIGHT_ALIGN(sizeof(FLIGHT_RECORD) + Length);
+	head = _ring->Head;
+	pos = (size_t)(head % _size);
+	/* Records do not wrap, the rest of the ring is skipped by a pad record */
+	if (_size - pos < size)
+		gap = _size - pos;
+
+	_flight_recorder_reserve(head + gap + size);
+	if (gap > 0) {
+		r = (PFLIGHT_RECORD)(_data + pos);
+		r->Size = (uint32_t)gap;
+		r->Type = frtPad;
+		pos = 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	r = (PFLIGHT_RECORD)(_data + pos);
+	r->Size = (uint32_t)size;
+	r->Type = (uint16_t)Type;
+	r->Length = (uint16_t)Length;
+	r->Timestamp = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+	memcpy(r + 1, Data, Length);
+	if (Type == frtTx)
+		_flight_recorder_mask((char*)(r + 1), Length);
+
+	__atomic_store_n(&_ring->Head, head + gap + size, __ATOMIC_RELEASE);
+
+	return;
+}
+
+
+int flight_recorder_dump(const char* FileName)
+{
+	int ret = 0;
+	log_enter("FileName=\"%s\"", FileName);
+
+	if (FileName == NULL)
+		FileName = _dumpFile;
+
+	if (_ring != NULL) {
+		flight_recorder_event("dump");
+		ret = _flight_recorder_dump(FileName);
+	} else ret = ENODEV;
+
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+int flight_recorder_init(const char* RingFile, size_t Size, const char* DumpFile)
+{
+	int ret = 0;
+	int fd = -1;
+	struct stat st;
+	size_t total = 0;
+	void* addr = MAP_FAILED;
+	PFLIGHT_RECORDER_HEADER h = NULL;
+	struct sigaction sa;
+	stack_t ss;
+	log_enter("RingFile=\"%s\"; Size=%zu; DumpFile=\"%s\"", RingFile, Size, DumpFile);
+
+	if (Size < FLIGHT_RECORDER_SIZE_MIN)
+		Size = FLIGHT_RECORDER_SIZE_MIN;
+
+	Size = FLIGHT_ALIGN(Size);
+	total = sizeof(FLIGHT_RECORDER_HEADER) + Size;
+	_dumpFile = strdup(DumpFile);
+	if (_dumpFile == NULL)
+		ret = ENOMEM;
+
+	if (ret == 0) {
+		fd = open(RingFile, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+		if (fd == -1)
+			ret = errno;
+	}
+
+	if (ret == 0 && fstat(fd, &st) == -1)
+		ret = errno;
+
+	if (ret == 0 && (size_t)st.st_size != total && ftruncate(fd, (off_t)total) == -1)
+		ret = errno;
+
+	if (ret == 0) {
+		addr = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (addr == MAP_FAILED)
+			ret = errno;
+	}
+
+	if (fd != -1)
+		close(fd);
+
+	/* The records of the previous run are kept, they are the interesting part after a crash or a watchdog reset */
+	if (ret == 0) {
+		h = (PFLIGHT_RECORDER_HEADER)addr;
+		if (memcmp(h->Magic, FLIGHT_RECORDER_MAGIC, sizeof(h->Magic)) != 0 || h->Size != Size ||
+			h->Head < h->Tail || h->Head - h->Tail > Size || (h->Head | h->Tail) % 8 != 0) {
+			memset(h, 0, sizeof(FLIGHT_RECORDER_HEADER));
+			h->Size = Size;
+			memcpy(h->Magic, FLIGHT_RECORDER_MAGIC, sizeof(h->Magic));
+		}
+
+		_ring = h;
+		_data = (unsigned char*)(h + 1);
+		_size = Size;
+	}
+
+	/* The crash handler runs on its own stack, a stack overflow is a crash worth recording */
+	if (ret == 0) {
+		_altStack = malloc(SIGSTKSZ);
+		if (_altStack != NULL) {
+			memset(&ss, 0, sizeof(ss));
+			ss.ss_sp = _altStack;
+			ss.ss_size = SIGSTKSZ;
+			if (sigaltstack(&ss, NULL) == -1)
+				log_warning("sigaltstack: %i", errno);
+		}
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = _on_crash;
+		sa.sa_flags = SA_RESETHAND | SA_ONSTACK | SA_NODEFER;
+		sigemptyset(&sa.sa_mask);
+		for (size_t i = 0; i < sizeof(_crashSignals) / sizeof(_crashSignals[0]); ++i)
+			sigaction(_crashSignals[i], &sa, NULL);
+
+		flight_recorder_event("start");
+	}
+
+	if (ret != 0) {
+		if (addr != MAP_FAILED)
+			munmap(addr, total);
+
+		free(_dumpFile);
+		_dumpFile = NULL;
+	}
+
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+void flight_recorder_finit(void)
+{
+	PFLIGHT_RECORDER_HEADER h = NULL;
+	stack_t ss;
+	log_enter("");
+
+	if (_ring != NULL) {
+		flight_recorder_event("stop");
+		for (size_t i = 0; i < sizeof(_crashSignals) / sizeof(_crashSignals[0]); ++i)
+			signal(_crashSignals[i], SIG_DFL);
+
+		if (_altStack != NULL) {
+			memset(&ss, 0, sizeof(ss));
+			ss.ss_flags = SS_DISABLE;
+			sigaltstack(&ss, NULL);
+			free(_altStack);
+			_altStack = NULL;
+		}
+
+		h = _ring;
+		_ring = NULL;
+		munmap(h, sizeof(FLIGHT_RECORDER_HEADER) + _size);
+		_data = NULL;
+		_size = 0;
+		free(_dumpFile);
+		_dumpFile = NULL;
+	}
+
+	log_exit("void");
+	return;
+}
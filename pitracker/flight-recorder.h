@@ -0,0 +1,54 @@
+
+#pragma once
+
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+/*
+ * The ring is a shared file mapping (/dev/shm by default), so it survives
+ * the process: FLIGHT_RECORDER_HEADER followed by Size bytes of records.
+ * Tail and Head count bytes from the creation of the ring, the records
+ * between them are complete. A dump is a copy of the mapping.
+ */
+
+#define FLIGHT_RECORDER_MAGIC			"PTFLGT1\n"
+#define FLIGHT_RECORDER_SIZE_MIN		4096
+#define FLIGHT_RECORD_DATA_MAX			1024
+
+typedef enum _EFlightRecordType {
+	frtPad,
+	frtTx,
+	frtRx,
+	frtUrc,
+	frtEvent,
+	/* A serial wait that ended without data, used by session captures */
+	frtTimeout,
+	/* The main loop read the clock, used by session captures */
+	frtClock,
+} EFlightRecordType, *PEFlightRecordType;
+
+typedef struct _FLIGHT_RECORDER_HEADER {
+	char Magic[8];
+	uint64_t Size;
+	uint64_t Head;
+	uint64_t Tail;
+} FLIGHT_RECORDER_HEADER, *PFLIGHT_RECORDER_HEADER;
+
+typedef struct _FLIGHT_RECORD {
+	/* Whole record, a multiple of 8 bytes */
+	uint32_t Size;
+	uint16_t Type;
+	uint16_t Length;
+	/* CLOCK_MONOTONIC in nanoseconds */
+	uint64_t Timestamp;
+} FLIGHT_RECORD, *PFLIGHT_RECORD;
+
+
+int flight_recorder_init(const char* RingFile, size_t Size, const char* DumpFile);
+void flight_recorder_finit(void);
+void flight_recorder_record(EFlightRecordType Type, const void* Data, size_t Length);
+int flight_recorder_dump(const char* FileName);
+
+#define flight_recorder_event(aLiteral)		flight_recorder_record(frtEvent, aLiteral, sizeof(aLiteral) - 1)
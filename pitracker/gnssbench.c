@@ -0,0 +1,90 @@
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "logging.h"
+#include "line-buffer.h"
+#include "commands.h"
+
+
+/*
+ * Measures one AT+CGNSINF cycle (command, response wait, line splitting and
+ * parsing) against a canned modem answer on a socket pair. Build it with
+ * different LOG_LEVEL values to compare tracing compiled out with tracing
+ * only masked out by the verbosity (the first argument, 0x3 by default).
+ */
+
+
+#define GNSSBENCH_ITERATIONS_DEFAULT			100000
+
+static const char _response[] =
+	"AT+CGNSINF\r\r\n"
+	"+CGNSINF: 1,1,20200115123456.000,50.087451,14.420671,230.5,0.00,0.0,1,,1.1,1.4,0.9,,12,8,,,39,,\r\n"
+	"\r\n"
+	"OK\r\n";
+
+
+int main(int argc, char** argv)
+{
+	int ret = 0;
+	int fds[2];
+	long iterations = GNSSBENCH_ITERATIONS_DEFAULT;
+	char drain[256];
+	GPS_RECORD record;
+	struct timespec start;
+	struct timespec end;
+	double ns = 0;
+
+	if (argc > 1)
+		_verbose = strtoul(argv[1], NULL, 0);
+
+	if (argc > 2)
+		iterations = strtol(argv[2], NULL, 0);
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+		ret = errno;
+		fprintf(stderr, "Unable to create the socket pair: %i\n", ret);
+		return ret;
+	}
+
+	ret = line_buffer_init();
+	if (ret == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (long i = 0; i < iterations; ++i) {
+			/* The answer is queued before the command, so the wait never sleeps */
+			if (write(fds[1], _response, sizeof(_response) - 1) != (ssize_t)(sizeof(_response) - 1)) {
+				ret = EIO;
+				break;
+			}
+
+			ret = command_gnss_info(fds[0], &record);
+			if (ret != 0)
+				break;
+
+			command_gnss_info_free(&record);
+			if (read(fds[1], drain, sizeof(drain)) <= 0) {
+				ret = EIO;
+				break;
+			}
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		line_buffer_finit();
+	}
+
+	if (ret == 0) {
+		ns = (double)(end.tv_sec - start.tv_sec) * 1e9 + (double)(end.tv_nsec - start.tv_nsec);
+		printf("LOG_LEVEL=0x%x verbose=0x%lx: %ld cycles, %.0lf ns per cycle\n", LOG_LEVEL, _verbose, iterations, ns / (double)iterations);
+	} else fprintf(stderr, "Benchmark failed: %i\n", ret);
+
+	close(fds[1]);
+	close(fds[0]);
+
+	return ret;
+}
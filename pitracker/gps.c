@@ -9,23 +9,84 @@
 #include <errno.h>
 #include <unistd.h>
 #include <limits.h>
+#include <time.h>
+#include <signal.h>
 #include "logging.h"
 #include "serial.h"
 #include "line-buffer.h"
 #include "field-array.h"
 #include "commands.h"
+#include "inbox.h"
 #include "settings.h"
 #include "accounts.h"
 #include "cmdline.h"
+#include "pdu.h"
+#include "track.h"
+#include "config-watch.h"
+#include "flight-recorder.h"
+#include "capture.h"
+#include "metrics.h"
+#include "arbiter.h"
+#include "coroutine.h"
+#include "arena.h"
+#include "control.h"
 
 
 //  +CMTI: "SM",0, incomming SMS on index 0
 
 
 
-static void* _notifyCallbackHandle = NULL;
-static int _gpsPeriod = 0;
-static int _syncPeriod = 0;
+static volatile sig_atomic_t _terminate = 0;
+static volatile sig_atomic_t _reload = 0;
+static volatile sig_atomic_t _dump = 0;
+
+
+#define SMS_UPLINK_BATCH_MAX				64
+#define MODEM_READY_TIMEOUT					30
+/* CMUX channels (DLCI 1 to 3): SMS and control, GNSS polling, GPRS */
+#define GPS_CHANNELS						3
+#define GPS_CHANNEL_CONTROL					0
+#define GPS_CHANNEL_GNSS					1
+#define GPS_CHANNEL_DATA					2
+/* One modem per "device" entry */
+#define GPS_DEVICES_MAX						8
+/* Seconds a GNSS powered up for a read gets to find satellites */
+#define GNSS_WARM_UP						60
+
+
+/* Everything one modem needs; settings, accounts and logging are shared by all of them */
+typedef struct _GPS_DEVICE {
+	size_t Index;
+	char* Name;
+	int Open;
+	int PortFD;
+	/* Handles of the CMUX channels, all PortFD without CMUX */
+	int Channels[GPS_CHANNELS];
+	int SerialFD;
+	int GnssFD;
+	int DataFD;
+	/* Seconds until the next GNSS read and the next synchronization */
+	int GpsPeriod;
+	int SyncPeriod;
+	/* Seconds until the GNSS powered up for a read has warmed up, 0 when it is not warming up */
+	int GnssWarmUp;
+	/* The sync job found GPRS detached and sends the track by SMS */
+	int SmsUplink;
+	void* NotifyCallbackHandle;
+	void* GpsPeriodCallbackHandle;
+	void* SyncPeriodCallbackHandle;
+	INBOX Inbox;
+} GPS_DEVICE, *PGPS_DEVICE;
+
+/* A message announced by +CMTI, handled by the arbiter */
+typedef struct _GPS_SMS_JOB {
+	PGPS_DEVICE Device;
+	char Storage[INBOX_STORAGE_NAME_MAX];
+	int Index;
+} GPS_SMS_JOB, *PGPS_SMS_JOB;
+
+/* The control channel of each open modem + 1, zero for the others; the command callbacks only get the channel */
+static int _deviceChannels[GPS_DEVICES_MAX];
 
 
 typedef enum _EControlCommand {
@@ -47,35 +108,102 @@ typedef enum _EControlCommand {
 	eccGPRSOn,
 	eccGPRSOff,
 	eccGPRSSync,
+	eccDump,
 } EControlCommand, *PEControlCommand;
 
-typedef int (CONTROL_COMMAND_CALLBACK)(int SerialFD, const char *Phone, EControlCommand Type, char **Args, size_t ArgCount, int *SendResult);
+/* Phone is NULL for the commands of the control socket */
+typedef int (CONTROL_COMMAND_CALLBACK)(int SerialFD, const char *Phone, EControlCommand Type, char **Args, size_t ArgCount, char *Reply, size_t ReplySize);
+
+/* The arguments of a command run as a coroutine, kept through its yields */
+typedef struct _CONTROL_COMMAND_CONTEXT {
+	COROUTINE Co;
+	int SerialFD;
+	const char* Phone;
+	EControlCommand Type;
+	char** Args;
+	size_t ArgCount;
+	char* Reply;
+	size_t ReplySize;
+	/* State of the flows */
+	COROUTINE Step;
+	int GnssStatus;
+} CONTROL_COMMAND_CONTEXT, *PCONTROL_COMMAND_CONTEXT;
+
+/* Runs a step of the command, sets *More until the last one; may call arbiter_sleep() before yielding */
+typedef int (CONTROL_COMMAND_ASYNC_CALLBACK)(PCONTROL_COMMAND_CONTEXT Context, int* More);
 
 #define CONTROL_FLAG_AUTH_REQUIRED			0x1
 #define CONTROL_FLAG_ADMIN_REQUIRED			0x2
 #define CONTROL_FLAG_SAVE_ACCOUNTS			0x4
 #define CONTROL_FLAG_SAVE_SETTINGS			0x8
 
+#define CONTROL_COMMAND_SEPARATOR			';'
+#define CONTROL_REPLY_SIZE					1024
+
 typedef struct _CONTROL_COMMAND {
 	EControlCommand Type;
 	const char* String;
 	size_t ArgCount;
 	CONTROL_COMMAND_CALLBACK* Callback;
 	int Flags;
+	/* Used instead of Callback by the commands waiting for the modem */
+	CONTROL_COMMAND_ASYNC_CALLBACK* AsyncCallback;
 } CONTROL_COMMAND, *PCONTROL_COMMAND;
 
+/* The commands of an SMS, run in order; the reply goes back once the last one is done */
+typedef struct _GPS_SMS_SESSION {
+	int SerialFD;
+	/* NULL for the commands of the control socket, Request then tells where their reply goes */
+	char* Phone;
+	CONTROL_REQUEST Request;
+	/* Of the last command failing */
+	int Result;
+	char* Text;
+	char** Commands;
+	size_t CommandCount;
+	size_t Current;
+	/* Run from _sms_process(), where no flow may start */
+	int Inline;
+	/* The asynchronous command being run and its arguments */
+	const CONTROL_COMMAND* Control;
+	char** Args;
+	size_t ArgCount;
+	CONTROL_COMMAND_CONTEXT Context;
+	char Part[256];
+	char Reply[CONTROL_REPLY_SIZE];
+	size_t ReplyLength;
+} GPS_SMS_SESSION, *PGPS_SMS_SESSION;
+
+
+/* Index of the modem served through SerialFD, (size_t)-1 for none */
+static size_t _device_index(int SerialFD)
+{
+	size_t ret = (size_t)-1;
+
+	for (size_t i = 0; i < GPS_DEVICES_MAX; ++i) {
+		if (_deviceChannels[i] == SerialFD + 1) {
+			ret = i;
+			break;
+		}
+	}
+
+	return ret;
+}
+
 
-int status_sms_callback(int SerialFD, const char* Phone, EControlCommand Type, char** Args, size_t ArgCount, int* SendResult)
+int status_sms_callback(int SerialFD, const char* Phone, EControlCommand Type, char** Args, size_t ArgCount, char* Reply, size_t ReplySize)
 {
 	int ret = 0;
 	char msg[256];
 	int loggedIn = 0;
-	log_enter("SerialFD=%i; Phone=\"%s\"; Type=%u; Args=0x%p; ArgCount=%zu; SendResult=0x%p", SerialFD, Phone, Type, Args, ArgCount, SendResult);
+	log_enter("SerialFD=%i; Phone=\"%s\"; Type=%u; Args=0x%p; ArgCount=%zu; Reply=0x%p; ReplySize=%zu", SerialFD, Phone, Type, Args, ArgCount, Reply, ReplySize);
 
 	memset(msg, 0, sizeof(msg));
-	ret = account_logged_in(Phone, &loggedIn);
+	ret = (Phone != NULL) ? account_logged_in(Phone, _device_index(SerialFD), &loggedIn) : 0;
 	if (ret != 0)
 		loggedIn = 0;
+	else if (Phone == NULL)
+		loggedIn = 1;
 
 	switch (Type) {
 		case eccStatus: {
@@ -109,6 +237,7 @@ int status_sms_callback(int SerialFD, const char* Phone, EControlCommand Type, c
 				gnssStatus = -1;
 			}
 
+			control_status_update(SerialFD, signalQuality, gprs, batteryCharge, gnssStatus);
 			snprintf(msg, sizeof(msg), "GSM %i %%; GPRS %i; BATTERY: %i %%; GPS: %i", signalQuality, gprs, batteryCharge, gnssStatus);
 			if (gnssStatus == 1 && loggedIn) {
 				ret = command_gnss_info(SerialFD, &gpsRecord);
@@ -116,6 +245,7 @@ int status_sms_callback(int SerialFD, const char* Phone, EControlCommand Type, c
 					log_error("Unable to get GNSS location: %i", ret);
 
 				if (ret == 0 && gpsRecord.FixStatus == 1) {
+					control_fix_update(SerialFD, &gpsRecord);
 					snprintf(msg, sizeof(msg), "GSM; %i %%; GPRS %i; BATTERY %i %%; GPS: %i/%i; Time: %s; Lat: %lf; Long: %lf", signalQuality, gprs, batteryCharge, gpsRecord.GNSSSatelitesUsed, gpsRecord.GNSSSatelitesInView, gpsRecord.Timestamp, gpsRecord.Lattitude, gpsRecord.Longitude);
 					command_gnss_info_free(&gpsRecord);
 				}
@@ -123,38 +253,37 @@ int status_sms_callback(int SerialFD, const char* Phone, EControlCommand Type, c
 
 			ret = 0;
 		} break;
+		case eccDump:
+			ret = flight_recorder_dump(NULL);
+			if (ret != 0)
+				log_error("Unable to dump the flight recorder: %i", ret);
+			break;
 		default:
 			break;
 	}
 
-	if (ret == 0 && msg[0] != '\0') {
-		ret = command_sms_send(SerialFD, Phone, msg);
-		if (ret != 0)
-			log_error("Unable to send response SMS: %i", ret);
-
-		if (ret == 0)
-			*SendResult = 0;
-	}
+	if (ret == 0 && msg[0] != '\0')
+		snprintf(Reply, ReplySize, "%s", msg);
 
-	log_exit("%i, *SendResult=%i", ret, *SendResult);
+	log_exit("%i, Reply=\"%s\"", ret, Reply);
 	return ret;
 }
 
 
-int account_sms_callback(int SerialFD, const char* Phone, EControlCommand Type, char** Args, size_t ArgCount, int* SendResult)
+int account_sms_callback(int SerialFD, const char* Phone, EControlCommand Type, char** Args, size_t ArgCount, char* Reply, size_t ReplySize)
 {
 	int ret = 0;
 	char msg[256];
-	log_enter("SerialFD=%i; Phone=\"%s\"; Type=%u; Args=0x%p; ArgCount=%zu; SendResult=0x%p", SerialFD, Phone, Type, Args, ArgCount, SendResult);
+	log_enter("SerialFD=%i; Phone=\"%s\"; Type=%u; Args=0x%p; ArgCount=%zu; Reply=0x%p; ReplySize=%zu", SerialFD, Phone, Type, Args, ArgCount, Reply, ReplySize);
 
 	memset(msg, 0, sizeof(msg));
 	switch (Type) {
 		case eccUserDelete:
 			break;
 		case eccLogin:
-			ret = account_login(Phone, Args[0]);
+			ret = account_login(Phone, Args[0], _device_index(SerialFD));
 			if (ret == ENOENT) {
-				ret = account_login("*", Args[0]);
+				ret = account_login("*", Args[0], _device_index(SerialFD));
 				if (ret == EEXIST)
 					ret = 0;
 
@@ -162,16 +291,8 @@ int account_sms_callback(int SerialFD, const char* Phone, EControlCommand Type,
 					ret = account_add(Phone, Args[0], 1);
 			
 				if (ret == 0)
-					ret = account_login(Phone, Args[0]);
+					ret = account_login(Phone, Args[0], _device_index(SerialFD));
 			
-				if (ret == 0) {
-					ret = accounts_save();
-					if (ret == 0)
-						ret = settings_save(_configFile, ':');
-
-					if (ret != 0)
-						log_warning("Unable to save settings: %i", ret);
-				}
 			}
 
 			switch (ret) {
@@ -192,7 +313,7 @@ int account_sms_callback(int SerialFD, const char* Phone, EControlCommand Type,
 			}
 			break;
 		case eccLogout:
-			ret = account_logout(Phone);
+			ret = account_logout(Phone, _device_index(SerialFD));
 			if (ret == EEXIST) {
 				ret = 0;
 				strncpy(msg, "NOT_LOGGED_IN", sizeof(msg) / sizeof(msg[0]));
@@ -200,127 +321,60 @@ int account_sms_callback(int SerialFD, const char* Phone, EControlCommand Type,
 			break;
 		case eccChangePassword:
 			ret = account_set_password(Phone, Args[0], Args[1]);
-			if (ret == 0) {
-				ret = accounts_save();
-				if (ret == 0)
-					ret = settings_save(_configFile, ':');
-			}
 			break;
 		default:
 			break;
 	}
 
-	if (ret == 0 && msg[0] != '\0') {
-		ret = command_sms_send(SerialFD, Phone, msg);
-		if (ret != 0)
-			log_error("Unable to send response SMS: %i", ret);
-
-		if (ret == 0)
-			*SendResult = 0;
-	}
+	if (ret == 0 && msg[0] != '\0')
+		snprintf(Reply, ReplySize, "%s", msg);
 
-	log_exit("%i, *SendResult=%i", ret, *SendResult);
+	log_exit("%i, Reply=\"%s\"", ret, Reply);
 	return ret;
 }
 
 
-int gps_control_sms_callback(int SerialFD, const char *Phone, EControlCommand Type, char** Args, size_t ArgCount, int* SendResult)
+int gps_control_sms_callback(int SerialFD, const char *Phone, EControlCommand Type, char** Args, size_t ArgCount, char* Reply, size_t ReplySize)
 {
 	int ret = 0;
 	char msg[256];
-	int gnssStatus = 0;
-	GPS_RECORD gpsRecord;
-	log_enter("SerialFD=%i; Phone=\"%s\"; Type=%u; Args=0x%p; ArgCount=%zu; SendResult=0x%p", SerialFD, Phone, Type, Args, ArgCount, SendResult);
+	log_enter("SerialFD=%i; Phone=\"%s\"; Type=%u; Args=0x%p; ArgCount=%zu; Reply=0x%p; ReplySize=%zu", SerialFD, Phone, Type, Args, ArgCount, Reply, ReplySize);
 
 	memset(msg, 0, sizeof(msg));
 	switch (Type) {
 		case eccGPSOn:
 			ret = command_gnss_enable(SerialFD, 1);
-			if (ret == 0) {
-				settings_value_set_int("gps", 0, 1);
-				settings_save(_configFile, ':');
-			}
+			if (ret == 0)
+				settings_set_int(skGps, 1);
 			break;
 		case eccGPSOff:
 			ret = command_gnss_enable(SerialFD, 0);
-			if (ret == 0) {
-				settings_value_set_int("gps", 0, 0);
-				settings_save(_configFile, ':');
-			}
-			break;
-		case eccMap:
-			ret = command_gnss_status(SerialFD, &gnssStatus);
-			if (ret == 0) {
-				if (!gnssStatus) {
-					ret = command_gnss_enable(SerialFD, 1);
-					if (ret != 0)
-						log_error("Unable to enable GNSS: %i", ret);
-
-					if (ret == 0)
-						sleep(60);
-				}
-
-				if (ret == 0) {
-					ret = command_gnss_info(SerialFD, &gpsRecord);
-					if (ret != 0)
-						log_error("Unable to get GNSS location: %i", ret);
-
-					if (ret == 0 && gpsRecord.FixStatus == 1) {
-						snprintf(msg, sizeof(msg) / sizeof(msg[0]), "https://mapy.cz/zakladni?x=%lf&y=%lf", gpsRecord.Longitude, gpsRecord.Lattitude);
-						command_gnss_info_free(&gpsRecord);
-					}
-
-					if (!gnssStatus) {
-						ret = command_gnss_enable(SerialFD, 0);
-						if (ret != 0)
-							log_error("Unable to disable GNSS: %i", ret);
-					}
-				}
-			} else log_error("Unable to get GNSS status: %i", ret);
+			if (ret == 0)
+				settings_set_int(skGps, 0);
 			break;
 		default:
 			ret = -1;
 			break;
 	}
 
-	if (ret == 0 && msg[0] != '\0') {
-		ret = command_sms_send(SerialFD, Phone, msg);
-		if (ret != 0)
-			log_error("Unable to send response SMS: %i", ret);
-
-		if (ret == 0)
-			*SendResult = 0;
-	}
+	if (ret == 0 && msg[0] != '\0')
+		snprintf(Reply, ReplySize, "%s", msg);
 
-	log_exit("%i, *SendResult=%i", ret, *SendResult);
+	log_exit("%i, Reply=\"%s\"", ret, Reply);
 	return ret;
 }
 
 
-int gprs_control_sms_callback(int SerialFD, const char* Phone, EControlCommand Type, char** Args, size_t ArgCount, int* SendResult)
+int gprs_control_sms_callback(int SerialFD, const char* Phone, EControlCommand Type, char** Args, size_t ArgCount, char* Reply, size_t ReplySize)
 {
 	int ret = 0;
 	char msg[256];
 	char* un = NULL;
 	char* pass = NULL;
-	log_enter("SerialFD=%i; Phone=\"%s\"; Type=%u; Args=0x%p; ArgCount=%zu; SendResult=0x%p", SerialFD, Phone, Type, Args, ArgCount, SendResult);
+	log_enter("SerialFD=%i; Phone=\"%s\"; Type=%u; Args=0x%p; ArgCount=%zu; Reply=0x%p; ReplySize=%zu", SerialFD, Phone, Type, Args, ArgCount, Reply, ReplySize);
 
 	memset(msg, 0, sizeof(msg));
 	switch (Type) {
-		case eccGPRSOn:
-			ret = command_gprs_connect(SerialFD, 1);
-			if (ret == 0) {
-				settings_value_set_int("gprs", 0, 1);
-				settings_save(_configFile, ':');
-			}
-			break;
-		case eccGPRSOff:
-			ret = command_gprs_connect(SerialFD, 0);
-			if (ret == 0) {
-				settings_value_set_int("gprs", 0, 0);
-				settings_save(_configFile, ':');
-			}
-			break;
 		case eccAPN:
 			un = "";
 			pass = "";
@@ -337,16 +391,149 @@ int gprs_control_sms_callback(int SerialFD, const char* Phone, EControlCommand T
 			break;
 	}
 
-	if (ret == 0 && msg[0] != '\0') {
-		ret = command_sms_send(SerialFD, Phone, msg);
-		if (ret != 0)
-			log_error("Unable to send response SMS: %i", ret);
+	if (ret == 0 && msg[0] != '\0')
+		snprintf(Reply, ReplySize, "%s", msg);
 
-		if (ret == 0)
-			*SendResult = 0;
+	log_exit("%i, Reply=\"%s\"", ret, Reply);
+	return ret;
+}
+
+
+/* The options tunable at run time; paths, the device and the PIN stay in the configuration file */
+static const ESettingsKey _runtimeOptions[] = {
+	skGps,
+	skGpsPeriod,
+	skPeriod,
+	skSyncPeriod,
+	skSavePeriod,
+	skGprs,
+	skApn,
+	skBatteryAlarm,
+	skSmsBudget,
+};
+
+
+static ESettingsKey _option_key(const char* Name)
+{
+	for (size_t i = 0; i < sizeof(_runtimeOptions) / sizeof(_runtimeOptions[0]); ++i) {
+		if (strcmp(settings_definition(_runtimeOptions[i])->Name, Name) == 0)
+			return _runtimeOptions[i];
+	}
+
+	return skMax;
+}
+
+
+int option_sms_callback(int SerialFD, const char* Phone, EControlCommand Type, char** Args, size_t ArgCount, char* Reply, size_t ReplySize)
+{
+	int ret = 0;
+	char msg[256];
+	char value[256];
+	size_t len = 0;
+	const char* str = NULL;
+	ESettingsKey key = skMax;
+	log_enter("SerialFD=%i; Phone=\"%s\"; Type=%u; Args=0x%p; ArgCount=%zu; Reply=0x%p; ReplySize=%zu", SerialFD, Phone, Type, Args, ArgCount, Reply, ReplySize);
+
+	memset(msg, 0, sizeof(msg));
+	key = _option_key(Args[0]);
+	if (key == skMax)
+		strncpy(msg, "UNKNOWN_OPTION", sizeof(msg) / sizeof(msg[0]));
+	else if (Type == eccGetOption) {
+		if (settings_definition(key)->Type == stString) {
+			str = settings_get_string(key);
+			snprintf(msg, sizeof(msg), "%s=%s", Args[0], (str != NULL) ? str : "");
+		} else snprintf(msg, sizeof(msg), "%s=%i", Args[0], settings_get_int(key));
+	} else if (Type == eccSetOption) {
+		/* A value may have several words, like the one of the APN */
+		value[0] = '\0';
+		for (size_t i = 1; i < ArgCount; ++i) {
+			snprintf(value + len, sizeof(value) - len, "%s%s", (i > 1 ? " " : ""), Args[i]);
+			len = strlen(value);
+		}
+
+		ret = settings_set_string(key, value);
+		if (ret == EINVAL || ret == ERANGE) {
+			ret = 0;
+			strncpy(msg, "INVALID_VALUE", sizeof(msg) / sizeof(msg[0]));
+		}
+	}
+
+	if (ret == 0 && msg[0] != '\0')
+		snprintf(Reply, ReplySize, "%s", msg);
+
+	log_exit("%i, Reply=\"%s\"", ret, Reply);
+	return ret;
+}
+
+
+/* The GNSS powered up for the map warms up while the other commands are served */
+int gps_control_async_callback(PCONTROL_COMMAND_CONTEXT Context, int* More)
+{
+	int ret = 0;
+	GPS_RECORD gpsRecord;
+	PCONTROL_COMMAND_CONTEXT c = Context;
+	log_enter("Context=0x%p; More=0x%p", Context, More);
+
+	CO_BEGIN(&c->Co);
+	ret = command_gnss_status(c->SerialFD, &c->GnssStatus);
+	if (ret != 0) {
+		log_error("Unable to get GNSS status: %i", ret);
+		CO_RETURN(&c->Co);
+	}
+
+	if (!c->GnssStatus) {
+		ret = command_gnss_enable(c->SerialFD, 1);
+		if (ret != 0) {
+			log_error("Unable to enable GNSS: %i", ret);
+			CO_RETURN(&c->Co);
+		}
+
+		arbiter_sleep(GNSS_WARM_UP);
+		CO_YIELD(&c->Co);
+	}
+
+	ret = command_gnss_info(c->SerialFD, &gpsRecord);
+	if (ret != 0)
+		log_error("Unable to get GNSS location: %i", ret);
+
+	if (ret == 0 && gpsRecord.FixStatus == 1) {
+		control_fix_update(c->SerialFD, &gpsRecord);
+		snprintf(c->Reply, c->ReplySize, "https://mapy.cz/zakladni?x=%lf&y=%lf", gpsRecord.Longitude, gpsRecord.Lattitude);
+		command_gnss_info_free(&gpsRecord);
+	}
+
+	if (!c->GnssStatus) {
+		ret = command_gnss_enable(c->SerialFD, 0);
+		if (ret != 0)
+			log_error("Unable to disable GNSS: %i", ret);
 	}
 
-	log_exit("%i, *SendResult=%i", ret, *SendResult);
+	CO_END(&c->Co);
+	*More = CO_RUNNING(&c->Co);
+
+	log_exit("%i, *More=%i", ret, *More);
+	return ret;
+}
+
+
+/* An AT command of the attach or detach per step */
+int gprs_control_async_callback(PCONTROL_COMMAND_CONTEXT Context, int* More)
+{
+	int ret = 0;
+	int connect = 0;
+	PCONTROL_COMMAND_CONTEXT c = Context;
+	log_enter("Context=0x%p; More=0x%p", Context, More);
+
+	connect = (c->Type == eccGPRSOn);
+	CO_BEGIN(&c->Co);
+	CO_AWAIT(&c->Co, &c->Step, ret = command_gprs_connect_step(&c->Step, c->SerialFD, connect));
+	if (ret == 0)
+		settings_set_int(skGprs, connect);
+
+	CO_END(&c->Co);
+	*More = CO_RUNNING(&c->Co);
+
+	log_exit("%i, *More=%i", ret, *More);
 	return ret;
 }
 
@@ -358,17 +545,18 @@ static CONTROL_COMMAND _ccs[] = {
 	{eccStatus, "#status", 0, status_sms_callback, 0},
 	{eccGPSOn, "#gpson", 0, gps_control_sms_callback, CONTROL_FLAG_SAVE_SETTINGS  | CONTROL_FLAG_AUTH_REQUIRED},
 	{eccGPSOff, "#gpsoff", 0, gps_control_sms_callback, CONTROL_FLAG_SAVE_SETTINGS  | CONTROL_FLAG_AUTH_REQUIRED},
-	{eccMap, "#map", 0, gps_control_sms_callback, CONTROL_FLAG_AUTH_REQUIRED},
+	{eccMap, "#map", 0, NULL, CONTROL_FLAG_AUTH_REQUIRED, gps_control_async_callback},
 	{eccFence, "#fence", 1, gps_control_sms_callback, CONTROL_FLAG_SAVE_SETTINGS  | CONTROL_FLAG_AUTH_REQUIRED},
 	{eccVersion, "#ver", 0, status_sms_callback, 0},
 	{eccSMS, "#sms", 2, NULL, CONTROL_FLAG_AUTH_REQUIRED},
 	{eccChangePassword, "#pass", 2, account_sms_callback, CONTROL_FLAG_SAVE_ACCOUNTS | CONTROL_FLAG_AUTH_REQUIRED},
 	{eccReboot, "#reboot", 0, NULL, CONTROL_FLAG_AUTH_REQUIRED},
-	{eccGetOption, "#getopt", 1, NULL, CONTROL_FLAG_AUTH_REQUIRED},
-	{eccSetOption, "#setopt", 2, NULL, CONTROL_FLAG_SAVE_SETTINGS  | CONTROL_FLAG_AUTH_REQUIRED},
+	{eccGetOption, "#getopt", 1, option_sms_callback, CONTROL_FLAG_AUTH_REQUIRED},
+	{eccSetOption, "#setopt", 2, option_sms_callback, CONTROL_FLAG_SAVE_SETTINGS  | CONTROL_FLAG_AUTH_REQUIRED},
 	{eccAPN, "#apn", 2, gprs_control_sms_callback, CONTROL_FLAG_SAVE_SETTINGS  | CONTROL_FLAG_AUTH_REQUIRED},
-	{eccGPRSOn, "#gprson", 0, gprs_control_sms_callback, CONTROL_FLAG_SAVE_SETTINGS  | CONTROL_FLAG_AUTH_REQUIRED},
-	{eccGPRSOff, "#gprsoff", 0, gprs_control_sms_callback, CONTROL_FLAG_SAVE_SETTINGS  | CONTROL_FLAG_AUTH_REQUIRED},
+	{eccGPRSOn, "#gprson", 0, NULL, CONTROL_FLAG_SAVE_SETTINGS  | CONTROL_FLAG_AUTH_REQUIRED, gprs_control_async_callback},
+	{eccGPRSOff, "#gprsoff", 0, NULL, CONTROL_FLAG_SAVE_SETTINGS  | CONTROL_FLAG_AUTH_REQUIRED, gprs_control_async_callback},
+	{eccDump, "#dump", 0, status_sms_callback, CONTROL_FLAG_AUTH_REQUIRED},
 };
 
 
@@ -393,107 +581,381 @@ const CONTROL_COMMAND* control_command(const char *Command)
 }
 
 
-static int _sms_process(int SerialFD, const SMS_MESSAGE* Msg)
+/* The first word of the command names a flow of several steps */
+static int _sms_command_async(const char* Command)
+{
+	char name[32];
+	const CONTROL_COMMAND* cc = NULL;
+
+	snprintf(name, sizeof(name), "%.*s", (int)strcspn(Command, " "), Command);
+	cc = control_command(name);
+
+	return (cc != NULL && cc->AsyncCallback != NULL);
+}
+
+
+/*
+ * Runs the command, or a step of it when it is asynchronous; *More is set
+ * until its last step is done. The reply goes to Session->Part.
+ */
+static int _sms_command_execute(PGPS_SMS_SESSION Session, const char* Command, int* More)
 {
 	int ret = 0;
 	int loggedIn = 0;
-	int sendResult = 0;
-	char** arr = NULL;
-	size_t arrSize = 0;
+	int done = 0;
+	int bypass = 0;
 	const CONTROL_COMMAND* cc = NULL;
-	log_enter("SerialFD=%i; Msg=0x%p", SerialFD, Msg);
+	char* reply = Session->Part;
+	size_t replySize = sizeof(Session->Part);
+	log_enter("Session=0x%p; Command=\"%s\"; More=0x%p", Session, Command, More);
+
+	cc = Session->Control;
+	if (cc == NULL) {
+		memset(reply, 0, replySize);
+		/* A flow keeps its arguments through several events */
+		bypass = arena_bypass(1);
+		ret = field_array_get(Command, ' ', &Session->Args, &Session->ArgCount);
+		arena_bypass(bypass);
+		if (ret != 0) {
+			log_error("Unable to get SMS arguments: %i", ret);
+			goto Exit;
+		}
 
-	ret = field_array_get(Msg->Text, ' ', &arr, &arrSize);
-	if (ret == 0) {
-		if (arrSize == 0) {
+		if (Session->ArgCount == 0) {
 			ret = -1;
-			log_error("SHS contains no argument");
+			log_error("SMS command contains no argument");
 		}
 
 		if (ret == 0) {
-			cc = control_command(arr[0]);
+			cc = control_command(Session->Args[0]);
 			if (cc == NULL) {
 				ret = -2;
-				log_error("Unknown command \"%s\"", arr[0]);
+				log_error("Unknown command \"%s\"", Session->Args[0]);
+				/* Text not meant for the tracker gets no reply by SMS */
+				if (Session->Phone == NULL)
+					snprintf(reply, replySize, "UNKNOWN_COMMAND");
 			}
 		}
 
 		if (ret == 0) {
-			if (cc->Callback != NULL) {
-				if (cc->ArgCount <= arrSize - 1) {
-					sendResult = 1;
-					ret = account_logged_in(Msg->PhoneNumber, &loggedIn);
-					if (ret == ENOENT) {
-						loggedIn = 0;
-						ret = 0;
-					}
+			if (cc->Callback == NULL && cc->AsyncCallback == NULL)
+				snprintf(reply, replySize, "NOT_IMPLEMENTED");
+			else if (cc->ArgCount > Session->ArgCount - 1)
+				snprintf(reply, replySize, "NOT_ENOUGH_ARGUMENTS");
+			else if (Session->Phone == NULL && cc->Callback == account_sms_callback)
+				snprintf(reply, replySize, "NOT_SUPPORTED");
+			else {
+				/* The permissions of the control socket keep the others out, its clients are logged in */
+				loggedIn = 1;
+				if (Session->Phone != NULL)
+					ret = account_logged_in(Session->Phone, _device_index(Session->SerialFD), &loggedIn);
+
+				if (ret == ENOENT) {
+					loggedIn = 0;
+					ret = 0;
+				}
 
-					if (ret == 0 && (cc->Flags & CONTROL_FLAG_AUTH_REQUIRED) != 0 && !loggedIn) {
-						sendResult = 0;
-						ret = command_sms_send(SerialFD, Msg->PhoneNumber, "NOT_AUTHENTICATED");
+				if (ret == 0) {
+					if ((cc->Flags & CONTROL_FLAG_AUTH_REQUIRED) != 0 && !loggedIn)
+						snprintf(reply, replySize, "NOT_AUTHENTICATED");
+					else if (cc->AsyncCallback != NULL) {
+						memset(&Session->Context, 0, sizeof(Session->Context));
+						CO_INIT(&Session->Context.Co);
+						Session->Context.SerialFD = Session->SerialFD;
+						Session->Context.Phone = Session->Phone;
+						Session->Context.Type = cc->Type;
+						Session->Context.Args = Session->Args + 1;
+						Session->Context.ArgCount = Session->ArgCount - 1;
+						Session->Context.Reply = reply;
+						Session->Context.ReplySize = replySize;
+						Session->Control = cc;
+					} else {
+						ret = cc->Callback(Session->SerialFD, Session->Phone, cc->Type, Session->Args + 1, Session->ArgCount - 1, reply, replySize);
+						done = 1;
 					}
-
-					if (ret == 0)
-						ret = cc->Callback(SerialFD, Msg->PhoneNumber, cc->Type, arr + 1, arrSize - 1, &sendResult);
-				} else {
-					sendResult = 0;
-					ret = command_sms_send(SerialFD, Msg->PhoneNumber, "NOT_ENOUGH_ARGUMENTS");
 				}
+			}
+		}
+	}
+
+	if (Session->Control != NULL) {
+		ret = cc->AsyncCallback(&Session->Context, More);
+		if (ret == 0 && *More)
+			goto Exit;
+
+		*More = 0;
+		Session->Control = NULL;
+		done = 1;
+	}
+
+	if (done && reply[0] == '\0') {
+		if (ret == 0)
+			snprintf(reply, replySize, "OK");
+		else snprintf(reply, replySize, "ERROR: %i", ret);
+	}
+
+	field_array_free(Session->Args, Session->ArgCount);
+	Session->Args = NULL;
+	Session->ArgCount = 0;
+Exit:
+	log_exit("%i, Reply=\"%s\", *More=%i", ret, reply, *More);
+	return ret;
+}
+
+
+static void _sms_session_free(void* Context)
+{
+	PGPS_SMS_SESSION s = (PGPS_SMS_SESSION)Context;
+
+	if (s->Args != NULL)
+		field_array_free(s->Args, s->ArgCount);
+
+	if (s->Commands != NULL)
+		field_array_free(s->Commands, s->CommandCount);
+
+	free(s->Text);
+	free(s->Phone);
+	free(s);
+
+	return;
+}
+
+
+/*
+ * Runs the commands of the SMS in order and sends the reply after the last
+ * one. A flow yielding ends the chunk, so the flows of several messages
+ * interleave on the control channel.
+ */
+static int _sms_session_job(void* Context, int* More)
+{
+	int ret = 0;
+	int more = 0;
+	PGPS_SMS_SESSION s = NULL;
+	log_enter("Context=0x%p; More=0x%p", Context, More);
+
+	s = (PGPS_SMS_SESSION)Context;
+	for (; s->Current < s->CommandCount; ++s->Current) {
+		char* cmd = s->Commands[s->Current];
+		char* cmdEnd = NULL;
+
+		while (*cmd == ' ' || *cmd == '\t')
+			++cmd;
+
+		cmdEnd = cmd + strlen(cmd);
+		while (cmdEnd != cmd && (cmdEnd[-1] == ' ' || cmdEnd[-1] == '\t'))
+			--cmdEnd;
+
+		*cmdEnd = '\0';
+		if (*cmd == '\0')
+			continue;
+
+		/* The flow starts from the arbiter, so it can sleep */
+		if (s->Inline && _sms_command_async(cmd)) {
+			*More = 1;
+			goto Exit;
+		}
+
+		more = 0;
+		ret = _sms_command_execute(s, cmd, &more);
+		if (ret != 0)
+			s->Result = ret;
+
+		ret = 0;
+		if (more) {
+			*More = 1;
+			goto Exit;
+		}
+
+		if (s->Part[0] != '\0') {
+			/* Whole outputs only, a cut one could read as a different value */
+			if (s->ReplyLength + 1 + strlen(s->Part) < sizeof(s->Reply)) {
+				snprintf(s->Reply + s->ReplyLength, sizeof(s->Reply) - s->ReplyLength, "%s%s", (s->ReplyLength > 0 ? "\n" : ""), s->Part);
+				s->ReplyLength = strlen(s->Reply);
 			} else {
-				sendResult = 0;
-				ret = command_sms_send(SerialFD, Msg->PhoneNumber, "NOT_IMPLEMENTED");
+				log_warning("Reply to %s is full, dropping the output of %s", (s->Phone != NULL) ? s->Phone : "the control client", cmd);
+				s->Result = E2BIG;
 			}
 		}
+	}
 
-		if (sendResult) {
-			char retMsg[60];
+	if (s->Phone == NULL) {
+		ret = control_reply(&s->Request, s->Result, s->Reply);
+		if (ret != 0)
+			log_error("Unable to answer control client %lu: %i", s->Request.Client, ret);
+	} else if (s->Reply[0] != '\0') {
+		ret = command_sms_send(s->SerialFD, s->Phone, s->Reply);
+		if (ret != 0)
+			log_error("Unable to send response: %i", ret);
+	}
 
-			memset(retMsg, 0, sizeof(retMsg));
-			if (ret == 0)
-				strncpy(retMsg, "OK", sizeof(retMsg));
-			else snprintf(retMsg, sizeof(retMsg), "ERROR: %i", ret);
-			
-			ret = command_sms_send(SerialFD, Msg->PhoneNumber, retMsg);
-			if (ret != 0)
-				log_error("Unable to send response: %i", ret);
+Exit:
+	log_exit("%i, *More=%i", ret, *More);
+	return ret;
+}
+
+
+static int _sms_process(int SerialFD, const SMS_MESSAGE* Msg, void* Context)
+{
+	int ret = 0;
+	int quotes = 0;
+	int more = 0;
+	int bypass = 0;
+	PGPS_SMS_SESSION s = NULL;
+	log_enter("SerialFD=%i; Msg=0x%p; Context=0x%p", SerialFD, Msg, Context);
+
+	flight_recorder_event("sms");
+	if (Msg->Binary) {
+		log_info("Ignoring binary SMS from %s (%zu bytes)", Msg->PhoneNumber, Msg->TextLength);
+		goto Exit;
+	}
+
+	s = calloc(1, sizeof(GPS_SMS_SESSION));
+	if (s == NULL) {
+		ret = ENOMEM;
+		goto Exit;
+	}
+
+	s->SerialFD = SerialFD;
+	s->Phone = strdup(Msg->PhoneNumber);
+	s->Text = strdup(Msg->Text);
+	if (s->Phone == NULL || s->Text == NULL)
+		ret = ENOMEM;
+
+	if (ret == 0) {
+		for (char* tmp = s->Text; *tmp != '\0'; ++tmp) {
+			if (*tmp == '"')
+				quotes = !quotes;
+			else if (!quotes && (*tmp == '\r' || *tmp == '\n'))
+				*tmp = CONTROL_COMMAND_SEPARATOR;
 		}
 
-		ret = command_sms_delete(SerialFD, Msg->Index, smsdtNormal);
+		/* The session may outlive the event */
+		bypass = arena_bypass(1);
+		ret = field_array_get(s->Text, CONTROL_COMMAND_SEPARATOR, &s->Commands, &s->CommandCount);
+		arena_bypass(bypass);
 		if (ret != 0)
-			log_error("Unable to delete SMS on index %i: %i", Msg->Index, ret);
+			log_error("Unable to split SMS commands: %i", ret);
+	}
+
+	/* Commands run at once up to the first flow, the arbiter runs the rest */
+	if (ret == 0) {
+		s->Inline = 1;
+		ret = _sms_session_job(s, &more);
+		s->Inline = 0;
+	}
+
+	if (ret == 0 && more) {
+		ret = arbiter_submit(apInteractive, "sms-commands", _sms_session_job, s, _sms_session_free);
+		if (ret == 0)
+			s = NULL;
+		else log_error("Unable to queue the SMS commands: %i", ret);
+	}
+
+	if (s != NULL)
+		_sms_session_free(s);
+
+Exit:
+	log_exit("%i", ret);
+	return ret;
+}
 
-		field_array_free(arr, arrSize);
-	} else log_error("Unable to get SMS arguments: %i", ret);
 
-	log_exit("%i");
+/* A command of the control socket runs like the ones of an SMS, Context are the devices */
+static int _control_request(const CONTROL_REQUEST* Request, void* Context)
+{
+	int ret = 0;
+	int bypass = 0;
+	PGPS_DEVICE device = NULL;
+	PGPS_SMS_SESSION s = NULL;
+	log_enter("Request=0x%p; Context=0x%p", Request, Context);
+
+	device = (PGPS_DEVICE)Context + Request->Device;
+	if (!device->Open) {
+		ret = ENODEV;
+		goto Exit;
+	}
+
+	s = calloc(1, sizeof(GPS_SMS_SESSION));
+	if (s == NULL) {
+		ret = ENOMEM;
+		goto Exit;
+	}
+
+	s->SerialFD = device->SerialFD;
+	s->Request = *Request;
+	s->Text = strdup(Request->Command);
+	if (s->Text == NULL)
+		ret = ENOMEM;
+
+	if (ret == 0) {
+		bypass = arena_bypass(1);
+		ret = field_array_get(s->Text, CONTROL_COMMAND_SEPARATOR, &s->Commands, &s->CommandCount);
+		arena_bypass(bypass);
+	}
+
+	/* Called from the idle wait, the commands wait for the arbiter like the ones of a URC */
+	if (ret == 0) {
+		ret = arbiter_submit(apInteractive, "control", _sms_session_job, s, _sms_session_free);
+		if (ret == 0)
+			s = NULL;
+	}
+
+	if (s != NULL)
+		_sms_session_free(s);
+
+Exit:
+	log_exit("%i", ret);
 	return ret;
 }
 
 
+static int _sms_job(void* Context, int* More)
+{
+	int ret = 0;
+	PGPS_SMS_JOB job = NULL;
+	log_enter("Context=0x%p; More=0x%p", Context, More);
+
+	job = (PGPS_SMS_JOB)Context;
+	ret = inbox_notify(&job->Device->Inbox, job->Device->SerialFD, job->Storage, job->Index, _sms_process, NULL);
+	if (ret == EAGAIN) {
+		ret = 0;
+		log_info("SMS on index %i is a part of an incomplete message", job->Index);
+	} else if (ret != 0)
+		log_error("Unable to handle SMS on index %i: %i", job->Index, ret);
+
+	log_exit("%i, *More=%i", ret, *More);
+	return ret;
+}
+
+
+/* The line may arrive in the middle of another command, the message is read once the arbiter gets to it */
 static int _notify_callback(const char* Line, void* Context)
 {
 	int ret = 0;
 	size_t len = 0;
 	char** arr = NULL;
 	size_t arrSize = 0;
-	int smsIndex = 0;
-	int serialFD = -1;
-	SMS_MESSAGE msg;
+	PGPS_SMS_JOB job = NULL;
 	log_enter("Line=0x%p; Context=0x%p", Line, Context);
 
-	serialFD = (int)Context;
 	len = strlen("+CMTI: ");
 	if (strlen(Line) >= len && memcmp(Line, "+CMTI: ", sizeof("+CMTI: ") - 1) == 0) {
 		Line += len;
 		ret = field_array_get(Line, ',', &arr, &arrSize);
 		if (ret == 0) {
 			if (arrSize >= 2) {
-				smsIndex = atoi(arr[1]);
-				log_info("New message: Storage = %s, index = %i", arr[0], smsIndex);
-				ret = command_sms_read(serialFD, smsIndex, &msg);
-				if (ret == 0)
-					_sms_process(serialFD, &msg);
-				else log_error("Unable to read SMS on index %i: %i", smsIndex, ret);
+				job = malloc(sizeof(GPS_SMS_JOB));
+				if (job != NULL) {
+					job->Device = (PGPS_DEVICE)Context;
+					snprintf(job->Storage, sizeof(job->Storage), "%s", arr[0]);
+					job->Index = atoi(arr[1]);
+					log_info("New message: Storage = %s, index = %i", job->Storage, job->Index);
+					ret = arbiter_submit(apInteractive, "sms", _sms_job, job, free);
+					if (ret != 0) {
+						log_error("Unable to queue SMS on index %i: %i", job->Index, ret);
+						free(job);
+					}
+				} else ret = ENOMEM;
 			} else log_error("No SMS index present", );
 
 			field_array_free(arr, arrSize);
@@ -505,224 +967,944 @@ static int _notify_callback(const char* Line, void* Context)
 }
 
 
-int main(int argc, char **argv)
+/* State kept in the settings: the first device uses the plain key, device N the key with ".N" */
+static const char* _device_key(const GPS_DEVICE* Device, const char* Name, char* Key, size_t Size)
 {
-	int ret = 0;
-	int serialFD = 0;
-
-	ret = line_buffer_init();
-	if (ret != 0) {
-		log_error("Unable to initialize Line Buffer: %i", ret);
-		return ret;
-	}
+	if (Device->Index == 0)
+		snprintf(Key, Size, "%s", Name);
+	else snprintf(Key, Size, "%s.%zu", Name, Device->Index);
 
-	ret = process_command_line(argc, argv);
-	if (ret == 0)
-		ret = accounts_init();
+	return Key;
+}
 
-	if (ret == 0) {
-		int baudrate = 0;
-		char* dn = NULL;
 
-		settings_print(stderr);
-		ret = settings_value_get_string("device", 0, &dn, "/dev/ttyS0");
-		if (ret == 0)
-			ret = settings_value_get_int("baudrate", 0, &baudrate, 115200);
+/* A shorter period takes effect right away instead of after the current countdown */
+static int _period_changed(ESettingsKey Key, void* Context)
+{
+	int ret = 0;
+	int period = 0;
+	int* countdown = NULL;
+	log_enter("Key=%u; Context=0x%p", Key, Context);
 
-		if (ret == 0)
-			ret = serial_open(dn, baudrate, &serialFD);
-		
-		if (ret == 0) {
-			int pinRequired = 0;
-			PSMS_MESSAGE msgs = NULL;
-			size_t msgCount = 0;
-
-			ret = command_pin_required(serialFD, &pinRequired);
-			if (ret == 0 && pinRequired) {
-				char* pin = NULL;
-
-				fprintf(stderr, "PIN is required\n");
-				ret = settings_value_get_string("pin", 0, &pin, NULL);
-				if (ret != 0) {
-					ret = -1;
-					fprintf(stderr, "PIN not specified (use -p <string>)\n");
-				}
+	countdown = (int*)Context;
+	period = settings_get_int(Key);
+	if (*countdown > period)
+		*countdown = period;
 
-				if (ret == 0) {
-					ret = command_pin_enter(serialFD, pin);
-					if (ret != 0)
-						log_error("Invalid PIN %s", pin);
-				
-					if (ret == 0)
-						sleep(10);
-				}
-			}
+	log_exit("%i", ret);
+	return ret;
+}
 
-			if (ret == 0) {
-				ret = command_set_text_mode(serialFD, 1);
-				if (ret != 0)
-					log_error("Unable to enable SMS text mode: %i", ret);
-			}
 
-			if (ret == 0) {
-				int gps = 0;
-				int gprs = 0;
+/* Each SIM has its own budget and its own smsused counter */
+static int _sms_uplink_budget(const GPS_DEVICE* Device, int* Remaining, char* Day, size_t DaySize, int* Used)
+{
+	int ret = 0;
+	int budget = 0;
+	char* usage = NULL;
+	char usageDay[16];
+	char key[64];
+	time_t now = 0;
+	struct tm t;
+	log_enter("Device=\"%s\"; Remaining=0x%p; Day=0x%p; DaySize=%zu; Used=0x%p", Device->Name, Remaining, Day, DaySize, Used);
+
+	*Used = 0;
+	now = time(NULL);
+	gmtime_r(&now, &t);
+	strftime(Day, DaySize, "%Y%m%d", &t);
+	budget = settings_get_int(skSmsBudget);
+	if (settings_value_get_string(_device_key(Device, "smsused", key, sizeof(key)), 0, &usage, NULL) != 0)
+		usage = NULL;
 
-				ret = settings_value_get_int("gps", 0, &gps, 0);
-				if (ret != 0)
-					log_error("Unable to load GNSS status: %i", ret);
+	if (ret == 0) {
+		/* smsused: <yyyyMMdd> <count>, reset on the first batch of a new day */
+		if (usage != NULL && sscanf(usage, "%15s %i", usageDay, Used) == 2 && strcmp(usageDay, Day) != 0)
+			*Used = 0;
 
-				ret = command_gnss_enable(serialFD, gps);
-				if (ret != 0)
-					log_error("Unable to set GPS state: %i", ret);
-			
-				ret = settings_value_get_int("gprs", 0, &gprs, 0);
-				if (ret != 0)
-					log_error("Unable to load GPRS status: %i", ret);
+		*Remaining = budget - *Used;
+	}
 
-				ret = command_gprs_connect(serialFD, gprs);
-				if (ret != 0)
-					log_error("Unable to set GPRS state: %i", ret);
-			}
+	log_exit("%i, *Remaining=%i, *Used=%i", ret, *Remaining, *Used);
+	return ret;
+}
 
-			{
-				char* cf = NULL;
 
-				ret = settings_value_get_int("gpsperiod", 0, &_gpsPeriod, 30);
-				if (ret != 0) {
-					_gpsPeriod = 30;
-					log_error("Unable to get GPS period: %i", ret);
-				}
+/* One SMS of the track per call, *More is set while there are fixes and budget left */
+static int _sms_uplink_chunk(const GPS_DEVICE* Device, int* More)
+{
+	int ret = 0;
+	int remaining = 0;
+	int used = 0;
+	char day[16];
+	char usage[64];
+	char locKey[64];
+	char usedKey[64];
+	const char* phone = NULL;
+	char** values = NULL;
+	size_t valueCount = 0;
+	size_t pointCount = 0;
+	size_t encoded = 0;
+	size_t length = 0;
+	TRACK_POINT points[SMS_UPLINK_BATCH_MAX];
+	unsigned char data[PDU_USER_DATA_OCTETS];
+	log_enter("Device=\"%s\"; More=0x%p", Device->Name, More);
+
+	*More = 0;
+	phone = settings_get_string(skSmsUplink);
+	if (phone == NULL)
+		goto Exit;
+
+	_device_key(Device, "loc", locKey, sizeof(locKey));
+	_device_key(Device, "smsused", usedKey, sizeof(usedKey));
+	ret = _sms_uplink_budget(Device, &remaining, day, sizeof(day), &used);
+	while (ret == 0 && remaining > 0) {
+		ret = settings_values_enum(locKey, &values, &valueCount);
+		if (ret == ENOENT || (ret == 0 && valueCount == 0)) {
+			ret = 0;
+			break;
+		}
 
-				ret = settings_value_get_int("syncperiod", 0, &_syncPeriod, 300);
-				if (ret != 0) {
-					_syncPeriod = 300;
-					log_error("Unable to get sync period: %i", ret);
-				}
+		if (ret != 0)
+			break;
 
-				ret = settings_value_get_string("logfile", 0, &cf, "gpsapp.log");
-				if (ret != 0)
-					log_error("Unable to set log file: %i", ret);
+		/* Oldest fixes first, invalid records are dropped */
+		pointCount = 0;
+		for (size_t i = 0; i < valueCount && pointCount < SMS_UPLINK_BATCH_MAX; ++i) {
+			if (track_point_parse(values[i], points + pointCount) != 0) {
+				log_warning("Dropping invalid location record \"%s\"", values[i]);
+				settings_values_free(values, valueCount);
+				values = NULL;
+				ret = settings_value_delete(locKey, i);
+				break;
+			}
 
-				ret = settings_value_get_string("gpsfile", 0, &cf, "gpsapp.gps");
-				if (ret != 0)
-					log_error("Unable to set GPS file: %i", ret);
+			++pointCount;
+		}
 
-				ret = settings_save(_configFile, ':');
-				if (ret != 0)
-					log_error("Unable to save the settings: %i", ret);
+		if (values == NULL)
+			continue;
+
+		settings_values_free(values, valueCount);
+		ret = track_encode(points, pointCount, data, sizeof(data), &length, &encoded);
+		if (ret == 0)
+			ret = command_sms_send_binary(Device->SerialFD, phone, data, length);
+
+		if (ret == 0) {
+			log_info("%zu locations sent via SMS (%zu bytes)", encoded, length);
+			for (size_t i = 0; i < encoded; ++i)
+				settings_value_delete(locKey, 0);
+
+			++used;
+			--remaining;
+			snprintf(usage, sizeof(usage), "%s %i", day, used);
+			ret = settings_value_set_string(usedKey, 0, usage);
+			/* The counter guards a paid budget, do not wait for the next periodic flush */
+			if (ret == 0)
+				ret = settings_flush(_configFile, ':', 1);
+
+			*More = (ret == 0);
+			break;
+		}
+	}
+
+	if (ret == 0 && remaining <= 0) {
+		*More = 0;
+		log_info("Daily SMS budget exhausted");
+	}
+
+Exit:
+	log_exit("%i, *More=%i", ret, *More);
+	return ret;
+}
+
+
+/* Attaching takes seconds, a modem still in the wanted state since the previous run is left alone */
+static int _gprs_apply(int SerialFD)
+{
+	int ret = 0;
+	int connected = -1;
+	int wanted = 0;
+	log_enter("SerialFD=%i", SerialFD);
+
+	wanted = settings_get_int(skGprs);
+	ret = command_gprs_connected(SerialFD, &connected);
+	if (ret != 0 || connected != wanted) {
+		if (wanted) {
+			ret = command_ready_wait(SerialFD, MODEM_READY_NETWORK, MODEM_READY_TIMEOUT, NULL);
+			if (ret != 0)
+				log_warning("Not registered to the network within %i seconds", MODEM_READY_TIMEOUT);
+		}
+
+		ret = command_gprs_connect(SerialFD, wanted);
+	}
+
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+/* AT+IPR rates of the SIM800 worth stepping up to, fastest first */
+static const int _baudRates[] = {
+	460800,
+	230400,
+	115200,
+	57600,
+	38400,
+	19200,
+};
+
+
+/* The first command after a switch may meet the modem still switching */
+static int _baud_rate_verify(int SerialFD)
+{
+	int ret = 0;
+
+	ret = command_ping(SerialFD);
+	if (ret != 0)
+		ret = command_ping(SerialFD);
+
+	return ret;
+}
+
+
+static int _baud_rate_try(int SerialFD, int Safe, int Rate)
+{
+	int ret = 0;
+	log_enter("SerialFD=%i; Safe=%i; Rate=%i", SerialFD, Safe, Rate);
+
+	ret = command_baud_rate_set(SerialFD, Rate);
+	if (ret == 0) {
+		ret = serial_rate_set(SerialFD, Rate);
+		if (ret == 0)
+			ret = _baud_rate_verify(SerialFD);
+
+		if (ret != 0) {
+			log_warning("No answer at %i baud, going back to %i", Rate, Safe);
+			/* The request may get through even when the answers do not */
+			command_baud_rate_set(SerialFD, Safe);
+			serial_rate_set(SerialFD, Safe);
+			if (_baud_rate_verify(SerialFD) != 0)
+				log_error("No answer at %i baud either", Safe);
+		}
+	}
+
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+/*
+ * The port opens at baudrate, the modem is then asked for the fastest
+ * rate up to maxbaudrate it accepts and answers at. modembaudrate keeps
+ * the result, so a restart after a crash finds the modem at that rate.
+ */
+static int _baud_rate_negotiate(const GPS_DEVICE* Device)
+{
+	int ret = 0;
+	int safe = 0;
+	int max = 0;
+	int current = 0;
+	char key[64];
+	log_enter("Device=\"%s\"", Device->Name);
+
+	safe = settings_get_int(skBaudRate);
+	max = settings_get_int(skMaxBaudRate);
+	_device_key(Device, "modembaudrate", key, sizeof(key));
+	if (settings_value_get_int(key, 0, &current, 0) != 0)
+		current = 0;
+
+	if (current != 0 && current != safe && command_ping(Device->PortFD) != 0) {
+		ret = serial_rate_set(Device->PortFD, current);
+		if (ret == 0)
+			ret = _baud_rate_verify(Device->PortFD);
+
+		if (ret == 0 && current <= max) {
+			log_info("The modem still runs at %i baud", current);
+			goto Exit;
+		}
+
+		if (ret == 0)
+			command_baud_rate_set(Device->PortFD, safe);
+
+		ret = serial_rate_set(Device->PortFD, safe);
+	}
+
+	current = safe;
+	for (size_t i = 0; ret == 0 && i < sizeof(_baudRates) / sizeof(_baudRates[0]); ++i) {
+		if (_baudRates[i] > max || _baudRates[i] <= safe)
+			continue;
+
+		if (_baud_rate_try(Device->PortFD, safe, _baudRates[i]) == 0) {
+			current = _baudRates[i];
+			log_info("Switched to %i baud", current);
+			break;
+		}
+	}
+
+	settings_value_set_int(key, 0, (current != safe) ? current : 0);
+Exit:
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+/* The next start opens at baudrate again, so the modem goes back to it */
+static void _baud_rate_restore(const GPS_DEVICE* Device)
+{
+	int safe = 0;
+	int current = 0;
+	char key[64];
+	log_enter("Device=\"%s\"", Device->Name);
+
+	safe = settings_get_int(skBaudRate);
+	_device_key(Device, "modembaudrate", key, sizeof(key));
+	if (settings_value_get_int(key, 0, &current, 0) == 0 && current != 0 &&
+		command_baud_rate_set(Device->PortFD, safe) == 0 && serial_rate_set(Device->PortFD, safe) == 0)
+		settings_value_set_int(key, 0, 0);
+
+	log_exit("void");
+	return;
+}
+
+
+/* Plain AT commands on the port stay in place when the modem refuses CMUX */
+static void _mux_open(PGPS_DEVICE Device)
+{
+	int ret = 0;
+	int rate = 0;
+	int* channels = Device->Channels;
+	char key[64];
+	log_enter("Device=\"%s\"", Device->Name);
+
+	if (settings_value_get_int(_device_key(Device, "modembaudrate", key, sizeof(key)), 0, &rate, 0) != 0 || rate == 0)
+		rate = settings_get_int(skBaudRate);
+
+	ret = command_mux_enable(Device->PortFD, rate);
+	if (ret == 0)
+		ret = serial_mux_open(Device->PortFD, GPS_CHANNELS, channels);
+
+	if (ret == 0)
+		log_info("%s: CMUX control %i, GNSS %i, data %i", Device->Name, channels[GPS_CHANNEL_CONTROL], channels[GPS_CHANNEL_GNSS], channels[GPS_CHANNEL_DATA]);
+	else {
+		log_warning("%s: unable to start CMUX, staying with a single channel: %i", Device->Name, ret);
+		for (int i = 0; i < GPS_CHANNELS; ++i)
+			channels[i] = Device->PortFD;
+	}
+
+	log_exit("void");
+	return;
+}
+
+
+static unsigned long _log_file_types(void)
+{
+	unsigned long ret = 0;
+
+	if (settings_get_int(skLogError))
+		ret |= (1 << ltError);
+
+	if (settings_get_int(skLogWarning))
+		ret |= (1 << ltWarning);
+
+	if (settings_get_int(skLogTrace))
+		ret |= (1 << ltTrace);
+
+	if (settings_get_int(skLogInfo))
+		ret |= (1 << ltInfo);
+
+	return ret;
+}
+
+
+static void _on_terminate(int Signal)
+{
+	_terminate = 1;
+	arbiter_stop();
+
+	return;
+}
+
+
+static void _on_reload(int Signal)
+{
+	_reload = 1;
+
+	return;
+}
+
+
+static void _on_dump(int Signal)
+{
+	_dump = 1;
+
+	return;
+}
+
+
+/* Applies only what changed to every modem; the countdowns follow through the period callbacks */
+static int _config_reload(PGPS_DEVICE Devices, size_t Count, int Force)
+{
+	int ret = 0;
+	int err = 0;
+	int changed[skMax];
+	log_enter("Devices=0x%p; Count=%zu; Force=%i", Devices, Count, Force);
+
+	ret = settings_reload(Force, changed);
+	if (ret == 0) {
+		for (size_t i = 0; i < Count; ++i) {
+			PGPS_DEVICE d = Devices + i;
+
+			if (!d->Open)
+				continue;
+
+			if (changed[skSmsMode]) {
+				err = command_set_text_mode(d->SerialFD, strcmp(settings_get_string(skSmsMode), "text") == 0);
+				if (err != 0)
+					log_error("%s: unable to set SMS mode: %i", d->Name, err);
 			}
 
-			ret = line_callback_register(_notify_callback, (void *)serialFD, &_notifyCallbackHandle);
-			if (ret == 0) {
-				ret = command_sms_list(serialFD, "ALL", &msgs, &msgCount);
-				if (ret != 0)
-					log_error("Unable to list SMS messages: %i", ret);
+			if (changed[skGps]) {
+				err = command_gnss_enable(d->GnssFD, settings_get_int(skGps));
+				if (err != 0)
+					log_error("%s: unable to set GPS state: %i", d->Name, err);
+			}
 
-				if (ret == 0) {
-					fprintf(stderr, "%zu messages\n", msgCount);
-					for (size_t i = 0; i < msgCount; ++i)
-						_sms_process(serialFD, msgs + i);
+			if (changed[skGprs]) {
+				err = _gprs_apply(d->DataFD);
+				if (err != 0)
+					log_error("%s: unable to set GPRS state: %i", d->Name, err);
+			}
+		}
 
-					sms_array_free(msgs, msgCount);
-				}
+		if (changed[skAccount]) {
+			err = accounts_reload();
+			if (err != 0)
+				log_error("Unable to reload accounts: %i", err);
+		}
 
-				for (;;) {
-					int gnssStatus = 0;
-					GPS_RECORD gpsRecord;
-					int timeUnit = 10;
-
-					serial_response_wait(serialFD, timeUnit, 0, NULL, NULL);
-					if (_gpsPeriod >= timeUnit)
-						_gpsPeriod -= timeUnit;
-					else _gpsPeriod = 0;
-
-					if (_gpsPeriod == 0) {
-						ret = command_gnss_status(serialFD, &gnssStatus);
-						if (ret == 0) {
-							if (!gnssStatus) {
-								ret = command_gnss_enable(serialFD, 1);
-								if (ret != 0)
-									log_error("Unable to enable GNSS: %i", ret);
-							
-								serial_response_wait(serialFD, 60, 0, NULL, NULL);
-							}
-
-							if (ret == 0) {
-								ret = command_gnss_info(serialFD, &gpsRecord);
-								if (ret != 0)
-									log_error("Unable to get GNSS location: %i", ret);
-
-								if (ret == 0 && gpsRecord.FixStatus == 1) {
-									char msg[1024];
-
-									snprintf(msg, sizeof(msg) / sizeof(msg[0]), "%lf %lf %s", gpsRecord.Lattitude, gpsRecord.Longitude, gpsRecord.Timestamp);
-									ret = settings_value_add("loc", msg);
-									if (ret != 0)
-										log_error("Unable to remember the GPS value: %i", ret);
-
-									if (ret == 0) {
-										ret = settings_save(_configFile, ':');
-										if (ret == EINVAL)
-											ret = 0;
-
-										if (ret != 0)
-											log_error("Unable to save settings: %i", ret);
-									}
-
-									command_gnss_info_free(&gpsRecord);
-								}
-
-								if (!gnssStatus) {
-									ret = command_gnss_enable(serialFD, 0);
-									if (ret != 0)
-										log_error("Unable to disable GNSS: %i", ret);
-								}
-							}
-						} else log_error("Unable to get GNSS status: %i", ret);					
-
-						ret = settings_value_get_int("gpsperiod", 0, &_gpsPeriod, 30);
-						if (ret != 0)
-							log_error("Unable to get GPS period: %i", ret);
-					}
+		if (changed[skLogError] || changed[skLogWarning] || changed[skLogTrace] || changed[skLogInfo])
+			log_file_mask(_log_file_types());
+
+		if (changed[skDevice] || changed[skBaudRate] || changed[skPin] || changed[skLogFile] ||
+			changed[skFlightSize] || changed[skFlightRing] || changed[skFlightDump] || changed[skMetricsSocket] ||
+			changed[skLowLatency] || changed[skRtPriority] || changed[skMaxBaudRate] || changed[skCmux])
+			log_warning("Serial port, PIN, log file, flight recorder and metrics socket changes take effect after restart");
+	} else log_error("Unable to reload %s, keeping the current settings: %i", _configFile, ret);
+
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+static void _device_close(PGPS_DEVICE Device)
+{
+	log_enter("Device=\"%s\"", Device->Name);
+
+	if (Device->NotifyCallbackHandle != NULL) {
+		line_callback_unregister(Device->NotifyCallbackHandle);
+		inbox_finit(&Device->Inbox);
+	}
+
+	if (Device->SyncPeriodCallbackHandle != NULL)
+		settings_callback_unregister(Device->SyncPeriodCallbackHandle);
+
+	if (Device->GpsPeriodCallbackHandle != NULL)
+		settings_callback_unregister(Device->GpsPeriodCallbackHandle);
+
+	if (Device->Open) {
+		if (settings_get_int(skCmux))
+			serial_mux_close(Device->PortFD, GPS_CHANNELS);
+
+		_baud_rate_restore(Device);
+		serial_close(Device->PortFD);
+	}
+
+	memset(Device->Channels, 0, sizeof(Device->Channels));
+	Device->NotifyCallbackHandle = NULL;
+	Device->SyncPeriodCallbackHandle = NULL;
+	Device->GpsPeriodCallbackHandle = NULL;
+	Device->Open = 0;
+
+	log_exit("void");
+	return;
+}
+
+
+/* Brings one modem up to serving commands; only a port that cannot be opened or watched fails */
+static int _device_open(PGPS_DEVICE Device, const struct timespec* Start)
+{
+	int ret = 0;
+	int first = 0;
+	int count = 0;
+	int modemBaudRate = 0;
+	int pinRequired = 0;
+	int gnssStatus = 0;
+	int ready = 0;
+	char key[64];
+	struct timespec now;
+	log_enter("Device=\"%s\"; Start=0x%p", Device->Name, Start);
+
+	ret = serial_open(Device->Name, settings_get_int(skBaudRate), &Device->PortFD);
+	if (ret != 0) {
+		log_error("Unable to open serial \"%s\": %i", Device->Name, ret);
+		goto Exit;
+	}
+
+	Device->Open = 1;
+	if (settings_get_int(skLowLatency) && serial_low_latency(Device->PortFD, settings_get_int(skRtPriority)) != 0)
+		log_warning("%s: unable to switch the serial port to low latency", Device->Name);
+
+	if (settings_value_get_int(_device_key(Device, "modembaudrate", key, sizeof(key)), 0, &modemBaudRate, 0) != 0)
+		modemBaudRate = 0;
 
-					if (_syncPeriod >= timeUnit)
-						_syncPeriod -= timeUnit;
-					else _syncPeriod = 0;
+	if ((settings_get_int(skMaxBaudRate) > settings_get_int(skBaudRate) || modemBaudRate != 0) &&
+		_baud_rate_negotiate(Device) != 0)
+		log_warning("%s: unable to negotiate a faster baud rate", Device->Name);
 
-					if (_syncPeriod == 0) {
-						int gprsEnabled = 0;
+	for (size_t i = 0; i < sizeof(Device->Channels) / sizeof(Device->Channels[0]); ++i)
+		Device->Channels[i] = Device->PortFD;
 
-						ret = command_gprs_connected(serialFD, &gprsEnabled);
-						if (ret != 0)
-							log_error("Unable to get GPRS status: %i", ret);
+	if (settings_get_int(skCmux))
+		_mux_open(Device);
 
-						if (ret == 0 && gprsEnabled) {
-							// TODO: Do the synchronization
-							ret = settings_key_delete("loc");
-							if (ret != 0)
-								log_error("Unable to delete the GPS location data: %i", ret);
-						}
+	Device->SerialFD = Device->Channels[GPS_CHANNEL_CONTROL];
+	/* The inbox is drained below, its commands look the modem up by the channel */
+	_deviceChannels[Device->Index] = Device->SerialFD + 1;
+	Device->GnssFD = Device->Channels[GPS_CHANNEL_GNSS];
+	Device->DataFD = Device->Channels[GPS_CHANNEL_DATA];
 
-						ret = settings_value_get_int("syncperiod", 0, &_syncPeriod, 300);
-						if (ret != 0)
-							log_error("Unable to get sync period: %i", ret);
+	/* GNSS does not need the SIM, powered first it looks for satellites while the SIM and network come up */
+	ret = command_gnss_status(Device->GnssFD, &gnssStatus);
+	if (ret != 0 || gnssStatus != settings_get_int(skGps)) {
+		ret = command_gnss_enable(Device->GnssFD, settings_get_int(skGps));
+		if (ret != 0)
+			log_error("%s: unable to set GPS state: %i", Device->Name, ret);
+	}
+
+	ret = command_pin_required(Device->SerialFD, &pinRequired);
+	if (ret == 0 && pinRequired) {
+		const char* pin = NULL;
+
+		fprintf(stderr, "%s: PIN is required\n", Device->Name);
+		pin = settings_get_string(skPin);
+		if (pin == NULL) {
+			ret = -1;
+			fprintf(stderr, "PIN not specified (use -p <string>)\n");
+		}
+
+		if (ret == 0) {
+			ret = command_pin_enter(Device->SerialFD, pin);
+			if (ret != 0)
+				log_error("%s: the SIM rejected the PIN: %i", Device->Name, ret);
+		}
+	}
+
+	if (ret == 0) {
+		ret = command_ready_wait(Device->SerialFD, MODEM_READY_SIM | MODEM_READY_SMS, MODEM_READY_TIMEOUT, &ready);
+		if (ret != 0) {
+			log_warning("%s: modem not ready within %i seconds (0x%x), continuing anyway", Device->Name, MODEM_READY_TIMEOUT, ready);
+			ret = 0;
+		}
+
+		flight_recorder_event("ready");
+	}
+
+	if (ret == 0) {
+		ret = command_set_text_mode(Device->SerialFD, strcmp(settings_get_string(skSmsMode), "text") == 0);
+		if (ret != 0)
+			log_error("%s: unable to set SMS mode: %i", Device->Name, ret);
+	}
+
+	Device->GpsPeriod = settings_get_int(skGpsPeriod);
+	Device->SyncPeriod = settings_get_int(skSyncPeriod);
+	ret = settings_callback_register(skGpsPeriod, _period_changed, &Device->GpsPeriod, &Device->GpsPeriodCallbackHandle);
+	if (ret == 0)
+		ret = settings_callback_register(skSyncPeriod, _period_changed, &Device->SyncPeriod, &Device->SyncPeriodCallbackHandle);
+
+	if (ret != 0)
+		log_error("%s: unable to watch period settings: %i", Device->Name, ret);
+
+	/* Every modem sees the URCs of its own channels only */
+	ret = line_callback_register(_notify_callback, Device, &Device->NotifyCallbackHandle);
+	if (ret != 0) {
+		log_error("%s: unable to register Line Buffer callback: %i", Device->Name, ret);
+		goto Exit;
+	}
+
+	serial_streams(Device->PortFD, &first, &count);
+	line_callback_filter(Device->NotifyCallbackHandle, first, count);
+	arena_enter();
+	ret = inbox_init(&Device->Inbox, Device->SerialFD);
+	if (ret == 0) {
+		ret = inbox_drain(&Device->Inbox, Device->SerialFD, _sms_process, NULL);
+		if (ret != 0)
+			log_error("%s: unable to process received SMS messages: %i", Device->Name, ret);
+	} else log_error("%s: unable to initialize SMS inbox: %i", Device->Name, ret);
+
+	arena_leave();
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	log_info("%s: serving commands %li ms after start", Device->Name, (long)((now.tv_sec - Start->tv_sec) * 1000 + (now.tv_nsec - Start->tv_nsec) / 1000000));
+	/* Attaching waits for the network registration, so it comes after the SMS commands are served */
+	ret = _gprs_apply(Device->DataFD);
+	if (ret != 0)
+		log_error("%s: unable to set GPRS state: %i", Device->Name, ret);
+
+	ret = 0;
+Exit:
+	if (ret != 0)
+		_device_close(Device);
+
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+static void _device_gps_read(PGPS_DEVICE Device)
+{
+	int ret = 0;
+	char key[64];
+	GPS_RECORD gpsRecord;
+
+	ret = command_gnss_info(Device->GnssFD, &gpsRecord);
+	if (ret != 0)
+		log_error("%s: unable to get GNSS location: %i", Device->Name, ret);
+
+	if (ret == 0 && gpsRecord.FixStatus == 1) {
+		char msg[1024];
+
+		control_fix_update(Device->SerialFD, &gpsRecord);
+		snprintf(msg, sizeof(msg) / sizeof(msg[0]), "%lf %lf %s", gpsRecord.Lattitude, gpsRecord.Longitude, gpsRecord.Timestamp);
+		ret = settings_value_add(_device_key(Device, "loc", key, sizeof(key)), msg);
+		if (ret != 0)
+			log_error("%s: unable to remember the GPS value: %i", Device->Name, ret);
+
+		command_gnss_info_free(&gpsRecord);
+	}
+
+	return;
+}
+
+
+static int _gps_read_job(void* Context, int* More)
+{
+	int ret = 0;
+	PGPS_DEVICE device = NULL;
+
+	device = (PGPS_DEVICE)Context;
+	_device_gps_read(device);
+	ret = command_gnss_enable(device->GnssFD, 0);
+	if (ret != 0)
+		log_error("%s: unable to disable GNSS: %i", device->Name, ret);
+
+	device->GpsPeriod = settings_get_int(skGpsPeriod);
+
+	return ret;
+}
+
+
+/* A GNSS found off is powered up and read by _gps_read_job once it has warmed up */
+static int _gps_job(void* Context, int* More)
+{
+	int ret = 0;
+	int gnssStatus = 0;
+	PGPS_DEVICE device = NULL;
+
+	device = (PGPS_DEVICE)Context;
+	flight_recorder_event("gps");
+	ret = command_gnss_status(device->GnssFD, &gnssStatus);
+	if (ret == 0 && !gnssStatus) {
+		ret = command_gnss_enable(device->GnssFD, 1);
+		if (ret == 0) {
+			device->GnssWarmUp = GNSS_WARM_UP;
+			return 0;
+		}
+
+		log_error("%s: unable to enable GNSS: %i", device->Name, ret);
+	} else if (ret == 0)
+		_device_gps_read(device);
+	else log_error("%s: unable to get GNSS status: %i", device->Name, ret);
+
+	device->GpsPeriod = settings_get_int(skGpsPeriod);
+
+	return ret;
+}
+
+
+/*
+ * A GNSS powered up just for the read gets GNSS_WARM_UP seconds to find
+ * satellites. The wait is counted down by the main loop instead of blocking
+ * it, so the other modems are served meanwhile.
+ */
+static void _device_gps(PGPS_DEVICE Device, int Elapsed)
+{
+	if (Device->GnssWarmUp > 0) {
+		Device->GnssWarmUp = (Device->GnssWarmUp > Elapsed) ? Device->GnssWarmUp - Elapsed : 0;
+		if (Device->GnssWarmUp == 0)
+			arbiter_submit(apTelemetry, "gnss-read", _gps_read_job, Device, NULL);
+
+		return;
+	}
+
+	if (Device->GpsPeriod >= Elapsed)
+		Device->GpsPeriod -= Elapsed;
+	else Device->GpsPeriod = 0;
+
+	/* The job restarts the countdown, a job still queued is not queued again */
+	if (Device->GpsPeriod == 0)
+		arbiter_submit(apTelemetry, "gnss", _gps_job, Device, NULL);
+
+	return;
+}
+
+
+/* Checks GPRS first, then sends one SMS of the track per chunk when it is detached */
+static int _sync_job(void* Context, int* More)
+{
+	int ret = 0;
+	int gprsEnabled = 0;
+	char key[64];
+	PGPS_DEVICE device = NULL;
+
+	device = (PGPS_DEVICE)Context;
+	if (device->SmsUplink) {
+		ret = _sms_uplink_chunk(device, More);
+		if (ret != 0)
+			log_error("%s: unable to send the GPS location data via SMS: %i", device->Name, ret);
+
+		device->SmsUplink = (ret == 0 && *More);
+		return ret;
+	}
+
+	flight_recorder_event("sync");
+	ret = command_gprs_connected(device->DataFD, &gprsEnabled);
+	if (ret != 0)
+		log_error("%s: unable to get GPRS status: %i", device->Name, ret);
+
+	if (ret == 0 && gprsEnabled) {
+		// TODO: Do the synchronization
+		ret = settings_key_delete(_device_key(device, "loc", key, sizeof(key)));
+		if (ret != 0)
+			log_error("%s: unable to delete the GPS location data: %i", device->Name, ret);
+	} else {
+		device->SmsUplink = 1;
+		*More = 1;
+	}
+
+	return ret;
+}
+
+
+static void _device_sync(PGPS_DEVICE Device, int Elapsed)
+{
+	if (Device->SyncPeriod >= Elapsed)
+		Device->SyncPeriod -= Elapsed;
+	else Device->SyncPeriod = 0;
+
+	/* The period runs from the start of the previous sync, not from the end of its upload */
+	if (Device->SyncPeriod == 0 && arbiter_submit(apBulk, "sync", _sync_job, Device, NULL) != EEXIST)
+		Device->SyncPeriod = settings_get_int(skSyncPeriod);
+
+	return;
+}
+
+
+int main(int argc, char **argv)
+{
+	int ret = 0;
+	PGPS_DEVICE devices = NULL;
+	size_t deviceCount = 0;
+	struct sigaction sa;
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* The main loop stops after the current wait and flushes the pending settings */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = _on_terminate;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sa.sa_handler = _on_reload;
+	sigaction(SIGHUP, &sa, NULL);
+	sa.sa_handler = _on_dump;
+	sigaction(SIGUSR1, &sa, NULL);
+
+	ret = line_buffer_init();
+	if (ret != 0) {
+		log_error("Unable to initialize Line Buffer: %i", ret);
+		return ret;
+	}
+
+	ret = process_command_line(argc, argv);
+	if (ret == 0) {
+		const char* logFile = settings_get_string(skLogFile);
+
+		/* Only the standard error unless a log file is configured */
+		if (logFile != NULL &&
+			log_file_open(logFile, (size_t)settings_get_int(skLogMaxSize), (size_t)settings_get_int(skMaxLogLines), _log_file_types()) != 0)
+			log_warning("Unable to open the log file %s, logging to the standard error only", logFile);
+
+		if (settings_get_int(skFlightSize) > 0 &&
+			flight_recorder_init(settings_get_string(skFlightRing), (size_t)settings_get_int(skFlightSize), settings_get_string(skFlightDump)) != 0)
+			log_warning("Unable to map the flight recorder %s", settings_get_string(skFlightRing));
+
+		if (settings_get_string(skMetricsSocket) != NULL && metrics_server_start(settings_get_string(skMetricsSocket)) != 0)
+			log_warning("Unable to serve metrics on %s", settings_get_string(skMetricsSocket));
+
+		ret = accounts_init();
+	}
+
+	if (ret == 0) {
+		settings_print(stderr);
+		/* Every "device" line is a modem of its own, the default one when there is none */
+		deviceCount = settings_get_count(skDevice);
+		if (deviceCount == 0)
+			deviceCount = 1;
+
+		if (deviceCount > GPS_DEVICES_MAX) {
+			log_warning("Serving only the first %i of %zu devices", GPS_DEVICES_MAX, deviceCount);
+			deviceCount = GPS_DEVICES_MAX;
+		}
+
+		if (deviceCount > 1 && (_recordFile != NULL || _replayFile != NULL)) {
+			log_warning("A capture covers a single modem, serving the first device only");
+			deviceCount = 1;
+		}
+
+		devices = calloc(deviceCount, sizeof(GPS_DEVICE));
+		if (devices == NULL)
+			ret = ENOMEM;
+
+		for (size_t i = 0; ret == 0 && i < deviceCount; ++i) {
+			char* name = NULL;
+
+			devices[i].Index = i;
+			if (settings_value_get_string("device", i, &name, settings_get_string(skDevice)) != 0)
+				name = (char*)settings_get_string(skDevice);
+
+			/* A reload may free the settings value */
+			devices[i].Name = strdup(name);
+			if (devices[i].Name == NULL)
+				ret = ENOMEM;
+		}
+
+		if (ret == 0 && _recordFile != NULL) {
+			ret = capture_record_open(_recordFile);
+			if (ret != 0)
+				log_error("Unable to create the capture %s: %i", _recordFile, ret);
+		} else if (ret == 0 && _replayFile != NULL) {
+			ret = capture_replay_open(_replayFile, _replayRealTime);
+			if (ret != 0)
+				log_error("Unable to load the capture %s: %i", _replayFile, ret);
+		}
+
+		if (ret == 0) {
+			int handles[GPS_DEVICES_MAX];
+			size_t handleCount = 0;
+			struct timespec last;
+			struct timespec now;
+
+			for (size_t i = 0; i < deviceCount; ++i) {
+				int err = _device_open(devices + i, &start);
+
+				if (err == 0) {
+					handles[handleCount++] = devices[i].SerialFD;
+					control_device_set(i, devices[i].SerialFD);
+				} else if (ret == 0)
+					ret = err;
+			}
+
+			/* Any modem that came up is served, the others are logged above */
+			if (handleCount > 0)
+				ret = 0;
+
+			/* A replay reads the idle waits of a capture as they were without the socket */
+			if (ret == 0 && settings_get_string(skControlSocket) != NULL) {
+				if (_recordFile != NULL || _replayFile != NULL)
+					log_warning("Not serving the control socket with a capture");
+				else if (control_server_start(settings_get_string(skControlSocket), settings_get_int(skControlMaxAge), _control_request, devices) != 0)
+					log_warning("Unable to serve control commands on %s", settings_get_string(skControlSocket));
+			}
+
+			if (ret == 0 && _configFile != NULL && config_watch_init(_configFile) != 0)
+				log_warning("Unable to watch %s, reload it by SIGHUP", _configFile);
+
+			capture_clock(&last);
+			while (ret == 0 && !_terminate) {
+				int timeUnit = 10;
+				int elapsed = 0;
+
+				/* A URC queuing a job ends the wait early, a sleeping job shortens it */
+				serial_response_wait_any(handles, handleCount, arbiter_timeout(timeUnit));
+				if (_terminate || capture_replay_done())
+					break;
+
+				/* The periods count whole seconds, however the waits were cut */
+				capture_clock(&now);
+				elapsed = (int)(now.tv_sec - last.tv_sec);
+				last.tv_sec += elapsed;
+
+				if (_configFile != NULL) {
+					int modified = 0;
+					int force = _reload;
+
+					_reload = 0;
+					if (config_watch_check(&modified) != 0)
+						modified = 0;
+
+					if (modified || force) {
+						flight_recorder_event("reload");
+						_config_reload(devices, deviceCount, force);
 					}
-					
-					fputc('.', stderr);
 				}
 
-				line_callback_unregister(_notifyCallbackHandle);
-			} else log_error("Unable to register Line Buffer callback: %i", ret);
+				if (_dump) {
+					_dump = 0;
+					if (flight_recorder_dump(NULL) != 0)
+						log_error("Unable to dump the flight recorder");
+				}
 
-			serial_close(serialFD);
-		} else {
-			log_error("Unable to open serial \"%s\": %i", dn, ret);
+				for (size_t i = 0; i < deviceCount; ++i) {
+					if (!devices[i].Open)
+						continue;
+
+					_device_gps(devices + i, elapsed);
+					_device_sync(devices + i, elapsed);
+				}
+
+				arbiter_run(handles, handleCount);
+
+				if (_configFile != NULL && settings_flush(_configFile, ':', 0) != 0)
+					log_error("Unable to save settings");
+
+				fputc('.', stderr);
+			}
+		}
+
+		control_server_stop();
+		/* Queued jobs refer to the devices */
+		arbiter_finit();
+		for (size_t i = 0; devices != NULL && i < deviceCount; ++i) {
+			_device_close(devices + i);
+			free(devices[i].Name);
 		}
+
+		free(devices);
 	}
 
+	config_watch_finit();
+	/* A full snapshot, so the file is complete without its journal */
+	if (_configFile != NULL && settings_save(_configFile, ':') != 0)
+		log_error("Unable to save settings on exit");
+
 	line_buffer_finit();
 	accounts_finit();
+	arena_finit();
+	capture_close();
+	metrics_server_stop();
+	flight_recorder_finit();
+	log_file_close();
 	settings_free();
 
 	return ret;
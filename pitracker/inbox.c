@@ -0,0 +1,348 @@
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "logging.h"
+#include "arena.h"
+#include "commands.h"
+#include "inbox.h"
+
+
+
+static const char* _storageNames[INBOX_STORAGES] = {
+	"SM",
+	"ME",
+};
+
+
+static PINBOX_STORAGE _inbox_storage_get(PINBOX Inbox, const char* Name)
+{
+	PINBOX_STORAGE ret = NULL;
+
+	for (size_t i = 0; i < INBOX_STORAGES; ++i) {
+		if (strcmp(Inbox->Storages[i].Name, Name) == 0) {
+			ret = Inbox->Storages + i;
+			break;
+		}
+	}
+
+	return ret;
+}
+
+
+static int _inbox_storage_select(PINBOX Inbox, int SerialFD, PINBOX_STORAGE Storage)
+{
+	int ret = 0;
+	int used = 0;
+	int total = 0;
+	size_t oldBytes = 0;
+	size_t newBytes = 0;
+	unsigned char* handled = NULL;
+	log_enter("SerialFD=%i; Storage=\"%s\"", SerialFD, Storage->Name);
+
+	ret = command_sms_storage_select(SerialFD, Storage->Name, &used, &total);
+	if (ret == 0) {
+		if (total > Storage->Total) {
+			/* Slots are 1-based on SIM800/SIM900 and 0-based elsewhere */
+			oldBytes = (Storage->Handled != NULL) ? (size_t)Storage->Total / 8 + 1 : 0;
+			newBytes = (size_t)total / 8 + 1;
+			handled = realloc(Storage->Handled, newBytes);
+			if (handled == NULL)
+				ret = ENOMEM;
+
+			/* Only the new bytes, the old ones keep the flags of the slots handled so far */
+			if (ret == 0) {
+				memset(handled + oldBytes, 0, newBytes - oldBytes);
+				Storage->Handled = handled;
+				Storage->Total = total;
+			}
+		}
+
+		if (ret == 0) {
+			Storage->Used = used;
+			Storage->Available = 1;
+			Inbox->Current = Storage;
+		}
+	}
+
+	log_exit("%i, Used=%i, Total=%i", ret, Storage->Used, Storage->Total);
+	return ret;
+}
+
+
+static void _inbox_slot_set(PINBOX_STORAGE Storage, int Index, int Handled)
+{
+	if (Index >= 0 && Index <= Storage->Total) {
+		if (Handled)
+			Storage->Handled[Index / 8] |= (unsigned char)(1 << (Index % 8));
+		else Storage->Handled[Index / 8] &= (unsigned char)~(1 << (Index % 8));
+	}
+
+	return;
+}
+
+
+static int _inbox_slot_handled(const INBOX_STORAGE* Storage, int Index)
+{
+	int ret = 0;
+
+	if (Index >= 0 && Index <= Storage->Total)
+		ret = (Storage->Handled[Index / 8] & (1 << (Index % 8))) != 0;
+
+	return ret;
+}
+
+
+static void _inbox_message_mark(PINBOX_STORAGE Storage, const SMS_MESSAGE* Message)
+{
+	_inbox_slot_set(Storage, Message->Index, 1);
+	for (size_t i = 0; i < Message->IndexCount; ++i)
+		_inbox_slot_set(Storage, Message->Indices[i], 1);
+
+	return;
+}
+
+
+/* Deletes handled slots one by one, used where a bulk delete would remove messages not handled yet */
+static int _inbox_slots_delete(int SerialFD, PINBOX_STORAGE Storage)
+{
+	int ret = 0;
+	int err = 0;
+	log_enter("SerialFD=%i; Storage=\"%s\"", SerialFD, Storage->Name);
+
+	for (int i = 0; i <= Storage->Total; ++i) {
+		if (!_inbox_slot_handled(Storage, i))
+			continue;
+
+		err = command_sms_delete(SerialFD, i, smsdtNormal);
+		if (err == 0) {
+			_inbox_slot_set(Storage, i, 0);
+			if (Storage->Used > 0)
+				--Storage->Used;
+		} else {
+			log_error("Unable to delete SMS on index %i: %i", i, err);
+			ret = err;
+		}
+	}
+
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+typedef struct _INBOX_ORDER {
+	const SMS_MESSAGE* Message;
+	const SMS_MESSAGE* Newest;
+} INBOX_ORDER, *PINBOX_ORDER;
+
+
+/* Newest sender first; the messages of a sender in the order they were sent, so a later command is not undone by an earlier one */
+static int _inbox_order_compare(const void* A, const void* B)
+{
+	int ret = 0;
+	const INBOX_ORDER* a = (const INBOX_ORDER*)A;
+	const INBOX_ORDER* b = (const INBOX_ORDER*)B;
+
+	ret = strcmp(b->Newest->Timestamp, a->Newest->Timestamp);
+	if (ret == 0)
+		ret = strcmp(a->Message->PhoneNumber, b->Message->PhoneNumber);
+
+	if (ret == 0)
+		ret = strcmp(a->Message->Timestamp, b->Message->Timestamp);
+
+	if (ret == 0)
+		ret = (a->Message->Index > b->Message->Index) - (a->Message->Index < b->Message->Index);
+
+	return ret;
+}
+
+
+static int _inbox_storage_drain(PINBOX Inbox, int SerialFD, PINBOX_STORAGE Storage, INBOX_CALLBACK* Callback, void* Context)
+{
+	int ret = 0;
+	int full = 0;
+	PSMS_MESSAGE msgs = NULL;
+	size_t msgCount = 0;
+	size_t pending = 0;
+	int* skipped = NULL;
+	size_t skippedCount = 0;
+	PINBOX_ORDER order = NULL;
+	log_enter("SerialFD=%i; Storage=\"%s\"; Callback=0x%p; Context=0x%p", SerialFD, Storage->Name, Callback, Context);
+
+	ret = _inbox_storage_select(Inbox, SerialFD, Storage);
+	if (ret != 0 || Storage->Used == 0)
+		goto Exit;
+
+	full = (Storage->Used >= Storage->Total);
+	ret = command_sms_list(SerialFD, "REC UNREAD", &msgs, &msgCount, &pending, &skipped, &skippedCount);
+	if (ret != 0)
+		goto Exit;
+
+	log_info("Storage %s: %i/%i slots used, %zu unread messages, %zu incomplete parts, %zu undecodable", Storage->Name, Storage->Used, Storage->Total, msgCount, pending, skippedCount);
+	for (size_t i = 0; i < skippedCount; ++i)
+		_inbox_slot_set(Storage, skipped[i], 1);
+
+	if (msgCount > 0) {
+		order = calloc(msgCount, sizeof(INBOX_ORDER));
+		if (order == NULL)
+			ret = ENOMEM;
+	}
+
+	if (ret == 0 && msgCount > 0) {
+		for (size_t i = 0; i < msgCount; ++i) {
+			order[i].Message = msgs + i;
+			order[i].Newest = msgs + i;
+			for (size_t j = 0; j < msgCount; ++j) {
+				if (strcmp(msgs[j].PhoneNumber, msgs[i].PhoneNumber) == 0 && strcmp(msgs[j].Timestamp, order[i].Newest->Timestamp) > 0)
+					order[i].Newest = msgs + j;
+			}
+		}
+
+		qsort(order, msgCount, sizeof(INBOX_ORDER), _inbox_order_compare);
+		for (size_t i = 0; i < msgCount; ++i) {
+			Callback(SerialFD, order[i].Message, Context);
+			_inbox_message_mark(Storage, order[i].Message);
+		}
+	}
+
+	if (ret == 0) {
+		/* Listing marked everything as read, so a bulk delete covers all handled slots unless parts of a message are still missing */
+		if (pending == 0) {
+			ret = command_sms_delete(SerialFD, 1, full ? smsdtRecvReadSentUnsent : smsdtRecvRead);
+			if (ret == 0) {
+				memset(Storage->Handled, 0, (size_t)Storage->Total / 8 + 1);
+				Storage->Used = 0;
+			}
+		} else ret = _inbox_slots_delete(SerialFD, Storage);
+	}
+
+	free(order);
+	arena_free(skipped);
+	sms_array_free(msgs, msgCount);
+Exit:
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+int inbox_init(PINBOX Inbox, int SerialFD)
+{
+	int ret = 0;
+	int available = 0;
+	log_enter("Inbox=0x%p; SerialFD=%i", Inbox, SerialFD);
+
+	memset(Inbox, 0, sizeof(INBOX));
+	for (size_t i = 0; i < INBOX_STORAGES; ++i) {
+		snprintf(Inbox->Storages[i].Name, sizeof(Inbox->Storages[i].Name), "%s", _storageNames[i]);
+		ret = _inbox_storage_select(Inbox, SerialFD, Inbox->Storages + i);
+		if (ret == 0)
+			++available;
+		else log_warning("SMS storage %s is not available: %i", _storageNames[i], ret);
+	}
+
+	ret = (available > 0) ? 0 : ENODEV;
+
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+void inbox_finit(PINBOX Inbox)
+{
+	log_enter("Inbox=0x%p", Inbox);
+
+	for (size_t i = 0; i < INBOX_STORAGES; ++i) {
+		free(Inbox->Storages[i].Handled);
+		Inbox->Storages[i].Handled = NULL;
+		Inbox->Storages[i].Total = 0;
+		Inbox->Storages[i].Used = 0;
+		Inbox->Storages[i].Available = 0;
+	}
+
+	Inbox->Current = NULL;
+
+	log_exit("void");
+	return;
+}
+
+
+int inbox_drain(PINBOX Inbox, int SerialFD, INBOX_CALLBACK* Callback, void* Context)
+{
+	int ret = 0;
+	int err = 0;
+	PINBOX_STORAGE storages = NULL;
+	log_enter("Inbox=0x%p; SerialFD=%i; Callback=0x%p; Context=0x%p", Inbox, SerialFD, Callback, Context);
+
+	storages = Inbox->Storages;
+	for (size_t i = 0; i < INBOX_STORAGES; ++i) {
+		if (!storages[i].Available)
+			continue;
+
+		err = _inbox_storage_drain(Inbox, SerialFD, storages + i, Callback, Context);
+		if (err != 0) {
+			log_error("Unable to drain SMS storage %s: %i", storages[i].Name, err);
+			ret = err;
+		}
+	}
+
+	/* New messages are reported for the SIM storage by default */
+	if (storages[0].Available && Inbox->Current != storages) {
+		err = _inbox_storage_select(Inbox, SerialFD, storages);
+		if (err != 0)
+			ret = err;
+	}
+
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+int inbox_notify(PINBOX Inbox, int SerialFD, const char* Storage, int Index, INBOX_CALLBACK* Callback, void* Context)
+{
+	int ret = 0;
+	SMS_MESSAGE msg;
+	PINBOX_STORAGE s = NULL;
+	log_enter("Inbox=0x%p; SerialFD=%i; Storage=\"%s\"; Index=%i; Callback=0x%p; Context=0x%p", Inbox, SerialFD, Storage, Index, Callback, Context);
+
+	s = _inbox_storage_get(Inbox, Storage);
+	if (s == NULL)
+		ret = ENOENT;
+
+	if (ret == 0 && s != Inbox->Current)
+		ret = _inbox_storage_select(Inbox, SerialFD, s);
+
+	if (ret == 0) {
+		if (s->Total < Index) {
+			ret = _inbox_storage_select(Inbox, SerialFD, s);
+			if (ret == 0 && s->Total < Index)
+				ret = ERANGE;
+		}
+	}
+
+	if (ret == 0 && _inbox_slot_handled(s, Index)) {
+		/* Handled before, only the delete failed */
+		ret = _inbox_slots_delete(SerialFD, s);
+		goto Exit;
+	}
+
+	if (ret == 0) {
+		memset(&msg, 0, sizeof(msg));
+		ret = command_sms_read(SerialFD, Index, &msg);
+		if (ret == 0) {
+			Callback(SerialFD, &msg, Context);
+			_inbox_message_mark(s, &msg);
+			ret = _inbox_slots_delete(SerialFD, s);
+			sms_free(&msg);
+		} else if (ret == EBADMSG) {
+			_inbox_slot_set(s, Index, 1);
+			ret = _inbox_slots_delete(SerialFD, s);
+		}
+	}
+
+Exit:
+	log_exit("%i", ret);
+	return ret;
+}
@@ -0,0 +1,34 @@
+
+#pragma once
+
+
+#include "commands.h"
+
+
+#define INBOX_STORAGE_NAME_MAX			8
+#define INBOX_STORAGES					2
+
+
+typedef int (INBOX_CALLBACK)(int SerialFD, const SMS_MESSAGE* Message, void* Context);
+
+typedef struct _INBOX_STORAGE {
+	char Name[INBOX_STORAGE_NAME_MAX];
+	int Available;
+	int Used;
+	int Total;
+	/* One bit per slot, set once the message stored there has been handled */
+	unsigned char* Handled;
+} INBOX_STORAGE, *PINBOX_STORAGE;
+
+/* The SMS storages of one modem */
+typedef struct _INBOX {
+	INBOX_STORAGE Storages[INBOX_STORAGES];
+	/* The storage AT+CPMS selected last */
+	PINBOX_STORAGE Current;
+} INBOX, *PINBOX;
+
+
+int inbox_init(PINBOX Inbox, int SerialFD);
+void inbox_finit(PINBOX Inbox);
+int inbox_drain(PINBOX Inbox, int SerialFD, INBOX_CALLBACK* Callback, void* Context);
+int inbox_notify(PINBOX Inbox, int SerialFD, const char* Storage, int Index, INBOX_CALLBACK* Callback, void* Context);
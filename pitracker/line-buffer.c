@@ -6,14 +6,20 @@
 #include <string.h>
 #include <errno.h>
 #include "logging.h"
+#include "arena.h"
 #include "line-buffer.h"
 
 
 
 #define LINE_BUFFER_SIZE			1024
 
-static char _lineBuffer[LINE_BUFFER_SIZE];
-static size_t _lineBufferIndex = 0;
+typedef struct _LINE_BUFFER_STREAM {
+	char Data[LINE_BUFFER_SIZE];
+	size_t Index;
+} LINE_BUFFER_STREAM, *PLINE_BUFFER_STREAM;
+
+/* Each channel of each port assembles its lines apart, so a partial line of one never swallows another */
+static LINE_BUFFER_STREAM _lineBuffers[LINE_BUFFER_STREAMS];
 static LINE_BUFFER_CALLBACK_RECORD _lineCallbackHead;
 static void* _debugCallbackHandle = NULL;
 
@@ -29,40 +35,46 @@ static int _line_buffer_debug_callback(const char* Line, void* Context)
 
 
 
-int line_buffer_insert(const char* Data, size_t Length)
+int line_buffer_insert_stream(int Stream, const char* Data, size_t Length)
 {
 	int ret = 0;
 	char* tmp = NULL;
 	char* lineEnd = NULL;
+	PLINE_BUFFER_STREAM s = NULL;
 	PLINE_BUFFER_CALLBACK_RECORD r = NULL;
 	PLINE_BUFFER_CALLBACK_RECORD old = NULL;
-	log_enter("Data=0x%p; Length=%zu", Data, Length);
-
-	if (_lineBufferIndex + Length + 1 < LINE_BUFFER_SIZE) {
-		memcpy(_lineBuffer + _lineBufferIndex, Data, Length);
-		_lineBufferIndex += Length;
-		_lineBuffer[_lineBufferIndex] = '\0';
-		lineEnd = strstr(_lineBuffer, "\r\n");
+	log_enter("Stream=%i; Data=0x%p; Length=%zu", Stream, Data, Length);
+
+	s = _lineBuffers + Stream;
+	if (s->Index + Length + 1 < LINE_BUFFER_SIZE) {
+		memcpy(s->Data + s->Index, Data, Length);
+		s->Index += Length;
+		s->Data[s->Index] = '\0';
+		lineEnd = strstr(s->Data, "\r\n");
 		while (lineEnd != NULL) {
 			lineEnd[0] = '\0';
 			lineEnd[1] = '\0';
 			lineEnd += 2;
-			tmp = _lineBuffer;
+			tmp = s->Data;
 			while (*tmp == '\r' || *tmp == '\n')
 				++tmp;
 
+			/* A URC is an event of its own unless a command waits for its response */
+			arena_enter();
 			r = _lineCallbackHead.Next;
 			while (r != &_lineCallbackHead) {
 				old = r;
 				r = r->Next;
-				if (old->Enabled)
+				if (old->Enabled && Stream >= old->StreamFirst && Stream - old->StreamFirst < old->StreamCount)
 					old->Callback(tmp, old->Context);				
 			}
 
-			memmove(_lineBuffer, lineEnd, (_lineBufferIndex - (size_t)(lineEnd - _lineBuffer))*sizeof(char));
-			_lineBufferIndex -= (size_t)(lineEnd - _lineBuffer);
-			_lineBuffer[_lineBufferIndex] = '\0';
-			lineEnd = strstr(_lineBuffer, "\r\n");
+			arena_leave();
+
+			memmove(s->Data, lineEnd, (s->Index - (size_t)(lineEnd - s->Data))*sizeof(char));
+			s->Index -= (size_t)(lineEnd - s->Data);
+			s->Data[s->Index] = '\0';
+			lineEnd = strstr(s->Data, "\r\n");
 		}
 	} else ret = ENOMEM;
 
@@ -71,6 +83,12 @@ int line_buffer_insert(const char* Data, size_t Length)
 }
 
 
+int line_buffer_insert(const char* Data, size_t Length)
+{
+	return line_buffer_insert_stream(0, Data, Length);
+}
+
+
 int line_callback_register(LINE_BUFFER_CALLBACK* Callback, void* Context, void** Handle)
 {
 	int ret = 0;
@@ -83,6 +101,7 @@ int line_callback_register(LINE_BUFFER_CALLBACK* Callback, void* Context, void**
 		record->Callback = Callback;
 		record->Context = Context;
 		record->Enabled = 1;
+		record->StreamCount = LINE_BUFFER_STREAMS;
 		record->Next = &_lineCallbackHead;
 		record->Prev = _lineCallbackHead.Prev;
 		_lineCallbackHead.Prev->Next = record;
@@ -122,6 +141,20 @@ void line_callback_enable(void* Handle, int Enable)
 }
 
 
+void line_callback_filter(void* Handle, int First, int Count)
+{
+	PLINE_BUFFER_CALLBACK_RECORD record = NULL;
+	log_enter("Handle=0x%p; First=%i; Count=%i", Handle, First, Count);
+
+	record = (PLINE_BUFFER_CALLBACK_RECORD)Handle;
+	record->StreamFirst = First;
+	record->StreamCount = Count;
+
+	log_exit("void");
+	return;
+}
+
+
 int line_buffer_init(void)
 {
 	int ret = 0;
@@ -129,7 +162,7 @@ int line_buffer_init(void)
 
 	_lineCallbackHead.Next = &_lineCallbackHead;
 	_lineCallbackHead.Prev = &_lineCallbackHead;
-	ret = line_callback_register(_line_buffer_debug_callback, &_lineBufferIndex, &_debugCallbackHandle);
+	ret = line_callback_register(_line_buffer_debug_callback, _lineBuffers, &_debugCallbackHandle);
 
 	log_exit("%i", ret);
 	return ret;
@@ -3,6 +3,8 @@
 
 
 
+/* Separate partial lines, one per channel of up to eight serial ports */
+#define LINE_BUFFER_STREAMS			32
 
 typedef int (LINE_BUFFER_CALLBACK)(const char *Line, void *Context);
 
@@ -12,13 +14,18 @@ typedef struct _LINE_BUFFER_CALLBACK_RECORD {
 	LINE_BUFFER_CALLBACK* Callback;
 	void* Context;
 	int Enabled;
+	/* Lines of other streams are not passed to the callback */
+	int StreamFirst;
+	int StreamCount;
 } LINE_BUFFER_CALLBACK_RECORD, *PLINE_BUFFER_CALLBACK_RECORD;
 
 
 int line_buffer_insert(const char* Data, size_t Length);
+int line_buffer_insert_stream(int Stream, const char* Data, size_t Length);
 int line_callback_register(LINE_BUFFER_CALLBACK* Callback, void* Context, void** Handle);
 void line_callback_unregister(void* Handle);
 void line_callback_enable(void* Handle, int Enable);
+void line_callback_filter(void* Handle, int First, int Count);
 
 int line_buffer_init(void);
 void line_buffer_finit(void);
@@ -0,0 +1,268 @@
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include "binlog.h"
+#include "flight-recorder.h"
+#include "capture.h"
+
+
+/*
+ * Turns binary log files written by gpsapp back into text. Files are
+ * decoded in the order given, so pass rotated files oldest first
+ * (gpsapp.log.3 gpsapp.log.2 gpsapp.log.1 gpsapp.log). Flight recorder
+ * dumps, rings and session captures are recognized by their magic.
+ */
+
+
+typedef struct _LOGDECODE_FORMAT {
+	uint64_t Id;
+	char* Format;
+} LOGDECODE_FORMAT, *PLOGDECODE_FORMAT;
+
+
+static PLOGDECODE_FORMAT _formats = NULL;
+static size_t _formatCapacity = 0;
+static size_t _formatCount = 0;
+
+
+static PLOGDECODE_FORMAT _format_slot(PLOGDECODE_FORMAT Formats, size_t Capacity, uint64_t Id)
+{
+	size_t slot = 0;
+
+	slot = (size_t)((Id >> 3) % Capacity);
+	while (Formats[slot].Format != NULL && Formats[slot].Id != Id)
+		slot = (slot + 1) % Capacity;
+
+	return Formats + slot;
+}
+
+
+/* A later definition of the same address (a new run of gpsapp) replaces the older one */
+static int _format_define(uint64_t Id, const char* Format)
+{
+	int ret = 0;
+	PLOGDECODE_FORMAT tmp = NULL;
+	PLOGDECODE_FORMAT slot = NULL;
+	size_t capacity = 0;
+	char* f = NULL;
+
+	if (_formatCount * 2 >= _formatCapacity) {
+		capacity = (_formatCapacity > 0) ? _formatCapacity * 2 : 1024;
+		tmp = calloc(capacity, sizeof(LOGDECODE_FORMAT));
+		if (tmp == NULL)
+			ret = ENOMEM;
+
+		if (ret == 0) {
+			for (size_t i = 0; i < _formatCapacity; ++i) {
+				if (_formats[i].Format != NULL)
+					*_format_slot(tmp, capacity, _formats[i].Id) = _formats[i];
+			}
+
+			free(_formats);
+			_formats = tmp;
+			_formatCapacity = capacity;
+		}
+	}
+
+	if (ret == 0) {
+		f = strdup(Format);
+		if (f == NULL)
+			ret = ENOMEM;
+	}
+
+	if (ret == 0) {
+		slot = _format_slot(_formats, _formatCapacity, Id);
+		if (slot->Format == NULL)
+			++_formatCount;
+
+		free(slot->Format);
+		slot->Id = Id;
+		slot->Format = f;
+	}
+
+	return ret;
+}
+
+
+static void _flight_data_print(const unsigned char* Data, size_t Length)
+{
+	putchar('"');
+	for (size_t i = 0; i < Length; ++i) {
+		switch (Data[i]) {
+			case '\r': fputs("\\r", stdout); break;
+			case '\n': fputs("\\n", stdout); break;
+			case '"': fputs("\\\"", stdout); break;
+			case '\\': fputs("\\\\", stdout); break;
+			default:
+				if (Data[i] < 0x20 || Data[i] >= 0x7f)
+					printf("\\x%02x", Data[i]);
+				else putchar(Data[i]);
+				break;
+		}
+	}
+
+	puts("\"");
+
+	return;
+}
+
+
+static void _flight_record_print(const FLIGHT_RECORD* Record)
+{
+	static const char* types[] = { "PAD", "TX", "RX", "URC", "EVENT", "TIMEOUT" };
+
+	printf("%llu.%06llu %s ", (unsigned long long)(Record->Timestamp / 1000000000ULL), (unsigned long long)(Record->Timestamp % 1000000000ULL / 1000), (Record->Type < sizeof(types) / sizeof(types[0])) ? types[Record->Type] : "?");
+	_flight_data_print((const unsigned char*)(Record + 1), Record->Length);
+
+	return;
+}
+
+
+static int _decode_flight(FILE* File, const char* FileName)
+{
+	int ret = 0;
+	FLIGHT_RECORDER_HEADER h;
+	unsigned char* data = NULL;
+	uint64_t pos = 0;
+	PFLIGHT_RECORD r = NULL;
+
+	memcpy(h.Magic, FLIGHT_RECORDER_MAGIC, sizeof(h.Magic));
+	if (fread((char*)&h + sizeof(h.Magic), sizeof(h) - sizeof(h.Magic), 1, File) != 1 ||
+		h.Size < FLIGHT_RECORDER_SIZE_MIN || h.Size % 8 != 0 || h.Head < h.Tail || h.Head - h.Tail > h.Size)
+		ret = EINVAL;
+
+	if (ret == 0) {
+		data = malloc((size_t)h.Size);
+		if (data == NULL)
+			ret = ENOMEM;
+	}
+
+	if (ret == 0 && fread(data, (size_t)h.Size, 1, File) != 1)
+		ret = EINVAL;
+
+	pos = h.Tail;
+	while (ret == 0 && pos < h.Head) {
+		r = (PFLIGHT_RECORD)(data + pos % h.Size);
+		if (r->Size == 0 || r->Size > h.Size - pos % h.Size) {
+			fprintf(stderr, "%s: corrupted record\n", FileName);
+			break;
+		}
+
+		if (r->Type != frtPad)
+			_flight_record_print(r);
+
+		pos += r->Size;
+	}
+
+	free(data);
+
+	return ret;
+}
+
+
+static int _decode_capture(FILE* File, const char* FileName)
+{
+	int ret = 0;
+	unsigned char record[sizeof(FLIGHT_RECORD) + UINT16_MAX + 8] __attribute__((aligned(8)));
+	PFLIGHT_RECORD r = (PFLIGHT_RECORD)record;
+
+	while (fread(r, sizeof(FLIGHT_RECORD), 1, File) == 1) {
+		if (r->Size < sizeof(FLIGHT_RECORD) + r->Length || r->Size > sizeof(record) ||
+			(r->Size > sizeof(FLIGHT_RECORD) && fread(r + 1, r->Size - sizeof(FLIGHT_RECORD), 1, File) != 1)) {
+			fprintf(stderr, "%s: truncated record\n", FileName);
+			break;
+		}
+
+		_flight_record_print(r);
+	}
+
+	return ret;
+}
+
+
+static int _decode_file(const char* FileName)
+{
+	int ret = 0;
+	FILE* f = NULL;
+	char magic[sizeof(BINLOG_MAGIC) - 1];
+	unsigned char record[UINT16_MAX + 1] __attribute__((aligned(8)));
+	PBINLOG_RECORD_HEADER h = (PBINLOG_RECORD_HEADER)record;
+	PLOGDECODE_FORMAT format = NULL;
+	time_t secs = 0;
+	struct tm t;
+	char ts[32];
+
+	f = (strcmp(FileName, "-") == 0) ? stdin : fopen(FileName, "rb");
+	if (f == NULL)
+		ret = errno;
+
+	if (ret == 0 && fread(magic, sizeof(magic), 1, f) != 1)
+		ret = EINVAL;
+
+	if (ret == 0 && memcmp(magic, FLIGHT_RECORDER_MAGIC, sizeof(magic)) == 0)
+		ret = _decode_flight(f, FileName);
+	else if (ret == 0 && memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) == 0)
+		ret = _decode_capture(f, FileName);
+	else if (ret == 0 && memcmp(magic, BINLOG_MAGIC, sizeof(magic)) != 0)
+		ret = EINVAL;
+
+	while (ret == 0 && fread(h, sizeof(BINLOG_RECORD_HEADER), 1, f) == 1) {
+		if (h->Size < sizeof(BINLOG_RECORD_HEADER) ||
+			(h->Size > sizeof(BINLOG_RECORD_HEADER) &&
+			fread(record + sizeof(BINLOG_RECORD_HEADER), h->Size - sizeof(BINLOG_RECORD_HEADER), 1, f) != 1)) {
+			/* The writer was killed in the middle of a write */
+			fprintf(stderr, "%s: truncated record\n", FileName);
+			break;
+		}
+
+		if (h->Type == binlogFormat) {
+			record[h->Size - 1] = '\0';
+			ret = _format_define(h->Format, (const char*)(h + 1));
+			continue;
+		}
+
+		format = (_formatCapacity > 0) ? _format_slot(_formats, _formatCapacity, h->Format) : NULL;
+		secs = (time_t)(h->Timestamp / 1000000000ULL);
+		gmtime_r(&secs, &t);
+		strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S", &t);
+		printf("%s.%06lu ", ts, (unsigned long)(h->Timestamp % 1000000000ULL / 1000));
+		if (format == NULL || format->Format == NULL)
+			printf("<unknown format 0x%llx>\n", (unsigned long long)h->Format);
+		else binlog_record_print(stdout, h, format->Format);
+	}
+
+	if (f != NULL && f != stdin)
+		fclose(f);
+
+	if (ret != 0)
+		fprintf(stderr, "Unable to decode %s: %i\n", FileName, ret);
+
+	return ret;
+}
+
+
+int main(int argc, char** argv)
+{
+	int ret = 0;
+
+	if (argc > 1) {
+		for (int i = 1; i < argc; ++i) {
+			if (_decode_file(argv[i]) != 0)
+				ret = 1;
+		}
+	} else if (_decode_file("-") != 0)
+		ret = 1;
+
+	for (size_t i = 0; i < _formatCapacity; ++i)
+		free(_formats[i].Format);
+
+	free(_formats);
+
+	return ret;
+}
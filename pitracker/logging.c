@@ -3,10 +3,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include "binlog.h"
 #include "logging.h"
 
 
 unsigned long _verbose = 0x3;
+unsigned long _logFileMask = 0;
+static int _logFileOpen = 0;
 
 
 
@@ -15,9 +18,16 @@ void LogMessage(ELogType Type, const char* Format, ...)
 	va_list vl;
 	char msg[1024];
 
+	/* Only the arguments are recorded, the writer thread and logdecode do the formatting */
+	if (_logFileMask & (1 << (int)Type)) {
+		va_start(vl, Format);
+		binlog_record(Type, Format, vl);
+		va_end(vl);
+	}
+
+	/* The macros check the masks before evaluating the arguments, this covers direct callers */
 	if (_verbose & (1 << (int)Type)) {
 		va_start(vl, Format);
-		memset(msg, 0, sizeof(msg));
 		vsnprintf(msg, sizeof(msg) / sizeof(msg[0]), Format, vl);
 		fputs(msg, stderr);
 		va_end(vl);
@@ -25,3 +35,36 @@ void LogMessage(ELogType Type, const char* Format, ...)
 
 	return;
 }
+
+
+int log_file_open(const char* FileName, size_t MaxSize, size_t MaxRecords, unsigned long Mask)
+{
+	int ret = 0;
+
+	ret = binlog_start(FileName, MaxSize, MaxRecords);
+	if (ret == 0) {
+		_logFileOpen = 1;
+		_logFileMask = Mask;
+	}
+
+	return ret;
+}
+
+
+void log_file_mask(unsigned long Mask)
+{
+	if (_logFileOpen)
+		_logFileMask = Mask;
+
+	return;
+}
+
+
+void log_file_close(void)
+{
+	_logFileMask = 0;
+	_logFileOpen = 0;
+	binlog_stop();
+
+	return;
+}
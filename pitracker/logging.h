@@ -2,6 +2,9 @@
 #pragma once
 
 
+#include <stddef.h>
+
+
 
 typedef enum _ELogType {
 	ltError,
@@ -12,25 +15,44 @@ typedef enum _ELogType {
 
 
 extern unsigned long _verbose;
+/* Log types recorded into the binary log file */
+extern unsigned long _logFileMask;
+
+
+/* Log types compiled in, one bit per ELogType; the others cost nothing, not even their arguments */
+#ifndef LOG_LEVEL
+#define LOG_LEVEL					0xf
+#endif
+
+#define log_enabled(aType)	\
+	((LOG_LEVEL & (1 << (aType))) != 0 && ((_verbose | _logFileMask) & (1UL << (aType))) != 0)
 
+#define log_message(aType, aFormat, ...)	\
+	do {	\
+		if (log_enabled(aType))	\
+			LogMessage(aType, aFormat, __VA_ARGS__);	\
+	} while (0)
 
 #define log_enter(aFormat, ...)	\
-	LogMessage(ltTrace, "[TRACE]: %s(" aFormat ")\n", __FUNCTION__, __VA_ARGS__ + 0)
+	log_message(ltTrace, "[TRACE]: %s(" aFormat ")\n", __FUNCTION__, __VA_ARGS__ + 0)
 
 #define log_exit(aFormat, ...)	\
-	LogMessage(ltTrace, "[TRACE]: %s(-):" aFormat "\n", __FUNCTION__, __VA_ARGS__ + 0)
+	log_message(ltTrace, "[TRACE]: %s(-):" aFormat "\n", __FUNCTION__, __VA_ARGS__ + 0)
 
 #define log_error(aFormat, ...)	\
-	LogMessage(ltError, "[ERROR]: " aFormat "\n", __VA_ARGS__ + 0)
+	log_message(ltError, "[ERROR]: " aFormat "\n", __VA_ARGS__ + 0)
 
 #define log_warning(aFormat, ...)	\
-	LogMessage(ltWarning, "[WARNING]: " aFormat "\n", __VA_ARGS__ + 0)
+	log_message(ltWarning, "[WARNING]: " aFormat "\n", __VA_ARGS__ + 0)
 
 #define log_trace(aFormat, ...)	\
-	LogMessage(ltTrace, "[TRACE]: " aFormat "\n", __VA_ARGS__ + 0)
+	log_message(ltTrace, "[TRACE]: " aFormat "\n", __VA_ARGS__ + 0)
 
 #define log_info(aFormat, ...)	\
-	LogMessage(ltInfo, "[INFO]: " aFormat "\n", __VA_ARGS__ + 0)
+	log_message(ltInfo, "[INFO]: " aFormat "\n", __VA_ARGS__ + 0)
 
 
 void LogMessage(ELogType Type, const char* Format, ...);
+int log_file_open(const char* FileName, size_t MaxSize, size_t MaxRecords, unsigned long Mask);
+void log_file_mask(unsigned long Mask);
+void log_file_close(void);
@@ -0,0 +1,647 @@
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "logging.h"
+#include "metrics.h"
+
+
+
+#define METRICS_REQUEST_TIMEOUT_MS		200
+
+static METRICS_VERB _verbs[METRICS_VERB_MAX];
+static size_t _verbCount = 0;
+static METRICS_JOB_CLASS _jobClasses[METRICS_JOB_CLASS_MAX];
+static size_t _jobClassCount = 0;
+static unsigned long long _unsolicitedRxBytes = 0;
+/* Events served by the arena, the allocations it took over from malloc() and the largest event */
+static unsigned long long _arenaEvents = 0;
+static unsigned long long _arenaAllocations = 0;
+static unsigned long _arenaLastAllocations = 0;
+static size_t _arenaMaxBytes = 0;
+/* The verb of the command waiting for its final result, -1 if none */
+static int _current = -1;
+static struct timespec _currentStart;
+static pthread_mutex_t _lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int _listenFD = -1;
+static int _stopPipe[2] = { -1, -1 };
+static char* _socketPath = NULL;
+static pthread_t _serverThread;
+static int _serverRunning = 0;
+static const char* _resultNames[] = { "ok", "error", "timeout" };
+
+typedef struct _METRICS_TIMEOUT {
+	const char* Verb;
+	int Timeout;
+} METRICS_TIMEOUT, *PMETRICS_TIMEOUT;
+
+/* Maximum response times of the network commands (SIM800 manual), the other verbs get METRICS_TIMEOUT_DEFAULT_MS */
+static const METRICS_TIMEOUT _timeoutDefaults[] = {
+	{"CGACT", 150000},
+	{"CGATT", 75000},
+	{"CIICR", 85000},
+	{"CIPSEND", 60000},
+	{"CIPSHUT", 65000},
+	{"CIPSTART", 160000},
+	{"CMGD", 25000},
+	{"CMGL", 20000},
+	{"CMGS", 60000},
+	{"COPS", 120000},
+	{"SAPBR", 85000},
+};
+
+
+
+/* "AT+CGNSINF" gives CGNSINF, "ATE0" gives E */
+static void _metrics_verb_name(const char* Command, char* Name)
+{
+	size_t len = 0;
+	int extended = 0;
+
+	Command += 2;
+	if (*Command != '\0' && strchr("+&$#^", *Command) != NULL) {
+		extended = 1;
+		++Command;
+	}
+
+	while (len < METRICS_VERB_LENGTH - 1 && (isalpha((unsigned char)*Command) || (extended && (isdigit((unsigned char)*Command) || *Command == '_')))) {
+		Name[len] = (char)toupper((unsigned char)*Command);
+		++len;
+		++Command;
+	}
+
+	if (len == 0) {
+		memcpy(Name, "AT", 2);
+		len = 2;
+	}
+
+	Name[len] = '\0';
+
+	return;
+}
+
+
+static int _metrics_verb_index(const char* Name)
+{
+	int ret = -1;
+
+	for (size_t i = 0; i < _verbCount; ++i) {
+		if (strcmp(_verbs[i].Name, Name) == 0) {
+			ret = (int)i;
+			break;
+		}
+	}
+
+	if (ret == -1 && _verbCount < METRICS_VERB_MAX) {
+		memset(_verbs + _verbCount, 0, sizeof(METRICS_VERB));
+		strcpy(_verbs[_verbCount].Name, Name);
+		ret = (int)_verbCount;
+		++_verbCount;
+	}
+
+	return ret;
+}
+
+
+static size_t _metrics_bucket(unsigned long long Microseconds)
+{
+	size_t ret = 0;
+	int octave = 0;
+
+	if (Microseconds < METRICS_SUB_BUCKETS)
+		return (size_t)Microseconds;
+
+	octave = 63 - __builtin_clzll(Microseconds);
+	ret = (size_t)(octave - 1) * METRICS_SUB_BUCKETS + (size_t)((Microseconds >> (octave - 2)) & (METRICS_SUB_BUCKETS - 1));
+	if (ret >= METRICS_BUCKETS)
+		ret = METRICS_BUCKETS - 1;
+
+	return ret;
+}
+
+
+/* Exclusive upper bound of the bucket in microseconds */
+static unsigned long long _metrics_bucket_limit(size_t Bucket)
+{
+	int octave = 0;
+
+	if (Bucket < METRICS_SUB_BUCKETS)
+		return Bucket + 1;
+
+	octave = (int)(Bucket / METRICS_SUB_BUCKETS) + 1;
+
+	return (unsigned long long)(METRICS_SUB_BUCKETS + 1 + Bucket % METRICS_SUB_BUCKETS) << (octave - 2);
+}
+
+
+static void _metrics_end(EMetricsResult Result)
+{
+	struct timespec now;
+	unsigned long long us = 0;
+	PMETRICS_VERB v = NULL;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (unsigned long long)(now.tv_sec - _currentStart.tv_sec) * 1000000ULL + (unsigned long long)((now.tv_nsec - _currentStart.tv_nsec) / 1000);
+	v = _verbs + _current;
+	++v->Results[Result];
+	v->LastResult = Result;
+	/* The time a command is left without an answer says nothing about its latency */
+	if (Result != mrTimeout) {
+		v->DurationSum += us;
+		++v->Buckets[_metrics_bucket(us)];
+	}
+
+	_current = -1;
+
+	return;
+}
+
+
+/* A command left without a final result when the next one starts has timed out; text after a prompt is not a command of its own */
+void metrics_command_begin(const char* Command)
+{
+	char name[METRICS_VERB_LENGTH];
+
+	if (strncasecmp(Command, "AT", 2) != 0)
+		return;
+
+	_metrics_verb_name(Command, name);
+	pthread_mutex_lock(&_lock);
+	if (_current != -1)
+		_metrics_end(mrTimeout);
+
+	_current = _metrics_verb_index(name);
+	clock_gettime(CLOCK_MONOTONIC, &_currentStart);
+	pthread_mutex_unlock(&_lock);
+
+	return;
+}
+
+
+void metrics_command_end(EMetricsResult Result)
+{
+	pthread_mutex_lock(&_lock);
+	if (_current != -1)
+		_metrics_end(Result);
+
+	pthread_mutex_unlock(&_lock);
+
+	return;
+}
+
+
+void metrics_bytes(int Tx, size_t Length)
+{
+	pthread_mutex_lock(&_lock);
+	if (_current != -1) {
+		if (Tx)
+			_verbs[_current].TxBytes += Length;
+		else _verbs[_current].RxBytes += Length;
+	} else if (!Tx)
+		_unsolicitedRxBytes += Length;
+
+	pthread_mutex_unlock(&_lock);
+
+	return;
+}
+
+
+/* A verb that timed out last time gets its full default once more */
+static int _metrics_verb_timeout(const METRICS_VERB* Verb)
+{
+	int ret = METRICS_TIMEOUT_DEFAULT_MS;
+	unsigned long count = 0;
+	unsigned long cumulative = 0;
+	size_t j = 0;
+	long long learned = 0;
+
+	for (size_t i = 0; i < sizeof(_timeoutDefaults) / sizeof(_timeoutDefaults[0]); ++i) {
+		if (strcmp(_timeoutDefaults[i].Verb, Verb->Name) == 0) {
+			ret = _timeoutDefaults[i].Timeout;
+			break;
+		}
+	}
+
+	for (j = 0; j < METRICS_BUCKETS; ++j)
+		count += Verb->Buckets[j];
+
+	if (count >= METRICS_TIMEOUT_SAMPLES_MIN && Verb->LastResult != mrTimeout) {
+		for (j = 0; j < METRICS_BUCKETS - 1; ++j) {
+			cumulative += Verb->Buckets[j];
+			if (cumulative * 100 >= count * 99)
+				break;
+		}
+
+		learned = (long long)(_metrics_bucket_limit(j) / 1000) * METRICS_TIMEOUT_MULTIPLIER;
+		if (learned < METRICS_TIMEOUT_MIN_MS)
+			learned = METRICS_TIMEOUT_MIN_MS;
+
+		if (learned < ret)
+			ret = (int)learned;
+	}
+
+	return ret;
+}
+
+
+void metrics_job_end(const char* Class, unsigned long long Microseconds)
+{
+	PMETRICS_JOB_CLASS c = NULL;
+
+	pthread_mutex_lock(&_lock);
+	for (size_t i = 0; i < _jobClassCount; ++i) {
+		if (strcmp(_jobClasses[i].Name, Class) == 0) {
+			c = _jobClasses + i;
+			break;
+		}
+	}
+
+	if (c == NULL && _jobClassCount < METRICS_JOB_CLASS_MAX) {
+		c = _jobClasses + _jobClassCount;
+		memset(c, 0, sizeof(METRICS_JOB_CLASS));
+		snprintf(c->Name, sizeof(c->Name), "%s", Class);
+		++_jobClassCount;
+	}
+
+	if (c != NULL) {
+		c->DurationSum += Microseconds;
+		++c->Buckets[_metrics_bucket(Microseconds)];
+	}
+
+	pthread_mutex_unlock(&_lock);
+
+	return;
+}
+
+
+void metrics_arena_event(unsigned long Allocations, size_t Bytes)
+{
+	pthread_mutex_lock(&_lock);
+	++_arenaEvents;
+	_arenaAllocations += Allocations;
+	_arenaLastAllocations = Allocations;
+	if (Bytes > _arenaMaxBytes)
+		_arenaMaxBytes = Bytes;
+
+	pthread_mutex_unlock(&_lock);
+
+	return;
+}
+
+
+/* Milliseconds to wait for the answer to the command sent last */
+int metrics_command_timeout(void)
+{
+	int ret = METRICS_TIMEOUT_DEFAULT_MS;
+
+	pthread_mutex_lock(&_lock);
+	if (_current != -1)
+		ret = _metrics_verb_timeout(_verbs + _current);
+
+	pthread_mutex_unlock(&_lock);
+
+	return ret;
+}
+
+
+/* Only the power of two boundaries from 1 ms up, the finer buckets serve the quantiles */
+static void _metrics_histogram_write(FILE* Stream, const char* Metric, const char* Label, const char* Value, const unsigned long* Buckets, unsigned long long Sum)
+{
+	unsigned long count = 0;
+	unsigned long cumulative = 0;
+
+	for (size_t j = 0; j < METRICS_BUCKETS; ++j)
+		count += Buckets[j];
+
+	for (size_t j = 0; j < METRICS_BUCKETS; ++j) {
+		cumulative += Buckets[j];
+		if (j % METRICS_SUB_BUCKETS == METRICS_SUB_BUCKETS - 1 && _metrics_bucket_limit(j) >= 1024)
+			fprintf(Stream, "%s_bucket{%s=\"%s\",le=\"%g\"} %lu\n", Metric, Label, Value, _metrics_bucket_limit(j) / 1000000.0, cumulative);
+	}
+
+	fprintf(Stream, "%s_bucket{%s=\"%s\",le=\"+Inf\"} %lu\n", Metric, Label, Value, count);
+	fprintf(Stream, "%s_sum{%s=\"%s\"} %g\n", Metric, Label, Value, Sum / 1000000.0);
+	fprintf(Stream, "%s_count{%s=\"%s\"} %lu\n", Metric, Label, Value, count);
+
+	return;
+}
+
+
+/* Upper bound of the bucket holding the quantile */
+static void _metrics_quantiles_write(FILE* Stream, const char* Metric, const char* Label, const char* Value, const unsigned long* Buckets)
+{
+	unsigned long count = 0;
+	unsigned long cumulative = 0;
+	static const double quantiles[] = { 0.5, 0.9, 0.99 };
+
+	for (size_t j = 0; j < METRICS_BUCKETS; ++j)
+		count += Buckets[j];
+
+	if (count == 0)
+		return;
+
+	for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); ++q) {
+		size_t j = 0;
+
+		cumulative = 0;
+		for (j = 0; j < METRICS_BUCKETS - 1; ++j) {
+			cumulative += Buckets[j];
+			if (cumulative >= quantiles[q] * count)
+				break;
+		}
+
+		fprintf(Stream, "%s{%s=\"%s\",quantile=\"%g\"} %g\n", Metric, Label, Value, quantiles[q], _metrics_bucket_limit(j) / 1000000.0);
+	}
+
+	return;
+}
+
+
+/* Prometheus text exposition format 0.0.4 */
+int metrics_write(FILE* Stream)
+{
+	int ret = 0;
+	PMETRICS_VERB verbs = NULL;
+	size_t verbCount = 0;
+	PMETRICS_JOB_CLASS jobClasses = NULL;
+	size_t jobClassCount = 0;
+	unsigned long long unsolicited = 0;
+	unsigned long long arenaEvents = 0;
+	unsigned long long arenaAllocations = 0;
+	unsigned long arenaLastAllocations = 0;
+	size_t arenaMaxBytes = 0;
+
+	verbs = malloc(sizeof(_verbs));
+	jobClasses = malloc(sizeof(_jobClasses));
+	if (verbs == NULL || jobClasses == NULL) {
+		free(verbs);
+		free(jobClasses);
+		return ENOMEM;
+	}
+
+	pthread_mutex_lock(&_lock);
+	verbCount = _verbCount;
+	memcpy(verbs, _verbs, verbCount * sizeof(METRICS_VERB));
+	jobClassCount = _jobClassCount;
+	memcpy(jobClasses, _jobClasses, jobClassCount * sizeof(METRICS_JOB_CLASS));
+	unsolicited = _unsolicitedRxBytes;
+	arenaEvents = _arenaEvents;
+	arenaAllocations = _arenaAllocations;
+	arenaLastAllocations = _arenaLastAllocations;
+	arenaMaxBytes = _arenaMaxBytes;
+	pthread_mutex_unlock(&_lock);
+
+	fprintf(Stream, "# HELP gpsapp_at_command_duration_seconds Time from sending an AT command to its final result.\n");
+	fprintf(Stream, "# TYPE gpsapp_at_command_duration_seconds histogram\n");
+	for (size_t i = 0; i < verbCount; ++i)
+		_metrics_histogram_write(Stream, "gpsapp_at_command_duration_seconds", "verb", verbs[i].Name, verbs[i].Buckets, verbs[i].DurationSum);
+
+	fprintf(Stream, "# HELP gpsapp_at_command_duration_quantile_seconds Upper bound of the latency bucket holding the quantile.\n");
+	fprintf(Stream, "# TYPE gpsapp_at_command_duration_quantile_seconds gauge\n");
+	for (size_t i = 0; i < verbCount; ++i)
+		_metrics_quantiles_write(Stream, "gpsapp_at_command_duration_quantile_seconds", "verb", verbs[i].Name, verbs[i].Buckets);
+
+	fprintf(Stream, "# HELP gpsapp_at_command_timeout_seconds Current timeout of the verb.\n");
+	fprintf(Stream, "# TYPE gpsapp_at_command_timeout_seconds gauge\n");
+	for (size_t i = 0; i < verbCount; ++i)
+		fprintf(Stream, "gpsapp_at_command_timeout_seconds{verb=\"%s\"} %g\n", verbs[i].Name, _metrics_verb_timeout(verbs + i) / 1000.0);
+
+	fprintf(Stream, "# HELP gpsapp_at_commands_total AT commands by their final result.\n");
+	fprintf(Stream, "# TYPE gpsapp_at_commands_total counter\n");
+	for (size_t i = 0; i < verbCount; ++i) {
+		for (int r = 0; r < mrMax; ++r)
+			fprintf(Stream, "gpsapp_at_commands_total{verb=\"%s\",result=\"%s\"} %lu\n", verbs[i].Name, _resultNames[r], verbs[i].Results[r]);
+	}
+
+	fprintf(Stream, "# HELP gpsapp_serial_tx_bytes_total Bytes written to the modem.\n");
+	fprintf(Stream, "# TYPE gpsapp_serial_tx_bytes_total counter\n");
+	for (size_t i = 0; i < verbCount; ++i)
+		fprintf(Stream, "gpsapp_serial_tx_bytes_total{verb=\"%s\"} %llu\n", verbs[i].Name, verbs[i].TxBytes);
+
+	fprintf(Stream, "# HELP gpsapp_serial_rx_bytes_total Bytes read from the modem, unsolicited ones outside of any command.\n");
+	fprintf(Stream, "# TYPE gpsapp_serial_rx_bytes_total counter\n");
+	for (size_t i = 0; i < verbCount; ++i)
+		fprintf(Stream, "gpsapp_serial_rx_bytes_total{verb=\"%s\"} %llu\n", verbs[i].Name, verbs[i].RxBytes);
+
+	fprintf(Stream, "gpsapp_serial_rx_bytes_total{verb=\"unsolicited\"} %llu\n", unsolicited);
+	fprintf(Stream, "# HELP gpsapp_job_duration_seconds Time from queuing a modem job to its completion.\n");
+	fprintf(Stream, "# TYPE gpsapp_job_duration_seconds histogram\n");
+	for (size_t i = 0; i < jobClassCount; ++i)
+		_metrics_histogram_write(Stream, "gpsapp_job_duration_seconds", "priority", jobClasses[i].Name, jobClasses[i].Buckets, jobClasses[i].DurationSum);
+
+	fprintf(Stream, "# HELP gpsapp_job_duration_quantile_seconds Upper bound of the latency bucket holding the quantile.\n");
+	fprintf(Stream, "# TYPE gpsapp_job_duration_quantile_seconds gauge\n");
+	for (size_t i = 0; i < jobClassCount; ++i)
+		_metrics_quantiles_write(Stream, "gpsapp_job_duration_quantile_seconds", "priority", jobClasses[i].Name, jobClasses[i].Buckets);
+
+	fprintf(Stream, "# HELP gpsapp_arena_events_total Events (job chunks, SMS drains) whose parsing memory came from the arena.\n");
+	fprintf(Stream, "# TYPE gpsapp_arena_events_total counter\n");
+	fprintf(Stream, "gpsapp_arena_events_total %llu\n", arenaEvents);
+	fprintf(Stream, "# HELP gpsapp_arena_allocations_total Allocations served by the arena instead of malloc().\n");
+	fprintf(Stream, "# TYPE gpsapp_arena_allocations_total counter\n");
+	fprintf(Stream, "gpsapp_arena_allocations_total %llu\n", arenaAllocations);
+	fprintf(Stream, "# HELP gpsapp_arena_last_event_allocations Allocations served by the arena in the last event.\n");
+	fprintf(Stream, "# TYPE gpsapp_arena_last_event_allocations gauge\n");
+	fprintf(Stream, "gpsapp_arena_last_event_allocations %lu\n", arenaLastAllocations);
+	fprintf(Stream, "# HELP gpsapp_arena_max_event_bytes Arena bytes used by the largest event.\n");
+	fprintf(Stream, "# TYPE gpsapp_arena_max_event_bytes gauge\n");
+	fprintf(Stream, "gpsapp_arena_max_event_bytes %zu\n", arenaMaxBytes);
+	if (ferror(Stream))
+		ret = EIO;
+
+	free(jobClasses);
+	free(verbs);
+
+	return ret;
+}
+
+
+static void _metrics_send(int FD, const char* Data, size_t Length)
+{
+	ssize_t sent = 0;
+
+	while (Length > 0) {
+		sent = send(FD, Data, Length, MSG_NOSIGNAL);
+		if (sent == -1) {
+			if (errno == EINTR)
+				continue;
+
+			break;
+		}
+
+		Data += sent;
+		Length -= (size_t)sent;
+	}
+
+	return;
+}
+
+
+/* Plain text for socat and nc, an HTTP response when the request looks like one (curl --unix-socket) */
+static void _metrics_serve(int FD)
+{
+	struct pollfd pfd;
+	char request[512];
+	ssize_t len = 0;
+	char* body = NULL;
+	size_t bodySize = 0;
+	FILE* stream = NULL;
+	char header[160];
+
+	memset(&pfd, 0, sizeof(pfd));
+	pfd.fd = FD;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, METRICS_REQUEST_TIMEOUT_MS) == 1) {
+		len = recv(FD, request, sizeof(request) - 1, 0);
+		if (len < 0)
+			len = 0;
+	}
+
+	request[len] = '\0';
+	stream = open_memstream(&body, &bodySize);
+	if (stream != NULL) {
+		metrics_write(stream);
+		fclose(stream);
+		if (strncmp(request, "GET ", 4) == 0) {
+			snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", bodySize);
+			_metrics_send(FD, header, strlen(header));
+		}
+
+		_metrics_send(FD, body, bodySize);
+		free(body);
+	}
+
+	return;
+}
+
+
+static void* _metrics_thread(void* Context)
+{
+	int fd = -1;
+	struct pollfd fds[2];
+
+	memset(fds, 0, sizeof(fds));
+	fds[0].fd = _listenFD;
+	fds[0].events = POLLIN;
+	fds[1].fd = _stopPipe[0];
+	fds[1].events = POLLIN;
+	while (1) {
+		if (poll(fds, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+
+			break;
+		}
+
+		if (fds[1].revents != 0)
+			break;
+
+		if (fds[0].revents & POLLIN) {
+			fd = accept(_listenFD, NULL, NULL);
+			if (fd != -1) {
+				_metrics_serve(fd);
+				close(fd);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+
+int metrics_server_start(const char* Path)
+{
+	int ret = 0;
+	struct sockaddr_un addr;
+	sigset_t all;
+	sigset_t old;
+	log_enter("Path=\"%s\"", Path);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(Path) >= sizeof(addr.sun_path))
+		ret = ENAMETOOLONG;
+
+	if (ret == 0) {
+		strcpy(addr.sun_path, Path);
+		_socketPath = strdup(Path);
+		if (_socketPath == NULL)
+			ret = ENOMEM;
+	}
+
+	if (ret == 0) {
+		_listenFD = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (_listenFD == -1)
+			ret = errno;
+	}
+
+	/* A socket left behind by a crashed instance */
+	if (ret == 0) {
+		unlink(Path);
+		if (bind(_listenFD, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(_listenFD, 4) == -1)
+			ret = errno;
+	}
+
+	if (ret == 0 && pipe(_stopPipe) == -1)
+		ret = errno;
+
+	if (ret == 0) {
+		sigfillset(&all);
+		pthread_sigmask(SIG_SETMASK, &all, &old);
+		ret = pthread_create(&_serverThread, NULL, _metrics_thread, NULL);
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		if (ret == 0)
+			_serverRunning = 1;
+	}
+
+	if (ret != 0)
+		metrics_server_stop();
+
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+void metrics_server_stop(void)
+{
+	log_enter("");
+
+	if (_serverRunning) {
+		if (write(_stopPipe[1], "", 1) == -1)
+			log_warning("Unable to stop the metrics server: %i", errno);
+
+		pthread_join(_serverThread, NULL);
+		_serverRunning = 0;
+	}
+
+	for (size_t i = 0; i < sizeof(_stopPipe) / sizeof(_stopPipe[0]); ++i) {
+		if (_stopPipe[i] != -1) {
+			close(_stopPipe[i]);
+			_stopPipe[i] = -1;
+		}
+	}
+
+	if (_listenFD != -1) {
+		close(_listenFD);
+		_listenFD = -1;
+		unlink(_socketPath);
+	}
+
+	free(_socketPath);
+	_socketPath = NULL;
+
+	log_exit("void");
+	return;
+}
@@ -0,0 +1,60 @@
+
+#pragma once
+
+
+#include <stdio.h>
+#include <stddef.h>
+
+
+/*
+ * AT command instrumentation, kept per verb (CGNSINF, CMGS, ...): a
+ * log-linear latency histogram with METRICS_SUB_BUCKETS buckets per power
+ * of two microseconds, result counters and bytes sent and received.
+ */
+
+#define METRICS_VERB_MAX				64
+#define METRICS_VERB_LENGTH				16
+#define METRICS_SUB_BUCKETS				4
+#define METRICS_BUCKETS					108
+/* Classes of jobs timed from their submission to their completion */
+#define METRICS_JOB_CLASS_MAX			8
+
+/* Timeouts: the learned one is a multiple of the 99th percentile, clamped to the minimum and to the default of the verb */
+#define METRICS_TIMEOUT_DEFAULT_MS		4000
+#define METRICS_TIMEOUT_MIN_MS			1000
+#define METRICS_TIMEOUT_MULTIPLIER		3
+#define METRICS_TIMEOUT_SAMPLES_MIN		20
+
+typedef enum _EMetricsResult {
+	mrOK,
+	mrError,
+	mrTimeout,
+	mrMax,
+} EMetricsResult, *PEMetricsResult;
+
+typedef struct _METRICS_VERB {
+	char Name[METRICS_VERB_LENGTH];
+	unsigned long Results[mrMax];
+	unsigned long long TxBytes;
+	unsigned long long RxBytes;
+	unsigned long long DurationSum;
+	EMetricsResult LastResult;
+	unsigned long Buckets[METRICS_BUCKETS];
+} METRICS_VERB, *PMETRICS_VERB;
+
+typedef struct _METRICS_JOB_CLASS {
+	char Name[METRICS_VERB_LENGTH];
+	unsigned long long DurationSum;
+	unsigned long Buckets[METRICS_BUCKETS];
+} METRICS_JOB_CLASS, *PMETRICS_JOB_CLASS;
+
+
+void metrics_command_begin(const char* Command);
+void metrics_command_end(EMetricsResult Result);
+void metrics_bytes(int Tx, size_t Length);
+int metrics_command_timeout(void);
+void metrics_job_end(const char* Class, unsigned long long Microseconds);
+void metrics_arena_event(unsigned long Allocations, size_t Bytes);
+int metrics_write(FILE* Stream);
+int metrics_server_start(const char* Path);
+void metrics_server_stop(void);
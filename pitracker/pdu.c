@@ -0,0 +1,908 @@
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include "logging.h"
+#include "pdu.h"
+
+
+
+#define PDU_FIRST_OCTET_MTI_MASK		0x03
+#define PDU_FIRST_OCTET_MTI_DELIVER		0x00
+#define PDU_FIRST_OCTET_MTI_SUBMIT		0x01
+#define PDU_FIRST_OCTET_VPF_RELATIVE	0x10
+#define PDU_FIRST_OCTET_UDHI			0x40
+
+#define PDU_TOA_INTERNATIONAL			0x91
+#define PDU_TOA_UNKNOWN					0x81
+#define PDU_TOA_ALPHANUMERIC			0x50
+#define PDU_TOA_TON_MASK				0x70
+
+#define PDU_UDH_IEI_CONCAT8				0x00
+#define PDU_UDH_IEI_CONCAT16			0x08
+#define PDU_UDH_CONCAT8_LENGTH			6
+
+#define PDU_GSM7_ESCAPE					0x1B
+#define PDU_GSM7_SINGLE_SEPTETS			160
+#define PDU_GSM7_CONCAT_SEPTETS			153
+#define PDU_OCTETS_SINGLE				140
+#define PDU_OCTETS_CONCAT				134
+
+
+/* GSM 03.38 default alphabet */
+static const unsigned short _gsm7Basic[128] = {
+	0x0040, 0x00A3, 0x0024, 0x00A5, 0x00E8, 0x00E9, 0x00F9, 0x00EC, 0x00F2, 0x00C7, 0x000A, 0x00D8, 0x00F8, 0x000D, 0x00C5, 0x00E5,
+	0x0394, 0x005F, 0x03A6, 0x0393, 0x039B, 0x03A9, 0x03A0, 0x03A8, 0x03A3, 0x0398, 0x039E, 0x00A0, 0x00C6, 0x00E6, 0x00DF, 0x00C9,
+	0x0020, 0x0021, 0x0022, 0x0023, 0x00A4, 0x0025, 0x0026, 0x0027, 0x0028, 0x0029, 0x002A, 0x002B, 0x002C, 0x002D, 0x002E, 0x002F,
+	0x0030, 0x0031, 0x0032, 0x0033, 0x0034, 0x0035, 0x0036, 0x0037, 0x0038, 0x0039, 0x003A, 0x003B, 0x003C, 0x003D, 0x003E, 0x003F,
+	0x00A1, 0x0041, 0x0042, 0x0043, 0x0044, 0x0045, 0x0046, 0x0047, 0x0048, 0x0049, 0x004A, 0x004B, 0x004C, 0x004D, 0x004E, 0x004F,
+	0x0050, 0x0051, 0x0052, 0x0053, 0x0054, 0x0055, 0x0056, 0x0057, 0x0058, 0x0059, 0x005A, 0x00C4, 0x00D6, 0x00D1, 0x00DC, 0x00A7,
+	0x00BF, 0x0061, 0x0062, 0x0063, 0x0064, 0x0065, 0x0066, 0x0067, 0x0068, 0x0069, 0x006A, 0x006B, 0x006C, 0x006D, 0x006E, 0x006F,
+	0x0070, 0x0071, 0x0072, 0x0073, 0x0074, 0x0075, 0x0076, 0x0077, 0x0078, 0x0079, 0x007A, 0x00E4, 0x00F6, 0x00F1, 0x00FC, 0x00E0,
+};
+
+typedef struct _GSM7_EXTENSION {
+	unsigned char Septet;
+	unsigned short CodePoint;
+} GSM7_EXTENSION, *PGSM7_EXTENSION;
+
+static const GSM7_EXTENSION _gsm7Extension[] = {
+	{0x0A, 0x000C},
+	{0x14, 0x005E},
+	{0x28, 0x007B},
+	{0x29, 0x007D},
+	{0x2F, 0x005C},
+	{0x3C, 0x005B},
+	{0x3D, 0x007E},
+	{0x3E, 0x005D},
+	{0x40, 0x007C},
+	{0x65, 0x20AC},
+};
+
+/* Hex digit values, 0xFF for invalid characters */
+static unsigned char _hexValues[256];
+static int _hexValuesInitialized = 0;
+static unsigned char _concatReference = 0;
+
+
+typedef struct _PDU_CONCAT_GROUP {
+	int Used;
+	unsigned long Age;
+	char Address[PDU_ADDRESS_MAX];
+	int Reference;
+	int PartCount;
+	int Present[PDU_CONCAT_MAX_PARTS];
+	int Indices[PDU_CONCAT_MAX_PARTS];
+	PDU_MESSAGE Parts[PDU_CONCAT_MAX_PARTS];
+} PDU_CONCAT_GROUP, *PPDU_CONCAT_GROUP;
+
+static PDU_CONCAT_GROUP _concatGroups[PDU_CONCAT_MAX_GROUPS];
+static unsigned long _concatAge = 0;
+
+
+static void _hex_values_init(void)
+{
+	if (!_hexValuesInitialized) {
+		memset(_hexValues, 0xFF, sizeof(_hexValues));
+		for (int i = 0; i < 10; ++i)
+			_hexValues['0' + i] = (unsigned char)i;
+
+		for (int i = 0; i < 6; ++i) {
+			_hexValues['a' + i] = (unsigned char)(10 + i);
+			_hexValues['A' + i] = (unsigned char)(10 + i);
+		}
+
+		_hexValuesInitialized = 1;
+	}
+
+	return;
+}
+
+
+static uint64_t _load_le64(const unsigned char* Data, size_t Available)
+{
+	uint64_t ret = 0;
+
+	if (Available > sizeof(ret))
+		Available = sizeof(ret);
+
+	for (size_t i = 0; i < Available; ++i)
+		ret |= ((uint64_t)Data[i]) << (i * 8);
+
+	return ret;
+}
+
+
+static size_t _utf8_put(unsigned long CodePoint, unsigned char* Out)
+{
+	size_t ret = 0;
+
+	if (CodePoint < 0x80) {
+		Out[0] = (unsigned char)CodePoint;
+		ret = 1;
+	} else if (CodePoint < 0x800) {
+		Out[0] = (unsigned char)(0xC0 | (CodePoint >> 6));
+		Out[1] = (unsigned char)(0x80 | (CodePoint & 0x3F));
+		ret = 2;
+	} else if (CodePoint < 0x10000) {
+		Out[0] = (unsigned char)(0xE0 | (CodePoint >> 12));
+		Out[1] = (unsigned char)(0x80 | ((CodePoint >> 6) & 0x3F));
+		Out[2] = (unsigned char)(0x80 | (CodePoint & 0x3F));
+		ret = 3;
+	} else {
+		Out[0] = (unsigned char)(0xF0 | (CodePoint >> 18));
+		Out[1] = (unsigned char)(0x80 | ((CodePoint >> 12) & 0x3F));
+		Out[2] = (unsigned char)(0x80 | ((CodePoint >> 6) & 0x3F));
+		Out[3] = (unsigned char)(0x80 | (CodePoint & 0x3F));
+		ret = 4;
+	}
+
+	return ret;
+}
+
+
+static const char* _utf8_get(const char* Text, unsigned long* CodePoint)
+{
+	const unsigned char* t = (const unsigned char*)Text;
+	unsigned long cp = 0;
+	size_t extra = 0;
+
+	if (t[0] < 0x80) {
+		cp = t[0];
+	} else if ((t[0] & 0xE0) == 0xC0) {
+		cp = t[0] & 0x1F;
+		extra = 1;
+	} else if ((t[0] & 0xF0) == 0xE0) {
+		cp = t[0] & 0x0F;
+		extra = 2;
+	} else if ((t[0] & 0xF8) == 0xF0) {
+		cp = t[0] & 0x07;
+		extra = 3;
+	} else cp = '?';
+
+	++t;
+	for (size_t i = 0; i < extra; ++i) {
+		if ((*t & 0xC0) != 0x80) {
+			cp = '?';
+			break;
+		}
+
+		cp = (cp << 6) | (*t & 0x3F);
+		++t;
+	}
+
+	*CodePoint = cp;
+	return (const char*)t;
+}
+
+
+static int _gsm7_from_code_point(unsigned long CodePoint, unsigned char* Septets, size_t* Count)
+{
+	int ret = ENOENT;
+
+	for (size_t i = 0; i < sizeof(_gsm7Basic) / sizeof(_gsm7Basic[0]); ++i) {
+		if (_gsm7Basic[i] == CodePoint && i != PDU_GSM7_ESCAPE) {
+			Septets[0] = (unsigned char)i;
+			*Count = 1;
+			ret = 0;
+			break;
+		}
+	}
+
+	if (ret == ENOENT) {
+		for (size_t i = 0; i < sizeof(_gsm7Extension) / sizeof(_gsm7Extension[0]); ++i) {
+			if (_gsm7Extension[i].CodePoint == CodePoint) {
+				Septets[0] = PDU_GSM7_ESCAPE;
+				Septets[1] = _gsm7Extension[i].Septet;
+				*Count = 2;
+				ret = 0;
+				break;
+			}
+		}
+	}
+
+	return ret;
+}
+
+
+static size_t _gsm7_to_utf8(const unsigned char* Septets, size_t Count, unsigned char* Out, size_t OutSize)
+{
+	size_t ret = 0;
+	unsigned long cp = 0;
+	unsigned char tmp[4];
+	size_t len = 0;
+
+	for (size_t i = 0; i < Count; ++i) {
+		cp = _gsm7Basic[Septets[i] & 0x7F];
+		if (Septets[i] == PDU_GSM7_ESCAPE && i + 1 < Count) {
+			++i;
+			cp = ' ';
+			for (size_t j = 0; j < sizeof(_gsm7Extension) / sizeof(_gsm7Extension[0]); ++j) {
+				if (_gsm7Extension[j].Septet == Septets[i]) {
+					cp = _gsm7Extension[j].CodePoint;
+					break;
+				}
+			}
+		}
+
+		len = _utf8_put(cp, tmp);
+		if (ret + len >= OutSize)
+			break;
+
+		memcpy(Out + ret, tmp, len);
+		ret += len;
+	}
+
+	Out[ret] = '\0';
+
+	return ret;
+}
+
+
+static size_t _ucs2_to_utf8(const unsigned char* Data, size_t Length, unsigned char* Out, size_t OutSize)
+{
+	size_t ret = 0;
+	unsigned long cp = 0;
+	unsigned long low = 0;
+	unsigned char tmp[4];
+	size_t len = 0;
+
+	for (size_t i = 0; i + 1 < Length; i += 2) {
+		cp = ((unsigned long)Data[i] << 8) | Data[i + 1];
+		if (cp >= 0xD800 && cp < 0xDC00 && i + 3 < Length) {
+			low = ((unsigned long)Data[i + 2] << 8) | Data[i + 3];
+			if (low >= 0xDC00 && low < 0xE000) {
+				cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+				i += 2;
+			}
+		}
+
+		len = _utf8_put(cp, tmp);
+		if (ret + len >= OutSize)
+			break;
+
+		memcpy(Out + ret, tmp, len);
+		ret += len;
+	}
+
+	Out[ret] = '\0';
+
+	return ret;
+}
+
+
+static int _address_encode(const char* Phone, char* Hex)
+{
+	int ret = 0;
+	size_t digits = 0;
+	unsigned char toa = PDU_TOA_UNKNOWN;
+	char* tmp = NULL;
+
+	if (*Phone == '+') {
+		toa = PDU_TOA_INTERNATIONAL;
+		++Phone;
+	}
+
+	digits = strlen(Phone);
+	if (digits == 0 || digits > PDU_ADDRESS_MAX / 2 * 2 - 2)
+		ret = EINVAL;
+
+	for (size_t i = 0; ret == 0 && i < digits; ++i) {
+		if (Phone[i] < '0' || Phone[i] > '9')
+			ret = EINVAL;
+	}
+
+	if (ret == 0) {
+		tmp = Hex + sprintf(Hex, "%02X%02X", (unsigned int)digits, toa);
+		for (size_t i = 0; i < digits; i += 2) {
+			*tmp++ = (i + 1 < digits) ? Phone[i + 1] : 'F';
+			*tmp++ = Phone[i];
+		}
+
+		*tmp = '\0';
+	}
+
+	return ret;
+}
+
+
+static size_t _address_decode(const unsigned char* Data, size_t Length, char* Address)
+{
+	size_t ret = 0;
+	size_t digits = 0;
+	size_t octets = 0;
+	unsigned char toa = 0;
+	char* tmp = Address;
+
+	*Address = '\0';
+	if (Length < 2)
+		return 0;
+
+	digits = Data[0];
+	toa = Data[1];
+	octets = (digits + 1) / 2;
+	if (2 + octets > Length)
+		return 0;
+
+	if ((toa & PDU_TOA_TON_MASK) == PDU_TOA_ALPHANUMERIC) {
+		unsigned char septets[PDU_ADDRESS_MAX];
+		size_t septetCount = digits * 4 / 7;
+
+		if (septetCount >= sizeof(septets))
+			septetCount = sizeof(septets) - 1;
+
+		pdu_septets_unpack(Data + 2, octets, 0, septetCount, septets);
+		_gsm7_to_utf8(septets, septetCount, (unsigned char*)Address, PDU_ADDRESS_MAX);
+	} else {
+		if ((toa & PDU_TOA_TON_MASK) == (PDU_TOA_INTERNATIONAL & PDU_TOA_TON_MASK))
+			*tmp++ = '+';
+
+		for (size_t i = 0; i < digits && tmp - Address < PDU_ADDRESS_MAX - 1; ++i) {
+			unsigned char d = (i & 1) ? (Data[2 + i / 2] >> 4) : (Data[2 + i / 2] & 0xF);
+
+			*tmp++ = (d < 10) ? (char)('0' + d) : '?';
+		}
+
+		*tmp = '\0';
+	}
+
+	ret = 2 + octets;
+
+	return ret;
+}
+
+
+static unsigned int _semi_octet(unsigned char Value)
+{
+	return (Value & 0xF) * 10 + (Value >> 4);
+}
+
+
+int pdu_is_hex(const char* Hex, size_t Length)
+{
+	int ret = 1;
+	const unsigned char* h = (const unsigned char*)Hex;
+
+	_hex_values_init();
+	if ((Length % 2) != 0)
+		ret = 0;
+
+	for (size_t i = 0; ret && i < Length; ++i)
+		ret = (_hexValues[h[i]] != 0xFF);
+
+	return ret;
+}
+
+
+/* Decodes eight hex digits per step as a SWAR word, the hex string is expected to be validated. */
+size_t pdu_hex_decode(const char* Hex, size_t Length, unsigned char* Data)
+{
+	size_t ret = 0;
+	const unsigned char* h = (const unsigned char*)Hex;
+	uint64_t w = 0;
+	uint64_t v = 0;
+
+	ret = Length / 2;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	while (Length >= 8) {
+		memcpy(&w, h, sizeof(w));
+		/* '0'-'9' have bit 6 clear, 'A'-'F' and 'a'-'f' have it set and need +9 */
+		v = (w & 0x0F0F0F0F0F0F0F0FULL) + ((w >> 6) & 0x0101010101010101ULL) * 9;
+		v = ((v & 0x00FF00FF00FF00FFULL) << 4) | ((v >> 8) & 0x00FF00FF00FF00FFULL);
+		v = (v | (v >> 8)) & 0x0000FFFF0000FFFFULL;
+		v = (v | (v >> 16)) & 0x00000000FFFFFFFFULL;
+		Data[0] = (unsigned char)v;
+		Data[1] = (unsigned char)(v >> 8);
+		Data[2] = (unsigned char)(v >> 16);
+		Data[3] = (unsigned char)(v >> 24);
+		Data += 4;
+		h += 8;
+		Length -= 8;
+	}
+#endif
+	_hex_values_init();
+	while (Length >= 2) {
+		*Data = (unsigned char)((_hexValues[h[0]] << 4) | _hexValues[h[1]]);
+		++Data;
+		h += 2;
+		Length -= 2;
+	}
+
+	return ret;
+}
+
+
+void pdu_hex_encode(const unsigned char* Data, size_t Length, char* Hex)
+{
+	static const char digits[] = "0123456789ABCDEF";
+
+	for (size_t i = 0; i < Length; ++i) {
+		*Hex++ = digits[Data[i] >> 4];
+		*Hex++ = digits[Data[i] & 0xF];
+	}
+
+	*Hex = '\0';
+
+	return;
+}
+
+
+/* Extracts eight septets per 64-bit load; BitOffset accounts for the UDH fill bits. */
+void pdu_septets_unpack(const unsigned char* Data, size_t Length, size_t BitOffset, size_t SeptetCount, unsigned char* Septets)
+{
+	size_t bit = BitOffset;
+	size_t byte = 0;
+	uint64_t w = 0;
+
+	while (SeptetCount >= 8 && (bit >> 3) < Length) {
+		byte = bit >> 3;
+		w = _load_le64(Data + byte, Length - byte) >> (bit & 7);
+
+		Septets[0] = (unsigned char)(w & 0x7F);
+		Septets[1] = (unsigned char)((w >> 7) & 0x7F);
+		Septets[2] = (unsigned char)((w >> 14) & 0x7F);
+		Septets[3] = (unsigned char)((w >> 21) & 0x7F);
+		Septets[4] = (unsigned char)((w >> 28) & 0x7F);
+		Septets[5] = (unsigned char)((w >> 35) & 0x7F);
+		Septets[6] = (unsigned char)((w >> 42) & 0x7F);
+		Septets[7] = (unsigned char)((w >> 49) & 0x7F);
+		Septets += 8;
+		SeptetCount -= 8;
+		bit += 56;
+	}
+
+	while (SeptetCount > 0) {
+		byte = bit >> 3;
+		w = (byte < Length) ? Data[byte] : 0;
+		if (byte + 1 < Length)
+			w |= ((uint64_t)Data[byte + 1]) << 8;
+
+		*Septets = (unsigned char)((w >> (bit & 7)) & 0x7F);
+		++Septets;
+		--SeptetCount;
+		bit += 7;
+	}
+
+	return;
+}
+
+
+void pdu_septets_pack(const unsigned char* Septets, size_t SeptetCount, size_t BitOffset, unsigned char* Data)
+{
+	size_t bit = BitOffset;
+	size_t byte = 0;
+
+	for (size_t i = 0; i < SeptetCount; ++i) {
+		byte = bit >> 3;
+		Data[byte] |= (unsigned char)((Septets[i] & 0x7F) << (bit & 7));
+		if ((bit & 7) > 1)
+			Data[byte + 1] |= (unsigned char)((Septets[i] & 0x7F) >> (8 - (bit & 7)));
+
+		bit += 7;
+	}
+
+	return;
+}
+
+
+int pdu_deliver_decode(const char* Hex, PPDU_MESSAGE Message)
+{
+	int ret = 0;
+	size_t hexLen = 0;
+	size_t len = 0;
+	size_t pos = 0;
+	size_t tmp = 0;
+	unsigned char firstOctet = 0;
+	unsigned char dcs = 0;
+	unsigned char udl = 0;
+	size_t udhLen = 0;
+	unsigned char data[PDU_HEX_MAX / 2 + 1];
+	log_enter("Hex=\"%s\"; Message=0x%p", Hex, Message);
+
+	memset(Message, 0, sizeof(PDU_MESSAGE));
+	Message->PartCount = 1;
+	Message->PartNo = 1;
+	hexLen = strlen(Hex);
+	if (hexLen / 2 > sizeof(data) || !pdu_is_hex(Hex, hexLen))
+		ret = EINVAL;
+
+	if (ret == 0) {
+		len = pdu_hex_decode(Hex, hexLen, data);
+		/* SMSC information */
+		pos = 1 + (size_t)data[0];
+		if (pos + 1 >= len)
+			ret = EINVAL;
+	}
+
+	if (ret == 0) {
+		firstOctet = data[pos];
+		++pos;
+		if ((firstOctet & PDU_FIRST_OCTET_MTI_MASK) != PDU_FIRST_OCTET_MTI_DELIVER)
+			ret = ENOTSUP;
+	}
+
+	if (ret == 0) {
+		tmp = _address_decode(data + pos, len - pos, Message->Address);
+		if (tmp == 0)
+			ret = EINVAL;
+
+		pos += tmp;
+		/* PID, DCS, SCTS (7), UDL */
+		if (ret == 0 && pos + 10 > len)
+			ret = EINVAL;
+	}
+
+	if (ret == 0) {
+		const unsigned char* ts = NULL;
+
+		dcs = data[pos + 1];
+		ts = data + pos + 2;
+		snprintf(Message->Timestamp, sizeof(Message->Timestamp), "%02u/%02u/%02u,%02u:%02u:%02u%c%02u",
+			_semi_octet(ts[0]), _semi_octet(ts[1]), _semi_octet(ts[2]),
+			_semi_octet(ts[3]), _semi_octet(ts[4]), _semi_octet(ts[5]),
+			(ts[6] & 0x08) ? '-' : '+', _semi_octet(ts[6] & 0xF7));
+		udl = data[pos + 9];
+		pos += 10;
+		if ((dcs & 0xC0) == 0x00 || (dcs & 0xC0) == 0x40) {
+			switch ((dcs >> 2) & 0x3) {
+				case 1:
+					Message->DataCoding = pdc8Bit;
+					break;
+				case 2:
+					Message->DataCoding = pdcUCS2;
+					break;
+				default:
+					Message->DataCoding = pdcGSM7;
+					break;
+			}
+		} else if ((dcs & 0xF0) == 0xF0)
+			Message->DataCoding = (dcs & 0x04) ? pdc8Bit : pdcGSM7;
+		else if ((dcs & 0xF0) == 0xE0)
+			Message->DataCoding = pdcUCS2;
+		else Message->DataCoding = pdcGSM7;
+
+		if ((firstOctet & PDU_FIRST_OCTET_UDHI) != 0 && pos < len) {
+			size_t iePos = pos + 1;
+
+			udhLen = (size_t)data[pos] + 1;
+			while (iePos + 1 < pos + udhLen && iePos + 1 < len) {
+				unsigned char iei = data[iePos];
+				unsigned char ieLen = data[iePos + 1];
+
+				if (iePos + 2 + ieLen > len)
+					break;
+
+				if (iei == PDU_UDH_IEI_CONCAT8 && ieLen == 3) {
+					Message->Reference = data[iePos + 2];
+					Message->PartCount = data[iePos + 3];
+					Message->PartNo = data[iePos + 4];
+				} else if (iei == PDU_UDH_IEI_CONCAT16 && ieLen == 4) {
+					Message->Reference = (data[iePos + 2] << 8) | data[iePos + 3];
+					Message->PartCount = data[iePos + 4];
+					Message->PartNo = data[iePos + 5];
+				}
+
+				iePos += 2 + (size_t)ieLen;
+			}
+		}
+
+		switch (Message->DataCoding) {
+			case pdcGSM7: {
+				unsigned char septets[PDU_GSM7_SINGLE_SEPTETS];
+				size_t skip = (udhLen * 8 + 6) / 7;
+				size_t count = udl;
+
+				if (count > PDU_GSM7_SINGLE_SEPTETS)
+					count = PDU_GSM7_SINGLE_SEPTETS;
+
+				if (skip > count)
+					skip = count;
+
+				pdu_septets_unpack(data + pos, len - pos, skip * 7, count - skip, septets);
+				Message->DataLength = _gsm7_to_utf8(septets, count - skip, Message->Data, sizeof(Message->Data));
+			} break;
+			case pdcUCS2:
+				if (udl > len - pos)
+					udl = (unsigned char)(len - pos);
+
+				if (udhLen > udl)
+					udhLen = udl;
+
+				Message->DataLength = _ucs2_to_utf8(data + pos + udhLen, udl - udhLen, Message->Data, sizeof(Message->Data));
+				break;
+			case pdc8Bit:
+				if (udl > len - pos)
+					udl = (unsigned char)(len - pos);
+
+				if (udhLen > udl)
+					udhLen = udl;
+
+				Message->DataLength = udl - udhLen;
+				memcpy(Message->Data, data + pos + udhLen, Message->DataLength);
+				Message->Data[Message->DataLength] = '\0';
+				break;
+		}
+
+		if (Message->PartCount == 0 || Message->PartNo == 0 || Message->PartNo > Message->PartCount) {
+			Message->PartCount = 1;
+			Message->PartNo = 1;
+		}
+	}
+
+	log_exit("%i, Address=\"%s\", DataLength=%zu, Part=%i/%i", ret, Message->Address, Message->DataLength, Message->PartNo, Message->PartCount);
+	return ret;
+}
+
+
+int pdu_submit_encode(const char* Phone, EPDUDataCoding DataCoding, const unsigned char* Data, size_t Length, PPDU_SUBMIT_PART* Parts, size_t* Count)
+{
+	int ret = 0;
+	size_t partCapacity = 0;
+	size_t partCount = 0;
+	size_t offset = 0;
+	size_t chunks[PDU_CONCAT_MAX_PARTS];
+	char address[PDU_ADDRESS_MAX * 2];
+	int concatenated = 0;
+	unsigned char reference = 0;
+	PPDU_SUBMIT_PART tmpParts = NULL;
+	log_enter("Phone=\"%s\"; DataCoding=%u; Data=0x%p; Length=%zu; Parts=0x%p; Count=0x%p", Phone, DataCoding, Data, Length, Parts, Count);
+
+	ret = _address_encode(Phone, address);
+	if (ret == 0) {
+		partCapacity = (DataCoding == pdcGSM7) ? PDU_GSM7_SINGLE_SEPTETS : PDU_OCTETS_SINGLE;
+		if (Length > partCapacity) {
+			partCapacity = (DataCoding == pdcGSM7) ? PDU_GSM7_CONCAT_SEPTETS : PDU_OCTETS_CONCAT;
+			concatenated = 1;
+			/* Skip zero when the 8-bit reference wraps */
+			if (++_concatReference == 0)
+				++_concatReference;
+
+			reference = _concatReference;
+		}
+	}
+
+	/* Split on unit boundaries so that escape sequences and surrogate pairs stay together */
+	while (ret == 0 && (offset < Length || partCount == 0)) {
+		size_t chunk = Length - offset;
+
+		if (partCount == PDU_CONCAT_MAX_PARTS) {
+			ret = E2BIG;
+			break;
+		}
+
+		if (chunk > partCapacity) {
+			chunk = partCapacity;
+			if (DataCoding == pdcGSM7 && Data[offset + chunk - 1] == PDU_GSM7_ESCAPE)
+				--chunk;
+
+			if (DataCoding == pdcUCS2 && (Data[offset + chunk - 2] & 0xFC) == 0xD8)
+				chunk -= 2;
+		}
+
+		chunks[partCount] = chunk;
+		offset += chunk;
+		++partCount;
+	}
+
+	if (ret == 0) {
+		tmpParts = calloc(partCount, sizeof(PDU_SUBMIT_PART));
+		if (tmpParts == NULL)
+			ret = ENOMEM;
+	}
+
+	offset = 0;
+	for (size_t i = 0; ret == 0 && i < partCount; ++i) {
+		PPDU_SUBMIT_PART p = tmpParts + i;
+		unsigned char ud[PDU_USER_DATA_OCTETS];
+		size_t udLength = 0;
+		size_t udl = 0;
+		size_t header = 0;
+		unsigned char firstOctet = PDU_FIRST_OCTET_MTI_SUBMIT | PDU_FIRST_OCTET_VPF_RELATIVE;
+		unsigned char dcs = 0x00;
+
+		memset(ud, 0, sizeof(ud));
+		if (concatenated) {
+			firstOctet |= PDU_FIRST_OCTET_UDHI;
+			ud[0] = PDU_UDH_CONCAT8_LENGTH - 1;
+			ud[1] = PDU_UDH_IEI_CONCAT8;
+			ud[2] = 3;
+			ud[3] = reference;
+			ud[4] = (unsigned char)partCount;
+			ud[5] = (unsigned char)(i + 1);
+			header = PDU_UDH_CONCAT8_LENGTH;
+		}
+
+		switch (DataCoding) {
+			case pdcGSM7: {
+				size_t headerSeptets = (header * 8 + 6) / 7;
+
+				dcs = 0x00;
+				pdu_septets_pack(Data + offset, chunks[i], headerSeptets * 7, ud);
+				udl = headerSeptets + chunks[i];
+				udLength = (udl * 7 + 7) / 8;
+			} break;
+			case pdc8Bit:
+			case pdcUCS2:
+				dcs = (DataCoding == pdcUCS2) ? 0x08 : 0x04;
+				memcpy(ud + header, Data + offset, chunks[i]);
+				udl = header + chunks[i];
+				udLength = udl;
+				break;
+		}
+
+		/* Default SMSC, no message reference, relative validity of four days */
+		snprintf(p->Hex, sizeof(p->Hex), "00%02X00%s00%02XAA%02X", firstOctet, address, dcs, (unsigned int)udl);
+		pdu_hex_encode(ud, udLength, p->Hex + strlen(p->Hex));
+		p->TPDULength = strlen(p->Hex) / 2 - 1;
+		offset += chunks[i];
+	}
+
+	if (ret == 0) {
+		*Parts = tmpParts;
+		*Count = partCount;
+	}
+
+	if (ret != 0)
+		free(tmpParts);
+
+	log_exit("%i, *Count=%zu", ret, *Count);
+	return ret;
+}
+
+
+int pdu_submit_encode_text(const char* Phone, const char* Text, PPDU_SUBMIT_PART* Parts, size_t* Count)
+{
+	int ret = 0;
+	size_t len = 0;
+	size_t count = 0;
+	unsigned long cp = 0;
+	unsigned char* buf = NULL;
+	EPDUDataCoding dataCoding = pdcGSM7;
+	const char* t = NULL;
+	log_enter("Phone=\"%s\"; Text=\"%s\"; Parts=0x%p; Count=0x%p", Phone, Text, Parts, Count);
+
+	/* Either two septets or up to four UCS-2 octets per character */
+	buf = malloc(strlen(Text) * 4 + 1);
+	if (buf == NULL)
+		ret = ENOMEM;
+
+	if (ret == 0) {
+		t = Text;
+		while (*t != '\0') {
+			t = _utf8_get(t, &cp);
+			if (_gsm7_from_code_point(cp, buf + len, &count) != 0) {
+				dataCoding = pdcUCS2;
+				break;
+			}
+
+			len += count;
+		}
+
+		if (dataCoding == pdcUCS2) {
+			len = 0;
+			t = Text;
+			while (*t != '\0') {
+				t = _utf8_get(t, &cp);
+				if (cp >= 0x10000) {
+					unsigned long high = 0xD800 + ((cp - 0x10000) >> 10);
+					unsigned long low = 0xDC00 + ((cp - 0x10000) & 0x3FF);
+
+					buf[len++] = (unsigned char)(high >> 8);
+					buf[len++] = (unsigned char)high;
+					cp = low;
+				}
+
+				buf[len++] = (unsigned char)(cp >> 8);
+				buf[len++] = (unsigned char)cp;
+			}
+		}
+
+		ret = pdu_submit_encode(Phone, dataCoding, buf, len, Parts, Count);
+		free(buf);
+	}
+
+	log_exit("%i, *Count=%zu", ret, *Count);
+	return ret;
+}
+
+
+void pdu_submit_free(PPDU_SUBMIT_PART Parts, size_t Count)
+{
+	log_enter("Parts=0x%p; Count=%zu", Parts, Count);
+
+	free(Parts);
+
+	log_exit("void");
+
+	return;
+}
+
+
+int pdu_concat_add(const PDU_MESSAGE* Part, int Index, unsigned char** Data, size_t* DataLength, int** Indices, size_t* IndexCount)
+{
+	int ret = 0;
+	size_t total = 0;
+	int complete = 1;
+	PPDU_CONCAT_GROUP g = NULL;
+	PPDU_CONCAT_GROUP oldest = NULL;
+	unsigned char* tmpData = NULL;
+	int* tmpIndices = NULL;
+	log_enter("Part=0x%p; Index=%i; Data=0x%p; DataLength=0x%p; Indices=0x%p; IndexCount=0x%p", Part, Index, Data, DataLength, Indices, IndexCount);
+
+	if (Part->PartCount < 1 || Part->PartCount > PDU_CONCAT_MAX_PARTS)
+		ret = E2BIG;
+
+	if (ret == 0) {
+		for (size_t i = 0; i < PDU_CONCAT_MAX_GROUPS; ++i) {
+			PPDU_CONCAT_GROUP c = _concatGroups + i;
+
+			if (c->Used && c->Reference == Part->Reference && c->PartCount == Part->PartCount &&
+				strcmp(c->Address, Part->Address) == 0) {
+				g = c;
+				break;
+			}
+
+			if (oldest == NULL || !c->Used || (oldest->Used && c->Age < oldest->Age))
+				oldest = c;
+		}
+
+		if (g == NULL) {
+			g = oldest;
+			if (g->Used)
+				log_warning("Dropping incomplete concatenated message %i from %s", g->Reference, g->Address);
+
+			memset(g, 0, sizeof(PDU_CONCAT_GROUP));
+			g->Used = 1;
+			g->Reference = Part->Reference;
+			g->PartCount = Part->PartCount;
+			snprintf(g->Address, sizeof(g->Address), "%s", Part->Address);
+		}
+
+		g->Age = ++_concatAge;
+		g->Parts[Part->PartNo - 1] = *Part;
+		g->Indices[Part->PartNo - 1] = Index;
+		g->Present[Part->PartNo - 1] = 1;
+		for (int i = 0; i < g->PartCount; ++i) {
+			complete &= g->Present[i];
+			total += g->Parts[i].DataLength;
+		}
+
+		if (!complete)
+			ret = EAGAIN;
+	}
+
+	if (ret == 0) {
+		tmpData = malloc(total + 1);
+		tmpIndices = calloc((unsigned int)g->PartCount, sizeof(int));
+		if (tmpData == NULL || tmpIndices == NULL)
+			ret = ENOMEM;
+
+		if (ret == 0) {
+			total = 0;
+			for (int i = 0; i < g->PartCount; ++i) {
+				memcpy(tmpData + total, g->Parts[i].Data, g->Parts[i].DataLength);
+				total += g->Parts[i].DataLength;
+				tmpIndices[i] = g->Indices[i];
+			}
+
+			tmpData[total] = '\0';
+			*Data = tmpData;
+			*DataLength = total;
+			*Indices = tmpIndices;
+			*IndexCount = (size_t)g->PartCount;
+			g->Used = 0;
+		}
+
+		if (ret != 0) {
+			free(tmpIndices);
+			free(tmpData);
+		}
+	}
+
+	log_exit("%i", ret);
+	return ret;
+}
@@ -0,0 +1,52 @@
+
+#pragma once
+
+
+#include <stddef.h>
+
+
+#define PDU_ADDRESS_MAX					32
+#define PDU_TIMESTAMP_MAX				32
+#define PDU_USER_DATA_OCTETS			140
+#define PDU_USER_DATA_MAX				(160 * 3 + 1)
+#define PDU_CONCAT_MAX_PARTS			8
+#define PDU_CONCAT_MAX_GROUPS			8
+#define PDU_HEX_MAX						((1 + 12 + 1 + 1 + 1 + PDU_ADDRESS_MAX / 2 + 1 + 1 + 1 + 1 + PDU_USER_DATA_OCTETS) * 2 + 1)
+
+
+typedef enum _EPDUDataCoding {
+	pdcGSM7,
+	pdc8Bit,
+	pdcUCS2,
+} EPDUDataCoding, *PEPDUDataCoding;
+
+typedef struct _PDU_MESSAGE {
+	char Address[PDU_ADDRESS_MAX];
+	char Timestamp[PDU_TIMESTAMP_MAX];
+	EPDUDataCoding DataCoding;
+	/* UTF-8 text for pdcGSM7 and pdcUCS2, raw octets for pdc8Bit */
+	unsigned char Data[PDU_USER_DATA_MAX];
+	size_t DataLength;
+	int Reference;
+	int PartCount;
+	int PartNo;
+} PDU_MESSAGE, *PPDU_MESSAGE;
+
+typedef struct _PDU_SUBMIT_PART {
+	char Hex[PDU_HEX_MAX];
+	size_t TPDULength;
+} PDU_SUBMIT_PART, *PPDU_SUBMIT_PART;
+
+
+int pdu_is_hex(const char* Hex, size_t Length);
+size_t pdu_hex_decode(const char* Hex, size_t Length, unsigned char* Data);
+void pdu_hex_encode(const unsigned char* Data, size_t Length, char* Hex);
+void pdu_septets_unpack(const unsigned char* Data, size_t Length, size_t BitOffset, size_t SeptetCount, unsigned char* Septets);
+void pdu_septets_pack(const unsigned char* Septets, size_t SeptetCount, size_t BitOffset, unsigned char* Data);
+
+int pdu_deliver_decode(const char* Hex, PPDU_MESSAGE Message);
+int pdu_submit_encode(const char* Phone, EPDUDataCoding DataCoding, const unsigned char* Data, size_t Length, PPDU_SUBMIT_PART* Parts, size_t* Count);
+int pdu_submit_encode_text(const char* Phone, const char* Text, PPDU_SUBMIT_PART* Parts, size_t* Count);
+void pdu_submit_free(PPDU_SUBMIT_PART Parts, size_t Count);
+
+int pdu_concat_add(const PDU_MESSAGE* Part, int Index, unsigned char** Data, size_t* DataLength, int** Indices, size_t* IndexCount);
@@ -0,0 +1,724 @@
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include "logging.h"
+#include "serial-io.h"
+
+
+/*
+ * Head and Tail count bytes since the start, a ring is empty when they
+ * are equal. A side that finds its ring full sets Waiting and checks
+ * again after a full barrier, the other side clears it after a barrier
+ * of its own and signals the eventfd, so no wake-up gets lost.
+ */
+
+
+
+static void _serial_io_signal(int EventFD)
+{
+	uint64_t one = 1;
+
+	while (write(EventFD, &one, sizeof(one)) == -1 && errno == EINTR)
+		;
+
+	return;
+}
+
+
+static void _serial_io_clear(int EventFD)
+{
+	uint64_t value = 0;
+
+	while (read(EventFD, &value, sizeof(value)) == -1 && errno == EINTR)
+		;
+
+	return;
+}
+
+
+/* Contiguous free space at the producer side */
+static size_t _ring_free(PSERIAL_IO_RING Ring, unsigned char** Start)
+{
+	size_t ret = 0;
+	size_t offset = 0;
+
+	offset = Ring->Head & (Ring->Size - 1);
+	ret = Ring->Size - (Ring->Head - __atomic_load_n(&Ring->Tail, __ATOMIC_ACQUIRE));
+	if (ret > Ring->Size - offset)
+		ret = Ring->Size - offset;
+
+	*Start = Ring->Data + offset;
+
+	return ret;
+}
+
+
+/* All free space, wrapped or not */
+static size_t _ring_space(PSERIAL_IO_RING Ring)
+{
+	return Ring->Size - (Ring->Head - __atomic_load_n(&Ring->Tail, __ATOMIC_ACQUIRE));
+}
+
+
+static void _ring_produce(PSERIAL_IO_RING Ring, size_t Length)
+{
+	__atomic_store_n(&Ring->Head, Ring->Head + Length, __ATOMIC_RELEASE);
+
+	return;
+}
+
+
+/* Copies the data in, across the end of the ring if needed; there must be room */
+static void _ring_push(PSERIAL_IO_RING Ring, const unsigned char* Data, size_t Length)
+{
+	size_t len = 0;
+	unsigned char* start = NULL;
+
+	while (Length > 0) {
+		len = _ring_free(Ring, &start);
+		if (len > Length)
+			len = Length;
+
+		memcpy(start, Data, len);
+		_ring_produce(Ring, len);
+		Data += len;
+		Length -= len;
+	}
+
+	return;
+}
+
+
+/* Contiguous data at the consumer side */
+static size_t _ring_used(PSERIAL_IO_RING Ring, const unsigned char** Start)
+{
+	size_t ret = 0;
+	size_t offset = 0;
+
+	offset = Ring->Tail & (Ring->Size - 1);
+	ret = __atomic_load_n(&Ring->Head, __ATOMIC_ACQUIRE) - Ring->Tail;
+	if (ret > Ring->Size - offset)
+		ret = Ring->Size - offset;
+
+	*Start = Ring->Data + offset;
+
+	return ret;
+}
+
+
+/* Releases the space and wakes the producer if it waits for it */
+static void _ring_consume(PSERIAL_IO_RING Ring, size_t Length, int EventFD)
+{
+	__atomic_store_n(&Ring->Tail, Ring->Tail + Length, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&Ring->Waiting, __ATOMIC_RELAXED) && __atomic_exchange_n(&Ring->Waiting, 0, __ATOMIC_ACQ_REL))
+		_serial_io_signal(EventFD);
+
+	return;
+}
+
+
+/* Tells whether Needed bytes fit, the producer may sleep only when they do not */
+static int _ring_wait_prepare(PSERIAL_IO_RING Ring, size_t Needed)
+{
+	int ret = 0;
+
+	__atomic_store_n(&Ring->Waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	ret = (_ring_space(Ring) >= Needed);
+	if (ret)
+		__atomic_store_n(&Ring->Waiting, 0, __ATOMIC_RELAXED);
+
+	return ret;
+}
+
+
+static int _ring_init(PSERIAL_IO_RING Ring, size_t Size)
+{
+	int ret = 0;
+
+	Ring->Size = Size;
+	Ring->Data = malloc(Size);
+	if (Ring->Data == NULL)
+		ret = ENOMEM;
+
+	return ret;
+}
+
+
+static void _serial_io_fail(PSERIAL_IO Io, int Error)
+{
+	if (Error == EPIPE)
+		log_info("HUP from the serial port");
+	else log_error("Serial port error: %i", Error);
+
+	__atomic_store_n(&Io->Error, Error, __ATOMIC_RELEASE);
+	for (int i = 0; i < SERIAL_IO_CHANNELS; ++i)
+		_serial_io_signal(Io->Channels[i].RxEvent);
+
+	_serial_io_signal(Io->SpaceEvent);
+
+	return;
+}
+
+
+static void _serial_io_answer(PSERIAL_IO Io, int Dlci, int Connected)
+{
+	__atomic_store_n(&Io->Channels[Dlci].Connected, Connected, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&Io->Channels[Dlci].Answers, 1, __ATOMIC_RELEASE);
+	_serial_io_signal(Io->Channels[0].RxEvent);
+
+	return;
+}
+
+
+static void _serial_io_frame(int Dlci, ECmuxFrameType Type, const unsigned char* Data, size_t Length, void* Context)
+{
+	PSERIAL_IO io = NULL;
+	PSERIAL_IO_CHANNEL c = NULL;
+
+	io = (PSERIAL_IO)Context;
+	if (Dlci >= SERIAL_IO_CHANNELS)
+		return;
+
+	c = io->Channels + Dlci;
+	switch (Type) {
+		case cftUIH:
+		case cftUI:
+			/* Of the multiplexer control messages only the answer to the close down matters */
+			if (Dlci == 0) {
+				if (Length > 0 && Data[0] == CMUX_CLD_RESPONSE)
+					_serial_io_answer(io, 0, 0);
+			} else if (Length > 0) {
+				if (_ring_space(&c->Rx) >= Length) {
+					_ring_push(&c->Rx, Data, Length);
+					_serial_io_signal(c->RxEvent);
+				} else log_warning("Channel %i full, %zu bytes dropped", Dlci, Length);
+			}
+			break;
+		case cftUA:
+			_serial_io_answer(io, Dlci, c->Pending == cftSABM);
+			break;
+		case cftDM:
+			_serial_io_answer(io, Dlci, 0);
+			break;
+		default:
+			break;
+	}
+
+	return;
+}
+
+
+/* Prepares the next frame to write: a control frame first, then the channels in turn */
+static void _serial_io_frame_next(PSERIAL_IO Io)
+{
+	int control = 0;
+	int dlci = 0;
+	int channel = 0;
+	ECmuxFrameType type = cftUIH;
+	size_t len = 0;
+	const unsigned char* data = NULL;
+	static const unsigned char closeDown[] = {CMUX_CLD_COMMAND, CMUX_EA};
+
+	Io->WireOffset = 0;
+	Io->WireLength = 0;
+	control = __atomic_exchange_n(&Io->Control, 0, __ATOMIC_ACQ_REL);
+	if (control != 0) {
+		--control;
+		dlci = control >> 8;
+		type = (ECmuxFrameType)(control & 0xff);
+		if (type == cftUIH)
+			Io->WireLength = cmux_frame_encode(0, cftUIH, closeDown, sizeof(closeDown), Io->Wire);
+		else Io->WireLength = cmux_frame_encode(dlci, type, NULL, 0, Io->Wire);
+
+		Io->Channels[dlci].Pending = type;
+		return;
+	}
+
+	for (int i = 0; i < SERIAL_IO_CHANNELS - 1; ++i) {
+		channel = 1 + (Io->NextChannel + i) % (SERIAL_IO_CHANNELS - 1);
+		len = _ring_used(&Io->Channels[channel].Tx, &data);
+		if (len > 0) {
+			if (len > CMUX_N1)
+				len = CMUX_N1;
+
+			Io->WireLength = cmux_frame_encode(channel, cftUIH, data, len, Io->Wire);
+			_ring_consume(&Io->Channels[channel].Tx, len, Io->SpaceEvent);
+			Io->NextChannel = channel % (SERIAL_IO_CHANNELS - 1);
+			break;
+		}
+	}
+
+	return;
+}
+
+
+static int _serial_io_tx_pending(PSERIAL_IO Io, int Mux)
+{
+	int ret = 0;
+	const unsigned char* data = NULL;
+
+	if (Mux) {
+		ret = (Io->WireOffset < Io->WireLength || __atomic_load_n(&Io->Control, __ATOMIC_ACQUIRE) != 0);
+		for (int i = 1; !ret && i < SERIAL_IO_CHANNELS; ++i)
+			ret = (_ring_used(&Io->Channels[i].Tx, &data) > 0);
+	} else ret = (_ring_used(&Io->Channels[0].Tx, &data) > 0);
+
+	return ret;
+}
+
+
+/* In CMUX mode a read may complete frames of any open channel, each of them must have room */
+static int _serial_io_rx_space(PSERIAL_IO Io, int Mux)
+{
+	int ret = 1;
+	PSERIAL_IO_RING r = NULL;
+
+	if (Mux) {
+		for (int i = 1; ret && i < SERIAL_IO_CHANNELS; ++i) {
+			r = &Io->Channels[i].Rx;
+			if (__atomic_load_n(&Io->Channels[i].Connected, __ATOMIC_RELAXED))
+				ret = (_ring_space(r) >= 2 * SERIAL_IO_MUX_READ || _ring_wait_prepare(r, 2 * SERIAL_IO_MUX_READ));
+		}
+	} else ret = (_ring_space(&Io->Channels[0].Rx) > 0 || _ring_wait_prepare(&Io->Channels[0].Rx, 1));
+
+	return ret;
+}
+
+
+static void* _serial_io_thread(void* Context)
+{
+	int err = 0;
+	int mux = 0;
+	int m = 0;
+	PSERIAL_IO io = NULL;
+	PSERIAL_IO_CHANNEL raw = NULL;
+	struct pollfd fds[2];
+	unsigned char* start = NULL;
+	const unsigned char* data = NULL;
+	unsigned char buf[SERIAL_IO_MUX_READ];
+	size_t len = 0;
+	ssize_t transmitted = 0;
+
+	io = (PSERIAL_IO)Context;
+	raw = io->Channels;
+	memset(fds, 0, sizeof(fds));
+	fds[1].fd = io->TxEvent;
+	fds[1].events = POLLIN;
+	/* What is queued when the stop comes is still sent */
+	while (__atomic_load_n(&io->Running, __ATOMIC_ACQUIRE) || (err == 0 && _serial_io_tx_pending(io, mux))) {
+		m = __atomic_load_n(&io->Mux, __ATOMIC_ACQUIRE);
+		if (m != mux) {
+			mux = m;
+			cmux_decoder_init(&io->Decoder);
+			io->WireOffset = 0;
+			io->WireLength = 0;
+		}
+
+		fds[0].fd = io->FD;
+		fds[0].events = 0;
+		fds[0].revents = 0;
+		fds[1].revents = 0;
+		if (err == 0) {
+			if (_serial_io_rx_space(io, mux))
+				fds[0].events |= POLLIN;
+
+			if (_serial_io_tx_pending(io, mux))
+				fds[0].events |= POLLOUT;
+		} else fds[0].fd = -1;
+
+		if (poll(fds, sizeof(fds) / sizeof(fds[0]), -1) == -1) {
+			if (errno != EINTR && err == 0) {
+				err = errno;
+				_serial_io_fail(io, err);
+			}
+
+			continue;
+		}
+
+		if (fds[1].revents & POLLIN)
+			_serial_io_clear(io->TxEvent);
+
+		if (fds[0].revents & POLLIN) {
+			if (mux)
+				transmitted = read(io->FD, buf, sizeof(buf));
+			else {
+				len = _ring_free(&raw->Rx, &start);
+				transmitted = read(io->FD, start, len);
+			}
+
+			if (transmitted > 0) {
+				if (mux)
+					cmux_decode(&io->Decoder, buf, (size_t)transmitted, _serial_io_frame, io);
+				else {
+					_ring_produce(&raw->Rx, (size_t)transmitted);
+					_serial_io_signal(raw->RxEvent);
+				}
+			} else if (transmitted == 0)
+				err = EPIPE;
+			else if (errno != EAGAIN && errno != EINTR)
+				err = errno;
+		}
+
+		if (err == 0 && (fds[0].revents & POLLOUT)) {
+			if (mux) {
+				if (io->WireOffset == io->WireLength)
+					_serial_io_frame_next(io);
+
+				data = io->Wire + io->WireOffset;
+				len = io->WireLength - io->WireOffset;
+			} else len = _ring_used(&raw->Tx, &data);
+
+			transmitted = (len > 0) ? write(io->FD, data, len) : 0;
+			if (transmitted > 0) {
+				if (mux)
+					io->WireOffset += (size_t)transmitted;
+				else _ring_consume(&raw->Tx, (size_t)transmitted, io->SpaceEvent);
+			} else if (transmitted == -1 && errno != EAGAIN && errno != EINTR)
+				err = errno;
+		}
+
+		if (err == 0 && (fds[0].revents & (POLLERR | POLLNVAL)))
+			err = EIO;
+
+		/* Data read together with the hang-up go first */
+		if (err == 0 && (fds[0].revents & POLLHUP) && !(fds[0].revents & POLLIN))
+			err = EPIPE;
+
+		if (err != 0 && fds[0].fd != -1)
+			_serial_io_fail(io, err);
+	}
+
+	return NULL;
+}
+
+
+static void _serial_io_free(PSERIAL_IO Io)
+{
+	PSERIAL_IO_CHANNEL c = NULL;
+
+	if (Io->SpaceEvent != -1)
+		close(Io->SpaceEvent);
+
+	if (Io->TxEvent != -1)
+		close(Io->TxEvent);
+
+	for (int i = 0; i < SERIAL_IO_CHANNELS; ++i) {
+		c = Io->Channels + i;
+		if (c->RxEvent != -1)
+			close(c->RxEvent);
+
+		free(c->Tx.Data);
+		free(c->Rx.Data);
+	}
+
+	free(Io);
+
+	return;
+}
+
+
+int serial_io_start(int FD, PSERIAL_IO* Io)
+{
+	int ret = 0;
+	int flags = 0;
+	void* mem = NULL;
+	PSERIAL_IO tmpIo = NULL;
+	PSERIAL_IO_CHANNEL c = NULL;
+	sigset_t all;
+	sigset_t old;
+	log_enter("FD=%i; Io=0x%p", FD, Io);
+
+	ret = posix_memalign(&mem, SERIAL_IO_CACHE_LINE, sizeof(SERIAL_IO));
+	if (ret != 0)
+		goto Exit;
+
+	tmpIo = (PSERIAL_IO)mem;
+	memset(tmpIo, 0, sizeof(SERIAL_IO));
+	tmpIo->FD = FD;
+	tmpIo->TxEvent = -1;
+	tmpIo->SpaceEvent = -1;
+	for (int i = 0; i < SERIAL_IO_CHANNELS; ++i)
+		tmpIo->Channels[i].RxEvent = -1;
+
+	for (int i = 0; ret == 0 && i < SERIAL_IO_CHANNELS; ++i) {
+		c = tmpIo->Channels + i;
+		ret = _ring_init(&c->Rx, SERIAL_IO_RX_RING_SIZE);
+		if (ret == 0)
+			ret = _ring_init(&c->Tx, SERIAL_IO_TX_RING_SIZE);
+
+		if (ret == 0) {
+			c->RxEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			if (c->RxEvent == -1) {
+				ret = errno;
+				log_error("eventfd: %i", ret);
+			}
+		}
+	}
+
+	if (ret != 0)
+		goto Exit;
+
+	tmpIo->TxEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	tmpIo->SpaceEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (tmpIo->TxEvent == -1 || tmpIo->SpaceEvent == -1) {
+		ret = errno;
+		log_error("eventfd: %i", ret);
+		goto Exit;
+	}
+
+	/* The thread must never block in read() or write(), it serves both directions */
+	flags = fcntl(FD, F_GETFL);
+	if (flags == -1 || fcntl(FD, F_SETFL, flags | O_NONBLOCK) == -1) {
+		ret = errno;
+		log_error("fcntl(F_SETFL): %i", ret);
+		goto Exit;
+	}
+
+	tmpIo->Running = 1;
+	/* Signals are for the main loop, not for the serial thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	ret = pthread_create(&tmpIo->Thread, NULL, _serial_io_thread, tmpIo);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0) {
+		log_error("pthread_create: %i", ret);
+		goto Exit;
+	}
+
+	*Io = tmpIo;
+	tmpIo = NULL;
+Exit:
+	if (tmpIo != NULL)
+		_serial_io_free(tmpIo);
+
+	log_exit("%i, *Io=0x%p", ret, *Io);
+	return ret;
+}
+
+
+void serial_io_stop(PSERIAL_IO Io)
+{
+	log_enter("Io=0x%p", Io);
+
+	__atomic_store_n(&Io->Running, 0, __ATOMIC_RELEASE);
+	_serial_io_signal(Io->TxEvent);
+	pthread_join(Io->Thread, NULL);
+	_serial_io_free(Io);
+
+	log_exit("void");
+	return;
+}
+
+
+int serial_io_priority(PSERIAL_IO Io, int Priority)
+{
+	int ret = 0;
+	struct sched_param sp;
+	log_enter("Io=0x%p; Priority=%i", Io, Priority);
+
+	memset(&sp, 0, sizeof(sp));
+	sp.sched_priority = Priority;
+	ret = pthread_setschedparam(Io->Thread, (Priority > 0) ? SCHED_FIFO : SCHED_OTHER, &sp);
+
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+/* Waits until the thread has taken everything queued on any channel */
+int serial_io_flush(PSERIAL_IO Io)
+{
+	int ret = 0;
+	struct pollfd fds;
+	PSERIAL_IO_RING r = NULL;
+	log_enter("Io=0x%p", Io);
+
+	memset(&fds, 0, sizeof(fds));
+	fds.fd = Io->SpaceEvent;
+	fds.events = POLLIN;
+	for (int i = 0; ret == 0 && i < SERIAL_IO_CHANNELS; ++i) {
+		r = &Io->Channels[i].Tx;
+		while (ret == 0 && __atomic_load_n(&r->Tail, __ATOMIC_ACQUIRE) != r->Head) {
+			__atomic_store_n(&r->Waiting, 1, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&r->Tail, __ATOMIC_ACQUIRE) != r->Head && poll(&fds, 1, -1) > 0)
+				_serial_io_clear(Io->SpaceEvent);
+
+			ret = __atomic_load_n(&Io->Error, __ATOMIC_ACQUIRE);
+		}
+	}
+
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+/* Called once the modem has accepted AT+CMUX, and after it has closed the multiplexer down */
+int serial_io_mux(PSERIAL_IO Io, int Enable)
+{
+	int ret = 0;
+	log_enter("Io=0x%p; Enable=%i", Io, Enable);
+
+	if (Enable)
+		ret = serial_io_flush(Io);
+
+	if (ret == 0) {
+		for (int i = 0; i < SERIAL_IO_CHANNELS; ++i)
+			__atomic_store_n(&Io->Channels[i].Connected, 0, __ATOMIC_RELAXED);
+
+		__atomic_store_n(&Io->Mux, Enable, __ATOMIC_RELEASE);
+		_serial_io_signal(Io->TxEvent);
+	}
+
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+/*
+ * Sends SABM or DISC for the DLCI, or with cftUIH the close down of the
+ * multiplexer, and waits up to Timeout ms for the answer. ECONNREFUSED
+ * means the modem answered with DM.
+ */
+int serial_io_control(PSERIAL_IO Io, int Dlci, ECmuxFrameType Type, int Timeout)
+{
+	int ret = 0;
+	int remaining = 0;
+	unsigned int answers = 0;
+	struct pollfd fds;
+	struct timespec start;
+	struct timespec now;
+	log_enter("Io=0x%p; Dlci=%i; Type=0x%x; Timeout=%i", Io, Dlci, Type, Timeout);
+
+	answers = __atomic_load_n(&Io->Channels[Dlci].Answers, __ATOMIC_ACQUIRE);
+	__atomic_store_n(&Io->Control, ((Dlci << 8) | Type) + 1, __ATOMIC_RELEASE);
+	_serial_io_signal(Io->TxEvent);
+	memset(&fds, 0, sizeof(fds));
+	fds.fd = Io->Channels[0].RxEvent;
+	fds.events = POLLIN;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (ret == 0 && __atomic_load_n(&Io->Channels[Dlci].Answers, __ATOMIC_ACQUIRE) == answers) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		remaining = Timeout - (int)((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000);
+		if (remaining <= 0) {
+			ret = ETIMEDOUT;
+			break;
+		}
+
+		if (poll(&fds, 1, remaining) > 0)
+			_serial_io_clear(Io->Channels[0].RxEvent);
+
+		ret = __atomic_load_n(&Io->Error, __ATOMIC_ACQUIRE);
+	}
+
+	if (ret == 0 && __atomic_load_n(&Io->Channels[Dlci].Connected, __ATOMIC_RELAXED) != (Type == cftSABM))
+		ret = ECONNREFUSED;
+
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+int serial_io_event(const SERIAL_IO* Io, int Channel)
+{
+	return Io->Channels[Channel].RxEvent;
+}
+
+
+/* The channel whose event is Event, -1 if none */
+int serial_io_channel(const SERIAL_IO* Io, int Event)
+{
+	int ret = -1;
+
+	for (int i = 0; i < SERIAL_IO_CHANNELS; ++i) {
+		if (Io->Channels[i].RxEvent == Event) {
+			ret = i;
+			break;
+		}
+	}
+
+	return ret;
+}
+
+
+/* Never blocks, *Read is zero when the ring is empty; call it until then after every wake-up */
+int serial_io_read(PSERIAL_IO Io, int Channel, void* Buffer, size_t Size, ssize_t* Read)
+{
+	int ret = 0;
+	size_t len = 0;
+	const unsigned char* data = NULL;
+	PSERIAL_IO_CHANNEL c = NULL;
+
+	c = Io->Channels + Channel;
+	_serial_io_clear(c->RxEvent);
+	len = _ring_used(&c->Rx, &data);
+	if (len > Size)
+		len = Size;
+
+	if (len > 0) {
+		memcpy(Buffer, data, len);
+		_ring_consume(&c->Rx, len, Io->TxEvent);
+	} else ret = __atomic_load_n(&Io->Error, __ATOMIC_ACQUIRE);
+
+	*Read = (ssize_t)len;
+
+	return ret;
+}
+
+
+/* Queues the data for the thread, waits only while the transmit ring is full */
+int serial_io_write(PSERIAL_IO Io, int Channel, const void* Data, size_t Length)
+{
+	int ret = 0;
+	size_t len = 0;
+	unsigned char* start = NULL;
+	struct pollfd fds;
+	const unsigned char* d = NULL;
+	PSERIAL_IO_RING r = NULL;
+
+	r = &Io->Channels[Channel].Tx;
+	d = (const unsigned char*)Data;
+	while (Length > 0) {
+		ret = __atomic_load_n(&Io->Error, __ATOMIC_ACQUIRE);
+		if (ret != 0)
+			break;
+
+		len = _ring_free(r, &start);
+		if (len == 0 && !_ring_wait_prepare(r, 1)) {
+			memset(&fds, 0, sizeof(fds));
+			fds.fd = Io->SpaceEvent;
+			fds.events = POLLIN;
+			if (poll(&fds, 1, -1) > 0)
+				_serial_io_clear(Io->SpaceEvent);
+
+			continue;
+		}
+
+		len = _ring_free(r, &start);
+		if (len > Length)
+			len = Length;
+
+		memcpy(start, d, len);
+		_ring_produce(r, len);
+		_serial_io_signal(Io->TxEvent);
+		d += len;
+		Length -= len;
+	}
+
+	return ret;
+}
@@ -0,0 +1,91 @@
+
+#pragma once
+
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include "cmux.h"
+
+
+/*
+ * A thread owning the serial port. It moves whatever the modem sends into
+ * the receive ring as soon as it arrives and writes what the application
+ * queues into the transmit ring, so a slow flush or log write on the
+ * application thread never leaves bytes waiting in the UART. Each ring has
+ * a single producer and a single consumer; the eventfd returned by
+ * serial_io_event() becomes readable when received data or an error wait
+ * for the application.
+ *
+ * Channel 0 is the port itself. Once serial_io_mux() turns CMUX on, the
+ * thread sends the transmit rings of the other channels as UIH frames of
+ * their DLCI and sorts the received frames into their receive rings;
+ * channel 0 then only carries the control frames of serial_io_control().
+ */
+
+#define SERIAL_IO_CACHE_LINE			64
+#define SERIAL_IO_RX_RING_SIZE			(64 * 1024)
+#define SERIAL_IO_TX_RING_SIZE			(4 * 1024)
+#define SERIAL_IO_CHANNELS				4
+/* Largest read in CMUX mode, every channel must have room for twice as much */
+#define SERIAL_IO_MUX_READ				256
+
+typedef struct _SERIAL_IO_RING {
+	/* Fixed once the thread runs, Size is a power of two */
+	unsigned char* Data;
+	size_t Size;
+	/* Advanced by the producer only */
+	size_t Head __attribute__((aligned(SERIAL_IO_CACHE_LINE)));
+	/* Advanced by the consumer only */
+	size_t Tail __attribute__((aligned(SERIAL_IO_CACHE_LINE)));
+	/* The producer found the ring full and waits for the consumer */
+	int Waiting __attribute__((aligned(SERIAL_IO_CACHE_LINE)));
+} SERIAL_IO_RING, *PSERIAL_IO_RING;
+
+typedef struct _SERIAL_IO_CHANNEL {
+	SERIAL_IO_RING Rx;
+	SERIAL_IO_RING Tx;
+	/* Wakes the application: data in Rx or an error; on channel 0 also an answer to a control frame */
+	int RxEvent;
+	/* The DLCI is open */
+	int Connected;
+	/* UA and DM frames received for the DLCI */
+	unsigned int Answers;
+	/* The last control frame sent for the DLCI, thread only */
+	ECmuxFrameType Pending;
+} SERIAL_IO_CHANNEL, *PSERIAL_IO_CHANNEL;
+
+typedef struct _SERIAL_IO {
+	SERIAL_IO_CHANNEL Channels[SERIAL_IO_CHANNELS];
+	pthread_t Thread;
+	int FD;
+	/* Wakes the thread: data in a Tx ring, space in an Rx ring, a control frame or the stop request */
+	int TxEvent;
+	/* Wakes a writer waiting for space in a Tx ring */
+	int SpaceEvent;
+	int Running;
+	/* errno of the failure that stopped the port, EPIPE for a hang-up */
+	int Error;
+	/* CMUX frames instead of the raw stream */
+	int Mux;
+	/* The control frame waiting for the thread, ((Dlci << 8) | Type) + 1 */
+	int Control;
+	/* Thread only: the frame decoder and the frame being written */
+	CMUX_DECODER Decoder;
+	unsigned char Wire[CMUX_FRAME_MAX];
+	size_t WireLength;
+	size_t WireOffset;
+	int NextChannel;
+} SERIAL_IO, *PSERIAL_IO;
+
+
+int serial_io_start(int FD, PSERIAL_IO* Io);
+void serial_io_stop(PSERIAL_IO Io);
+int serial_io_priority(PSERIAL_IO Io, int Priority);
+int serial_io_flush(PSERIAL_IO Io);
+int serial_io_mux(PSERIAL_IO Io, int Enable);
+int serial_io_control(PSERIAL_IO Io, int Dlci, ECmuxFrameType Type, int Timeout);
+int serial_io_event(const SERIAL_IO* Io, int Channel);
+int serial_io_channel(const SERIAL_IO* Io, int Event);
+int serial_io_read(PSERIAL_IO Io, int Channel, void* Buffer, size_t Size, ssize_t* Read);
+int serial_io_write(PSERIAL_IO Io, int Channel, const void* Data, size_t Length);
@@ -13,23 +13,114 @@
 #include <linux/serial.h>
 #include <poll.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include "logging.h"
 #include "line-buffer.h"
+#include "flight-recorder.h"
+#include "capture.h"
+#include "metrics.h"
+#include "serial-io.h"
+#include "arena.h"
 #include "serial.h"
 
 
+#define SERIAL_MUX_TIMEOUT				3000
+/* Each channel of each port assembles its lines in a line buffer stream of its own */
+#define SERIAL_PORTS_MAX				(LINE_BUFFER_STREAMS / SERIAL_IO_CHANNELS)
+
+
+static int _commandPending = 0;
+static void* _urcCallbackHandle = NULL;
+static PSERIAL_IO _ports[SERIAL_PORTS_MAX];
+static size_t _portCount = 0;
+/* Ends the idle waits after the data at hand, set when work got queued */
+static int _waitBreak = 0;
+/* Descriptors of other modules the idle waits poll along with the modems */
+static SERIAL_WATCH _watches[SERIAL_WATCH_MAX];
+static size_t _watchCount = 0;
+
+
+/*
+ * Ports opened by serial_open() are served by an I/O thread each, other
+ * descriptors are used directly. The port itself is channel 0, the
+ * handles returned by serial_mux_open() are the CMUX channels.
+ */
+static PSERIAL_IO _serial_io(int fd, int* Channel)
+{
+	PSERIAL_IO ret = NULL;
+	int channel = -1;
+
+	for (size_t i = 0; i < SERIAL_PORTS_MAX; ++i) {
+		if (_ports[i] == NULL)
+			continue;
+
+		channel = (_ports[i]->FD == fd) ? 0 : serial_io_channel(_ports[i], fd);
+		if (channel >= 0) {
+			ret = _ports[i];
+			*Channel = channel;
+			break;
+		}
+	}
+
+	return ret;
+}
+
+
+static int _serial_stream(const SERIAL_IO* Io, int Channel)
+{
+	int ret = 0;
+
+	for (size_t i = 0; i < SERIAL_PORTS_MAX; ++i) {
+		if (_ports[i] == Io) {
+			ret = (int)i * SERIAL_IO_CHANNELS + Channel;
+			break;
+		}
+	}
+
+	return ret;
+}
+
+
+static int _final_result(const char* Line)
+{
+	return (
+		strcmp(Line, "OK") == 0 ||
+		strcmp(Line, "ERROR") == 0 ||
+		strncmp(Line, "+CME ERROR: ", sizeof("+CME ERROR: ") - 1) == 0 ||
+		strncmp(Line, "+CMS ERROR: ", sizeof("+CMS ERROR: ") - 1) == 0
+		);
+}
+
+
 static int _line_buffer_OK_callback(const char* Line, void* Context)
 {
 	int ret = 0;
 	int* pFound = NULL;
 
 	pFound = (int*)Context;
-	if (*pFound != -1) {
-		*pFound = (
-			strcmp(Line, "OK") == 0 ||
-			strcmp(Line, "ERROR") == 0
-			);
-	}
+	/* URCs may follow the final result in the same read, they must not hide it */
+	if (*pFound == 0)
+		*pFound = _final_result(Line);
+
+	return ret;
+}
+
+
+/* Lines arriving with no command outstanding are unsolicited */
+static int _line_buffer_urc_callback(const char* Line, void* Context)
+{
+	int ret = 0;
+
+	if (_commandPending) {
+		if (_final_result(Line)) {
+			_commandPending = 0;
+			metrics_command_end((strcmp(Line, "OK") == 0) ? mrOK : mrError);
+		}
+	} else if (Line[0] != '\0')
+		flight_recorder_record(frtUrc, Line, strlen(Line));
 
 	return ret;
 }
@@ -55,10 +146,32 @@ int serial_open(const char* device, int rate, int* Handle)
 {
 	int ret = 0;
 	int fd = -1;
+	size_t port = 0;
 	speed_t speed = 0;
 	struct termios options;
 	log_enter("device=\"%s\"; rate=%u; Handle=0x%p", device, rate, Handle);
 
+	while (port < SERIAL_PORTS_MAX && _ports[port] != NULL)
+		++port;
+
+	if (port == SERIAL_PORTS_MAX) {
+		ret = EMFILE;
+		log_error("No more than %i serial ports are supported", SERIAL_PORTS_MAX);
+		goto Cleanup;
+	}
+
+	/* The capture plays the modem, the handle only has to be valid */
+	if (capture_replaying()) {
+		fd = open("/dev/null", O_RDWR);
+		if (fd == -1) {
+			ret = errno;
+			log_error("open(\"/dev/null\"): %i", ret);
+			goto Cleanup;
+		}
+
+		goto Callbacks;
+	}
+
 	fd = open(device, O_RDWR | O_NOCTTY);
 	if (fd == -1) {
 		ret = errno;
@@ -95,11 +208,33 @@ int serial_open(const char* device, int rate, int* Handle)
 		goto Cleanup;
 	}
 
+	ret = serial_io_start(fd, _ports + port);
+	if (ret != 0) {
+		log_error("Unable to start the serial I/O thread: %i", ret);
+		goto Cleanup;
+	}
+
+Callbacks:
+	if (_urcCallbackHandle == NULL) {
+		ret = line_callback_register(_line_buffer_urc_callback, NULL, &_urcCallbackHandle);
+		if (ret != 0) {
+			log_error("Unable to register the URC callback: %i", ret);
+			goto Cleanup;
+		}
+	}
+
+	++_portCount;
 	*Handle = fd;
 	fd = -1;
 Cleanup:
-	if (fd != -1)
+	if (fd != -1) {
+		if (_ports[port] != NULL) {
+			serial_io_stop(_ports[port]);
+			_ports[port] = NULL;
+		}
+
 		close(fd);
+	}
 
 	log_exit("%i, *Handle=%i", ret, *Handle);
 	return ret;
@@ -108,8 +243,28 @@ Cleanup:
 
 void serial_close(int Handle)
 {
+	int channel = 0;
+	PSERIAL_IO io = NULL;
 	log_enter("Handle=%i", Handle);
 
+	if (_portCount > 0)
+		--_portCount;
+
+	if (_portCount == 0 && _urcCallbackHandle != NULL) {
+		line_callback_unregister(_urcCallbackHandle);
+		_urcCallbackHandle = NULL;
+	}
+
+	io = _serial_io(Handle, &channel);
+	if (io != NULL && channel == 0) {
+		for (size_t i = 0; i < SERIAL_PORTS_MAX; ++i) {
+			if (_ports[i] == io)
+				_ports[i] = NULL;
+		}
+
+		serial_io_stop(io);
+	}
+
 	close(Handle);
 
 	log_exit("void");
@@ -117,85 +272,416 @@ void serial_close(int Handle)
 }
 
 
+/*
+ * Data reach the reader as soon as the driver has them: ASYNC_LOW_LATENCY
+ * makes the UART driver push every received byte to the line discipline
+ * and VMIN 1 with VTIME 0 makes poll() report the very first byte (with
+ * VTIME 0 it waits for VMIN bytes). A nonzero Priority also runs the I/O
+ * thread with SCHED_FIFO, the caller one level below it, and locks the
+ * memory, so neither waits for a page fault or for other processes.
+ */
+int serial_low_latency(int fd, int Priority)
+{
+	int ret = 0;
+	int err = 0;
+	int channel = 0;
+	struct serial_struct ss;
+	struct termios options;
+	struct sched_param sp;
+	PSERIAL_IO io = NULL;
+	log_enter("fd=%i; Priority=%i", fd, Priority);
+
+	if (capture_replaying())
+		goto Exit;
+
+	/* USB adapters and pseudo terminals do not know the flag, the rest still helps */
+	memset(&ss, 0, sizeof(ss));
+	if (ioctl(fd, TIOCGSERIAL, &ss) == 0) {
+		ss.flags |= ASYNC_LOW_LATENCY;
+		if (ioctl(fd, TIOCSSERIAL, &ss) == -1)
+			log_warning("TIOCSSERIAL: %i", errno);
+	} else log_warning("TIOCGSERIAL: %i, the driver keeps its latency", errno);
+
+	if (tcgetattr(fd, &options) == -1) {
+		ret = errno;
+		log_error("tcgetattr: %i", ret);
+		goto Exit;
+	}
+
+	options.c_cc[VMIN] = 1;
+	options.c_cc[VTIME] = 0;
+	if (tcsetattr(fd, TCSANOW, &options) != 0) {
+		ret = errno;
+		log_error("tcsetattr(TCSANOW): %i", ret);
+		goto Exit;
+	}
+
+	if (Priority > 0) {
+		if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+			log_warning("mlockall: %i", errno);
+
+		io = _serial_io(fd, &channel);
+		if (io != NULL) {
+			err = serial_io_priority(io, Priority);
+			if (err != 0)
+				log_warning("Unable to set the priority of the serial thread: %i", err);
+		}
+
+		memset(&sp, 0, sizeof(sp));
+		sp.sched_priority = (Priority > 1) ? Priority - 1 : 1;
+		err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+		if (err != 0)
+			log_warning("Unable to set the priority of the application thread: %i", err);
+	}
+
+Exit:
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+/* Whatever was queued goes out at the old rate, whatever was received at it is dropped */
+int serial_rate_set(int fd, int rate)
+{
+	int ret = 0;
+	int channel = 0;
+	speed_t speed = 0;
+	struct termios options;
+	PSERIAL_IO io = NULL;
+	log_enter("fd=%i; rate=%i", fd, rate);
+
+	if (capture_replaying())
+		goto Exit;
+
+	speed = _rate_to_constant(rate);
+	if (speed == B0) {
+		ret = EINVAL;
+		log_error("Unknown baud rate %i", rate);
+		goto Exit;
+	}
+
+	io = _serial_io(fd, &channel);
+	if (io != NULL)
+		ret = serial_io_flush(io);
+
+	if (ret == 0 && tcdrain(fd) == -1)
+		ret = errno;
+
+	if (ret == 0 && tcgetattr(fd, &options) == -1)
+		ret = errno;
+
+	if (ret == 0) {
+		cfsetispeed(&options, speed);
+		cfsetospeed(&options, speed);
+		if (tcsetattr(fd, TCSANOW, &options) != 0)
+			ret = errno;
+	}
+
+	if (ret == 0)
+		tcflush(fd, TCIFLUSH);
+
+	if (ret != 0)
+		log_error("Unable to switch to %i baud: %i", rate, ret);
+
+Exit:
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+/* Closes the channels, then the multiplexer; the modem is back in AT command mode */
+static void _serial_mux_down(PSERIAL_IO Io, int Count)
+{
+	for (int i = Count; i > 0; --i)
+		serial_io_control(Io, i, cftDISC, SERIAL_MUX_TIMEOUT);
+
+	if (serial_io_control(Io, 0, cftUIH, SERIAL_MUX_TIMEOUT) != 0)
+		log_warning("The modem has not confirmed the multiplexer close down");
+
+	serial_io_mux(Io, 0);
+
+	return;
+}
+
+
+/*
+ * Switches the port opened by serial_open() to CMUX once the modem has
+ * accepted AT+CMUX and opens DLCI 1 to Count. Handles receive their
+ * descriptors, usable by every serial_* function. When there is no I/O
+ * thread (replay), all of them are fd and the traffic stays as it was.
+ */
+int serial_mux_open(int fd, int Count, int* Handles)
+{
+	int ret = 0;
+	int channel = 0;
+	int opened = 0;
+	PSERIAL_IO io = NULL;
+	log_enter("fd=%i; Count=%i; Handles=0x%p", fd, Count, Handles);
+
+	if (Count >= SERIAL_IO_CHANNELS) {
+		ret = EINVAL;
+		goto Exit;
+	}
+
+	io = _serial_io(fd, &channel);
+	if (io == NULL || channel != 0) {
+		for (int i = 0; i < Count; ++i)
+			Handles[i] = fd;
+
+		goto Exit;
+	}
+
+	ret = serial_io_mux(io, 1);
+	if (ret == 0)
+		ret = serial_io_control(io, 0, cftSABM, SERIAL_MUX_TIMEOUT);
+
+	for (int i = 1; ret == 0 && i <= Count; ++i) {
+		ret = serial_io_control(io, i, cftSABM, SERIAL_MUX_TIMEOUT);
+		if (ret == 0) {
+			Handles[i - 1] = serial_io_event(io, i);
+			opened = i;
+		}
+	}
+
+	if (ret != 0) {
+		log_error("Unable to open the CMUX channels: %i", ret);
+		_serial_mux_down(io, opened);
+		goto Exit;
+	}
+
+	flight_recorder_event("cmux");
+Exit:
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+void serial_mux_close(int fd, int Count)
+{
+	int channel = 0;
+	PSERIAL_IO io = NULL;
+	log_enter("fd=%i; Count=%i", fd, Count);
+
+	io = _serial_io(fd, &channel);
+	if (io != NULL && channel == 0 && __atomic_load_n(&io->Mux, __ATOMIC_ACQUIRE))
+		_serial_mux_down(io, Count);
+
+	log_exit("void");
+	return;
+}
+
+
+static int _serial_write(int fd, const char* Data, size_t Length)
+{
+	int ret = 0;
+	int channel = 0;
+	ssize_t transmitted = 0;
+	PSERIAL_IO io = NULL;
+
+	if (capture_replaying()) {
+		metrics_bytes(1, Length);
+		capture_replay_write(Data, Length);
+		return ret;
+	}
+
+	io = _serial_io(fd, &channel);
+	if (io != NULL) {
+		metrics_bytes(1, Length);
+		flight_recorder_record(frtTx, Data, Length);
+		capture_record(frtTx, Data, Length);
+		ret = serial_io_write(io, channel, Data, Length);
+		if (ret != 0)
+			log_error("Unable to write data: %i", ret);
+
+		return ret;
+	}
+
+	while (Length > 0) {
+		transmitted = write(fd, Data, Length);
+		if (transmitted == -1) {
+			ret = errno;
+			if (ret == EINTR) {
+				ret = 0;
+				continue;
+			}
+
+			log_error("Unable to write data: %i", ret);
+			break;
+		}
+
+		metrics_bytes(1, (size_t)transmitted);
+		flight_recorder_record(frtTx, Data, (size_t)transmitted);
+		capture_record(frtTx, Data, (size_t)transmitted);
+
+		Length -= (size_t)transmitted;
+		Data += transmitted;
+	}
+
+	return ret;
+}
+
+
 int serial_command(int fd, const char *Command, int CR, int LF)
 {
 	int ret = 0;
 	size_t len = 0;
-	ssize_t transmitted = 0;
-	char cmd[256];
-	const char* tmp = NULL;
+	char suffix[2];
 	log_enter("fd=%i; Command=\"%s\"", fd, Command);
 
-	memset(cmd, 0, sizeof(cmd));
-	strncpy(cmd, Command, sizeof(cmd) / sizeof(cmd[0]) - 3);
-	len = strlen(cmd);
+	_commandPending = 1;
+	metrics_command_begin(Command);
 	if (CR) {
-		cmd[len] = '\r';
+		suffix[len] = '\r';
 		++len;
 	}
 
 	if (LF) {
-		cmd[len] = '\n';
+		suffix[len] = '\n';
 		++len;
 	}
 
-	tmp = cmd;
-	while (len > 0) {
-		transmitted = write(fd, tmp, len);
-		if (transmitted == -1) {
-			ret = errno;
-			log_error("Unable to write data", ret);
-			break;
-		}
+	ret = _serial_write(fd, Command, strlen(Command));
+	if (ret == 0 && len > 0)
+		ret = _serial_write(fd, suffix, len);
 
-		len -= (size_t)transmitted;
-		tmp += transmitted;
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+/* Passes a chunk read from the serial port to the line callbacks and appends it to the response */
+static int _serial_response_append(int Stream, const char* Data, size_t Length, char** Response, size_t* ResponseSize)
+{
+	int ret = 0;
+	char* newResponse = NULL;
+
+	metrics_bytes(0, Length);
+	ret = line_buffer_insert_stream(Stream, Data, Length);
+	if (ret != 0) {
+		log_error("Cannot insert %zu bytes into the Line Buffer: %i", Length, ret);
+		goto Exit;
 	}
 
-	log_exit("%i", ret);
+	newResponse = arena_realloc(*Response, *ResponseSize + Length + 1);
+	if (newResponse == NULL) {
+		ret = ENOMEM;
+		log_error("Unable to reallocate response buffer: %i", ret);
+		goto Exit;
+	}
+
+	*Response = newResponse;
+	memcpy(*Response + *ResponseSize, Data, Length);
+	*ResponseSize += Length;
+	(*Response)[*ResponseSize] = '\0';
+Exit:
 	return ret;
 }
 
 
-int serial_response_wait(int fd, int Timeout, int OKSearch, char **Response, size_t *ResponseSize)
+/* Data read from the modem, whichever way they came */
+static int _serial_received(int Stream, const char* Data, size_t Length, char** Response, size_t* ResponseSize)
+{
+	flight_recorder_record(frtRx, Data, Length);
+	capture_record(frtRx, Data, Length);
+
+	return _serial_response_append(Stream, Data, Length, Response, ResponseSize);
+}
+
+
+/* Everything the I/O thread has received so far; a wake-up with nothing new is not a timeout */
+static int _serial_io_drain(PSERIAL_IO Io, int Channel, int Stream, char** Response, size_t* ResponseSize, ssize_t* Transmitted)
+{
+	int ret = 0;
+	ssize_t len = 0;
+	char buf[1024];
+
+	*Transmitted = 1;
+	do {
+		ret = serial_io_read(Io, Channel, buf, sizeof(buf), &len);
+		if (ret == 0 && len > 0)
+			ret = _serial_received(Stream, buf, (size_t)len, Response, ResponseSize);
+	} while (ret == 0 && len > 0);
+
+	/* The thread has already reported the failure */
+	if (ret == EPIPE) {
+		ret = 0;
+		*Transmitted = 0;
+	}
+
+	return ret;
+}
+
+
+/* The "> " prompt of CMGS and CIPSEND ends no line, so the line callbacks never see it */
+static int _serial_prompt(const char* Response, size_t ResponseSize)
+{
+	return (ResponseSize >= 2 && memcmp(Response + ResponseSize - 2, "> ", 2) == 0 &&
+		(ResponseSize == 2 || Response[ResponseSize - 3] == '\n'));
+}
+
+
+static int _serial_response_wait(int fd, int Timeout, int OKSearch, int Prompt, char **Response, size_t *ResponseSize)
 {
 	int ret = 0;
 	char* tmpResponse = NULL;
-	char* newResponse = NULL;
 	size_t tmpResponseSize = 0;
 	ssize_t transmitted = 0;
 	struct pollfd fds;
 	char buf[1024];
 	void* okCallbackHandle = NULL;
 	int okFound = 0;
-	log_enter("fd=%i; Timeout=%i; OKSearch=%u; Response=0x%p; ResponseSize=0x%p", fd, Timeout, OKSearch, Response, ResponseSize);
+	int promptFound = 0;
+	int channel = 0;
+	PSERIAL_IO io = NULL;
+	log_enter("fd=%i; Timeout=%i ms; OKSearch=%u; Prompt=%i; Response=0x%p; ResponseSize=0x%p", fd, Timeout, OKSearch, Prompt, Response, ResponseSize);
 
 	if (!OKSearch)
 		okFound = -1;
 
 	ret = line_callback_register(_line_buffer_OK_callback, &okFound, &okCallbackHandle);
 	if (ret == 0) {
+		io = _serial_io(fd, &channel);
 		memset(&fds, 0, sizeof(fds));
-		fds.fd = fd;
+		fds.fd = (io != NULL) ? serial_io_event(io, channel) : fd;
 		fds.events = POLLIN;
 		do {
 			transmitted = 0;
 			fds.revents = 0;
-			ret = poll(&fds, sizeof(fds) / sizeof(fds), Timeout * 1000);
+			if (capture_replaying()) {
+				ret = capture_replay_read(buf, sizeof(buf), &transmitted);
+				if (ret == 0 && transmitted > 0)
+					ret = _serial_response_append(0, buf, (size_t)transmitted, &tmpResponse, &tmpResponseSize);
+
+				if (ret == 0 && Prompt)
+					promptFound = _serial_prompt(tmpResponse, tmpResponseSize);
+
+				continue;
+			}
+
+			ret = poll(&fds, sizeof(fds) / sizeof(fds), Timeout);
 			switch (ret) {
 			case 0:
+				capture_record(frtTimeout, NULL, 0);
 				break;
 			case -1:
 				ret = errno;
 				if (ret == EINTR) {
 					ret = 0;
 					transmitted = 1;
-					Timeout -= 1;
+					Timeout = (Timeout > 1000) ? Timeout - 1000 : 0;
 					log_warning("poll() interrupted");
 				}
 				break;
 			default:
 				ret = 0;
+				if (io != NULL) {
+					ret = _serial_io_drain(io, channel, _serial_stream(io, channel), &tmpResponse, &tmpResponseSize, &transmitted);
+					if (ret == 0 && Prompt)
+						promptFound = _serial_prompt(tmpResponse, tmpResponseSize);
+
+					break;
+				}
+
 				if (fds.revents & POLLERR) {
 					ret = -1;
 					log_error("Serial port error");
@@ -210,23 +696,12 @@ int serial_response_wait(int fd, int Timeout, int OKSearch, char **Response, siz
 						continue;
 					}
 
-					ret = line_buffer_insert(buf, (size_t)transmitted);
-					if (ret != 0) {
-						log_error("Cannot insert %zu bytes into the Line Buffer: %i", ret);
-						continue;
-					}
-
-					newResponse = realloc(tmpResponse, tmpResponseSize + (size_t)transmitted + 1);
-					if (newResponse == NULL) {
-						ret = ENOMEM;
-						log_error("Unable to reallocate response buffer", ret);
+					ret = _serial_received(0, buf, (size_t)transmitted, &tmpResponse, &tmpResponseSize);
+					if (ret != 0)
 						continue;
-					}
 
-					tmpResponse = newResponse;
-					memcpy(tmpResponse + tmpResponseSize, buf, (size_t)transmitted);
-					tmpResponseSize += (size_t)transmitted;
-					tmpResponse[tmpResponseSize] = '\0';
+					if (Prompt)
+						promptFound = _serial_prompt(tmpResponse, tmpResponseSize);
 				}
 
 				if (fds.revents & POLLHUP) {
@@ -236,9 +711,14 @@ int serial_response_wait(int fd, int Timeout, int OKSearch, char **Response, siz
 				}
 				break;
 			}
-		} while (ret == 0 && transmitted > 0 && okFound != 1);
+		} while (ret == 0 && transmitted > 0 && okFound != 1 && !promptFound && !(okFound == -1 && !Prompt && _waitBreak));
 	
 		line_callback_unregister(okCallbackHandle);
+		if (OKSearch && okFound != 1)
+			metrics_command_end(mrTimeout);
+
+		/* Whatever arrives after the wait is not a response anymore */
+		_commandPending = 0;
 	}
 
 	if (ret == 0 && Response != NULL) {
@@ -247,7 +727,7 @@ int serial_response_wait(int fd, int Timeout, int OKSearch, char **Response, siz
 	}
 
 	if (ret != 0 || Response == NULL) {
-		free(tmpResponse);
+		arena_free(tmpResponse);
 		tmpResponse = NULL;
 	}
 
@@ -256,14 +736,143 @@ int serial_response_wait(int fd, int Timeout, int OKSearch, char **Response, siz
 }
 
 
+int serial_response_wait(int fd, int Timeout, int OKSearch, char **Response, size_t *ResponseSize)
+{
+	return _serial_response_wait(fd, Timeout * 1000, OKSearch, 0, Response, ResponseSize);
+}
+
+
+/*
+ * Waits for unsolicited data on several handles at once and passes it to
+ * the line callbacks, returns after Timeout seconds without any or when a
+ * signal arrives. A watched descriptor getting ready has its callback
+ * called, like a URC it ends the wait by queuing a job.
+ */
+int serial_response_wait_any(const int* Handles, size_t Count, int Timeout)
+{
+	int ret = 0;
+	int ready = 0;
+	int channel = 0;
+	struct pollfd fds[LINE_BUFFER_STREAMS + SERIAL_WATCH_MAX];
+	PSERIAL_IO io = NULL;
+	log_enter("Handles=0x%p; Count=%zu; Timeout=%i", Handles, Count, Timeout);
+
+	_waitBreak = 0;
+	if ((Count == 1 && _watchCount == 0) || capture_replaying()) {
+		ret = serial_response_wait(Handles[0], Timeout, 0, NULL, NULL);
+		goto Exit;
+	}
+
+	if (Count > LINE_BUFFER_STREAMS) {
+		ret = EINVAL;
+		goto Exit;
+	}
+
+	memset(fds, 0, sizeof(fds));
+	for (size_t i = 0; i < Count; ++i) {
+		io = _serial_io(Handles[i], &channel);
+		fds[i].fd = (io != NULL) ? serial_io_event(io, channel) : Handles[i];
+		fds[i].events = POLLIN;
+	}
+
+	for (size_t i = 0; i < _watchCount; ++i) {
+		fds[Count + i].fd = _watches[i].FD;
+		fds[Count + i].events = POLLIN;
+	}
+
+	do {
+		ready = poll(fds, Count + _watchCount, Timeout * 1000);
+		if (ready == -1) {
+			if (errno != EINTR)
+				ret = errno;
+
+			break;
+		}
+
+		for (size_t i = 0; ret == 0 && ready > 0 && i < Count; ++i) {
+			if (fds[i].revents != 0)
+				ret = _serial_response_wait(Handles[i], 0, 0, 0, NULL, NULL);
+		}
+
+		for (size_t i = 0; ret == 0 && ready > 0 && i < _watchCount; ++i) {
+			if (fds[Count + i].revents != 0)
+				_watches[i].Callback(_watches[i].FD, _watches[i].Context);
+		}
+	} while (ret == 0 && ready > 0 && !_waitBreak);
+
+Exit:
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+/* Makes the current or next serial_response_wait_any() return once the data at hand is passed on */
+void serial_wait_break(void)
+{
+	_waitBreak = 1;
+
+	return;
+}
+
+
+/* Polls fd in the idle waits, Callback runs in the main loop once it is readable */
+int serial_watch(int fd, SERIAL_WATCH_CALLBACK* Callback, void* Context)
+{
+	int ret = 0;
+	log_enter("fd=%i; Callback=0x%p; Context=0x%p", fd, Callback, Context);
+
+	if (_watchCount < SERIAL_WATCH_MAX) {
+		_watches[_watchCount].FD = fd;
+		_watches[_watchCount].Callback = Callback;
+		_watches[_watchCount].Context = Context;
+		++_watchCount;
+	} else ret = ENOSPC;
+
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+void serial_unwatch(int fd)
+{
+	log_enter("fd=%i", fd);
+
+	for (size_t i = 0; i < _watchCount; ++i) {
+		if (_watches[i].FD == fd) {
+			--_watchCount;
+			_watches[i] = _watches[_watchCount];
+			break;
+		}
+	}
+
+	log_exit("void");
+	return;
+}
+
+
+/* The line buffer streams the data of the port behind fd go to */
+void serial_streams(int fd, int* First, int* Count)
+{
+	int channel = 0;
+	PSERIAL_IO io = NULL;
+
+	io = _serial_io(fd, &channel);
+	*First = (io != NULL) ? _serial_stream(io, 0) : 0;
+	*Count = (io != NULL) ? SERIAL_IO_CHANNELS : LINE_BUFFER_STREAMS;
+
+	return;
+}
+
+
 int serial_command_with_response(int fd, const char *Command, int CR, int LF, int OKSearch, char **Response, size_t* ResponseSize)
 {
 	int ret = 0;
 	log_enter("fd=%i; Command=\"%s\"; CR=%u; LF=%i; OKSearch=%i; Response=0x%p; ResponseSize=0x%p", fd, Command, CR, LF, OKSearch, Response, ResponseSize);
 
+	/* Commands not waiting for the final result wait for the prompt of their data */
 	ret = serial_command(fd, Command, CR, LF);
 	if (ret == 0)
-		ret = serial_response_wait(fd, 4, OKSearch, Response, ResponseSize);
+		ret = _serial_response_wait(fd, metrics_command_timeout(), OKSearch, !OKSearch, Response, ResponseSize);
 
 	log_exit("%i, *Response=\"%s\", *ResponseSize=%zu", ret, *Response, *ResponseSize);
 	return ret;
@@ -291,7 +900,7 @@ int serial_response_to_lines(char* Response, size_t ResponseSize, char*** Lines,
 				*Response = '\0';
 				*(Response - 1) = '\0';
 				if (tmpLineCount == *LineCount) {
-					tmp = realloc(tmpLines, (tmpLineCount + 1) * sizeof(char*));
+					tmp = arena_realloc(tmpLines, (tmpLineCount + 1) * sizeof(char*));
 					if (tmp == NULL) {
 						ret = ENOMEM;
 						continue;
@@ -316,7 +925,7 @@ int serial_response_to_lines(char* Response, size_t ResponseSize, char*** Lines,
 
 	if (ret == 0 && lineStart != Response) {
 		if (tmpLineCount == *LineCount) {
-			tmp = realloc(tmpLines, (tmpLineCount + 1) * sizeof(char*));
+			tmp = arena_realloc(tmpLines, (tmpLineCount + 1) * sizeof(char*));
 			if (tmp != NULL) {
 				tmpLines = tmp;
 				*LineCount = tmpLineCount + 1;
@@ -329,7 +938,7 @@ int serial_response_to_lines(char* Response, size_t ResponseSize, char*** Lines,
 		}
 
 		if (ret != 0)
-			free(tmpLines);
+			arena_free(tmpLines);
 	}
 
 	if (ret == 0) {
@@ -370,6 +979,9 @@ ESerialCommandStatus serial_command_status(char** Lines, size_t LineCount)
 		} else if (sizeof("+CME ERROR: ") - 1 <= len && memcmp(l, "+CME ERROR: ", sizeof("+CME ERROR: ") - 1) == 0) {
 			ret = scsError;
 			break;
+		} else if (sizeof("+CMS ERROR: ") - 1 <= len && memcmp(l, "+CMS ERROR: ", sizeof("+CMS ERROR: ") - 1) == 0) {
+			ret = scsError;
+			break;
 		}
 	}
 
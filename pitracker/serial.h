@@ -8,11 +8,30 @@ typedef enum _ESerialCommandStatus {
 	scsError,
 } ESerialCommandStatus, * PESerialCommandStatus;
 
+#define SERIAL_WATCH_MAX				4
+
+typedef void (SERIAL_WATCH_CALLBACK)(int fd, void* Context);
+
+typedef struct _SERIAL_WATCH {
+	int FD;
+	SERIAL_WATCH_CALLBACK* Callback;
+	void* Context;
+} SERIAL_WATCH, *PSERIAL_WATCH;
+
 
 int serial_open(const char* device, int rate, int* Handle);
 void serial_close(int Handle);
+int serial_low_latency(int fd, int Priority);
+int serial_rate_set(int fd, int rate);
+int serial_mux_open(int fd, int Count, int* Handles);
+void serial_mux_close(int fd, int Count);
 int serial_command(int fd, const char *Command, int CR, int LF);
 int serial_response_wait(int fd, int Timeout, int OKSearch, char** Response, size_t* ResponseSize);
+int serial_response_wait_any(const int* Handles, size_t Count, int Timeout);
+void serial_streams(int fd, int* First, int* Count);
+void serial_wait_break(void);
+int serial_watch(int fd, SERIAL_WATCH_CALLBACK* Callback, void* Context);
+void serial_unwatch(int fd);
 int serial_command_with_response(int fd, const char* Command, int CR, int LF, int OKSearch, char** Response, size_t* ResponseSize);
 int serial_response_to_lines(char* Response, size_t ResponseSize, char*** Lines, size_t* LineCount);
 ESerialCommandStatus serial_command_status(char** Lines, size_t LineCount);
@@ -9,66 +9,330 @@
 #include <assert.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
+#include <libgen.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "logging.h"
 #include "field-array.h"
 #include "settings.h"
 
-/*
-
-account: <number> <password> [admin=0|1]
-account: * <password> [admin=0|1]
-gps: 0|1
-loc: <lat> <long> <timestamp>
-logerror: 0|1
-logwarning: 0|1
-logtrace: 0|1
-loginfo: 0|1
-apn: <URL> <user> <password>
-gprs: 0|1
-name: <string>
-batteryalarm: <percentage>
-period: <seconds>
-fence: <lat> <loc> <radius>
-server: <ip> <port>
-logfile: <filename>
-maxloglines: <integer>
-pin: <string>
-device: </dev/ttyS0>
-baudrate: <integer>
-*/
-
-
-
+static const SETTINGS_DEFINITION _definitions[skMax] = {
+	[skAccount] = {"account", stList, NULL, 0, 0, "<number>|* <password> [admin=0|1]"},
+	[skGps] = {"gps", stBool, "0", 0, 1, "0|1"},
+	[skGpsPeriod] = {"gpsperiod", stInt, "30", 0, 86400, "<seconds>"},
+	[skLoc] = {"loc", stList, NULL, 0, 0, "<lat> <long> <timestamp>"},
+	[skLogError] = {"logerror", stBool, "1", 0, 1, "0|1"},
+	[skLogWarning] = {"logwarning", stBool, "1", 0, 1, "0|1"},
+	[skLogTrace] = {"logtrace", stBool, "0", 0, 1, "0|1"},
+	[skLogInfo] = {"loginfo", stBool, "1", 0, 1, "0|1"},
+	[skApn] = {"apn", stString, NULL, 0, 0, "<URL> <user> <password>"},
+	[skGprs] = {"gprs", stBool, "0", 0, 1, "0|1"},
+	[skName] = {"name", stString, NULL, 0, 0, "<string>"},
+	[skBatteryAlarm] = {"batteryalarm", stInt, "0", 0, 100, "<percentage>"},
+	[skPeriod] = {"period", stInt, "30", 0, 86400, "<seconds>"},
+	[skSyncPeriod] = {"syncperiod", stInt, "300", 0, 604800, "<seconds>"},
+	[skFence] = {"fence", stList, NULL, 0, 0, "<lat> <loc> <radius>"},
+	[skServer] = {"server", stString, NULL, 0, 0, "<ip> <port>"},
+	[skLogFile] = {"logfile", stString, NULL, 0, 0, "<filename>"},
+	[skGpsFile] = {"gpsfile", stString, "gpsapp.gps", 0, 0, "<filename>"},
+	[skMaxLogLines] = {"maxloglines", stInt, "0", 0, INT_MAX, "<integer>"},
+	[skPin] = {"pin", stString, NULL, 0, 0, "<string>"},
+	[skDevice] = {"device", stString, "/dev/ttyS0", 0, 0, "</dev/ttyS0>"},
+	[skBaudRate] = {"baudrate", stInt, "115200", 1200, 4000000, "<integer>"},
+	[skSmsMode] = {"smsmode", stString, "pdu", 0, 0, "pdu|text"},
+	[skSmsUplink] = {"smsuplink", stString, NULL, 0, 0, "<phone>"},
+	[skSmsBudget] = {"smsbudget", stInt, "10", 0, 1000, "<integer>"},
+	[skSmsUsed] = {"smsused", stString, NULL, 0, 0, "<yyyyMMdd> <integer>"},
+	[skSavePeriod] = {"saveperiod", stInt, "60", 0, 86400, "<seconds>"},
+	[skJournalMax] = {"journalmax", stInt, "16384", 0, 16777216, "<bytes>"},
+	[skLogMaxSize] = {"logmaxsize", stInt, "1048576", 4096, INT_MAX, "<bytes>"},
+	[skFlightSize] = {"flightsize", stInt, "65536", 0, 16777216, "<bytes>"},
+	[skFlightRing] = {"flightring", stString, "/dev/shm/gpsapp.flight", 0, 0, "<filename>"},
+	[skFlightDump] = {"flightdump", stString, "gpsapp.flight", 0, 0, "<filename>"},
+	[skMetricsSocket] = {"metricssocket", stString, NULL, 0, 0, "<filename>"},
+	[skLowLatency] = {"lowlatency", stBool, "0", 0, 1, "0|1"},
+	[skRtPriority] = {"rtpriority", stInt, "0", 0, 99, "<0-99>"},
+	[skMaxBaudRate] = {"maxbaudrate", stInt, "0", 0, 4000000, "<integer>"},
+	[skModemBaudRate] = {"modembaudrate", stInt, "0", 0, 4000000, "<integer>"},
+	[skCmux] = {"cmux", stBool, "0", 0, 1, "0|1"},
+	[skControlSocket] = {"controlsocket", stString, NULL, 0, 0, "<filename>"},
+	[skControlMaxAge] = {"controlmaxage", stInt, "30", 0, 86400, "<seconds>"},
+};
+
+
+
+#define SETTINGS_INDEX_MIN				16
+#define SETTINGS_KEYS_MIN				8
+#define SETTINGS_VALUES_MIN				2
+#define SETTINGS_ARENA_BLOCK_SIZE		4096
+
+
+/* Strings are bump-allocated and only released all at once; replaced ones are accounted as garbage until the next compaction */
+typedef struct _SETTINGS_ARENA_BLOCK {
+	struct _SETTINGS_ARENA_BLOCK *Next;
+	size_t Size;
+	size_t Used;
+	char Data[];
+} SETTINGS_ARENA_BLOCK, *PSETTINGS_ARENA_BLOCK;
+
+typedef struct _SETTINGS_ARENA {
+	PSETTINGS_ARENA_BLOCK Blocks;
+	size_t Used;
+	size_t Garbage;
+} SETTINGS_ARENA, *PSETTINGS_ARENA;
 
 typedef struct _SETTINGS_KEY_ENTRY {
 	char *Name;
+	uint32_t Hash;
+	/* ESettingsKey of a declared key, -1 otherwise */
+	int Definition;
 	size_t ValueCount;
+	size_t ValueCapacity;
 	char **Values;
+	/* The journal of this generation already holds the base record of the key */
+	int Journaled;
 } SETTINGS_KEY_ENTRY, *PSETTINGS_KEY_ENTRY;
 
-typedef struct _SETTINGS_ROOT_ENTRY {
+/* Parsed form of the first value of a declared key */
+typedef struct _SETTINGS_VALUE {
+	int Int;
+	const char *String;
+	size_t Count;
+} SETTINGS_VALUE, *PSETTINGS_VALUE;
+
+typedef struct _SETTINGS_STORE {
+	/* Keys in insertion order, which is also the order they are saved in */
 	size_t KeyCount;
+	size_t KeyCapacity;
 	PSETTINGS_KEY_ENTRY Keys;
-} SETTINGS_ROOT_ENTRY, * PSETTINGS_ROOT_ENTRY;
+	/* Open addressing with linear probing; a slot holds the key position + 1, zero marks a free slot */
+	size_t IndexSize;
+	uint32_t *Index;
+	SETTINGS_ARENA Arena;
+	/* Private mapping of the loaded file, tokenized in place */
+	char *Map;
+	size_t MapSize;
+	int CacheReady;
+	SETTINGS_VALUE Cache[skMax];
+	/* Changed since the last save */
+	int Dirty;
+	time_t LastSave;
+	/* Mutations since the last snapshot of FileName, appended to FileName.journal */
+	char *FileName;
+	char Delimiter;
+	char Comment;
+	int JournalFD;
+	size_t JournalSize;
+	int JournalBroken;
+	/* The journal holds records the snapshot lacks */
+	int JournalPending;
+	unsigned long Generation;
+	int Replaying;
+	/* FileName as last loaded or saved, so own saves are not mistaken for external edits */
+	struct stat FileStat;
+} SETTINGS_STORE, *PSETTINGS_STORE;
+
+typedef struct _SETTINGS_REPLAY_KEY {
+	const char *Name;
+	/* The file value differs from the base the journaled changes started from */
+	int Edited;
+} SETTINGS_REPLAY_KEY, *PSETTINGS_REPLAY_KEY;
+
+/* Keys of a replayed journal, the file may have been edited since on any of them */
+typedef struct _SETTINGS_REPLAY {
+	int Merge;
+	size_t KeyCount;
+	size_t KeyCapacity;
+	PSETTINGS_REPLAY_KEY Keys;
+	size_t Conflicts;
+} SETTINGS_REPLAY, *PSETTINGS_REPLAY;
 
 
-static SETTINGS_ROOT_ENTRY _root;
+static SETTINGS_STORE _store = {.JournalFD = -1};
+static SETTINGS_CALLBACK_RECORD _callbackHead = {&_callbackHead, &_callbackHead, skMax, NULL, NULL};
 
 
-static PSETTINGS_KEY_ENTRY _get_key_entry(const SETTINGS_ROOT_ENTRY* Root, const char *Key)
+static uint32_t _settings_hash(const char *Key)
 {
-	PSETTINGS_KEY_ENTRY ret = NULL;
-	PSETTINGS_KEY_ENTRY tmp = NULL;
-	log_enter("Root=0x%p; Key=\"%s\"", Root, Key);
+	uint32_t ret = 2166136261u;
+
+	while (*Key != '\0') {
+		ret ^= (unsigned char)*Key;
+		ret *= 16777619u;
+		++Key;
+	}
+
+	return ret;
+}
+
+
+/* Zero stands for a missing key */
+static uint32_t _settings_values_hash(const SETTINGS_KEY_ENTRY *Entry)
+{
+	uint32_t ret = 0;
+	const char *value = NULL;
+
+	if (Entry != NULL) {
+		ret = 2166136261u;
+		for (size_t i = 0; i < Entry->ValueCount; ++i) {
+			for (value = Entry->Values[i]; *value != '\0'; ++value) {
+				ret ^= (unsigned char)*value;
+				ret *= 16777619u;
+			}
+
+			ret ^= '\n';
+			ret *= 16777619u;
+		}
+
+		if (ret == 0)
+			ret = 1;
+	}
+
+	return ret;
+}
+
+
+static char *_arena_alloc(PSETTINGS_ARENA Arena, size_t Size)
+{
+	char *ret = NULL;
+	size_t blockSize = SETTINGS_ARENA_BLOCK_SIZE;
+	PSETTINGS_ARENA_BLOCK block = NULL;
+
+	block = Arena->Blocks;
+	if (block == NULL || block->Size - block->Used < Size) {
+		if (blockSize < Size)
+			blockSize = Size;
+
+		block = malloc(sizeof(SETTINGS_ARENA_BLOCK) + blockSize);
+		if (block != NULL) {
+			block->Next = Arena->Blocks;
+			block->Size = blockSize;
+			block->Used = 0;
+			Arena->Blocks = block;
+		}
+	}
+
+	if (block != NULL) {
+		ret = block->Data + block->Used;
+		block->Used += Size;
+		Arena->Used += Size;
+	}
+
+	return ret;
+}
+
+
+static char *_arena_strdup(PSETTINGS_ARENA Arena, const char *String)
+{
+	char *ret = NULL;
+	size_t len = 0;
+
+	len = strlen(String) + 1;
+	ret = _arena_alloc(Arena, len);
+	if (ret != NULL)
+		memcpy(ret, String, len);
+
+	return ret;
+}
+
+
+static void _arena_release(PSETTINGS_ARENA Arena, const char *String)
+{
+	Arena->Garbage += strlen(String) + 1;
+
+	return;
+}
+
+
+static void _arena_free(PSETTINGS_ARENA Arena)
+{
+	PSETTINGS_ARENA_BLOCK block = NULL;
+	PSETTINGS_ARENA_BLOCK old = NULL;
+
+	block = Arena->Blocks;
+	while (block != NULL) {
+		old = block;
+		block = block->Next;
+		free(old);
+	}
+
+	memset(Arena, 0, sizeof(SETTINGS_ARENA));
+
+	return;
+}
+
 
-	tmp = Root->Keys;
-	for (size_t i = 0; i < Root->KeyCount; ++i) {
-		if (strcmp(Key, tmp->Name) == 0) {
-			ret = tmp;
+static uint32_t *_index_slot(const SETTINGS_STORE *Store, const char *Key, uint32_t Hash)
+{
+	uint32_t *ret = NULL;
+	size_t mask = 0;
+	size_t pos = 0;
+	const SETTINGS_KEY_ENTRY *ke = NULL;
+
+	mask = Store->IndexSize - 1;
+	pos = Hash & mask;
+	for (;;) {
+		ret = Store->Index + pos;
+		if (*ret == 0)
 			break;
+
+		ke = Store->Keys + *ret - 1;
+		if (ke->Hash == Hash && strcmp(ke->Name, Key) == 0)
+			break;
+
+		pos = (pos + 1) & mask;
+	}
+
+	return ret;
+}
+
+
+static int _index_rebuild(PSETTINGS_STORE Store, size_t Size)
+{
+	int ret = 0;
+	uint32_t *index = NULL;
+	size_t mask = 0;
+	size_t pos = 0;
+	log_enter("Store=0x%p; Size=%zu", Store, Size);
+
+	index = calloc(Size, sizeof(uint32_t));
+	if (index == NULL)
+		ret = ENOMEM;
+
+	if (ret == 0) {
+		mask = Size - 1;
+		for (size_t i = 0; i < Store->KeyCount; ++i) {
+			pos = Store->Keys[i].Hash & mask;
+			while (index[pos] != 0)
+				pos = (pos + 1) & mask;
+
+			index[pos] = (uint32_t)(i + 1);
 		}
 
-		++tmp;
+		free(Store->Index);
+		Store->Index = index;
+		Store->IndexSize = Size;
+	}
+
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+static PSETTINGS_KEY_ENTRY _get_key_entry(const SETTINGS_STORE *Store, const char *Key)
+{
+	PSETTINGS_KEY_ENTRY ret = NULL;
+	const uint32_t *slot = NULL;
+	log_enter("Store=0x%p; Key=\"%s\"", Store, Key);
+
+	if (Store->IndexSize > 0) {
+		slot = _index_slot(Store, Key, _settings_hash(Key));
+		if (*slot != 0)
+			ret = Store->Keys + *slot - 1;
 	}
 
 	log_exit("0x%p", ret);
@@ -76,6 +340,615 @@ static PSETTINGS_KEY_ENTRY _get_key_entry(const SETTINGS_ROOT_ENTRY* Root, const
 }
 
 
+static int _settings_definition_find(const char *Name)
+{
+	int ret = -1;
+
+	for (int i = 0; i < skMax; ++i) {
+		if (strcmp(_definitions[i].Name, Name) == 0) {
+			ret = i;
+			break;
+		}
+	}
+
+	return ret;
+}
+
+
+static int _settings_int_parse(const char *String, int Min, int Max, int *Value)
+{
+	int ret = 0;
+	long val = 0;
+	char *end = NULL;
+
+	errno = 0;
+	val = strtol(String, &end, 0);
+	if (end == String || *end != '\0' || errno == ERANGE)
+		ret = EINVAL;
+
+	if (ret == 0 && (val < Min || val > Max))
+		ret = ERANGE;
+
+	if (ret == 0)
+		*Value = (int)val;
+
+	return ret;
+}
+
+
+static void _settings_notify(ESettingsKey Key)
+{
+	PSETTINGS_CALLBACK_RECORD r = NULL;
+	PSETTINGS_CALLBACK_RECORD next = NULL;
+	log_enter("Key=%u", Key);
+
+	r = _callbackHead.Next;
+	while (r != &_callbackHead) {
+		/* The callback may unregister itself */
+		next = r->Next;
+		if (r->Key == Key)
+			r->Callback(Key, r->Context);
+
+		r = next;
+	}
+
+	log_exit("void");
+	return;
+}
+
+
+static void _settings_cache_update(PSETTINGS_STORE Store, ESettingsKey Key, int Notify)
+{
+	SETTINGS_VALUE old;
+	PSETTINGS_VALUE v = NULL;
+	const SETTINGS_DEFINITION *d = NULL;
+	const SETTINGS_KEY_ENTRY *ke = NULL;
+
+	d = _definitions + Key;
+	v = Store->Cache + Key;
+	old = *v;
+	memset(v, 0, sizeof(SETTINGS_VALUE));
+	v->String = d->Default;
+	ke = _get_key_entry(Store, d->Name);
+	if (ke != NULL && ke->ValueCount > 0) {
+		v->String = ke->Values[0];
+		v->Count = ke->ValueCount;
+	}
+
+	if (d->Type == stInt || d->Type == stBool) {
+		if (v->String != NULL && _settings_int_parse(v->String, d->Min, d->Max, &v->Int) != 0) {
+			log_warning("Invalid value \"%s\" of %s, using the default", v->String, d->Name);
+			v->String = d->Default;
+		}
+
+		if (v->String == d->Default && d->Default != NULL)
+			_settings_int_parse(d->Default, d->Min, d->Max, &v->Int);
+	}
+
+	if (Notify && Store->CacheReady &&
+		(old.Int != v->Int || (d->Type == stList && old.Count != v->Count) ||
+		(old.String != v->String && (old.String == NULL || v->String == NULL || strcmp(old.String, v->String) != 0))))
+		_settings_notify(Key);
+
+	return;
+}
+
+
+static void _settings_cache_refresh(PSETTINGS_STORE Store, int Notify)
+{
+	for (int i = 0; i < skMax; ++i)
+		_settings_cache_update(Store, (ESettingsKey)i, Notify);
+
+	Store->CacheReady = 1;
+
+	return;
+}
+
+
+/* Key is referenced, not copied */
+static int _key_entry_add(PSETTINGS_STORE Store, char *Key, PSETTINGS_KEY_ENTRY *Entry)
+{
+	int ret = 0;
+	uint32_t hash = 0;
+	uint32_t *slot = NULL;
+	size_t newCapacity = 0;
+	PSETTINGS_KEY_ENTRY newKeys = NULL;
+	PSETTINGS_KEY_ENTRY ke = NULL;
+	log_enter("Store=0x%p; Key=\"%s\"; Entry=0x%p", Store, Key, Entry);
+
+	/* Keep the load factor at most 1/2 */
+	if ((Store->KeyCount + 1) * 2 > Store->IndexSize)
+		ret = _index_rebuild(Store, (Store->IndexSize > 0) ? Store->IndexSize * 2 : SETTINGS_INDEX_MIN);
+
+	if (ret == 0 && Store->KeyCount == Store->KeyCapacity) {
+		newCapacity = (Store->KeyCapacity > 0) ? Store->KeyCapacity * 2 : SETTINGS_KEYS_MIN;
+		newKeys = realloc(Store->Keys, newCapacity * sizeof(SETTINGS_KEY_ENTRY));
+		if (newKeys != NULL) {
+			Store->Keys = newKeys;
+			Store->KeyCapacity = newCapacity;
+		} else ret = ENOMEM;
+	}
+
+	if (ret == 0) {
+		hash = _settings_hash(Key);
+		slot = _index_slot(Store, Key, hash);
+		assert(*slot == 0);
+		ke = Store->Keys + Store->KeyCount;
+		memset(ke, 0, sizeof(SETTINGS_KEY_ENTRY));
+		ke->Name = Key;
+		ke->Hash = hash;
+		ke->Definition = _settings_definition_find(Key);
+		++Store->KeyCount;
+		*slot = (uint32_t)Store->KeyCount;
+		*Entry = ke;
+	}
+
+	log_exit("%i, *Entry=0x%p", ret, *Entry);
+	return ret;
+}
+
+
+/* Value is referenced, not copied */
+static int _key_entry_value_append(PSETTINGS_KEY_ENTRY Entry, char *Value)
+{
+	int ret = 0;
+	size_t newCapacity = 0;
+	char **newValues = NULL;
+
+	if (Entry->ValueCount == Entry->ValueCapacity) {
+		newCapacity = (Entry->ValueCapacity > 0) ? Entry->ValueCapacity * 2 : SETTINGS_VALUES_MIN;
+		newValues = realloc(Entry->Values, newCapacity * sizeof(char *));
+		if (newValues != NULL) {
+			Entry->Values = newValues;
+			Entry->ValueCapacity = newCapacity;
+		} else ret = ENOMEM;
+	}
+
+	if (ret == 0) {
+		Entry->Values[Entry->ValueCount] = Value;
+		++Entry->ValueCount;
+	}
+
+	return ret;
+}
+
+
+/* Moves all live strings into a single fresh block, dropping the garbage and the file mapping */
+static int _settings_compact(PSETTINGS_STORE Store)
+{
+	int ret = 0;
+	size_t total = 0;
+	size_t len = 0;
+	char *buf = NULL;
+	SETTINGS_ARENA arena;
+	PSETTINGS_KEY_ENTRY ke = NULL;
+	log_enter("Store=0x%p", Store);
+
+	ke = Store->Keys;
+	for (size_t i = 0; i < Store->KeyCount; ++i) {
+		total += strlen(ke->Name) + 1;
+		for (size_t j = 0; j < ke->ValueCount; ++j)
+			total += strlen(ke->Values[j]) + 1;
+
+		++ke;
+	}
+
+	memset(&arena, 0, sizeof(arena));
+	if (total > 0) {
+		buf = _arena_alloc(&arena, total);
+		if (buf == NULL)
+			ret = ENOMEM;
+	}
+
+	if (ret == 0) {
+		ke = Store->Keys;
+		for (size_t i = 0; i < Store->KeyCount; ++i) {
+			len = strlen(ke->Name) + 1;
+			memcpy(buf, ke->Name, len);
+			ke->Name = buf;
+			buf += len;
+			for (size_t j = 0; j < ke->ValueCount; ++j) {
+				len = strlen(ke->Values[j]) + 1;
+				memcpy(buf, ke->Values[j], len);
+				ke->Values[j] = buf;
+				buf += len;
+			}
+
+			++ke;
+		}
+
+		_arena_free(&Store->Arena);
+		Store->Arena = arena;
+		if (Store->Map != NULL) {
+			munmap(Store->Map, Store->MapSize);
+			Store->Map = NULL;
+			Store->MapSize = 0;
+		}
+
+		/* Cached strings pointed to the old arena */
+		for (int i = 0; i < skMax; ++i) {
+			PSETTINGS_VALUE v = Store->Cache + i;
+
+			if (v->String != NULL && v->String != _definitions[i].Default) {
+				ke = _get_key_entry(Store, _definitions[i].Name);
+				v->String = ke->Values[0];
+			}
+		}
+	}
+
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+static int _settings_journal_append(PSETTINGS_STORE Store, const char *Format, ...)
+{
+	int ret = 0;
+	int len = 0;
+	char buf[512];
+	char *record = buf;
+	ssize_t written = 0;
+	size_t offset = 0;
+	va_list args;
+
+	if (Store->JournalFD == -1 || Store->JournalBroken || Store->Replaying)
+		goto Exit;
+
+	va_start(args, Format);
+	len = vsnprintf(buf, sizeof(buf), Format, args);
+	va_end(args);
+	if (len < 0)
+		ret = EINVAL;
+
+	if (ret == 0 && (size_t)len >= sizeof(buf)) {
+		record = malloc((size_t)len + 1);
+		if (record != NULL) {
+			va_start(args, Format);
+			vsnprintf(record, (size_t)len + 1, Format, args);
+			va_end(args);
+		} else ret = ENOMEM;
+	}
+
+	while (ret == 0 && offset < (size_t)len) {
+		written = write(Store->JournalFD, record + offset, (size_t)len - offset);
+		if (written == -1) {
+			ret = errno;
+			if (ret == EINTR)
+				ret = 0;
+
+			continue;
+		}
+
+		offset += (size_t)written;
+	}
+
+	if (ret == 0) {
+		Store->JournalSize += (size_t)len;
+		Store->JournalPending = 1;
+	}
+
+	/* The next flush writes a full snapshot instead */
+	if (ret != 0) {
+		log_error("Unable to append to the settings journal: %i", ret);
+		Store->JournalBroken = 1;
+	}
+
+	if (record != buf)
+		free(record);
+
+Exit:
+	return ret;
+}
+
+
+static int _settings_journal_reset(PSETTINGS_STORE Store)
+{
+	int ret = 0;
+	log_enter("Store=0x%p", Store);
+
+	Store->JournalBroken = 0;
+	Store->JournalSize = 0;
+	if (ftruncate(Store->JournalFD, 0) == -1)
+		ret = errno;
+
+	if (ret == 0)
+		ret = _settings_journal_append(Store, "G %lu\n", Store->Generation);
+
+	if (ret == 0 && fdatasync(Store->JournalFD) == -1)
+		ret = errno;
+
+	Store->JournalPending = 0;
+	for (size_t i = 0; i < Store->KeyCount; ++i)
+		Store->Keys[i].Journaled = 0;
+
+	if (ret != 0)
+		Store->JournalBroken = 1;
+
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+/* Precedes the first change of a key in a journal generation, so a replay can tell the keys edited in the file since */
+static void _settings_journal_base(PSETTINGS_STORE Store, const char *Key, PSETTINGS_KEY_ENTRY Entry)
+{
+	if (Entry == NULL || !Entry->Journaled) {
+		_settings_journal_append(Store, "B %08x %s\n", (unsigned int)_settings_values_hash(Entry), Key);
+		if (Entry != NULL)
+			Entry->Journaled = 1;
+	}
+
+	return;
+}
+
+
+static PSETTINGS_REPLAY_KEY _settings_replay_key(PSETTINGS_REPLAY Replay, const char *Key, int Add)
+{
+	PSETTINGS_REPLAY_KEY ret = NULL;
+	PSETTINGS_REPLAY_KEY newKeys = NULL;
+	size_t newCapacity = 0;
+
+	for (size_t i = 0; i < Replay->KeyCount; ++i) {
+		if (strcmp(Replay->Keys[i].Name, Key) == 0) {
+			ret = Replay->Keys + i;
+			break;
+		}
+	}
+
+	if (ret == NULL && Add) {
+		if (Replay->KeyCount == Replay->KeyCapacity) {
+			newCapacity = (Replay->KeyCapacity > 0) ? Replay->KeyCapacity * 2 : SETTINGS_KEYS_MIN;
+			newKeys = realloc(Replay->Keys, newCapacity * sizeof(SETTINGS_REPLAY_KEY));
+			if (newKeys != NULL) {
+				Replay->Keys = newKeys;
+				Replay->KeyCapacity = newCapacity;
+			}
+		}
+
+		if (Replay->KeyCount < Replay->KeyCapacity) {
+			ret = Replay->Keys + Replay->KeyCount;
+			ret->Name = Key;
+			ret->Edited = 0;
+			++Replay->KeyCount;
+		}
+	}
+
+	return ret;
+}
+
+
+/* Records of the keys edited in the file since the journal was written are dropped, the file wins */
+static int _settings_journal_apply(PSETTINGS_STORE Store, PSETTINGS_REPLAY Replay, char *Record)
+{
+	int ret = 0;
+	int edited = 0;
+	unsigned long index = 0;
+	char *key = NULL;
+	char *value = NULL;
+	char *end = NULL;
+	PSETTINGS_REPLAY_KEY rk = NULL;
+
+	if (Record[0] == '\0' || Record[1] != ' ')
+		ret = EINVAL;
+
+	if (ret == 0) {
+		key = Record + 2;
+		if (Record[0] == 'S' || Record[0] == 'D' || Record[0] == 'B') {
+			index = strtoul(key, &end, (Record[0] == 'B') ? 16 : 10);
+			if (end == key || *end != ' ')
+				ret = EINVAL;
+
+			key = end + 1;
+		}
+	}
+
+	if (ret == 0 && (Record[0] == 'A' || Record[0] == 'S')) {
+		value = strchr(key, Store->Delimiter);
+		if (value == NULL)
+			ret = EINVAL;
+
+		if (ret == 0) {
+			*value = '\0';
+			++value;
+			if (*value == ' ')
+				++value;
+		}
+	}
+
+	/* The base is checked again at every record, it is written anew once a key is deleted or the store reloaded */
+	if (ret == 0 && Record[0] == 'B') {
+		rk = _settings_replay_key(Replay, key, 1);
+		if (rk == NULL)
+			ret = ENOMEM;
+
+		if (ret == 0) {
+			edited = (_settings_values_hash(_get_key_entry(Store, key)) != (uint32_t)index);
+			if (edited && !rk->Edited) {
+				log_warning("Setting %s was edited in %s, its journaled changes are dropped", key, Store->FileName);
+				++Replay->Conflicts;
+			}
+
+			rk->Edited = edited;
+		}
+
+		goto Exit;
+	}
+
+	if (ret == 0) {
+		rk = _settings_replay_key(Replay, key, 0);
+		if (rk == NULL && Replay->Merge) {
+			/* A journal without base records cannot tell, keep the file */
+			rk = _settings_replay_key(Replay, key, 1);
+			if (rk == NULL)
+				ret = ENOMEM;
+
+			if (ret == 0) {
+				log_warning("Setting %s has no base in the settings journal, its journaled changes are dropped", key);
+				rk->Edited = 1;
+				++Replay->Conflicts;
+			}
+		}
+
+		if (ret == 0 && rk != NULL && rk->Edited)
+			goto Exit;
+	}
+
+	if (ret == 0) {
+		switch (Record[0]) {
+			case 'A':
+				ret = settings_value_add(key, value);
+				break;
+			case 'S':
+				ret = settings_value_set_string(key, index, value);
+				break;
+			case 'D':
+				ret = settings_value_delete(key, index);
+				break;
+			case 'K':
+				ret = settings_key_delete(key);
+				break;
+			case 'N':
+				ret = settings_key_add(key);
+				if (ret == EEXIST)
+					ret = 0;
+				break;
+			default:
+				ret = EINVAL;
+				break;
+		}
+	}
+
+Exit:
+	return ret;
+}
+
+
+/* Replays the journal of the loaded snapshot, the journal of the previous one has already been merged into it */
+static int _settings_journal_open(PSETTINGS_STORE Store, const char *FileName, mode_t Mode)
+{
+	int ret = 0;
+	int err = 0;
+	int fd = -1;
+	int dirty = 0;
+	SETTINGS_REPLAY replay;
+	char *name = NULL;
+	char *buf = NULL;
+	size_t nameLen = 0;
+	size_t size = 0;
+	size_t valid = 0;
+	size_t header = 0;
+	ssize_t len = 0;
+	unsigned long generation = 0;
+	char *lineStart = NULL;
+	char *lineEnd = NULL;
+	struct stat st;
+	log_enter("Store=0x%p; FileName=\"%s\"; Mode=0%o", Store, FileName, Mode);
+
+	memset(&replay, 0, sizeof(replay));
+	nameLen = strlen(FileName) + sizeof(".journal");
+	name = malloc(nameLen);
+	if (name == NULL)
+		ret = ENOMEM;
+
+	if (ret == 0) {
+		snprintf(name, nameLen, "%s.journal", FileName);
+		fd = open(name, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, Mode & 0666);
+		if (fd == -1)
+			ret = errno;
+
+		free(name);
+	}
+
+	if (ret == 0 && fstat(fd, &st) == -1)
+		ret = errno;
+
+	if (ret == 0) {
+		size = (size_t)st.st_size;
+		buf = malloc(size + 1);
+		if (buf == NULL)
+			ret = ENOMEM;
+	}
+
+	while (ret == 0 && valid < size) {
+		len = pread(fd, buf + valid, size - valid, (off_t)valid);
+		if (len == -1 && errno == EINTR)
+			continue;
+
+		if (len <= 0) {
+			ret = (len == -1) ? errno : EIO;
+			continue;
+		}
+
+		valid += (size_t)len;
+	}
+
+	if (ret == 0) {
+		buf[size] = '\0';
+		valid = 0;
+		lineEnd = memchr(buf, '\n', size);
+		if (lineEnd != NULL && sscanf(buf, "G %lu", &generation) == 1 && generation + 1 != Store->Generation) {
+			/* Another generation means the file was replaced since, not by a save */
+			replay.Merge = (generation != Store->Generation);
+			if (replay.Merge)
+				log_warning("Settings journal of generation %lu does not match the snapshot at %lu, merging it into the edited file", generation, Store->Generation);
+
+			header = (size_t)(lineEnd - buf) + 1;
+			valid = header;
+			dirty = Store->Dirty;
+			Store->Replaying = 1;
+			lineStart = lineEnd + 1;
+			/* A record without its newline was torn by a crash */
+			while (ret == 0 && (lineEnd = memchr(lineStart, '\n', size - (size_t)(lineStart - buf))) != NULL) {
+				*lineEnd = '\0';
+				err = _settings_journal_apply(Store, &replay, lineStart);
+				if (err == EINVAL)
+					break;
+
+				if (err == ENOMEM)
+					ret = err;
+				else if (err != 0)
+					log_warning("Unable to replay settings journal record \"%s\": %i", lineStart, err);
+
+				lineStart = lineEnd + 1;
+				valid = (size_t)(lineStart - buf);
+			}
+
+			Store->Replaying = 0;
+			Store->Dirty = dirty;
+			log_info("Settings journal replayed, %zu of %zu bytes, %zu keys kept as edited", valid, size, replay.Conflicts);
+			/* The journal no longer applies to the file as it is, the next flush writes a snapshot that does */
+			if (replay.Merge || replay.Conflicts > 0) {
+				Store->JournalBroken = 1;
+				Store->Dirty = 1;
+			}
+		} else if (size > 0) log_info("Dropping settings journal of generation %lu, the snapshot is at %lu", generation, Store->Generation);
+	}
+
+	if (ret == 0) {
+		Store->JournalFD = fd;
+		if (valid > 0) {
+			if (valid < size && ftruncate(fd, (off_t)valid) == -1)
+				ret = errno;
+
+			Store->JournalSize = valid;
+			Store->JournalPending = (valid > header);
+		} else ret = _settings_journal_reset(Store);
+
+		if (ret != 0)
+			Store->JournalFD = -1;
+	}
+
+	if (ret != 0 && fd != -1)
+		close(fd);
+
+	free(replay.Keys);
+	free(buf);
+
+	log_exit("%i", ret);
+	return ret;
+}
+
+
 int settings_keys_enum(char*** Keys, size_t* Count)
 {
 	int ret = 0;
@@ -84,11 +957,11 @@ int settings_keys_enum(char*** Keys, size_t* Count)
 	PSETTINGS_KEY_ENTRY entry = NULL;
 	log_enter("Keys=0x%p; Count=0x%p", Keys, Count);
 
-	tmpCount = _root.KeyCount;
+	tmpCount = _store.KeyCount;
 	if (tmpCount > 0) {
 		tmpKeys = calloc(tmpCount, sizeof(char*));
 		if (tmpKeys != NULL) {
-			entry = _root.Keys;
+			entry = _store.Keys;
 			for (size_t i = 0; i < tmpCount; ++i) {
 				tmpKeys[i] = entry->Name;
 				++entry;
@@ -109,22 +982,25 @@ int settings_keys_enum(char*** Keys, size_t* Count)
 int settings_key_add(const char* Key)
 {
 	int ret = 0;
+	char* name = NULL;
 	PSETTINGS_KEY_ENTRY entry = NULL;
-	PSETTINGS_KEY_ENTRY newEntries = NULL;
 	log_enter("Key=\"%s\"", Key);
 
-	entry = _get_key_entry(&_root, Key);
+	entry = _get_key_entry(&_store, Key);
 	if (entry == NULL) {
-		newEntries = realloc(_root.Keys, (_root.KeyCount + 1)*sizeof(SETTINGS_KEY_ENTRY));
-		if (newEntries != NULL) {
-			_root.Keys = newEntries;
-			entry = newEntries + _root.KeyCount;
-			memset(entry, 0, sizeof(SETTINGS_KEY_ENTRY));
-			entry->Name = strdup(Key);
-			if (entry->Name != NULL)
-				++_root.KeyCount;
-			else ret = ENOMEM;
-		} else ret = ENOMEM;
+		_settings_journal_base(&_store, Key, NULL);
+		name = _arena_strdup(&_store.Arena, Key);
+		if (name == NULL)
+			ret = ENOMEM;
+
+		if (ret == 0)
+			ret = _key_entry_add(&_store, name, &entry);
+
+		if (ret == 0) {
+			entry->Journaled = 1;
+			_store.Dirty = 1;
+			_settings_journal_append(&_store, "N %s\n", Key);
+		}
 	} else ret = EEXIST;
 
 	log_exit("%i", ret);
@@ -135,23 +1011,32 @@ int settings_key_add(const char* Key)
 int settings_key_delete(const char* Key)
 {
 	int ret = 0;
-	PSETTINGS_KEY_ENTRY tmp = NULL;
+	PSETTINGS_KEY_ENTRY ke = NULL;
+	size_t pos = 0;
+	int definition = -1;
 	log_enter("Key=\"%s\"", Key);
 
-	ret = ENOENT;
-	tmp = _root.Keys;
-	for (size_t i = 0; i < _root.KeyCount; ++i) {
-		if (strcmp(Key, tmp->Name) == 0) {
-			memmove(tmp, tmp + 1, (_root.KeyCount - i - 1)*sizeof(SETTINGS_KEY_ENTRY));
-			--_root.KeyCount;
-			ret = 0;
-			break;
-		}
+	ke = _get_key_entry(&_store, Key);
+	if (ke != NULL) {
+		_settings_journal_base(&_store, Key, ke);
+		_arena_release(&_store.Arena, ke->Name);
+		for (size_t i = 0; i < ke->ValueCount; ++i)
+			_arena_release(&_store.Arena, ke->Values[i]);
 
-		++tmp;
-	}
+		free(ke->Values);
+		definition = ke->Definition;
+		pos = (size_t)(ke - _store.Keys);
+		memmove(ke, ke + 1, (_store.KeyCount - pos - 1)*sizeof(SETTINGS_KEY_ENTRY));
+		--_store.KeyCount;
+		/* Positions of the following keys changed */
+		ret = _index_rebuild(&_store, _store.IndexSize);
+		_store.Dirty = 1;
+		_settings_journal_append(&_store, "K %s\n", Key);
+		if (ret == 0 && definition >= 0)
+			_settings_cache_update(&_store, (ESettingsKey)definition, 1);
+	} else ret = ENOENT;
 
-	log_exit("0x%p", ret);
+	log_exit("%i", ret);
 	return ret;
 }
 
@@ -174,7 +1059,7 @@ int settings_value_count(const char *Key, size_t *Count)
 		const SETTINGS_KEY_ENTRY *ke = NULL;
 		log_enter("Kewy=%s", Key, Count);
 		
-		ke = _get_key_entry(&_root, Key);
+		ke = _get_key_entry(&_store, Key);
 		if (ke != NULL)
 			*Count = ke->ValueCount;
 		else ret = ENOENT;
@@ -192,7 +1077,7 @@ int settings_values_enum(const char* Key, char*** Values, size_t* Count)
 	const SETTINGS_KEY_ENTRY* ke = NULL;
 	log_enter("Key=\"%s\"; Values=0x%p; Count=0x%p", Key, Values, Count);
 
-	ke = _get_key_entry(&_root, Key);
+	ke = _get_key_entry(&_store, Key);
 	if (ke != NULL) {
 		tmpCount = ke->ValueCount;
 		if (tmpCount > 0) {
@@ -216,30 +1101,42 @@ int settings_values_enum(const char* Key, char*** Values, size_t* Count)
 int settings_value_add(const char* Key, const char* Value)
 {
 	int ret = 0;
+	char* name = NULL;
+	char* value = NULL;
 	PSETTINGS_KEY_ENTRY ke = NULL;
-	char** tmpValues = NULL;
 	log_enter("Key=\"%s\"; Value=\"%s\"", Key, Value);
 
-	ke = _get_key_entry(&_root, Key);
+	ke = _get_key_entry(&_store, Key);
+	_settings_journal_base(&_store, Key, ke);
 	if (ke == NULL) {
-		ret = settings_key_add(Key);
-		if (ret == 0) {
-			ke = _get_key_entry(&_root, Key);
-			assert(ke != NULL);
-		}
+		name = _arena_strdup(&_store.Arena, Key);
+		if (name == NULL)
+			ret = ENOMEM;
+
+		if (ret == 0)
+			ret = _key_entry_add(&_store, name, &ke);
+
+		if (ret == 0)
+			ke->Journaled = 1;
+	}
+
+	if (ret == 0) {
+		value = _arena_strdup(&_store.Arena, Value);
+		if (value == NULL)
+			ret = ENOMEM;
 	}
 
+	if (ret == 0)
+		ret = _key_entry_value_append(ke, value);
+
 	if (ret == 0) {
-		tmpValues = realloc(ke->Values, (ke->ValueCount + 1)*sizeof(char *));
-		if (tmpValues != NULL) {
-			ke->Values = tmpValues;
-			tmpValues[ke->ValueCount] = strdup(Value);
-			if (tmpValues[ke->ValueCount] != NULL)
-				++ke->ValueCount;
-			else ret = ENOMEM;
-		} else ret = ENOMEM;
+		_store.Dirty = 1;
+		_settings_journal_append(&_store, "A %s%c %s\n", Key, _store.Delimiter, Value);
 	}
 
+	if (ret == 0 && ke->Definition >= 0)
+		_settings_cache_update(&_store, (ESettingsKey)ke->Definition, 1);
+
 	log_exit("%i", ret);
 	return ret;
 }
@@ -251,7 +1148,7 @@ int settings_value_get_string(const char* Key, size_t Index, char** Value, const
 	const SETTINGS_KEY_ENTRY* ke = NULL;
 	log_enter("Key=\"%s\"; Index=%zu; Value=0x%p; Default=\"%s\"", Key, Index, Value, Default);
 
-	ke = _get_key_entry(&_root, Key);
+	ke = _get_key_entry(&_store, Key);
 	if (ke != NULL) {
 		if (Index < ke->ValueCount)
 			*Value = ke->Values[Index];
@@ -301,13 +1198,18 @@ int settings_value_set_string(const char* Key, size_t Index, const char* Value)
 	PSETTINGS_KEY_ENTRY ke = NULL;
 	log_enter("Key=\"%s\"; Index=%zu; Value=\"%s\"", Key, Index, Value);
 
-	ke = _get_key_entry(&_root, Key);
+	ke = _get_key_entry(&_store, Key);
 	if (ke != NULL) {
 		if (ke->ValueCount > Index) {
-			tmp = strdup(Value);
+			tmp = _arena_strdup(&_store.Arena, Value);
 			if (tmp != NULL) {
-				free(ke->Values[Index]);
+				_settings_journal_base(&_store, Key, ke);
+				_arena_release(&_store.Arena, ke->Values[Index]);
 				ke->Values[Index] = tmp;
+				_store.Dirty = 1;
+				_settings_journal_append(&_store, "S %zu %s%c %s\n", Index, Key, _store.Delimiter, Value);
+				if (ke->Definition >= 0)
+					_settings_cache_update(&_store, (ESettingsKey)ke->Definition, 1);
 			} else ret = ENOMEM;
 		} else ret = settings_value_add(Key, Value);
 	} else ret = settings_value_add(Key, Value);
@@ -337,11 +1239,17 @@ int settings_value_delete(const char* Key, size_t Index)
 	PSETTINGS_KEY_ENTRY ke = NULL;
 	log_enter("Key=\"%s\"; Index=%zu", Key, Index);
 
-	ke = _get_key_entry(&_root, Key);
+	ke = _get_key_entry(&_store, Key);
 	if (ke != NULL) {
 		if (ke->ValueCount > Index) {
+			_settings_journal_base(&_store, Key, ke);
+			_arena_release(&_store.Arena, ke->Values[Index]);
 			memmove(ke->Values + Index, ke->Values + Index + 1, (ke->ValueCount - Index - 1)*sizeof(char *));;
 			--ke->ValueCount;
+			_store.Dirty = 1;
+			_settings_journal_append(&_store, "D %zu %s\n", Index, Key);
+			if (ke->Definition >= 0)
+				_settings_cache_update(&_store, (ESettingsKey)ke->Definition, 1);
 		} else ret = ERANGE;
 	} else ret = ENOENT;
 
@@ -362,98 +1270,463 @@ void settings_values_free(char** Values, size_t Count)
 }
 
 
-int settings_load(const char* FileName, char Delimiter, char Comment)
+const SETTINGS_DEFINITION* settings_definition(ESettingsKey Key)
+{
+	const SETTINGS_DEFINITION* ret = NULL;
+	log_enter("Key=%u", Key);
+
+	if (Key < skMax)
+		ret = _definitions + Key;
+
+	log_exit("0x%p", ret);
+	return ret;
+}
+
+
+int settings_get_int(ESettingsKey Key)
 {
 	int ret = 0;
-	FILE *f = NULL;
-	size_t chunkSize = 1024;
-	size_t bufSize = 0;
-	char *buf = NULL;
-	char *tmp = NULL;
-	char *lineStart = NULL;
-	char *delimiter = NULL;
-	char *keyEnd = NULL;
-	char *valueEnd = NULL;
-	log_enter("FileName=\"%s\"; Delimiter=%c; Comment=%c", FileName, Delimiter, Comment);
-	
-	f = fopen(FileName, "r");
-	if (f != NULL) {
-		while (ret == 0 && !feof(f)) {
-			buf = realloc(buf, bufSize + chunkSize + 1);
-			if (buf == NULL) {
-				ret = ENOMEM;
-				continue;
-			}
-			
-			memset(buf + bufSize, 0, chunkSize + 1);
-			chunkSize = fread(buf + bufSize, 1, chunkSize, f);
-			if (chunkSize == (size_t)-1 || ferror(f)) {
-				ret = errno;
-				continue;
-			}
-			
-			bufSize += chunkSize;
+	log_enter("Key=%u", Key);
+
+	assert(Key < skMax);
+	if (!_store.CacheReady)
+		_settings_cache_refresh(&_store, 0);
+
+	ret = (_definitions[Key].Type == stList) ? (int)_store.Cache[Key].Count : _store.Cache[Key].Int;
+
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+const char* settings_get_string(ESettingsKey Key)
+{
+	const char* ret = NULL;
+	log_enter("Key=%u", Key);
+
+	assert(Key < skMax);
+	if (!_store.CacheReady)
+		_settings_cache_refresh(&_store, 0);
+
+	ret = _store.Cache[Key].String;
+
+	log_exit("\"%s\"", ret);
+	return ret;
+}
+
+
+size_t settings_get_count(ESettingsKey Key)
+{
+	size_t ret = 0;
+	log_enter("Key=%u", Key);
+
+	assert(Key < skMax);
+	if (!_store.CacheReady)
+		_settings_cache_refresh(&_store, 0);
+
+	ret = _store.Cache[Key].Count;
+
+	log_exit("%zu", ret);
+	return ret;
+}
+
+
+int settings_set_int(ESettingsKey Key, int Value)
+{
+	int ret = 0;
+	const SETTINGS_DEFINITION* d = NULL;
+	log_enter("Key=%u; Value=%i", Key, Value);
+
+	assert(Key < skMax);
+	d = _definitions + Key;
+	if (d->Type != stInt && d->Type != stBool)
+		ret = EINVAL;
+
+	if (ret == 0 && (Value < d->Min || Value > d->Max))
+		ret = ERANGE;
+
+	if (ret == 0)
+		ret = settings_value_set_int(d->Name, 0, Value);
+
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+int settings_set_string(ESettingsKey Key, const char* Value)
+{
+	int ret = 0;
+	int tmp = 0;
+	const SETTINGS_DEFINITION* d = NULL;
+	log_enter("Key=%u; Value=\"%s\"", Key, Value);
+
+	assert(Key < skMax);
+	d = _definitions + Key;
+	if (d->Type == stInt || d->Type == stBool)
+		ret = _settings_int_parse(Value, d->Min, d->Max, &tmp);
+
+	if (ret == 0)
+		ret = settings_value_set_string(d->Name, 0, Value);
+
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+int settings_callback_register(ESettingsKey Key, SETTINGS_CALLBACK* Callback, void* Context, void** Handle)
+{
+	int ret = 0;
+	PSETTINGS_CALLBACK_RECORD record = NULL;
+	log_enter("Key=%u; Callback=0x%p; Context=0x%p; Handle=0x%p", Key, Callback, Context, Handle);
+
+	record = malloc(sizeof(SETTINGS_CALLBACK_RECORD));
+	if (record != NULL) {
+		memset(record, 0, sizeof(SETTINGS_CALLBACK_RECORD));
+		record->Key = Key;
+		record->Callback = Callback;
+		record->Context = Context;
+		record->Next = &_callbackHead;
+		record->Prev = _callbackHead.Prev;
+		_callbackHead.Prev->Next = record;
+		_callbackHead.Prev = record;
+		*Handle = record;
+	} else ret = ENOMEM;
+
+	log_exit("%i, *Handle=0x%p", ret, *Handle);
+	return ret;
+}
+
+
+void settings_callback_unregister(void* Handle)
+{
+	PSETTINGS_CALLBACK_RECORD record = NULL;
+	log_enter("Handle=0x%p", Handle);
+
+	record = (PSETTINGS_CALLBACK_RECORD)Handle;
+	record->Prev->Next = record->Next;
+	record->Next->Prev = record->Prev;
+	free(record);
+
+	log_exit("void");
+	return;
+}
+
+
+static int _settings_line_parse(PSETTINGS_STORE Store, char* Line, char Delimiter, char Comment)
+{
+	int ret = 0;
+	char* delimiter = NULL;
+	char* keyEnd = NULL;
+	char* valueEnd = NULL;
+	PSETTINGS_KEY_ENTRY ke = NULL;
+
+	while (isspace((unsigned char)*Line))
+		++Line;
+
+	if (*Line == Comment) {
+		/* Generation of the journal already merged into this snapshot */
+		sscanf(Line + 1, " journal %lu", &Store->Generation);
+		goto Exit;
+	}
+
+	if (*Line == '\0')
+		goto Exit;
+
+	delimiter = strchr(Line, Delimiter);
+	if (delimiter == NULL) {
+		log_error("Invalid settings line \"%s\"", Line);
+		ret = EINVAL;
+		goto Exit;
+	}
+
+	*delimiter = '\0';
+	keyEnd = delimiter;
+	while (keyEnd != Line && isspace((unsigned char)keyEnd[-1]))
+		--keyEnd;
+
+	*keyEnd = '\0';
+	++delimiter;
+	while (isspace((unsigned char)*delimiter))
+		++delimiter;
+
+	valueEnd = delimiter + strlen(delimiter);
+	while (valueEnd != delimiter && isspace((unsigned char)valueEnd[-1]))
+		--valueEnd;
+
+	*valueEnd = '\0';
+	ke = _get_key_entry(Store, Line);
+	if (ke == NULL)
+		ret = _key_entry_add(Store, Line, &ke);
+
+	if (ret == 0)
+		ret = _key_entry_value_append(ke, delimiter);
+
+Exit:
+	return ret;
+}
+
+
+static void _settings_store_free(PSETTINGS_STORE Store)
+{
+	PSETTINGS_KEY_ENTRY ke = NULL;
+	log_enter("Store=0x%p", Store);
+
+	ke = Store->Keys;
+	for (size_t i = 0; i < Store->KeyCount; ++i) {
+		free(ke->Values);
+		++ke;
+	}
+
+	free(Store->Keys);
+	free(Store->Index);
+	_arena_free(&Store->Arena);
+	if (Store->Map != NULL)
+		munmap(Store->Map, Store->MapSize);
+
+	if (Store->JournalFD != -1)
+		close(Store->JournalFD);
+
+	free(Store->FileName);
+	memset(Store, 0, sizeof(SETTINGS_STORE));
+	Store->JournalFD = -1;
+
+	log_exit("void");
+	return;
+}
+
+
+static int _settings_store_load(PSETTINGS_STORE Store, const char* FileName, char Delimiter, char Comment)
+{
+	int ret = 0;
+	int fd = -1;
+	struct stat st;
+	char* map = NULL;
+	size_t size = 0;
+	char* lineStart = NULL;
+	char* lineEnd = NULL;
+	char* end = NULL;
+	char* last = NULL;
+	log_enter("Store=0x%p; FileName=\"%s\"; Delimiter=%c; Comment=%c", Store, FileName, Delimiter, Comment);
+
+	fd = open(FileName, O_RDONLY);
+	if (fd == -1)
+		ret = errno;
+
+	if (ret == 0 && fstat(fd, &st) == -1)
+		ret = errno;
+
+	if (ret == 0 && st.st_size > 0) {
+		size = (size_t)st.st_size;
+		/* Private writable mapping, so the file can be tokenized in place */
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			map = NULL;
+			ret = errno;
 		}
+	}
 
-		if (ret == 0) {
-			lineStart = buf;
-			tmp = buf;
-			log_info("%u bytes read", bufSize);
-			for (size_t i = 0; i < bufSize; ++i) {
-				if (*tmp == '\r' || *tmp == '\n') {
-					*tmp = 0;
-					if (*lineStart == Comment) {
-						++tmp;
-						continue;
-					}
-					
-					delimiter = strchr(lineStart, Delimiter);
-					if (delimiter != NULL && *lineStart != 0) {
-						*delimiter = 0;
-						keyEnd = delimiter - 1;
-						while (keyEnd != lineStart && isspace(*keyEnd)) {
-							*keyEnd = 0;
-							--keyEnd;
-						}
-						
-						while (isspace(*lineStart) && lineStart != keyEnd)
-							++lineStart;
-							
-						++delimiter;
-						while (isspace(*delimiter))
-							++delimiter;
-						
-						valueEnd = tmp - 1;
-						while (valueEnd != delimiter && isspace(*valueEnd)) {
-							*valueEnd = 0;
-							--valueEnd;
-						}
-						
-						ret = settings_key_add(lineStart);
-						if (ret == EEXIST)
-							ret = 0;
-							
-						if (ret == 0)
-							ret = settings_value_add(lineStart, delimiter);
-					} else if (delimiter == NULL && *lineStart == 0)
-						ret = EINVAL;
-				
-					lineStart = tmp + 1;
-				}
-				
-				if (ret != 0)
-					break;
-				
-				++tmp;
+	if (fd != -1)
+		close(fd);
+
+	/* Only the most recently loaded file stays mapped */
+	if (ret == 0 && map != NULL && Store->Map != NULL) {
+		ret = _settings_compact(Store);
+		if (ret != 0)
+			munmap(map, size);
+	}
+
+	if (ret == 0 && map != NULL) {
+		Store->Map = map;
+		Store->MapSize = size;
+		log_info("%zu bytes mapped", size);
+		lineStart = map;
+		end = map + size;
+		while (ret == 0 && lineStart < end) {
+			lineEnd = memchr(lineStart, '\n', (size_t)(end - lineStart));
+			if (lineEnd != NULL) {
+				*lineEnd = '\0';
+				ret = _settings_line_parse(Store, lineStart, Delimiter, Comment);
+				lineStart = lineEnd + 1;
+			} else {
+				/* There is no room for the terminator past the end of the mapping */
+				last = _arena_alloc(&Store->Arena, (size_t)(end - lineStart) + 1);
+				if (last != NULL) {
+					memcpy(last, lineStart, (size_t)(end - lineStart));
+					last[end - lineStart] = '\0';
+					ret = _settings_line_parse(Store, last, Delimiter, Comment);
+				} else ret = ENOMEM;
+
+				lineStart = end;
 			}
 		}
-		
-		free(buf);
-		fclose(f);
+
 		if (ret != 0)
-			settings_free();
-	} else ret = errno;
-	
+			_settings_store_free(Store);
+	}
+
+	if (ret == 0) {
+		if (Store->JournalFD != -1) {
+			close(Store->JournalFD);
+			Store->JournalFD = -1;
+		}
+
+		free(Store->FileName);
+		Store->FileName = strdup(FileName);
+		if (Store->FileName == NULL)
+			ret = ENOMEM;
+
+		Store->Delimiter = Delimiter;
+		Store->Comment = Comment;
+	}
+
+	if (ret == 0) {
+		ret = _settings_journal_open(Store, FileName, st.st_mode);
+		if (ret == ENOMEM)
+			_settings_store_free(Store);
+		else if (ret != 0) {
+			log_warning("Settings journal not available, every save writes the whole file: %i", ret);
+			ret = 0;
+		}
+	}
+
+	if (ret == 0) {
+		Store->FileStat = st;
+		_settings_cache_refresh(Store, 1);
+	}
+
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+int settings_load(const char* FileName, char Delimiter, char Comment)
+{
+	int ret = 0;
+	log_enter("FileName=\"%s\"; Delimiter=%c; Comment=%c", FileName, Delimiter, Comment);
+
+	ret = _settings_store_load(&_store, FileName, Delimiter, Comment);
+
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+static int _settings_values_equal(const SETTINGS_KEY_ENTRY *A, const SETTINGS_KEY_ENTRY *B)
+{
+	int ret = 0;
+	size_t countA = 0;
+	size_t countB = 0;
+
+	if (A != NULL)
+		countA = A->ValueCount;
+
+	if (B != NULL)
+		countB = B->ValueCount;
+
+	ret = (countA == countB);
+	for (size_t i = 0; ret && i < countA; ++i)
+		ret = (strcmp(A->Values[i], B->Values[i]) == 0);
+
+	return ret;
+}
+
+
+int settings_reload(int Force, int *Changed)
+{
+	int ret = 0;
+	struct stat st;
+	SETTINGS_STORE old;
+	int changed[skMax];
+	const SETTINGS_DEFINITION *d = NULL;
+	log_enter("Force=%i; Changed=0x%p", Force, Changed);
+
+	memset(changed, 0, sizeof(changed));
+	if (_store.FileName == NULL)
+		ret = EINVAL;
+
+	if (ret == 0 && stat(_store.FileName, &st) == -1)
+		ret = errno;
+
+	if (ret == 0 && !Force &&
+		st.st_dev == _store.FileStat.st_dev && st.st_ino == _store.FileStat.st_ino &&
+		st.st_size == _store.FileStat.st_size &&
+		st.st_mtim.tv_sec == _store.FileStat.st_mtim.tv_sec && st.st_mtim.tv_nsec == _store.FileStat.st_mtim.tv_nsec)
+		goto Exit;
+
+	/* The journal is replayed through the public mutators, so the new store takes the place of the old one while loading */
+	if (ret == 0) {
+		old = _store;
+		memset(&_store, 0, sizeof(_store));
+		_store.JournalFD = -1;
+		ret = _settings_store_load(&_store, old.FileName, old.Delimiter, old.Comment);
+		if (ret != 0) {
+			/* A file that does not parse leaves the running settings untouched */
+			_settings_store_free(&_store);
+			_store = old;
+		}
+	}
+
+	if (ret == 0) {
+		for (int i = 0; i < skMax; ++i) {
+			d = _definitions + i;
+			changed[i] = !_settings_values_equal(_get_key_entry(&old, d->Name), _get_key_entry(&_store, d->Name));
+			if (changed[i])
+				log_info("Setting %s changed", d->Name);
+		}
+
+		/* Replayed changes may still wait for their sync */
+		_store.Dirty |= old.Dirty;
+		_store.LastSave = old.LastSave;
+		_settings_store_free(&old);
+		for (int i = 0; i < skMax; ++i) {
+			if (changed[i])
+				_settings_notify((ESettingsKey)i);
+		}
+	}
+
+Exit:
+	if (ret == 0 && Changed != NULL)
+		memcpy(Changed, changed, sizeof(changed));
+
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+static time_t _settings_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec;
+}
+
+
+/* Makes the rename durable */
+static int _settings_dir_sync(const char* FileName)
+{
+	int ret = 0;
+	int fd = -1;
+	char* path = NULL;
+	log_enter("FileName=\"%s\"", FileName);
+
+	path = strdup(FileName);
+	if (path == NULL)
+		ret = ENOMEM;
+
+	if (ret == 0) {
+		fd = open(dirname(path), O_RDONLY | O_DIRECTORY);
+		if (fd != -1) {
+			if (fsync(fd) == -1)
+				ret = errno;
+
+			close(fd);
+		} else ret = errno;
+
+		free(path);
+	}
+
 	log_exit("%i", ret);
 	return ret;
 }
@@ -464,17 +1737,51 @@ int settings_save(const char* FileName, char Delimiter)
 	int ret = 0;
 	FILE *f = NULL;
 	const SETTINGS_KEY_ENTRY *ke = NULL;
-	char line[512];
+	char* tmpName = NULL;
+	size_t nameLen = 0;
+	int journal = 0;
+	struct stat st;
 	log_enter("FileName=\"%s\"; Delimiter=\"%c\"", FileName, Delimiter);
 
-	if (FileName != NULL) {
-		f = fopen(FileName, "w");
-		if (f != NULL) {
-			ke = _root.Keys;
-			for (size_t i = 0; i < _root.KeyCount; ++i) {
+	if (FileName == NULL)
+		ret = EINVAL;
+
+	if (ret == 0)
+		journal = (_store.JournalFD != -1 && strcmp(_store.FileName, FileName) == 0);
+
+	/* Merging the journal is worth a snapshot on its own */
+	if (ret == 0 && !_store.Dirty && !(journal && _store.JournalPending))
+		goto Exit;
+
+	/* The mapped file is replaced, not truncated, so the mapping stays valid and only the garbage matters */
+	if (ret == 0 && _store.Arena.Garbage > _store.Arena.Used / 2)
+		ret = _settings_compact(&_store);
+
+	if (ret == 0) {
+		nameLen = strlen(FileName) + sizeof(".tmp");
+		tmpName = malloc(nameLen);
+		if (tmpName == NULL)
+			ret = ENOMEM;
+	}
+
+	if (ret == 0) {
+		snprintf(tmpName, nameLen, "%s.tmp", FileName);
+		f = fopen(tmpName, "w");
+		if (f == NULL)
+			ret = errno;
+
+		/* The file may hold the PIN and passwords, keep its permissions */
+		if (ret == 0 && stat(FileName, &st) == 0)
+			fchmod(fileno(f), st.st_mode & 07777);
+
+		if (ret == 0 && journal && fprintf(f, "%c journal %lu\n", _store.Comment, _store.Generation + 1) < 0)
+			ret = errno;
+
+		if (ret == 0) {
+			ke = _store.Keys;
+			for (size_t i = 0; i < _store.KeyCount; ++i) {
 				for (size_t j = 0; j < ke->ValueCount; ++j) {
-					snprintf(line, sizeof(line) / sizeof(line[0]), "%s%c %s\n", ke->Name, Delimiter, ke->Values[j]);
-					if (fwrite(line, strlen(line), 1, f) != strlen(line)) {
+					if (fprintf(f, "%s%c %s\n", ke->Name, Delimiter, ke->Values[j]) < 0) {
 						ret = errno;
 						break;
 					}
@@ -486,11 +1793,69 @@ int settings_save(const char* FileName, char Delimiter)
 				++ke;
 			}
 
-			fclose(f);
+			if (ret == 0 && fflush(f) != 0)
+				ret = errno;
+
+			if (ret == 0 && fsync(fileno(f)) == -1)
+				ret = errno;
+
+			if (fclose(f) != 0 && ret == 0)
+				ret = errno;
+
+			if (ret == 0 && rename(tmpName, FileName) == -1)
+				ret = errno;
+
 			if (ret != 0)
-				unlink(FileName);
-		} else ret = errno;
-	} else ret = EINVAL;
+				unlink(tmpName);
+		}
+
+		free(tmpName);
+	}
+
+	if (ret == 0) {
+		ret = _settings_dir_sync(FileName);
+		if (ret != 0) {
+			log_warning("Unable to sync the directory of %s: %i", FileName, ret);
+			ret = 0;
+		}
+
+		if (_store.FileName != NULL && strcmp(_store.FileName, FileName) == 0 && stat(FileName, &_store.FileStat) == -1)
+			memset(&_store.FileStat, 0, sizeof(_store.FileStat));
+
+		/* A crash before the reset leaves a journal of the old generation, which the next load drops */
+		if (journal) {
+			++_store.Generation;
+			if (_settings_journal_reset(&_store) != 0)
+				log_warning("Unable to reset the settings journal");
+		}
+
+		_store.Dirty = 0;
+		_store.LastSave = _settings_now();
+	}
+
+Exit:
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+int settings_flush(const char* FileName, char Delimiter, int Force)
+{
+	int ret = 0;
+	log_enter("FileName=\"%s\"; Delimiter=\"%c\"; Force=%i", FileName, Delimiter, Force);
+
+	/* Changes made within one save period are written together */
+	if (_store.Dirty &&
+		(Force || _store.LastSave == 0 || _settings_now() - _store.LastSave >= settings_get_int(skSavePeriod))) {
+		/* The journal already holds the changes, only a long one is merged into a new snapshot */
+		if (_store.JournalFD != -1 && !_store.JournalBroken && strcmp(_store.FileName, FileName) == 0 &&
+			_store.JournalSize < (size_t)settings_get_int(skJournalMax)) {
+			if (fdatasync(_store.JournalFD) == 0) {
+				_store.Dirty = 0;
+				_store.LastSave = _settings_now();
+			} else ret = errno;
+		} else ret = settings_save(FileName, Delimiter);
+	}
 
 	log_exit("%i", ret);
 	return ret;
@@ -499,22 +1864,9 @@ int settings_save(const char* FileName, char Delimiter)
 
 void settings_free(void)
 {
-	PSETTINGS_KEY_ENTRY ke = NULL;
 	log_enter("");
 
-	ke = _root.Keys;
-	for (size_t i = 0; i < _root.KeyCount; ++i) {
-		for (size_t j = 0; j < ke->ValueCount; ++j)
-			free(ke->Values[j]);
-		
-		free(ke->Values);
-		free(ke->Name);
-		++ke;
-	}
-
-	free(_root.Keys);
-	_root.Keys = NULL;
-	_root.KeyCount = 0;
+	_settings_store_free(&_store);
 
 	log_exit("void");
 	return;
@@ -526,9 +1878,9 @@ void settings_print(FILE *Stream)
 	const SETTINGS_KEY_ENTRY* ke = NULL;
 	log_enter("Stream=0x%p", Stream);
 
-	ke = _root.Keys;
-	for (size_t i = 0; i < _root.KeyCount; ++i) {
-		if (ke->ValueCount > 1) {
+	ke = _store.Keys;
+	for (size_t i = 0; i < _store.KeyCount; ++i) {
+		if (ke->ValueCount != 1) {
 			fprintf(Stream, "%s\n", ke->Name);
 			for (size_t j = 0; j < ke->ValueCount; ++j)
 				fprintf(Stream, "\t%s\n", ke->Values[j]);
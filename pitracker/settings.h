@@ -2,6 +2,82 @@
 #pragma once
 
 
+#include <stdio.h>
+
+
+
+typedef enum _ESettingsType {
+	stString,
+	stInt,
+	stBool,
+	/* Multiple values, each one a record of its own */
+	stList,
+} ESettingsType, *PESettingsType;
+
+typedef enum _ESettingsKey {
+	skAccount,
+	skGps,
+	skGpsPeriod,
+	skLoc,
+	skLogError,
+	skLogWarning,
+	skLogTrace,
+	skLogInfo,
+	skApn,
+	skGprs,
+	skName,
+	skBatteryAlarm,
+	skPeriod,
+	skSyncPeriod,
+	skFence,
+	skServer,
+	skLogFile,
+	skGpsFile,
+	skMaxLogLines,
+	skPin,
+	skDevice,
+	skBaudRate,
+	skSmsMode,
+	skSmsUplink,
+	skSmsBudget,
+	skSmsUsed,
+	skSavePeriod,
+	skJournalMax,
+	skLogMaxSize,
+	skFlightSize,
+	skFlightRing,
+	skFlightDump,
+	skMetricsSocket,
+	skLowLatency,
+	skRtPriority,
+	skMaxBaudRate,
+	skModemBaudRate,
+	skCmux,
+	skControlSocket,
+	skControlMaxAge,
+	skMax,
+} ESettingsKey, *PESettingsKey;
+
+typedef struct _SETTINGS_DEFINITION {
+	const char* Name;
+	ESettingsType Type;
+	/* NULL when the key has no default */
+	const char* Default;
+	int Min;
+	int Max;
+	const char* Syntax;
+} SETTINGS_DEFINITION, *PSETTINGS_DEFINITION;
+
+typedef int (SETTINGS_CALLBACK)(ESettingsKey Key, void* Context);
+
+typedef struct _SETTINGS_CALLBACK_RECORD {
+	struct _SETTINGS_CALLBACK_RECORD* Next;
+	struct _SETTINGS_CALLBACK_RECORD* Prev;
+	ESettingsKey Key;
+	SETTINGS_CALLBACK* Callback;
+	void* Context;
+} SETTINGS_CALLBACK_RECORD, *PSETTINGS_CALLBACK_RECORD;
+
 
 int settings_keys_enum(char ***Keys, size_t *Count);
 int settings_key_add(const char* Key);
@@ -19,8 +95,19 @@ void settings_values_free(char** Values, size_t Count);
 int settings_params_enum(const char *Key, size_t ValueIndex, char ***Params, size_t *Count);
 void settings_params_free(char** Params, size_t Count);
 
+const SETTINGS_DEFINITION* settings_definition(ESettingsKey Key);
+int settings_get_int(ESettingsKey Key);
+const char* settings_get_string(ESettingsKey Key);
+size_t settings_get_count(ESettingsKey Key);
+int settings_set_int(ESettingsKey Key, int Value);
+int settings_set_string(ESettingsKey Key, const char* Value);
+int settings_callback_register(ESettingsKey Key, SETTINGS_CALLBACK* Callback, void* Context, void** Handle);
+void settings_callback_unregister(void* Handle);
+
 int settings_load(const char* FileName, char Delimiter, char Comment);
+int settings_reload(int Force, int* Changed);
 int settings_save(const char* FileName, char Delimiter);
+int settings_flush(const char* FileName, char Delimiter, int Force);
 void settings_free(void);
 void settings_print(FILE* Stream);
 
@@ -0,0 +1,213 @@
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include "logging.h"
+#include "track.h"
+
+
+
+#define TRACK_VARINT_MAX				10
+
+
+static uint64_t _zigzag_encode(int64_t Value)
+{
+	return ((uint64_t)Value << 1) ^ (uint64_t)(Value >> 63);
+}
+
+
+static int64_t _zigzag_decode(uint64_t Value)
+{
+	return (int64_t)(Value >> 1) ^ -(int64_t)(Value & 1);
+}
+
+
+static size_t _varint_put(uint64_t Value, unsigned char* Buffer)
+{
+	size_t ret = 0;
+
+	do {
+		Buffer[ret] = (unsigned char)(Value & 0x7F);
+		Value >>= 7;
+		if (Value != 0)
+			Buffer[ret] |= 0x80;
+
+		++ret;
+	} while (Value != 0);
+
+	return ret;
+}
+
+
+static size_t _varint_get(const unsigned char* Data, size_t Length, uint64_t* Value)
+{
+	size_t ret = 0;
+	uint64_t v = 0;
+
+	while (ret < Length && ret < TRACK_VARINT_MAX) {
+		v |= ((uint64_t)(Data[ret] & 0x7F)) << (7 * ret);
+		if ((Data[ret] & 0x80) == 0) {
+			*Value = v;
+			return ret + 1;
+		}
+
+		++ret;
+	}
+
+	return 0;
+}
+
+
+int track_point_parse(const char* Value, PTRACK_POINT Point)
+{
+	int ret = 0;
+	double lat = 0;
+	double lon = 0;
+	char ts[32];
+	struct tm t;
+	log_enter("Value=\"%s\"; Point=0x%p", Value, Point);
+
+	memset(ts, 0, sizeof(ts));
+	memset(&t, 0, sizeof(t));
+	/* "<lat> <long> <yyyyMMddhhmmss.sss>" as stored by the GPS loop */
+	if (sscanf(Value, "%lf %lf %31s", &lat, &lon, ts) != 3 ||
+		sscanf(ts, "%4d%2d%2d%2d%2d%2d", &t.tm_year, &t.tm_mon, &t.tm_mday, &t.tm_hour, &t.tm_min, &t.tm_sec) != 6)
+		ret = EINVAL;
+
+	if (ret == 0 && (fabs(lat) > 90 || fabs(lon) > 180))
+		ret = ERANGE;
+
+	if (ret == 0) {
+		t.tm_year -= 1900;
+		t.tm_mon -= 1;
+		Point->Lattitude = (int32_t)lround(lat * TRACK_COORDINATE_SCALE);
+		Point->Longitude = (int32_t)lround(lon * TRACK_COORDINATE_SCALE);
+		Point->Time = timegm(&t);
+	}
+
+	log_exit("%i", ret);
+	return ret;
+}
+
+
+int track_encode(const TRACK_POINT* Points, size_t Count, unsigned char* Buffer, size_t Size, size_t* Length, size_t* Encoded)
+{
+	int ret = 0;
+	size_t len = 0;
+	size_t encoded = 0;
+	size_t pointLen = 0;
+	unsigned char point[3 * TRACK_VARINT_MAX];
+	const TRACK_POINT* prev = NULL;
+	log_enter("Points=0x%p; Count=%zu; Buffer=0x%p; Size=%zu; Length=0x%p; Encoded=0x%p", Points, Count, Buffer, Size, Length, Encoded);
+
+	if (Size < 1 + sizeof(point))
+		ret = ENOBUFS;
+
+	if (ret == 0) {
+		Buffer[len] = TRACK_FORMAT_VERSION;
+		++len;
+		for (size_t i = 0; i < Count; ++i) {
+			pointLen = 0;
+			if (prev == NULL) {
+				pointLen += _varint_put(_zigzag_encode(Points[i].Lattitude), point + pointLen);
+				pointLen += _varint_put(_zigzag_encode(Points[i].Longitude), point + pointLen);
+				pointLen += _varint_put((uint64_t)Points[i].Time, point + pointLen);
+			} else {
+				pointLen += _varint_put(_zigzag_encode((int64_t)Points[i].Lattitude - prev->Lattitude), point + pointLen);
+				pointLen += _varint_put(_zigzag_encode((int64_t)Points[i].Longitude - prev->Longitude), point + pointLen);
+				pointLen += _varint_put(_zigzag_encode((int64_t)Points[i].Time - (int64_t)prev->Time), point + pointLen);
+			}
+
+			if (len + pointLen > Size)
+				break;
+
+			memcpy(Buffer + len, point, pointLen);
+			len += pointLen;
+			prev = Points + i;
+			++encoded;
+		}
+
+		*Length = len;
+		*Encoded = encoded;
+	}
+
+	log_exit("%i, *Length=%zu, *Encoded=%zu", ret, *Length, *Encoded);
+	return ret;
+}
+
+
+int track_decode(const unsigned char* Data, size_t Length, PTRACK_POINT* Points, size_t* Count)
+{
+	int ret = 0;
+	size_t pos = 0;
+	size_t tmpCount = 0;
+	size_t used = 0;
+	uint64_t v[3];
+	PTRACK_POINT tmpPoints = NULL;
+	PTRACK_POINT prev = NULL;
+	log_enter("Data=0x%p; Length=%zu; Points=0x%p; Count=0x%p", Data, Length, Points, Count);
+
+	if (Length < 1 || Data[0] != TRACK_FORMAT_VERSION)
+		ret = EINVAL;
+
+	if (ret == 0) {
+		/* Every point takes at least three octets */
+		tmpPoints = calloc(Length / 3 + 1, sizeof(TRACK_POINT));
+		if (tmpPoints == NULL)
+			ret = ENOMEM;
+	}
+
+	pos = 1;
+	while (ret == 0 && pos < Length) {
+		for (size_t i = 0; ret == 0 && i < 3; ++i) {
+			used = _varint_get(Data + pos, Length - pos, v + i);
+			if (used == 0)
+				ret = EINVAL;
+
+			pos += used;
+		}
+
+		if (ret == 0) {
+			PTRACK_POINT p = tmpPoints + tmpCount;
+
+			if (prev == NULL) {
+				p->Lattitude = (int32_t)_zigzag_decode(v[0]);
+				p->Longitude = (int32_t)_zigzag_decode(v[1]);
+				p->Time = (time_t)v[2];
+			} else {
+				p->Lattitude = (int32_t)(prev->Lattitude + _zigzag_decode(v[0]));
+				p->Longitude = (int32_t)(prev->Longitude + _zigzag_decode(v[1]));
+				p->Time = (time_t)(prev->Time + _zigzag_decode(v[2]));
+			}
+
+			prev = p;
+			++tmpCount;
+		}
+	}
+
+	if (ret == 0) {
+		*Points = tmpPoints;
+		*Count = tmpCount;
+	}
+
+	if (ret != 0)
+		free(tmpPoints);
+
+	log_exit("%i, *Count=%zu", ret, *Count);
+	return ret;
+}
+
+
+void track_points_free(PTRACK_POINT Points, size_t Count)
+{
+	log_enter("Points=0x%p; Count=%zu", Points, Count);
+
+	free(Points);
+
+	log_exit("void");
+	return;
+}
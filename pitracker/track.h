@@ -0,0 +1,30 @@
+
+#pragma once
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+
+/*
+ * Delta-encoded track batch:
+ *   header octet (TRACK_FORMAT_VERSION)
+ *   first point: zigzag varint latitude, longitude (1e-5 degree units), varint UNIX time
+ *   next points: zigzag varint deltas of latitude, longitude and time against the previous point
+ */
+#define TRACK_FORMAT_VERSION				0x01
+#define TRACK_COORDINATE_SCALE				100000.0
+
+
+typedef struct _TRACK_POINT {
+	int32_t Lattitude;
+	int32_t Longitude;
+	time_t Time;
+} TRACK_POINT, *PTRACK_POINT;
+
+
+int track_point_parse(const char* Value, PTRACK_POINT Point);
+int track_encode(const TRACK_POINT* Points, size_t Count, unsigned char* Buffer, size_t Size, size_t* Length, size_t* Encoded);
+int track_decode(const unsigned char* Data, size_t Length, PTRACK_POINT* Points, size_t* Count);
+void track_points_free(PTRACK_POINT Points, size_t Count);
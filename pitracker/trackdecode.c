@@ -0,0 +1,86 @@
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "logging.h"
+#include "pdu.h"
+#include "track.h"
+
+
+/*
+ * Decodes track batches received as binary SMS. Each argument (or each
+ * line of the standard input) is the user data in hex, as reported by the
+ * receiving modem or SMS gateway.
+ */
+
+
+static int _decode_hex(const char* Hex)
+{
+	int ret = 0;
+	size_t len = 0;
+	size_t dataLen = 0;
+	unsigned char* data = NULL;
+	PTRACK_POINT points = NULL;
+	size_t pointCount = 0;
+	char ts[32];
+	struct tm t;
+
+	len = strlen(Hex);
+	while (len > 0 && (Hex[len - 1] == '\r' || Hex[len - 1] == '\n' || Hex[len - 1] == ' '))
+		--len;
+
+	if (!pdu_is_hex(Hex, len))
+		ret = EINVAL;
+
+	if (ret == 0) {
+		data = malloc(len / 2 + 1);
+		if (data == NULL)
+			ret = ENOMEM;
+	}
+
+	if (ret == 0) {
+		dataLen = pdu_hex_decode(Hex, len, data);
+		ret = track_decode(data, dataLen, &points, &pointCount);
+		if (ret == 0) {
+			for (size_t i = 0; i < pointCount; ++i) {
+				gmtime_r(&points[i].Time, &t);
+				strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%SZ", &t);
+				printf("%.5lf %.5lf %s\n", points[i].Lattitude / TRACK_COORDINATE_SCALE, points[i].Longitude / TRACK_COORDINATE_SCALE, ts);
+			}
+
+			track_points_free(points, pointCount);
+		}
+
+		free(data);
+	}
+
+	if (ret != 0)
+		fprintf(stderr, "Unable to decode \"%s\": %i\n", Hex, ret);
+
+	return ret;
+}
+
+
+int main(int argc, char** argv)
+{
+	int ret = 0;
+	char line[1024];
+
+	if (argc > 1) {
+		for (int i = 1; i < argc; ++i) {
+			if (_decode_hex(argv[i]) != 0)
+				ret = 1;
+		}
+	} else {
+		while (fgets(line, sizeof(line), stdin) != NULL) {
+			if (_decode_hex(line) != 0)
+				ret = 1;
+		}
+	}
+
+	return ret;
+}
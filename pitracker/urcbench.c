@@ -0,0 +1,221 @@
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include "logging.h"
+#include "line-buffer.h"
+#include "serial.h"
+
+
+/*
+ * Measures how long an unsolicited line takes from the write on the modem
+ * side of a pseudo terminal to the line callback of the application, with
+ * the port opened by serial_open() as gpsapp does. Arguments: low latency
+ * mode (0|1), SCHED_FIFO priority (0 for none), busy threads loading the
+ * CPUs (one per CPU by default) and the number of lines.
+ */
+
+
+#define URCBENCH_LINES_DEFAULT				2000
+#define URCBENCH_INTERVAL_US				1000
+
+typedef struct _URCBENCH {
+	int Master;
+	long Lines;
+	long Received;
+	long* Latencies;
+	volatile int Stop;
+} URCBENCH, *PURCBENCH;
+
+
+static uint64_t _urcbench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+
+static int _urcbench_callback(const char* Line, void* Context)
+{
+	PURCBENCH b = (PURCBENCH)Context;
+	unsigned long long sent = 0;
+
+	if (sscanf(Line, "+URCBENCH: %llu", &sent) == 1 && b->Received < b->Lines) {
+		b->Latencies[b->Received] = (long)(_urcbench_now() - sent);
+		++b->Received;
+	}
+
+	return 0;
+}
+
+
+static void* _urcbench_modem(void* Context)
+{
+	PURCBENCH b = (PURCBENCH)Context;
+	char line[64];
+	int len = 0;
+	struct timespec interval;
+
+	for (long i = 0; i < b->Lines; ++i) {
+		/* Jitter keeps the lines from falling into step with the scheduler tick */
+		interval.tv_sec = 0;
+		interval.tv_nsec = (URCBENCH_INTERVAL_US + rand() % URCBENCH_INTERVAL_US) * 1000L;
+		nanosleep(&interval, NULL);
+		len = snprintf(line, sizeof(line), "+URCBENCH: %llu\r\n", (unsigned long long)_urcbench_now());
+		if (write(b->Master, line, (size_t)len) != len)
+			break;
+	}
+
+	return NULL;
+}
+
+
+static void* _urcbench_load(void* Context)
+{
+	PURCBENCH b = (PURCBENCH)Context;
+
+	while (!b->Stop)
+		;
+
+	return NULL;
+}
+
+
+static int _urcbench_compare(const void* A, const void* B)
+{
+	long a = *(const long*)A;
+	long b = *(const long*)B;
+
+	return (a > b) - (a < b);
+}
+
+
+int main(int argc, char** argv)
+{
+	int ret = 0;
+	int fd = -1;
+	int lowLatency = 0;
+	int priority = 0;
+	int unlock = 0;
+	unsigned int pts = 0;
+	char slave[32];
+	long loaders = 0;
+	long idle = 0;
+	int modemStarted = 0;
+	void* callbackHandle = NULL;
+	pthread_t modem;
+	pthread_t* load = NULL;
+	pthread_attr_t attr;
+	struct sched_param sp;
+	URCBENCH b;
+
+	memset(&b, 0, sizeof(b));
+	b.Lines = URCBENCH_LINES_DEFAULT;
+	loaders = sysconf(_SC_NPROCESSORS_ONLN);
+	if (argc > 1)
+		lowLatency = atoi(argv[1]);
+
+	if (argc > 2)
+		priority = atoi(argv[2]);
+
+	if (argc > 3)
+		loaders = strtol(argv[3], NULL, 0);
+
+	if (argc > 4)
+		b.Lines = strtol(argv[4], NULL, 0);
+
+	b.Latencies = calloc((size_t)b.Lines, sizeof(long));
+	load = calloc((size_t)loaders + 1, sizeof(pthread_t));
+	if (b.Latencies == NULL || load == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return ENOMEM;
+	}
+
+	b.Master = open("/dev/ptmx", O_RDWR | O_NOCTTY);
+	if (b.Master == -1 || ioctl(b.Master, TIOCSPTLCK, &unlock) == -1 || ioctl(b.Master, TIOCGPTN, &pts) == -1) {
+		ret = errno;
+		fprintf(stderr, "Unable to create the pseudo terminal: %i\n", ret);
+		return ret;
+	}
+
+	snprintf(slave, sizeof(slave), "/dev/pts/%u", pts);
+	ret = line_buffer_init();
+	if (ret == 0)
+		ret = serial_open(slave, 115200, &fd);
+
+	if (ret == 0 && lowLatency)
+		ret = serial_low_latency(fd, priority);
+
+	if (ret == 0)
+		ret = line_callback_register(_urcbench_callback, &b, &callbackHandle);
+
+	if (ret == 0) {
+		/* The load and the modem must not inherit SCHED_FIFO from this thread */
+		pthread_attr_init(&attr);
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+		memset(&sp, 0, sizeof(sp));
+		pthread_attr_setschedparam(&attr, &sp);
+		for (long i = 0; i < loaders && ret == 0; ++i) {
+			ret = pthread_create(load + i, &attr, _urcbench_load, &b);
+			if (ret != 0)
+				loaders = i;
+		}
+
+		if (ret == 0) {
+			ret = pthread_create(&modem, &attr, _urcbench_modem, &b);
+			modemStarted = (ret == 0);
+		}
+
+		pthread_attr_destroy(&attr);
+		/* Each wait ends after a second of silence, the third one means the modem is done */
+		while (ret == 0 && b.Received < b.Lines && idle < 3) {
+			long received = b.Received;
+
+			ret = serial_response_wait(fd, 1, 0, NULL, NULL);
+			idle = (b.Received == received) ? idle + 1 : 0;
+		}
+
+		if (modemStarted)
+			pthread_join(modem, NULL);
+
+		b.Stop = 1;
+		for (long i = 0; i < loaders; ++i)
+			pthread_join(load[i], NULL);
+
+		line_callback_unregister(callbackHandle);
+	}
+
+	if (ret == 0 && b.Received > 0) {
+		qsort(b.Latencies, (size_t)b.Received, sizeof(long), _urcbench_compare);
+		printf("lowlatency=%i rtpriority=%i load=%ld: %ld lines, p50 %ld us, p99 %ld us, p99.9 %ld us, max %ld us\n",
+			lowLatency, priority, loaders, b.Received,
+			b.Latencies[b.Received / 2] / 1000,
+			b.Latencies[b.Received * 99 / 100] / 1000,
+			b.Latencies[b.Received * 999 / 1000] / 1000,
+			b.Latencies[b.Received - 1] / 1000);
+	} else fprintf(stderr, "Benchmark failed: %i\n", ret);
+
+	if (fd != -1)
+		serial_close(fd);
+
+	line_buffer_finit();
+	close(b.Master);
+	free(load);
+	free(b.Latencies);
+
+	return ret;
+}